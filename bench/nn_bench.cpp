@@ -0,0 +1,644 @@
+// Micro-benchmarks for the matrix kernels and layers.
+//
+//   nn_bench [--filter SUBSTR] [--min-time SEC] [--threads N]
+//            [--json OUT] [--baseline IN] [--threshold FRACTION] [--list]
+//
+// Every benchmark reports the median of several timed samples as ns/op,
+// together with GFLOP/s and GB/s derived from its nominal FLOP and byte
+// counts (compulsory traffic only, so GB/s is a lower bound). With
+// --baseline the run is compared against an earlier --json file, and the
+// exit status is 1 if any benchmark got slower by more than the threshold.
+
+#include "activation_relu.hpp"
+#include "activation_softmax.hpp"
+#include "categorical_cross_entropy.hpp"
+#include "execution_plan.hpp"
+#include "flat_matrix.hpp"
+#include "layer_dense.hpp"
+#include "layer_dense_relu.hpp"
+#include "matrix_expr.hpp"
+#include "random.hpp"
+#include "sequential.hpp"
+#include "sparse_matrix.hpp"
+#include "static_dense.hpp"
+#include "thread_pool.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+constexpr int SAMPLES = 5;
+
+// A benchmark's fixture is only built, by `setup`, when the benchmark is
+// selected; the returned closure runs one op.
+struct Benchmark {
+  std::string name;
+  double flops; // per op
+  double bytes; // per op
+  std::function<std::function<void()>()> setup;
+};
+
+struct Result {
+  std::string name;
+  double ns_per_op;
+  double gflops;
+  double gbps;
+};
+
+struct Options {
+  std::string filter;
+  std::string json;
+  std::string baseline;
+  double threshold = 0.10;
+  double min_time = 0.25;
+  int threads = 0;
+  bool list = false;
+};
+
+// Keeps the compiler from discarding results that are otherwise unused.
+template <typename V> void keep(const V &value) {
+  asm volatile("" : : "g"(&value) : "memory");
+}
+
+std::string shape(int a, int b) {
+  return std::to_string(a) + "x" + std::to_string(b);
+}
+
+template <typename T> const char *suffix();
+template <> const char *suffix<double>() { return "f64"; }
+template <> const char *suffix<float>() { return "f32"; }
+
+// With `padded`, every operand has padded rows (see FlatMatrix::padded).
+template <typename T>
+void add_matmul(std::vector<Benchmark> &out, int M, int K, int N,
+                bool padded = false) {
+  out.push_back({std::string("matmul/") + suffix<T>() + "/" +
+                     std::to_string(M) + "x" + std::to_string(K) + "x" +
+                     std::to_string(N) + (padded ? "/padded" : ""),
+                 2.0 * M * N * K,
+                 sizeof(T) * (double(M) * K + double(K) * N + double(M) * N),
+                 [=] {
+                   auto make = [&](int rows, int cols) {
+                     BasicFlatMatrix<T> m = randn_matrix<T>(rows, cols, 0, 1);
+                     if (!padded)
+                       return m;
+                     BasicFlatMatrix<T> p =
+                         BasicFlatMatrix<T>::padded(rows, cols);
+                     p = m;
+                     return p;
+                   };
+                   auto A = std::make_shared<BasicFlatMatrix<T>>(make(M, K));
+                   auto B = std::make_shared<BasicFlatMatrix<T>>(make(K, N));
+                   auto C = std::make_shared<BasicFlatMatrix<T>>(make(M, N));
+                   return [=] { matmul_into(*A, *B, *C); };
+                 }});
+}
+
+void add_transpose(std::vector<Benchmark> &out, int R, int C) {
+  out.push_back({"transpose/" + shape(R, C), 0.0,
+                 2.0 * sizeof(double) * R * C, [=] {
+                   auto M = std::make_shared<FlatMatrix>(
+                       randn_matrix<double>(R, C, 0, 1));
+                   return [=] { keep(transpose(*M)); };
+                 }});
+}
+
+// One He-normal weight matrix per call, as when building a model.
+void add_init(std::vector<Benchmark> &out, int R, int C) {
+  out.push_back({"init_he_normal/" + shape(R, C), 0.0,
+                 sizeof(double) * double(R) * C, [=] {
+                   auto layer = std::make_shared<std::uint64_t>(0);
+                   return [=] {
+                     keep(init_weights<double>(R, C, WeightInit::HeNormal, 1,
+                                               (*layer)++));
+                   };
+                 }});
+}
+
+void add_sum_cols(std::vector<Benchmark> &out, int R, int C) {
+  out.push_back({"sum_cols/" + shape(R, C), double(R) * C,
+                 sizeof(double) * (double(R) * C + C), [=] {
+                   auto M = std::make_shared<FlatMatrix>(
+                       randn_matrix<double>(R, C, 0, 1));
+                   auto sums = std::make_shared<std::vector<double>>();
+                   return [=] { sum_cols_into(*M, *sums); };
+                 }});
+}
+
+void add_elementwise_mul(std::vector<Benchmark> &out, int R, int C) {
+  out.push_back({"elementwise_mul/" + shape(R, C), double(R) * C,
+                 3.0 * sizeof(double) * R * C, [=] {
+                   auto A = std::make_shared<FlatMatrix>(
+                       randn_matrix<double>(R, C, 0, 1));
+                   auto B = std::make_shared<FlatMatrix>(
+                       randn_matrix<double>(R, C, 0, 1));
+                   return [=] { keep(elementwise_mul(*A, *B)); };
+                 }});
+}
+
+// max(A .* B - C, 0) as one fused expression and as three library calls.
+void add_fused_expr(std::vector<Benchmark> &out, int R, int C) {
+  out.push_back({"expr_fused/" + shape(R, C), 3.0 * R * C,
+                 4.0 * sizeof(double) * R * C, [=] {
+                   auto A = std::make_shared<FlatMatrix>(
+                       randn_matrix<double>(R, C, 0, 1));
+                   auto B = std::make_shared<FlatMatrix>(
+                       randn_matrix<double>(R, C, 0, 1));
+                   auto D = std::make_shared<FlatMatrix>(
+                       randn_matrix<double>(R, C, 0, 1));
+                   auto Z = std::make_shared<FlatMatrix>();
+                   return [=] {
+                     using namespace nn::expr;
+                     *Z = max(hadamard(*A, *B) - *D, 0.0);
+                   };
+                 }});
+  out.push_back({"expr_unfused/" + shape(R, C), 3.0 * R * C,
+                 4.0 * sizeof(double) * R * C, [=] {
+                   auto A = std::make_shared<FlatMatrix>(
+                       randn_matrix<double>(R, C, 0, 1));
+                   auto B = std::make_shared<FlatMatrix>(
+                       randn_matrix<double>(R, C, 0, 1));
+                   auto D = std::make_shared<FlatMatrix>(
+                       randn_matrix<double>(R, C, 0, 1));
+                   return [=] {
+                     keep(elementwise_max(
+                         subtract(elementwise_mul(*A, *B), *D), 0.0));
+                   };
+                 }});
+}
+
+void add_relu(std::vector<Benchmark> &out, int R, int C) {
+  double n = double(R) * C;
+  out.push_back({"relu_forward/" + shape(R, C), n, 2.0 * sizeof(double) * n,
+                 [=] {
+                   auto x = std::make_shared<FlatMatrix>(
+                       randn_matrix<double>(R, C, 0, 1));
+                   auto relu = std::make_shared<ActivationReLU>();
+                   return [=] { relu->forward(*x); };
+                 }});
+  out.push_back({"relu_backward/" + shape(R, C), n, 3.0 * sizeof(double) * n,
+                 [=] {
+                   auto x = std::make_shared<FlatMatrix>(
+                       randn_matrix<double>(R, C, 0, 1));
+                   auto d = std::make_shared<FlatMatrix>(
+                       randn_matrix<double>(R, C, 0, 1));
+                   auto relu = std::make_shared<ActivationReLU>();
+                   relu->forward(*x);
+                   return [=] { relu->backward(*d); };
+                 }});
+}
+
+void add_softmax(std::vector<Benchmark> &out, int R, int C) {
+  double n = double(R) * C;
+  out.push_back({"softmax_forward/" + shape(R, C), 4.0 * n,
+                 2.0 * sizeof(double) * n, [=] {
+                   auto x = std::make_shared<FlatMatrix>(
+                       randn_matrix<double>(R, C, 0, 1));
+                   auto softmax = std::make_shared<ActivationSoftmax>();
+                   return [=] { softmax->forward(*x); };
+                 }});
+  out.push_back({"softmax_backward/" + shape(R, C), 4.0 * n,
+                 3.0 * sizeof(double) * n, [=] {
+                   auto x = std::make_shared<FlatMatrix>(
+                       randn_matrix<double>(R, C, 0, 1));
+                   auto d = std::make_shared<FlatMatrix>(
+                       randn_matrix<double>(R, C, 0, 1));
+                   auto softmax = std::make_shared<ActivationSoftmax>();
+                   softmax->forward(*x);
+                   return [=] { softmax->backward(*d); };
+                 }});
+}
+
+void add_cce(std::vector<Benchmark> &out, int R, int C) {
+  out.push_back({"cce_labels/" + shape(R, C), 2.0 * R,
+                 (sizeof(double) + sizeof(int)) * double(R), [=] {
+                   auto probs = std::make_shared<FlatMatrix>(R, C, 1.0 / C);
+                   auto labels = std::make_shared<std::vector<int>>(R);
+                   for (int i = 0; i < R; ++i)
+                     (*labels)[i] = i % C;
+                   auto loss = std::make_shared<LossCategoricalCrossEntropy>();
+                   return [=] { keep(loss->forward(*probs, *labels)); };
+                 }});
+  out.push_back({"cce_onehot/" + shape(R, C), 2.0 * R * C,
+                 2.0 * sizeof(double) * R * C, [=] {
+                   auto probs = std::make_shared<FlatMatrix>(R, C, 1.0 / C);
+                   auto onehot = std::make_shared<FlatMatrix>(R, C, 0.0);
+                   for (int i = 0; i < R; ++i)
+                     (*onehot)(i, i % C) = 1.0;
+                   auto loss = std::make_shared<LossCategoricalCrossEntropy>();
+                   return [=] { keep(loss->forward(*probs, *onehot)); };
+                 }});
+}
+
+template <typename T>
+void add_dense(std::vector<Benchmark> &out, int R, int K, int N) {
+  std::string dims = std::to_string(R) + "x" + std::to_string(K) + "x" +
+                     std::to_string(N);
+  double io = double(R) * K + double(K) * N + double(R) * N;
+  out.push_back({std::string("dense_forward/") + suffix<T>() + "/" + dims,
+                 2.0 * R * K * N + double(R) * N, sizeof(T) * io, [=] {
+                   auto x = std::make_shared<BasicFlatMatrix<T>>(
+                       randn_matrix<T>(R, K, 0, 1));
+                   auto layer = std::make_shared<BasicLayerDense<T>>(K, N);
+                   return [=] { layer->forward(*x); };
+                 }});
+  out.push_back({std::string("dense_backward/") + suffix<T>() + "/" + dims,
+                 4.0 * R * K * N + double(R) * N, 2.0 * sizeof(T) * io, [=] {
+                   auto x = std::make_shared<BasicFlatMatrix<T>>(
+                       randn_matrix<T>(R, K, 0, 1));
+                   auto d = std::make_shared<BasicFlatMatrix<T>>(
+                       randn_matrix<T>(R, N, 0, 1));
+                   auto layer = std::make_shared<BasicLayerDense<T>>(K, N);
+                   layer->forward(*x);
+                   return [=] { layer->backward(*d); };
+                 }});
+}
+
+// First layer over R rows with `nnz` active features out of K, fed as CSR
+// with sparse weight gradients.
+void add_sparse_dense(std::vector<Benchmark> &out, int R, int K, int N,
+                      int nnz) {
+  auto input = [=] {
+    auto x = std::make_shared<CsrMatrix>(K);
+    std::vector<int> cols(nnz);
+    std::vector<double> values(nnz, 1.0);
+    for (int i = 0; i < R; ++i) {
+      for (int k = 0; k < nnz; ++k)
+        cols[k] = static_cast<int>((i * 7919L + k * 104729L) % K);
+      x->add_row(cols.data(), values.data(), nnz);
+    }
+    return x;
+  };
+  std::string dims = std::to_string(R) + "x" + std::to_string(K) + "x" +
+                     std::to_string(N) + "/nnz" + std::to_string(nnz);
+  double io = double(R) * nnz * N + double(R) * N;
+  out.push_back({"sparse_dense_forward/" + dims, 2.0 * R * nnz * N,
+                 sizeof(double) * io, [=] {
+                   auto x = input();
+                   auto layer = std::make_shared<LayerDense>(K, N);
+                   layer->sparse_gradients = true;
+                   return [=] { layer->forward(*x); };
+                 }});
+  out.push_back({"sparse_dense_backward/" + dims, 2.0 * R * nnz * N,
+                 2.0 * sizeof(double) * io, [=] {
+                   auto x = input();
+                   auto d = std::make_shared<FlatMatrix>(
+                       randn_matrix<double>(R, N, 0, 1));
+                   auto layer = std::make_shared<LayerDense>(K, N);
+                   layer->sparse_gradients = true;
+                   layer->forward(*x);
+                   return [=] { layer->backward(*d); };
+                 }});
+}
+
+// 784 -> 256 -> 128 -> 10 classifier, through the training forward and
+// through predict().
+void add_mlp_inference(std::vector<Benchmark> &out, int R) {
+  auto make = [] {
+    auto model = std::make_shared<Sequential>();
+    model->add<LayerDense>(784, 256);
+    model->add<ActivationReLU>();
+    model->add<LayerDense>(256, 128);
+    model->add<ActivationReLU>();
+    model->add<LayerDense>(128, 10);
+    model->add<ActivationSoftmax>();
+    return model;
+  };
+
+  double flops = 2.0 * R * (784 * 256 + 256 * 128 + 128 * 10);
+  double bytes = sizeof(double) * (double(R) * (784 + 10) +
+                                   784 * 256 + 256 * 128 + 128 * 10);
+  std::string dims = std::to_string(R);
+  out.push_back({"mlp_forward/" + dims, flops, bytes, [=] {
+                   auto model = make();
+                   auto x = std::make_shared<FlatMatrix>(
+                       randn_matrix<double>(R, 784, 0, 1));
+                   return [=] { model->forward(*x); };
+                 }});
+  out.push_back({"mlp_predict/" + dims, flops, bytes, [=] {
+                   auto model = make();
+                   auto x = std::make_shared<FlatMatrix>(
+                       randn_matrix<double>(R, 784, 0, 1));
+                   return [=] { keep(model->predict(*x)); };
+                 }});
+}
+
+// One training step (forward, head, backward) of the same classifier,
+// layer by layer and through a compiled ExecutionPlan.
+void add_mlp_train(std::vector<Benchmark> &out, int R) {
+  auto make = [] {
+    auto model = std::make_shared<Sequential>();
+    model->add<LayerDense>(784, 256);
+    model->add<ActivationReLU>();
+    model->add<LayerDense>(256, 128);
+    model->add<ActivationReLU>();
+    model->add<LayerDense>(128, 10);
+    return model;
+  };
+  auto batch = [R] {
+    auto y = std::make_shared<std::vector<int>>(R);
+    for (int i = 0; i < R; ++i)
+      (*y)[i] = i % 10;
+    return y;
+  };
+
+  double flops = 6.0 * R * (784 * 256 + 256 * 128 + 128 * 10);
+  double bytes = sizeof(double) * (3.0 * R * (784 + 10) +
+                                   2.0 * (784 * 256 + 256 * 128 + 128 * 10));
+  std::string dims = std::to_string(R);
+  out.push_back({"mlp_train_step/" + dims + "/layers", flops, bytes, [=] {
+                   auto model = make();
+                   auto head = std::make_shared<
+                       ActivationSoftmaxLossCategoricalCrossEntropy>();
+                   auto x = std::make_shared<FlatMatrix>(
+                       randn_matrix<double>(R, 784, 0, 1));
+                   auto y = batch();
+                   return [=] {
+                     model->forward(*x);
+                     keep(head->forward(model->output(), *y));
+                     head->backward(*y);
+                     model->backward(head->dinputs);
+                   };
+                 }});
+  out.push_back({"mlp_train_step/" + dims + "/plan", flops, bytes, [=] {
+                   auto planned = make();
+                   auto plan = std::make_shared<ExecutionPlan>(*planned, R);
+                   auto x = std::make_shared<FlatMatrix>(
+                       randn_matrix<double>(R, 784, 0, 1));
+                   auto y = batch();
+                   // The plan refers to `planned`, so the closure has to keep
+                   // it alive.
+                   return [planned, plan, x, y] {
+                     int correct = 0;
+                     keep(plan->train_step(*x, *y, correct));
+                   };
+                 }});
+}
+
+// A 16 -> 32 -> 4 policy net for one sample, with fixed-shape layers and
+// with the regular ones.
+template <typename T> void add_tiny_mlp(std::vector<Benchmark> &out) {
+  double flops = 2.0 * (16 * 32 + 32 * 4);
+  double bytes = sizeof(T) * (16 * 32 + 32 + 32 * 4 + 4 + 16 + 4);
+  out.push_back({std::string("tiny_mlp/") + suffix<T>() + "/dynamic", flops,
+                 bytes, [=] {
+                   auto hidden =
+                       std::make_shared<BasicLayerDenseReLU<T>>(16, 32);
+                   auto head = std::make_shared<BasicLayerDense<T>>(32, 4);
+                   auto x = std::make_shared<BasicFlatMatrix<T>>(
+                       randn_matrix<T>(1, 16, 0, 1));
+                   return [=] {
+                     hidden->forward(*x);
+                     head->forward(hidden->output);
+                   };
+                 }});
+  out.push_back({std::string("tiny_mlp/") + suffix<T>() + "/static", flops,
+                 bytes, [=] {
+                   BasicLayerDenseReLU<T> hidden(16, 32);
+                   BasicLayerDense<T> head(32, 4);
+                   BasicFlatMatrix<T> x = randn_matrix<T>(1, 16, 0, 1);
+                   auto s_hidden =
+                       std::make_shared<BasicStaticDense<T, 16, 32, true>>(
+                           hidden);
+                   auto s_head =
+                       std::make_shared<BasicStaticDense<T, 32, 4>>(head);
+                   auto s_x = std::make_shared<BasicStaticMatrix<T, 1, 16>>(x);
+                   auto s_y = std::make_shared<BasicStaticMatrix<T, 1, 4>>();
+                   return [=] {
+                     *s_y = s_head->forward(s_hidden->forward(*s_x));
+                     keep(*s_y);
+                   };
+                 }});
+}
+
+std::vector<Benchmark> make_benchmarks() {
+  std::vector<Benchmark> out;
+
+  // Square, tall-skinny and batch x features shapes.
+  for (int n : {64, 256, 512, 1024}) {
+    add_matmul<double>(out, n, n, n);
+    add_matmul<float>(out, n, n, n);
+  }
+  add_matmul<double>(out, 16384, 64, 64);
+  add_matmul<double>(out, 64, 16384, 64);
+  add_matmul<double>(out, 256, 784, 128);
+  add_matmul<double>(out, 64, 512, 512);
+  add_matmul<double>(out, 64, 512, 512, true);
+  add_matmul<float>(out, 256, 784, 128);
+
+  add_transpose(out, 1024, 1024);
+  add_transpose(out, 4096, 256);
+  add_init(out, 4096, 1024);
+  add_sum_cols(out, 4096, 512);
+  add_elementwise_mul(out, 1024, 1024);
+  add_fused_expr(out, 1024, 1024);
+  add_relu(out, 1024, 1024);
+  add_softmax(out, 4096, 10);
+  add_softmax(out, 256, 1000);
+  add_softmax(out, 32, 32768);
+  add_cce(out, 4096, 10);
+  add_cce(out, 256, 10000);
+
+  add_dense<double>(out, 256, 784, 128);
+  add_dense<double>(out, 64, 1024, 1024);
+  add_dense<float>(out, 256, 784, 128);
+  add_sparse_dense(out, 256, 100000, 64, 32);
+  add_mlp_inference(out, 32);
+  add_mlp_inference(out, 1024);
+  add_mlp_train(out, 256);
+
+  add_tiny_mlp<double>(out);
+  add_tiny_mlp<float>(out);
+  return out;
+}
+
+double seconds(const std::function<void()> &run, long iterations) {
+  auto start = std::chrono::steady_clock::now();
+  for (long i = 0; i < iterations; ++i)
+    run();
+  auto stop = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(stop - start).count();
+}
+
+Result measure(const Benchmark &bench, double min_time) {
+  std::function<void()> run = bench.setup();
+  run(); // warm caches, buffers and the thread pool
+
+  // Grow the iteration count until one sample takes its share of min_time.
+  double target = min_time / SAMPLES;
+  long iterations = 1;
+  for (;;) {
+    double t = seconds(run, iterations);
+    if (t >= target || iterations >= (1L << 30))
+      break;
+    double grow = t > 0 ? 1.2 * target / t : 10.0;
+    iterations = std::max(iterations + 1,
+                          static_cast<long>(iterations * std::min(grow, 10.0)));
+  }
+
+  std::vector<double> ns(SAMPLES);
+  for (double &sample : ns)
+    sample = seconds(run, iterations) * 1e9 / iterations;
+  std::sort(ns.begin(), ns.end());
+  double median = ns[SAMPLES / 2];
+
+  return {bench.name, median, bench.flops / median, bench.bytes / median};
+}
+
+void write_json(const std::string &path, const std::vector<Result> &results) {
+  std::ofstream out(path);
+  if (!out) {
+    std::fprintf(stderr, "nn_bench: cannot write %s\n", path.c_str());
+    std::exit(2);
+  }
+  out << "{\n  \"threads\": " << num_threads() << ",\n  \"benchmarks\": [\n";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const Result &r = results[i];
+    char line[512];
+    std::snprintf(line, sizeof(line),
+                  "    {\"name\": \"%s\", \"ns_per_op\": %.3f, \"gflops\": "
+                  "%.4f, \"gbps\": %.4f}%s\n",
+                  r.name.c_str(), r.ns_per_op, r.gflops, r.gbps,
+                  i + 1 < results.size() ? "," : "");
+    out << line;
+  }
+  out << "  ]\n}\n";
+}
+
+// Reads the name -> ns_per_op pairs back from a file written by write_json.
+std::map<std::string, double> read_baseline(const std::string &path) {
+  std::ifstream in(path);
+  if (!in) {
+    std::fprintf(stderr, "nn_bench: cannot read %s\n", path.c_str());
+    std::exit(2);
+  }
+  std::stringstream buffer;
+  buffer << in.rdbuf();
+  std::string text = buffer.str();
+
+  std::map<std::string, double> baseline;
+  const std::string name_key = "\"name\": \"";
+  const std::string ns_key = "\"ns_per_op\": ";
+  for (size_t pos = text.find(name_key); pos != std::string::npos;
+       pos = text.find(name_key, pos)) {
+    pos += name_key.size();
+    size_t end = text.find('"', pos);
+    size_t ns = text.find(ns_key, end);
+    if (end == std::string::npos || ns == std::string::npos)
+      break;
+    baseline[text.substr(pos, end - pos)] =
+        std::strtod(text.c_str() + ns + ns_key.size(), nullptr);
+    pos = ns;
+  }
+  return baseline;
+}
+
+Options parse(int argc, char **argv) {
+  Options options;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    auto value = [&]() -> std::string {
+      if (i + 1 >= argc) {
+        std::fprintf(stderr, "nn_bench: %s needs a value\n", arg.c_str());
+        std::exit(2);
+      }
+      return argv[++i];
+    };
+    if (arg == "--filter")
+      options.filter = value();
+    else if (arg == "--json")
+      options.json = value();
+    else if (arg == "--baseline")
+      options.baseline = value();
+    else if (arg == "--threshold")
+      options.threshold = std::atof(value().c_str());
+    else if (arg == "--min-time")
+      options.min_time = std::atof(value().c_str());
+    else if (arg == "--threads")
+      options.threads = std::atoi(value().c_str());
+    else if (arg == "--list")
+      options.list = true;
+    else {
+      std::fprintf(stderr,
+                   "usage: nn_bench [--filter SUBSTR] [--min-time SEC] "
+                   "[--threads N] [--json OUT] [--baseline IN] "
+                   "[--threshold FRACTION] [--list]\n");
+      std::exit(2);
+    }
+  }
+  return options;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  Options options = parse(argc, argv);
+  if (options.threads > 0)
+    set_num_threads(options.threads);
+
+#ifndef __OPTIMIZE__
+  std::fprintf(stderr, "nn_bench: built without optimization, numbers are "
+                       "not representative (use -DCMAKE_BUILD_TYPE=Release)\n");
+#endif
+
+  std::vector<Benchmark> benchmarks = make_benchmarks();
+  std::map<std::string, double> baseline;
+  if (!options.baseline.empty())
+    baseline = read_baseline(options.baseline);
+
+  std::printf("%-36s %12s %10s %10s %10s\n", "benchmark", "ns/op", "GFLOP/s",
+              "GB/s", baseline.empty() ? "" : "vs base");
+
+  std::vector<Result> results;
+  int regressions = 0;
+  for (const Benchmark &bench : benchmarks) {
+    if (bench.name.find(options.filter) == std::string::npos)
+      continue;
+    if (options.list) {
+      std::printf("%s\n", bench.name.c_str());
+      continue;
+    }
+
+    Result r = measure(bench, options.min_time);
+    results.push_back(r);
+
+    char flops[32] = "-";
+    if (bench.flops > 0)
+      std::snprintf(flops, sizeof(flops), "%.2f", r.gflops);
+    std::printf("%-36s %12.1f %10s %10.2f", r.name.c_str(), r.ns_per_op,
+                flops, r.gbps);
+
+    auto base = baseline.find(r.name);
+    if (base != baseline.end() && base->second > 0) {
+      double change = r.ns_per_op / base->second - 1.0;
+      bool regressed = change > options.threshold;
+      regressions += regressed;
+      std::printf(" %+9.1f%%%s", 100.0 * change, regressed ? "  REGRESSION" : "");
+    }
+    std::printf("\n");
+    std::fflush(stdout);
+  }
+
+  if (!options.json.empty())
+    write_json(options.json, results);
+
+  if (regressions > 0) {
+    std::printf("%d benchmark(s) slower than the baseline by more than "
+                "%.0f%%\n",
+                regressions, 100.0 * options.threshold);
+    return 1;
+  }
+  return 0;
+}
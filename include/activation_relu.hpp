@@ -1,16 +1,20 @@
 #pragma once
 
 #include "flat_matrix.hpp"
+#include "layer.hpp"
 
-class ActivationReLU {
+// backward masks with `output`, which is positive exactly where the input
+// was, so the inputs are never copied.
+template <typename T> class BasicActivationReLU : public BasicLayer<T> {
 public:
-  ~ActivationReLU() = default;
+  ~BasicActivationReLU() = default;
 
-  void forward(const FlatMatrix &inputs);
-  void backward(const FlatMatrix &dvalues);
+  void forward(const BasicFlatMatrix<T> &inputs) override;
+  void backward(const BasicFlatMatrix<T> &dvalues) override;
+  void forward_into(const BasicFlatMatrix<T> &inputs,
+                    BasicFlatMatrix<T> &out) override;
+  bool in_place() const override { return true; }
+};
 
-  FlatMatrix output, dinputs;
-
-private:
-  FlatMatrix inputs;
-};
\ No newline at end of file
+using ActivationReLU = BasicActivationReLU<double>;
+using ActivationReLUF = BasicActivationReLU<float>;
@@ -1,16 +1,18 @@
 #pragma once
 
 #include "flat_matrix.hpp"
+#include "layer.hpp"
 
-class ActivationSoftmax {
+template <typename T> class BasicActivationSoftmax : public BasicLayer<T> {
 public:
-  ~ActivationSoftmax() = default;
+  ~BasicActivationSoftmax() = default;
 
-  void forward(const FlatMatrix &inputs_);
-  void backward(const FlatMatrix &dvalues);
+  void forward(const BasicFlatMatrix<T> &inputs) override;
+  void backward(const BasicFlatMatrix<T> &dvalues) override;
+  void forward_into(const BasicFlatMatrix<T> &inputs,
+                    BasicFlatMatrix<T> &out) override;
+  bool in_place() const override { return true; }
+};
 
-  FlatMatrix output, dinputs;
-
-private:
-  FlatMatrix inputs;
-};
\ No newline at end of file
+using ActivationSoftmax = BasicActivationSoftmax<double>;
+using ActivationSoftmaxF = BasicActivationSoftmax<float>;
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "flat_matrix.hpp"
+#include <vector>
+
+// Softmax activation and categorical cross-entropy loss as one head. The
+// forward pass produces the probabilities and the mean clipped log-loss
+// together; the backward pass uses the closed form (p - y) / N instead of a
+// per-sample softmax Jacobian.
+template <typename T> class BasicActivationSoftmaxLossCategoricalCrossEntropy {
+public:
+  ~BasicActivationSoftmaxLossCategoricalCrossEntropy() = default;
+
+  double forward(const BasicFlatMatrix<T> &inputs,
+                 const std::vector<int> &y_true_labels);
+  double forward(const BasicFlatMatrix<T> &inputs,
+                 const BasicFlatMatrix<T> &y_true_onehot);
+
+  void backward(const std::vector<int> &y_true_labels);
+  void backward(const BasicFlatMatrix<T> &y_true_onehot);
+
+  BasicFlatMatrix<T> output, dinputs;
+};
+
+using ActivationSoftmaxLossCategoricalCrossEntropy =
+    BasicActivationSoftmaxLossCategoricalCrossEntropy<double>;
+using ActivationSoftmaxLossCategoricalCrossEntropyF =
+    BasicActivationSoftmaxLossCategoricalCrossEntropy<float>;
@@ -3,10 +3,13 @@
 #include "flat_matrix.hpp"
 #include <vector>
 
-class LossCategoricalCrossEntropy {
+template <typename T> class BasicLossCategoricalCrossEntropy {
 public:  
-  ~LossCategoricalCrossEntropy() = default;
+  ~BasicLossCategoricalCrossEntropy() = default;
 
-  double forward(const FlatMatrix &y_pred, const std::vector<int> &y_true_labels);
-  double forward(const FlatMatrix &y_pred, const FlatMatrix &y_true_onehot);  
-};
\ No newline at end of file
+  double forward(const BasicFlatMatrix<T> &y_pred, const std::vector<int> &y_true_labels);
+  double forward(const BasicFlatMatrix<T> &y_pred, const BasicFlatMatrix<T> &y_true_onehot);  
+};
+
+using LossCategoricalCrossEntropy = BasicLossCategoricalCrossEntropy<double>;
+using LossCategoricalCrossEntropyF = BasicLossCategoricalCrossEntropy<float>;
@@ -0,0 +1,99 @@
+#pragma once
+
+#include "sequential.hpp"
+#include <cstdint>
+#include <string>
+
+// Binary model checkpoint, all fields little-endian:
+//
+//   [0, 64)                    CheckpointHeader
+//   [64, 64 + 128 * layers)    one CheckpointLayerRecord per layer
+//   ...                        parameter and optimizer-state blocks
+//
+// Every block starts on a 64-byte boundary and the padding is zero, so a
+// mapped checkpoint can be used in place. The checksum covers everything
+// after the header.
+enum class CheckpointDtype : std::uint32_t { Float32 = 1, Float64 = 2 };
+
+enum class CheckpointLayerKind : std::uint32_t {
+  Dense = 1,
+  DenseReLU = 2,
+  ReLU = 3,
+  Softmax = 4
+};
+
+struct CheckpointHeader {
+  char magic[8]; // "NNCKPT\0\0"
+  std::uint32_t version;
+  CheckpointDtype dtype;
+  std::uint32_t layer_count;
+  std::uint32_t flags; // bit 0: optimizer state present
+  std::uint64_t iterations;
+  double current_learning_rate;
+  std::uint64_t file_size;
+  std::uint64_t checksum;
+  std::uint8_t reserved[8];
+};
+
+// Block offsets are 0 when a block is absent. The block order is weights,
+// biases, weight_momentums, bias_momentums, weight_cache, bias_cache.
+struct CheckpointLayerRecord {
+  CheckpointLayerKind kind;
+  std::uint32_t reserved0;
+  std::uint64_t rows;
+  std::uint64_t cols;
+  std::uint64_t offsets[6];
+  std::uint64_t reserved[7];
+};
+
+static_assert(sizeof(CheckpointHeader) == 64,
+              "CheckpointHeader has to be 64 bytes");
+static_assert(sizeof(CheckpointLayerRecord) == 128,
+              "CheckpointLayerRecord has to be 128 bytes");
+
+// Optimizer scalars needed to resume training; the moment buffers are
+// stored with their layers.
+struct OptimizerState {
+  std::uint64_t iterations = 0;
+  double current_learning_rate = 0.0;
+};
+
+template <typename Optimizer>
+OptimizerState optimizer_state(const Optimizer &optimizer) {
+  OptimizerState state;
+  state.iterations = static_cast<std::uint64_t>(optimizer.iterations);
+  state.current_learning_rate = optimizer.current_learning_rate;
+  return state;
+}
+
+template <typename Optimizer>
+void restore_optimizer_state(Optimizer &optimizer,
+                             const OptimizerState &state) {
+  optimizer.iterations = static_cast<int>(state.iterations);
+  optimizer.current_learning_rate = state.current_learning_rate;
+}
+
+struct CheckpointLoadOptions {
+  // Map the file privately and point the weights into it instead of
+  // copying them. Processes mapping the same file share its pages until
+  // they write to them; writes stay private and never reach the file. Such
+  // a model is meant for inference: no optimizer state is loaded, and the
+  // OptimizerState, if requested, is left zeroed.
+  bool map = false;
+  // Checksum the file on copying loads.
+  bool verify = true;
+  // Also checksum mapped loads. Off by default, since hashing reads every
+  // page of the file, which is the cost mapping is there to avoid.
+  bool verify_mapped = false;
+};
+
+// Writes a temporary file next to `path` and renames it into place, so
+// models mapped from an earlier checkpoint at `path` stay valid.
+template <typename T>
+void save_checkpoint(const std::string &path, const BasicSequential<T> &model,
+                     const OptimizerState *optimizer = nullptr);
+
+template <typename T>
+BasicSequential<T> load_checkpoint(const std::string &path,
+                                   const CheckpointLoadOptions &options = {},
+                                   OptimizerState *optimizer = nullptr);
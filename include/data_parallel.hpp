@@ -0,0 +1,78 @@
+#pragma once
+
+#include "activation_softmax_loss_cce.hpp"
+#include "fit_loop.hpp"
+#include "flat_matrix.hpp"
+#include "layer_dense.hpp"
+#include "profiler.hpp"
+#include "sequential.hpp"
+#include <memory>
+#include <random>
+#include <vector>
+
+// Synchronous data-parallel training of a Sequential model. Every
+// mini-batch is split into one contiguous shard per replica; the replicas
+// run forward and backward concurrently (one per pool participant, with
+// their inner kernels running serially) and their dweights/dbiases are
+// summed, weighted by shard size, with a fixed pairwise tree before a
+// single optimizer step on the original model.
+//
+// Replica 0 is the model itself. The other replicas hold views of its
+// weights and copies of its biases, refreshed after every step. Since the
+// shard boundaries and the reduction order only depend on the replica
+// count, results are bit-identical run to run for a fixed replica count,
+// whatever the thread scheduling.
+template <typename T> class BasicDataParallelTrainer {
+public:
+  // replicas <= 0 means one per thread of the global pool.
+  explicit BasicDataParallelTrainer(BasicSequential<T> &model,
+                                    int replicas = 0);
+
+  int replicas() const;
+
+  template <typename Optimizer>
+  std::vector<EpochStats> fit(const BasicFlatMatrix<T> &X,
+                              const std::vector<int> &y, Optimizer &optimizer,
+                              const FitOptions &options = {}) {
+    int batches = begin_fit(X, y, options);
+    return fit_loop(X.rows(), batches, options, m_order, m_rng,
+                    [&](int b, int &correct) {
+                      double loss =
+                          train_batch(X, y, b, options.batch_size, correct);
+                      NN_PROFILE_SCOPE("DataParallel::optimizer_step");
+                      optimizer_step(optimizer, m_dense[0]);
+                      sync_replicas();
+                      return loss;
+                    });
+  }
+
+private:
+  struct Shard {
+    BasicFlatMatrix<T> x;
+    std::vector<int> y;
+    BasicActivationSoftmaxLossCategoricalCrossEntropy<T> head;
+    double loss = 0.0;
+    int correct = 0;
+  };
+
+  int begin_fit(const BasicFlatMatrix<T> &X, const std::vector<int> &y,
+                const FitOptions &options);
+  double train_batch(const BasicFlatMatrix<T> &X, const std::vector<int> &y,
+                     int b, int batch_size, int &correct);
+  void run_shard(int r, const BasicFlatMatrix<T> &X,
+                 const std::vector<int> &y, int first, int count, int total);
+  void all_reduce(int active);
+  void sync_replicas();
+
+  BasicSequential<T> &m_model;
+  std::vector<std::unique_ptr<BasicSequential<T>>> m_copies; // replicas 1..n-1
+  std::vector<BasicSequential<T> *> m_replicas;
+  std::vector<std::vector<BasicLayerDense<T> *>> m_dense;
+  std::vector<Shard> m_shards;
+
+  std::vector<int> m_order;
+  std::mt19937 m_rng;
+};
+
+using DataParallelTrainer = BasicDataParallelTrainer<double>;
+using DataParallelTrainerF = BasicDataParallelTrainer<float>;
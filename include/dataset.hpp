@@ -0,0 +1,82 @@
+#pragma once
+
+#include "flat_matrix.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Binary dataset file, all fields little-endian:
+//
+//   [0, 64)          DatasetHeader
+//   features_offset  rows * cols values of `dtype`, row-major
+//   labels_offset    rows int32 labels
+//
+// Both blocks start on a 64-byte boundary so mapped rows are as aligned as
+// heap matrices.
+enum class DatasetDtype : std::uint32_t { Float32 = 1, Float64 = 2 };
+
+struct DatasetHeader {
+  char magic[8]; // "NNDATA\0\0"
+  std::uint32_t version;
+  DatasetDtype dtype;
+  std::uint64_t rows;
+  std::uint64_t cols;
+  std::uint64_t features_offset;
+  std::uint64_t labels_offset;
+  std::uint8_t reserved[16];
+};
+
+static_assert(sizeof(DatasetHeader) == 64, "DatasetHeader has to be 64 bytes");
+
+// Read-only view of a dataset file. The file is mapped privately, so pages
+// are loaded on first touch, shared with the page cache and never count as
+// anonymous memory; features() hands out matrices that point straight into
+// the mapping.
+class MappedDataset {
+public:
+  explicit MappedDataset(const std::string &path);
+  ~MappedDataset();
+
+  MappedDataset(const MappedDataset &) = delete;
+  MappedDataset &operator=(const MappedDataset &) = delete;
+  MappedDataset(MappedDataset &&other) noexcept;
+  MappedDataset &operator=(MappedDataset &&other) noexcept;
+
+  int rows() const;
+  int cols() const;
+  DatasetDtype dtype() const;
+
+  // Non-owning view of rows [first, first + count). T has to match dtype().
+  // The view stays valid as long as the dataset is alive.
+  template <typename T> BasicFlatMatrix<T> features(int first, int count);
+  template <typename T> BasicFlatMatrix<T> features();
+
+  const std::int32_t *labels() const;
+  std::vector<int> labels(int first, int count) const;
+
+private:
+  void unmap();
+
+  void *m_base = nullptr;
+  std::size_t m_size = 0;
+  DatasetHeader m_header{};
+};
+
+template <typename T>
+void write_dataset(const std::string &path, const BasicFlatMatrix<T> &X,
+                   const std::vector<int> &y);
+
+struct CsvOptions {
+  char delimiter = ',';
+  bool header = false;  // skip the first line
+  int label_column = 0; // -1 means the last column
+  DatasetDtype dtype = DatasetDtype::Float32;
+};
+
+// Streams a numeric CSV into the binary format in two passes (shape, then
+// data), holding only a bounded chunk of rows in memory. Returns the
+// number of rows written.
+int convert_csv_to_dataset(const std::string &csv_path,
+                           const std::string &out_path,
+                           const CsvOptions &options = {});
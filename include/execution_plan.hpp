@@ -0,0 +1,123 @@
+#pragma once
+
+#include "fit_loop.hpp"
+#include "flat_matrix.hpp"
+#include "layer_dense.hpp"
+#include "profiler.hpp"
+#include "sequential.hpp"
+#include "workspace.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <random>
+#include <vector>
+
+// Compiled form of a Sequential model of LayerDense, LayerDenseReLU,
+// ActivationReLU and ActivationSoftmax layers, for batches of up to
+// max_batch rows. Compiling infers every activation and gradient shape,
+// works out the step at which each buffer is written and last read, and
+// packs the buffers into one slab so that buffers with disjoint lifetimes
+// share memory. Elementwise layers and their gradients run in place.
+//
+// Running the plan walks a flat list of steps without virtual calls, shape
+// checks or allocations. Weight and bias gradients still go to the layers'
+// dweights and dbiases, so the optimizers work unchanged, while the layers'
+// output, dinputs and input copies are left empty. The plan refers to the
+// model's layers and must not outlive them. Layers with sparse_gradients
+// are rejected.
+template <typename T> class BasicExecutionPlan {
+public:
+  BasicExecutionPlan(BasicSequential<T> &model, int max_batch);
+
+  BasicExecutionPlan(const BasicExecutionPlan &) = delete;
+  BasicExecutionPlan &operator=(const BasicExecutionPlan &) = delete;
+
+  int max_batch() const;
+  int n_inputs() const;
+  int n_outputs() const;
+
+  // Size of the slab, and what its buffers would take without sharing.
+  std::size_t slab_bytes() const;
+  std::size_t unplanned_bytes() const;
+
+  // Logits for X, as a view into the slab that stays valid until the next
+  // call into the plan.
+  const BasicFlatMatrix<T> &forward(const BasicFlatMatrix<T> &X);
+
+  // Forward, softmax + cross-entropy head and backward over one batch.
+  // Returns the mean loss and adds the number of rows whose arg max matches
+  // the label to `correct`.
+  double train_step(const BasicFlatMatrix<T> &X, const std::vector<int> &y,
+                    int &correct);
+
+  // Same as Sequential::fit, with batch_size at most max_batch.
+  template <typename Optimizer>
+  std::vector<EpochStats> fit(const BasicFlatMatrix<T> &X,
+                              const std::vector<int> &y, Optimizer &optimizer,
+                              const FitOptions &options = {}) {
+    int batches = begin_fit(X, y, options);
+    return fit_loop(X.rows(), batches, options, m_order, m_rng,
+                    [&](int b, int &correct) {
+                      int first = b * options.batch_size;
+                      int count =
+                          std::min(options.batch_size, X.rows() - first);
+                      gather(X, y, first, count);
+                      double loss =
+                          train_step(m_batch_x, m_batch_y, correct) * count;
+                      NN_PROFILE_SCOPE("ExecutionPlan::optimizer_step");
+                      optimizer_step(optimizer, m_trainable);
+                      return loss;
+                    });
+  }
+
+private:
+  enum class Op { Dense, DenseReLU, ReLU, Softmax };
+
+  struct Step {
+    Op op;
+    BasicLayerDense<T> *dense; // Dense and DenseReLU only
+    int in_cols;
+    int out_cols;
+  };
+
+  // Buffer ids: act(i) is the input of step i (act(0) is the caller's
+  // batch and has no buffer), grad(i) the gradient with respect to it.
+  int act(int i) const { return i; }
+  int grad(int i) const { return static_cast<int>(m_steps.size()) + 1 + i; }
+  T *buffer(const std::vector<std::size_t> &offsets, int id) const;
+  // Offsets of every buffer for forward() alone or for train_step(); returns
+  // the slab size and adds the unshared size of the buffers to `unplanned`.
+  std::size_t layout(bool training, std::vector<std::size_t> &offsets,
+                     std::size_t &unplanned) const;
+
+  void check_batch(const BasicFlatMatrix<T> &X, const char *what) const;
+  void run_forward(const BasicFlatMatrix<T> &X,
+                   const std::vector<std::size_t> &offsets);
+  double run_head(int R, const std::vector<int> &y, int &correct);
+  void run_backward(const BasicFlatMatrix<T> &X);
+
+  int begin_fit(const BasicFlatMatrix<T> &X, const std::vector<int> &y,
+                const FitOptions &options);
+  void gather(const BasicFlatMatrix<T> &X, const std::vector<int> &y,
+              int first, int count);
+
+  std::vector<Step> m_steps;
+  std::vector<BasicLayerDense<T> *> m_trainable;
+  int m_max_batch;
+
+  // Byte offsets into the slab per buffer id, for forward() alone and for
+  // train_step(); the slab is sized for the larger of the two.
+  std::vector<std::size_t> m_infer_offsets, m_train_offsets;
+  std::size_t m_slab_bytes = 0, m_unplanned_bytes = 0;
+  Workspace m_slab;
+  unsigned char *m_base = nullptr;
+
+  BasicFlatMatrix<T> m_logits; // view into the slab
+
+  std::vector<int> m_order;
+  std::mt19937 m_rng;
+  BasicFlatMatrix<T> m_batch_x;
+  std::vector<int> m_batch_y;
+};
+
+using ExecutionPlan = BasicExecutionPlan<double>;
+using ExecutionPlanF = BasicExecutionPlan<float>;
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <random>
+#include <vector>
+
+struct EpochStats {
+  int epoch;
+  double loss;
+  double accuracy;
+};
+
+struct FitOptions {
+  int epochs = 1;
+  int batch_size = 32;
+  bool shuffle = true;
+  std::uint32_t seed = 0;
+  // Prints one line per epoch to stdout.
+  bool verbose = true;
+  // Called with the stats of every epoch as soon as it ends.
+  std::function<void(const EpochStats &)> on_epoch;
+};
+
+// Hands the stats of a finished epoch to options.on_epoch and, if
+// options.verbose, prints them.
+void report_epoch(const FitOptions &options, const EpochStats &stats);
+
+// The epoch loop behind every fit(). Each epoch reshuffles `order` with
+// `rng` (if options.shuffle), then runs `train_batch(b, correct)` for
+// batches 0 .. batches - 1; it trains batch b, steps the optimizer, adds
+// the rows it got right to `correct` and returns the summed (not mean)
+// loss of the batch.
+template <typename TrainBatch>
+std::vector<EpochStats> fit_loop(int rows, int batches,
+                                 const FitOptions &options,
+                                 std::vector<int> &order, std::mt19937 &rng,
+                                 TrainBatch train_batch) {
+  std::vector<EpochStats> history;
+  history.reserve(options.epochs);
+  for (int epoch = 1; epoch <= options.epochs; ++epoch) {
+    if (options.shuffle)
+      std::shuffle(order.begin(), order.end(), rng);
+
+    double loss_sum = 0.0;
+    int correct = 0;
+    for (int b = 0; b < batches; ++b)
+      loss_sum += train_batch(b, correct);
+
+    EpochStats stats{epoch, loss_sum / rows,
+                     static_cast<double>(correct) / rows};
+    history.push_back(stats);
+    report_epoch(options, stats);
+  }
+  return history;
+}
+
+// One optimizer step over `layers`, a range of BasicLayerDense pointers.
+template <typename Optimizer, typename Layers>
+void optimizer_step(Optimizer &optimizer, const Layers &layers) {
+  optimizer.pre_update_params();
+  for (auto *layer : layers)
+    optimizer.update_params(*layer);
+  optimizer.post_update_params();
+}
@@ -1,32 +1,180 @@
 #pragma once
 
-class FlatMatrix {
+#include <cstddef>
+#include <stdexcept>
+
+namespace nn {
+namespace expr {
+template <typename E> struct MatrixExpr;
+} // namespace expr
+} // namespace nn
+
+// Row-major dense matrix over a floating-point scalar type. The library is
+// instantiated for float and double; FlatMatrix is the double version.
+//
+// Rows are stride() elements apart. Matrices are packed (stride == cols)
+// unless they were created by padded() or are blocks of another matrix, and
+// owned buffers start on a 64-byte boundary.
+template <typename T> class BasicFlatMatrix {
 public:
-  FlatMatrix() : m_rows(0), m_cols(0), m_data(nullptr) {}
+  using value_type = T;
+
+  // Alignment of owned buffers, and of padded rows.
+  static constexpr std::size_t ALIGNMENT = 64;
+
+  BasicFlatMatrix()
+      : m_rows(0), m_cols(0), m_stride(0), m_capacity(0), m_data(nullptr),
+        m_owner(true), m_padded(false) {}
+
+  BasicFlatMatrix(int rows, int cols, T initVal = T(0));
+
+  BasicFlatMatrix(const BasicFlatMatrix &other);
+
+  BasicFlatMatrix(BasicFlatMatrix &&other) noexcept;
+
+  ~BasicFlatMatrix();
+
+  // Evaluates a lazy elementwise expression (see matrix_expr.hpp).
+  template <typename E> BasicFlatMatrix(const nn::expr::MatrixExpr<E> &expr);
+
+  // Non-owning matrix over `rows * cols` elements that stay owned by the
+  // caller (a mapped file, another matrix). Writes go to that memory, and a
+  // resize beyond it switches to a fresh owning buffer. Copies of a view
+  // are owning deep copies. Copy-assigning to a view, from a matrix or an
+  // expression, writes through and throws unless the shapes match; move
+  // assignment rebinds it.
+  static BasicFlatMatrix view(T *data, int rows, int cols);
+  // Same over rows that are `stride` elements apart.
+  static BasicFlatMatrix view(T *data, int rows, int cols, int stride);
+
+  // Matrix whose rows start on 64-byte boundaries, with the stride moved off
+  // multiples of 512 bytes so that walking a column does not keep hitting
+  // the same cache sets. Copies and resizes keep the padding.
+  static BasicFlatMatrix padded(int rows, int cols, T initVal = T(0));
+
+  // View of rows [row, row + rows) and columns [col, col + cols), sharing
+  // this matrix's buffer and stride. Resizing the block to another shape
+  // detaches it into an owning matrix.
+  BasicFlatMatrix block(int row, int col, int rows, int cols);
+
+  // Owning copy with packed rows.
+  BasicFlatMatrix compact() const;
 
-  FlatMatrix(int rows, int cols, double initVal = 0.0);
+  bool is_view() const;
+  bool is_contiguous() const { return m_stride == m_cols; }
 
-  FlatMatrix(const FlatMatrix &other);
+  T get(int i, int j) const;
 
-  ~FlatMatrix();
+  void set(int i, int j, T value);
 
-  double get(int i, int j) const;
+  // Unchecked element and row access for hot loops. The bounds are only
+  // verified in debug builds.
+  T &operator()(int i, int j) {
+#ifndef NDEBUG
+    check_index(i, j);
+#endif
+    return m_data[static_cast<size_t>(i) * m_stride + j];
+  }
 
-  void set(int i, int j, double value);
+  T operator()(int i, int j) const {
+#ifndef NDEBUG
+    check_index(i, j);
+#endif
+    return m_data[static_cast<size_t>(i) * m_stride + j];
+  }
+
+  T *row(int i) {
+#ifndef NDEBUG
+    check_index(i, 0);
+#endif
+    return m_data + static_cast<size_t>(i) * m_stride;
+  }
+
+  const T *row(int i) const {
+#ifndef NDEBUG
+    check_index(i, 0);
+#endif
+    return m_data + static_cast<size_t>(i) * m_stride;
+  }
 
   int rows() const;
 
   int cols() const;
 
-  FlatMatrix &operator=(const FlatMatrix &other);
+  // Distance between the starts of two consecutive rows, in elements.
+  int stride() const { return m_stride; }
+
+  // Changes the shape. The buffer is only reallocated when it is too small,
+  // so repeated calls with the same shape never touch the heap. Contents are
+  // unspecified afterwards.
+  void resize(int rows, int cols);
+
+  // First element; row i starts at data() + i * stride().
+  T *data();
+  const T *data() const;
+
+  BasicFlatMatrix &operator=(const BasicFlatMatrix &other);
+
+  BasicFlatMatrix &operator=(BasicFlatMatrix &&other) noexcept;
+
+  template <typename E>
+  BasicFlatMatrix &operator=(const nn::expr::MatrixExpr<E> &expr);
 
 private:
   int m_rows;
   int m_cols;
-  double *m_data;
-  int index(int i, int j) const;
+  int m_stride;
+  size_t m_capacity;
+  T *m_data;
+  bool m_owner;
+  bool m_padded; // keeps a padded stride across resizes and copies
+  size_t index(int i, int j) const;
+  void reserve(size_t size);
+  void release();
+  int stride_for(int cols) const;
+  void copy_rows(const BasicFlatMatrix &other);
+
+  // Assignments write through views, so they cannot change their shape.
+  void check_assign(int rows, int cols) const {
+    if (!m_owner && (rows != m_rows || cols != m_cols)) {
+      throw std::invalid_argument(
+          "FlatMatrix operator=: a view only takes a matrix of its shape!");
+    }
+  }
+
+  void check_index(int i, int j) const {
+    if (i < 0 || i >= m_rows || j < 0 || j >= m_cols) {
+      throw std::out_of_range("FlatMatrix::operator(): Index out of range");
+    }
+  }
 };
 
-FlatMatrix matmul(const FlatMatrix &A, const FlatMatrix &B);
+using FlatMatrix = BasicFlatMatrix<double>;
+using FlatMatrixF = BasicFlatMatrix<float>;
+
+template <typename T>
+BasicFlatMatrix<T> matmul(const BasicFlatMatrix<T> &A,
+                          const BasicFlatMatrix<T> &B);
+
+// A^T * B and A * B^T without materialising the transposed operand.
+template <typename T>
+BasicFlatMatrix<T> matmul_tn(const BasicFlatMatrix<T> &A,
+                             const BasicFlatMatrix<T> &B);
+template <typename T>
+BasicFlatMatrix<T> matmul_nt(const BasicFlatMatrix<T> &A,
+                             const BasicFlatMatrix<T> &B);
+
+// Same products written into an existing matrix, which is resized in place.
+template <typename T>
+void matmul_into(const BasicFlatMatrix<T> &A, const BasicFlatMatrix<T> &B,
+                 BasicFlatMatrix<T> &Result);
+template <typename T>
+void matmul_tn_into(const BasicFlatMatrix<T> &A, const BasicFlatMatrix<T> &B,
+                    BasicFlatMatrix<T> &Result);
+template <typename T>
+void matmul_nt_into(const BasicFlatMatrix<T> &A, const BasicFlatMatrix<T> &B,
+                    BasicFlatMatrix<T> &Result);
 
-FlatMatrix subtract(const FlatMatrix &A, const FlatMatrix &B);
\ No newline at end of file
+template <typename T>
+BasicFlatMatrix<T> subtract(const BasicFlatMatrix<T> &A,
+                            const BasicFlatMatrix<T> &B);
@@ -0,0 +1,20 @@
+#pragma once
+
+// Work folded into the store of each finished C tile while it is still in
+// registers: an optional per-column bias (length N) followed by an optional
+// ReLU.
+template <typename T> struct GemmEpilogue {
+  const T *bias = nullptr;
+  bool relu = false;
+};
+
+// Row-major general matrix multiply: C (M x N) = op(A) (M x K) * op(B) (K x N)
+// where op(X) is X or X^T. lda, ldb and ldc are the row strides of the
+// buffers as stored, so a transposed A is a K x M buffer with row stride lda.
+void gemm(bool transA, bool transB, int M, int N, int K, const double *A,
+          int lda, const double *B, int ldb, double *C, int ldc,
+          const GemmEpilogue<double> &epilogue = GemmEpilogue<double>());
+
+void gemm(bool transA, bool transB, int M, int N, int K, const float *A,
+          int lda, const float *B, int ldb, float *C, int ldc,
+          const GemmEpilogue<float> &epilogue = GemmEpilogue<float>());
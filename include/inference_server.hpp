@@ -0,0 +1,134 @@
+#pragma once
+
+#include "flat_matrix.hpp"
+#include "sequential.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct ServerOptions {
+  int max_batch = 32;
+  // How long the first request of a batch may wait for company.
+  int max_wait_us = 500;
+  // Number of recent request latencies kept for the percentiles.
+  int latency_window = 1 << 16;
+};
+
+struct ServerStats {
+  std::uint64_t requests;
+  std::uint64_t batches;
+  double mean_batch;
+  double p50_us;
+  double p99_us;
+  double max_us;
+  double throughput; // requests per second since start or reset_stats()
+};
+
+// Serves single-row predictions from a Sequential model. Concurrent requests
+// are queued and coalesced into one batch once max_batch rows are waiting
+// or the oldest has waited max_wait_us, so the GEMMs run on full batches
+// instead of one row at a time. Results are rows of the model output; the
+// model must not be used elsewhere while the server is running.
+//
+// Requests come either from the in-process submit()/predict() calls or from
+// a Unix domain socket (serve_unix). The socket protocol is a uint32 count
+// followed by that many values of T, in both directions; a count of 0 in a
+// reply means the request was rejected.
+template <typename T> class BasicInferenceServer {
+public:
+  BasicInferenceServer(BasicSequential<T> &model, int n_inputs,
+                       const ServerOptions &options = {});
+  ~BasicInferenceServer();
+
+  BasicInferenceServer(const BasicInferenceServer &) = delete;
+  BasicInferenceServer &operator=(const BasicInferenceServer &) = delete;
+
+  std::future<std::vector<T>> submit(std::vector<T> features);
+  std::vector<T> predict(std::vector<T> features);
+
+  // Listens on `path` until stop(); one thread per connection.
+  void serve_unix(const std::string &path);
+
+  // Finishes the queued requests and shuts the socket down.
+  void stop();
+
+  ServerStats stats() const;
+  void reset_stats();
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  struct Request {
+    std::vector<T> features;
+    std::promise<std::vector<T>> result;
+    Clock::time_point enqueued;
+  };
+
+  // A connection closes its own fd (and sets it to -1) and marks itself
+  // done when its client goes; accept_loop joins and drops done entries.
+  struct Connection {
+    explicit Connection(int socket) : fd(socket) {}
+
+    int fd;
+    bool done = false;
+    std::thread thread;
+  };
+
+  void batch_loop();
+  void run_batch(std::vector<Request> &batch);
+  void accept_loop();
+  void serve_connection(Connection &connection);
+
+  BasicSequential<T> &m_model;
+  int m_inputs;
+  ServerOptions m_options;
+
+  std::mutex m_mutex;
+  std::condition_variable m_ready;
+  std::deque<Request> m_queue;
+  bool m_stop = false;
+  std::thread m_batcher;
+
+  BasicFlatMatrix<T> m_batch;
+
+  mutable std::mutex m_stats_mutex;
+  std::vector<double> m_latencies; // ring buffer, microseconds
+  std::size_t m_latency_next = 0;
+  std::uint64_t m_requests = 0;
+  std::uint64_t m_batches = 0;
+  Clock::time_point m_stats_start;
+
+  std::string m_socket_path;
+  int m_listen_fd = -1;
+  std::thread m_acceptor;
+  std::mutex m_connections_mutex;
+  std::list<Connection> m_connections;
+};
+
+using InferenceServer = BasicInferenceServer<double>;
+using InferenceServerF = BasicInferenceServer<float>;
+
+// Blocking client for the serve_unix protocol.
+template <typename T> class BasicInferenceClient {
+public:
+  explicit BasicInferenceClient(const std::string &path);
+  ~BasicInferenceClient();
+
+  BasicInferenceClient(const BasicInferenceClient &) = delete;
+  BasicInferenceClient &operator=(const BasicInferenceClient &) = delete;
+
+  std::vector<T> predict(const std::vector<T> &features);
+
+private:
+  int m_fd;
+};
+
+using InferenceClient = BasicInferenceClient<double>;
+using InferenceClientF = BasicInferenceClient<float>;
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "flat_matrix.hpp"
+
+namespace layer_detail {
+inline bool &grad_mode() {
+  thread_local bool enabled = true;
+  return enabled;
+}
+} // namespace layer_detail
+
+// False while a NoGradGuard is alive on the calling thread. Layers then do
+// not keep what backward would need, so backward after such a forward
+// throws.
+inline bool grad_enabled() { return layer_detail::grad_mode(); }
+
+// Switches the calling thread to inference mode for the enclosing scope.
+class NoGradGuard {
+public:
+  NoGradGuard() : m_previous(layer_detail::grad_mode()) {
+    layer_detail::grad_mode() = false;
+  }
+  ~NoGradGuard() { layer_detail::grad_mode() = m_previous; }
+
+  NoGradGuard(const NoGradGuard &) = delete;
+  NoGradGuard &operator=(const NoGradGuard &) = delete;
+
+private:
+  bool m_previous;
+};
+
+// Common interface of everything that can be stacked in a Sequential model.
+// forward() fills `output`, backward() fills `dinputs`.
+template <typename T> class BasicLayer {
+public:
+  virtual ~BasicLayer() = default;
+
+  virtual void forward(const BasicFlatMatrix<T> &inputs) = 0;
+  virtual void backward(const BasicFlatMatrix<T> &dvalues) = 0;
+
+  // Inference forward into a caller-owned buffer, leaving the layer's own
+  // state alone. When in_place() is true, `out` may be `inputs`.
+  virtual void forward_into(const BasicFlatMatrix<T> &inputs,
+                            BasicFlatMatrix<T> &out) {
+    forward(inputs);
+    out = output;
+  }
+  virtual bool in_place() const { return false; }
+
+  BasicFlatMatrix<T> output, dinputs;
+};
+
+using Layer = BasicLayer<double>;
+using LayerF = BasicLayer<float>;
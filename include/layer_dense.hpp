@@ -1,23 +1,73 @@
 #pragma once
 
 #include "flat_matrix.hpp"
+#include "layer.hpp"
+#include "random.hpp"
+#include "sparse_matrix.hpp"
 #include <vector>
 
-class LayerDense {
+template <typename T> class BasicLayerDense : public BasicLayer<T> {
 public:
-  LayerDense(int n_inputs, int n_neurons);
-  ~LayerDense() = default;
-
-  void forward(const FlatMatrix &Inputs);
-  void backward(const FlatMatrix &dvalues);
-
-  FlatMatrix output;
-  FlatMatrix dinputs;
-  FlatMatrix weights;
-  std::vector<double> biases;
-  FlatMatrix dweights;
-  std::vector<double> dbiases;
-
-private:
-  FlatMatrix inputs;
-};
\ No newline at end of file
+  BasicLayerDense(int n_inputs, int n_neurons);
+  // Weights from init_weights(n_inputs, n_neurons, init, seed, layer), so
+  // a model built with one seed and distinct layer numbers is reproducible.
+  BasicLayerDense(int n_inputs, int n_neurons, WeightInit init,
+                  std::uint64_t seed, std::uint64_t layer);
+  // Takes over existing parameters, e.g. from a checkpoint. `weights` may be
+  // a view, in which case the layer does not own it.
+  BasicLayerDense(BasicFlatMatrix<T> weights, std::vector<T> biases);
+  ~BasicLayerDense() = default;
+
+  void forward(const BasicFlatMatrix<T> &Inputs) override;
+  void backward(const BasicFlatMatrix<T> &dvalues) override;
+  // `out` must not be `Inputs`.
+  void forward_into(const BasicFlatMatrix<T> &Inputs,
+                    BasicFlatMatrix<T> &out) override;
+
+  // Forward pass for sparse inputs, costing O(nnz * n_neurons) instead of
+  // O(rows * n_inputs * n_neurons). The following backward only computes
+  // the parameter gradients: dinputs is left empty, so a sparse layer has
+  // to come first in a model.
+  virtual void forward(const BasicCsrMatrix<T> &Inputs);
+
+  // True if dweights are held in sparse_dweights instead of dweights.
+  bool has_sparse_dweights() const;
+
+  BasicFlatMatrix<T> weights;
+  std::vector<T> biases;
+  BasicFlatMatrix<T> dweights;
+  std::vector<T> dbiases;
+
+  // With sparse inputs, backward keeps only the weight rows of the input
+  // columns that occur in the batch in sparse_dweights and leaves dweights
+  // alone. The optimizers then update only those rows.
+  bool sparse_gradients = false;
+  BasicSparseRowGradient<T> sparse_dweights;
+
+  // Optimizer state, sized and zeroed by the optimizer on its first update.
+  BasicFlatMatrix<T> weight_momentums;
+  std::vector<T> bias_momentums;
+  BasicFlatMatrix<T> weight_cache;
+  std::vector<T> bias_cache;
+
+protected:
+  // out = Inputs * weights + biases, then max(0, .) if relu.
+  void affine_into(const BasicFlatMatrix<T> &Inputs, BasicFlatMatrix<T> &out,
+                   bool relu) const;
+  // Remembers the inputs for backward, unless a NoGradGuard is alive.
+  void keep_inputs(const BasicFlatMatrix<T> &Inputs);
+  void keep_inputs(const BasicCsrMatrix<T> &Inputs);
+
+  // Shared by the dense and the sparse path of backward.
+  void weight_gradients(const BasicFlatMatrix<T> &dvalues);
+  void input_gradients(const BasicFlatMatrix<T> &dvalues);
+  int input_rows() const;
+
+  BasicFlatMatrix<T> inputs;
+  BasicCsrMatrix<T> sparse_inputs;
+  bool sparse_forward = false; // the last forward took sparse_inputs
+  bool inputs_kept = true;     // false after a forward under NoGradGuard
+};
+
+using LayerDense = BasicLayerDense<double>;
+using LayerDenseF = BasicLayerDense<float>;
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "layer_dense.hpp"
+
+// Dense layer followed by a ReLU. The bias and the activation are applied
+// in the GEMM epilogue, and backward masks dvalues and reduces dbiases in a
+// single pass, so `output` already holds the activated values.
+template <typename T> class BasicLayerDenseReLU : public BasicLayerDense<T> {
+public:
+  BasicLayerDenseReLU(int n_inputs, int n_neurons);
+  BasicLayerDenseReLU(int n_inputs, int n_neurons, WeightInit init,
+                      std::uint64_t seed, std::uint64_t layer);
+  BasicLayerDenseReLU(BasicFlatMatrix<T> weights, std::vector<T> biases);
+  ~BasicLayerDenseReLU() = default;
+
+  void forward(const BasicFlatMatrix<T> &Inputs) override;
+  void forward(const BasicCsrMatrix<T> &Inputs) override;
+  void forward_into(const BasicFlatMatrix<T> &Inputs,
+                    BasicFlatMatrix<T> &out) override;
+  void backward(const BasicFlatMatrix<T> &dvalues) override;
+
+private:
+  BasicFlatMatrix<T> dmasked;
+};
+
+using LayerDenseReLU = BasicLayerDenseReLU<double>;
+using LayerDenseReLUF = BasicLayerDenseReLU<float>;
@@ -0,0 +1,356 @@
+#pragma once
+
+#include "flat_matrix.hpp"
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <stdexcept>
+#include <type_traits>
+
+// Lazy elementwise arithmetic on FlatMatrix. The operators and functions in
+// nn::expr build a tree of light nodes instead of temporaries; the tree is
+// evaluated in one loop when it is assigned to a matrix, so
+//
+//   using namespace nn::expr;
+//   FlatMatrix Z = max(hadamard(A, B) - C, 0.0);
+//
+// reads A, B and C once and writes Z once. The operators only apply inside
+// nn::expr (or after a using-directive), so A + B on plain matrices does not
+// silently pick them up elsewhere. Nodes refer to their operands, so an
+// expression has to be assigned before the matrices it uses go away. Since
+// every element only depends on the operands at the same index, an operand
+// may also be the destination (A = hadamard(A, B) + C).
+
+namespace nn {
+namespace expr {
+
+// CRTP base of every expression node.
+template <typename E> struct MatrixExpr {
+  const E &self() const { return static_cast<const E &>(*this); }
+
+  int rows() const { return self().rows(); }
+  int cols() const { return self().cols(); }
+  // Flat index, only meaningful when every operand is contiguous.
+  auto operator[](std::size_t i) const { return self()[i]; }
+  auto at(int i, int j) const { return self().at(i, j); }
+  bool contiguous() const { return self().contiguous(); }
+};
+
+template <typename T> class MatrixRef : public MatrixExpr<MatrixRef<T>> {
+public:
+  using value_type = T;
+
+  explicit MatrixRef(const BasicFlatMatrix<T> &m)
+      : m_data(m.data()), m_rows(m.rows()), m_cols(m.cols()),
+        m_stride(m.stride()) {}
+
+  int rows() const { return m_rows; }
+  int cols() const { return m_cols; }
+  T operator[](std::size_t i) const { return m_data[i]; }
+  T at(int i, int j) const {
+    return m_data[static_cast<std::size_t>(i) * m_stride + j];
+  }
+  bool contiguous() const { return m_stride == m_cols; }
+
+private:
+  const T *m_data;
+  int m_rows;
+  int m_cols;
+  int m_stride;
+};
+
+template <typename L, typename R, typename Op>
+class BinaryExpr : public MatrixExpr<BinaryExpr<L, R, Op>> {
+public:
+  using value_type = typename L::value_type;
+
+  BinaryExpr(const L &lhs, const R &rhs) : m_lhs(lhs), m_rhs(rhs) {
+    if (lhs.rows() != rhs.rows() || lhs.cols() != rhs.cols()) {
+      throw std::invalid_argument("MatrixExpr: dimensions do not match!");
+    }
+  }
+
+  int rows() const { return m_lhs.rows(); }
+  int cols() const { return m_lhs.cols(); }
+  value_type operator[](std::size_t i) const {
+    return Op::apply(m_lhs[i], m_rhs[i]);
+  }
+  value_type at(int i, int j) const {
+    return Op::apply(m_lhs.at(i, j), m_rhs.at(i, j));
+  }
+  bool contiguous() const { return m_lhs.contiguous() && m_rhs.contiguous(); }
+
+private:
+  L m_lhs;
+  R m_rhs;
+};
+
+// Node applying a functor that may carry parameters (a scalar operand, the
+// bounds of a clip) to every element.
+template <typename E, typename Op>
+class UnaryExpr : public MatrixExpr<UnaryExpr<E, Op>> {
+public:
+  using value_type = typename E::value_type;
+
+  UnaryExpr(const E &operand, Op op) : m_operand(operand), m_op(op) {}
+
+  int rows() const { return m_operand.rows(); }
+  int cols() const { return m_operand.cols(); }
+  value_type operator[](std::size_t i) const { return m_op(m_operand[i]); }
+  value_type at(int i, int j) const { return m_op(m_operand.at(i, j)); }
+  bool contiguous() const { return m_operand.contiguous(); }
+
+private:
+  E m_operand;
+  Op m_op;
+};
+
+namespace detail {
+
+struct Add {
+  template <typename T> static T apply(T a, T b) { return a + b; }
+};
+struct Sub {
+  template <typename T> static T apply(T a, T b) { return a - b; }
+};
+struct Mul {
+  template <typename T> static T apply(T a, T b) { return a * b; }
+};
+struct Max {
+  template <typename T> static T apply(T a, T b) { return std::max(a, b); }
+};
+struct Min {
+  template <typename T> static T apply(T a, T b) { return std::min(a, b); }
+};
+
+template <typename T> struct AddScalar {
+  T s;
+  T operator()(T x) const { return x + s; }
+};
+template <typename T> struct SubFromScalar {
+  T s;
+  T operator()(T x) const { return s - x; }
+};
+template <typename T> struct MulScalar {
+  T s;
+  T operator()(T x) const { return x * s; }
+};
+template <typename T> struct DivScalar {
+  T s;
+  T operator()(T x) const { return x / s; }
+};
+template <typename T> struct MaxScalar {
+  T s;
+  T operator()(T x) const { return std::max(x, s); }
+};
+template <typename T> struct MinScalar {
+  T s;
+  T operator()(T x) const { return std::min(x, s); }
+};
+template <typename T> struct Clip {
+  T lo;
+  T hi;
+  T operator()(T x) const { return std::min(std::max(x, lo), hi); }
+};
+template <typename T> struct Negate {
+  T operator()(T x) const { return -x; }
+};
+
+// Maps an operand type to its node: matrices are wrapped in a MatrixRef,
+// expressions are used as they are. Other types have no node, which keeps
+// the operators below out of overload resolution for them.
+template <typename X, typename = void> struct node_of {};
+
+template <typename T> struct node_of<BasicFlatMatrix<T>> {
+  using type = MatrixRef<T>;
+  static type wrap(const BasicFlatMatrix<T> &m) { return type(m); }
+};
+
+template <typename X>
+struct node_of<X, std::enable_if_t<std::is_base_of<MatrixExpr<X>, X>::value>> {
+  using type = X;
+  static const X &wrap(const X &e) { return e; }
+};
+
+template <typename X> using node_t = typename node_of<std::decay_t<X>>::type;
+template <typename X> using scalar_t = typename node_t<X>::value_type;
+
+template <typename X> node_t<X> wrap(const X &x) {
+  return node_of<std::decay_t<X>>::wrap(x);
+}
+
+template <typename Op, typename L, typename R>
+BinaryExpr<node_t<L>, node_t<R>, Op> binary(const L &lhs, const R &rhs) {
+  static_assert(std::is_same<scalar_t<L>, scalar_t<R>>::value,
+                "MatrixExpr: operands have to share one scalar type");
+  return {wrap(lhs), wrap(rhs)};
+}
+
+template <typename X, typename Op>
+UnaryExpr<node_t<X>, Op> unary(const X &operand, Op op) {
+  return {wrap(operand), op};
+}
+
+} // namespace detail
+
+// Matrix (or expression) with matrix (or expression).
+template <typename L, typename R>
+auto operator+(const L &lhs, const R &rhs)
+    -> decltype(detail::binary<detail::Add>(lhs, rhs)) {
+  return detail::binary<detail::Add>(lhs, rhs);
+}
+
+template <typename L, typename R>
+auto operator-(const L &lhs, const R &rhs)
+    -> decltype(detail::binary<detail::Sub>(lhs, rhs)) {
+  return detail::binary<detail::Sub>(lhs, rhs);
+}
+
+// Elementwise (Hadamard) product; there is no operator* between matrices,
+// which would read as a matrix product.
+template <typename L, typename R>
+auto hadamard(const L &lhs, const R &rhs)
+    -> decltype(detail::binary<detail::Mul>(lhs, rhs)) {
+  return detail::binary<detail::Mul>(lhs, rhs);
+}
+
+template <typename L, typename R>
+auto max(const L &lhs, const R &rhs)
+    -> decltype(detail::binary<detail::Max>(lhs, rhs)) {
+  return detail::binary<detail::Max>(lhs, rhs);
+}
+
+template <typename L, typename R>
+auto min(const L &lhs, const R &rhs)
+    -> decltype(detail::binary<detail::Min>(lhs, rhs)) {
+  return detail::binary<detail::Min>(lhs, rhs);
+}
+
+// Matrix (or expression) with scalar.
+template <typename X>
+auto operator+(const X &x, detail::scalar_t<X> s) {
+  return detail::unary(x, detail::AddScalar<decltype(s)>{s});
+}
+
+template <typename X>
+auto operator+(detail::scalar_t<X> s, const X &x) {
+  return x + s;
+}
+
+template <typename X>
+auto operator-(const X &x, detail::scalar_t<X> s) {
+  return x + (-s);
+}
+
+template <typename X>
+auto operator-(detail::scalar_t<X> s, const X &x) {
+  return detail::unary(x, detail::SubFromScalar<decltype(s)>{s});
+}
+
+template <typename X>
+auto operator*(const X &x, detail::scalar_t<X> s) {
+  return detail::unary(x, detail::MulScalar<decltype(s)>{s});
+}
+
+template <typename X>
+auto operator*(detail::scalar_t<X> s, const X &x) {
+  return x * s;
+}
+
+template <typename X>
+auto operator/(const X &x, detail::scalar_t<X> s) {
+  return detail::unary(x, detail::DivScalar<decltype(s)>{s});
+}
+
+template <typename X, typename S = detail::scalar_t<X>>
+auto operator-(const X &x) {
+  return detail::unary(x, detail::Negate<S>{});
+}
+
+template <typename X> auto max(const X &x, detail::scalar_t<X> s) {
+  return detail::unary(x, detail::MaxScalar<decltype(s)>{s});
+}
+
+template <typename X> auto min(const X &x, detail::scalar_t<X> s) {
+  return detail::unary(x, detail::MinScalar<decltype(s)>{s});
+}
+
+// Limits every element to [lo, hi].
+template <typename X>
+auto clip(const X &x, detail::scalar_t<X> lo,
+          detail::scalar_t<X> hi) {
+  if (lo > hi)
+    throw std::invalid_argument("clip: lo has to be at most hi!");
+  return detail::unary(x, detail::Clip<decltype(lo)>{lo, hi});
+}
+
+} // namespace expr
+} // namespace nn
+
+// Evaluates `expr` into `dst` in a single pass. The loop is split over the
+// thread pool for large matrices; each chunk is a plain indexed loop the
+// compiler can vectorize once the node tree is inlined. Strided operands or
+// destinations are walked row by row.
+template <typename T, typename E>
+void evaluate_into(const nn::expr::MatrixExpr<E> &expr,
+                   BasicFlatMatrix<T> &dst) {
+  static_assert(std::is_same<typename E::value_type, T>::value,
+                "evaluate_into: the expression and the matrix have to share "
+                "one scalar type");
+  const E &e = expr.self();
+  dst.resize(e.rows(), e.cols());
+
+  constexpr int GRAIN = 16384;
+  if (!e.contiguous() || !dst.is_contiguous()) {
+    int C = e.cols();
+    int grain = std::max(1, GRAIN / C);
+    parallel_for(0, e.rows(), grain, [&](int first, int last) {
+      for (int i = first; i < last; ++i) {
+        T *out = dst.row(i);
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC ivdep
+#endif
+        for (int j = 0; j < C; ++j)
+          out[j] = e.at(i, j);
+      }
+    });
+    return;
+  }
+
+  T *out = dst.data();
+  std::size_t n = static_cast<std::size_t>(e.rows()) * e.cols();
+  if (n <= static_cast<std::size_t>(GRAIN)) {
+    for (std::size_t i = 0; i < n; ++i)
+      out[i] = e[i];
+    return;
+  }
+
+  // parallel_for counts in int, so it splits chunks of GRAIN elements and
+  // the element indices stay size_t.
+  int chunks = static_cast<int>((n + GRAIN - 1) / GRAIN);
+  parallel_for(0, chunks, 1, [&](int first, int last) {
+    std::size_t begin = static_cast<std::size_t>(first) * GRAIN;
+    std::size_t end = std::min(n, static_cast<std::size_t>(last) * GRAIN);
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC ivdep
+#endif
+    for (std::size_t i = begin; i < end; ++i)
+      out[i] = e[i];
+  });
+}
+
+template <typename T>
+template <typename E>
+BasicFlatMatrix<T>::BasicFlatMatrix(const nn::expr::MatrixExpr<E> &expr)
+    : BasicFlatMatrix() {
+  evaluate_into(expr, *this);
+}
+
+template <typename T>
+template <typename E>
+BasicFlatMatrix<T> &
+BasicFlatMatrix<T>::operator=(const nn::expr::MatrixExpr<E> &expr) {
+  check_assign(expr.self().rows(), expr.self().cols());
+  evaluate_into(expr, *this);
+  return *this;
+}
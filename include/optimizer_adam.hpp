@@ -0,0 +1,32 @@
+#pragma once
+
+#include "layer_dense.hpp"
+
+// Adam with bias-corrected moments and 1 / (1 + decay * t) learning-rate
+// decay. A non-zero weight_decay turns it into AdamW: the weights (not the
+// biases) shrink by learning_rate * weight_decay outside the adaptive step.
+// Both moment buffers live on the layer and are updated in the same pass
+// as the parameters.
+template <typename T> class BasicOptimizerAdam {
+public:
+  explicit BasicOptimizerAdam(double learning_rate = 0.001, double decay = 0.0,
+                              double epsilon = 1e-7, double beta_1 = 0.9,
+                              double beta_2 = 0.999,
+                              double weight_decay = 0.0);
+
+  void pre_update_params();
+  void update_params(BasicLayerDense<T> &layer);
+  void post_update_params();
+
+  double learning_rate;
+  double current_learning_rate;
+  double decay;
+  double epsilon;
+  double beta_1;
+  double beta_2;
+  double weight_decay;
+  int iterations;
+};
+
+using OptimizerAdam = BasicOptimizerAdam<double>;
+using OptimizerAdamF = BasicOptimizerAdam<float>;
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "flat_matrix.hpp"
+#include "layer_dense.hpp"
+#include <algorithm>
+#include <vector>
+
+// Helpers shared by the optimizers; not part of the public API.
+namespace optimizer_detail {
+
+// Sizes `state` like `like` and zeroes it, unless it already matches.
+template <typename T>
+void zeroed_like(BasicFlatMatrix<T> &state, const BasicFlatMatrix<T> &like) {
+  if (state.rows() == like.rows() && state.cols() == like.cols())
+    return;
+  state.resize(like.rows(), like.cols());
+  for (int i = 0; i < state.rows(); ++i)
+    std::fill(state.row(i), state.row(i) + state.cols(), T(0));
+}
+
+template <typename T>
+void zeroed_like(std::vector<T> &state, const std::vector<T> &like) {
+  if (state.size() != like.size())
+    state.assign(like.size(), T(0));
+}
+
+template <typename T> bool gradients_match(const BasicLayerDense<T> &layer) {
+  if (layer.dbiases.size() != layer.biases.size())
+    return false;
+  if (layer.has_sparse_dweights()) {
+    const BasicSparseRowGradient<T> &g = layer.sparse_dweights;
+    return g.values.cols() == layer.weights.cols() &&
+           g.values.rows() == static_cast<int>(g.rows.size());
+  }
+  return layer.dweights.rows() == layer.weights.rows() &&
+         layer.dweights.cols() == layer.weights.cols();
+}
+
+// Whether weights and their gradient and optimizer state can be walked as
+// one flat range; padded or viewed matrices go row by row instead. State an
+// optimizer does not use is empty, and so contiguous.
+template <typename T> bool packed(const BasicLayerDense<T> &layer) {
+  return layer.weights.is_contiguous() && layer.dweights.is_contiguous() &&
+         layer.weight_momentums.is_contiguous() &&
+         layer.weight_cache.is_contiguous();
+}
+
+} // namespace optimizer_detail
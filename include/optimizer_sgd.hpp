@@ -0,0 +1,26 @@
+#pragma once
+
+#include "layer_dense.hpp"
+
+// Stochastic gradient descent with optional momentum (classic or Nesterov)
+// and 1 / (1 + decay * t) learning-rate decay. The momentum buffers live on
+// the layer, and update_params() touches every weight and bias exactly once.
+template <typename T> class BasicOptimizerSGD {
+public:
+  explicit BasicOptimizerSGD(double learning_rate = 1.0, double decay = 0.0,
+                             double momentum = 0.0, bool nesterov = false);
+
+  void pre_update_params();
+  void update_params(BasicLayerDense<T> &layer);
+  void post_update_params();
+
+  double learning_rate;
+  double current_learning_rate;
+  double decay;
+  double momentum;
+  bool nesterov;
+  int iterations;
+};
+
+using OptimizerSGD = BasicOptimizerSGD<double>;
+using OptimizerSGDF = BasicOptimizerSGD<float>;
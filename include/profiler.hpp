@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Scoped timing for layers and kernels. Build with -DNN_PROFILING=ON (CMake)
+// to turn the NN_PROFILE_* macros into timers; otherwise they expand to
+// nothing and their arguments are not evaluated. The query functions below
+// are always available and simply report no data in that case.
+//
+// Each thread records into its own log. Read or reset the data only while no
+// parallel loop is running.
+
+struct ProfileStat {
+  std::string name;
+  std::uint64_t calls;
+  std::uint64_t total_ns;
+  std::uint64_t max_ns;
+  double flops;
+  double bytes;
+  // Heap buffers allocated by the thread running the scope; allocations by
+  // other threads, such as pool workers it hands chunks to, are not counted.
+  std::uint64_t allocations;
+
+  double gflops() const { return total_ns ? flops / total_ns : 0.0; }
+  double gbps() const { return total_ns ? bytes / total_ns : 0.0; }
+  // FLOPs per byte, the x axis of a roofline plot.
+  double intensity() const { return bytes > 0 ? flops / bytes : 0.0; }
+};
+
+bool profiling_enabled();
+
+// Aggregated over all threads, sorted by total time.
+std::vector<ProfileStat> profiler_stats();
+
+// Human-readable table of profiler_stats().
+std::string profile_report();
+
+void profiler_reset();
+
+// Writes every recorded scope as a Chrome trace_event "X" event, loadable in
+// chrome://tracing or Perfetto. At most `trace_capacity` events are kept per
+// thread; statistics keep counting past that.
+void write_chrome_trace(const std::string &path);
+void set_trace_capacity(std::size_t events_per_thread);
+
+// Returns a pointer to a copy of `name` that stays valid for the lifetime of
+// the program, for scope names built at run time.
+const char *profile_name(const std::string &name);
+
+class ProfileScope {
+public:
+  explicit ProfileScope(const char *name, double flops = 0.0,
+                        double bytes = 0.0);
+  ~ProfileScope();
+
+  ProfileScope(const ProfileScope &) = delete;
+  ProfileScope &operator=(const ProfileScope &) = delete;
+
+private:
+  const char *m_name;
+  double m_flops;
+  double m_bytes;
+  std::uint64_t m_start;
+  std::size_t m_allocations;
+};
+
+#define NN_PROFILE_CONCAT_(a, b) a##b
+#define NN_PROFILE_CONCAT(a, b) NN_PROFILE_CONCAT_(a, b)
+
+#if defined(NN_PROFILING) && NN_PROFILING
+#define NN_PROFILE_SCOPE(name)                                                 \
+  ProfileScope NN_PROFILE_CONCAT(nn_profile_scope_, __LINE__)(name)
+#define NN_PROFILE_SCOPE_COUNTS(name, flops, bytes)                            \
+  ProfileScope NN_PROFILE_CONCAT(nn_profile_scope_, __LINE__)(                 \
+      name, static_cast<double>(flops), static_cast<double>(bytes))
+#else
+#define NN_PROFILE_SCOPE(name) ((void)0)
+#define NN_PROFILE_SCOPE_COUNTS(name, flops, bytes) ((void)0)
+#endif
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "flat_matrix.hpp"
+#include "layer_dense.hpp"
+#include "layer_dense_relu.hpp"
+#include "sequential.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Int8 inference copy of a trained dense layer. Weights are quantized
+// symmetrically per output channel; inputs are quantized per row at run
+// time (or with one calibrated scale, see calibrate()). The product runs as
+// an int8 x int8 -> int32 kernel and is requantized to float together with
+// the bias and the optional ReLU.
+class QuantizedLayerDense {
+public:
+  template <typename T>
+  explicit QuantizedLayerDense(const BasicLayerDense<T> &layer,
+                               bool relu = false);
+  template <typename T>
+  explicit QuantizedLayerDense(const BasicLayerDenseReLU<T> &layer);
+
+  // Records the largest input magnitude seen over sample batches. Once
+  // calibrated, forward() uses that range as a fixed input scale instead of
+  // measuring every row.
+  template <typename T> void calibrate(const BasicFlatMatrix<T> &batch);
+  void reset_calibration();
+  bool calibrated() const;
+
+  template <typename T> void forward(const BasicFlatMatrix<T> &inputs);
+
+  int n_inputs() const;
+  int n_neurons() const;
+
+  // Bytes held by the quantized weights, scales and biases.
+  std::size_t memory_bytes() const;
+
+  FlatMatrixF output;
+
+private:
+  int m_inputs;
+  int m_neurons;
+  int m_stride; // n_inputs rounded up to the kernel width
+  bool m_relu;
+
+  std::vector<std::int8_t> m_weights; // n_neurons rows of m_stride values
+  std::vector<float> m_weight_scales;
+  std::vector<float> m_biases;
+
+  float m_calibrated_max = 0.0f;
+  bool m_calibrated = false;
+
+  std::vector<std::int8_t> m_qinputs;
+  std::vector<float> m_input_scales;
+};
+
+// Int8 copy of a Sequential model made of LayerDense and LayerDenseReLU
+// layers; an ActivationReLU right after a LayerDense is folded into it.
+// Layers hand float activations to each other, each quantizing its own
+// inputs.
+class QuantizedSequential {
+public:
+  template <typename T>
+  explicit QuantizedSequential(const BasicSequential<T> &model);
+
+  // Calibrates every layer on the activations it receives for `batch`.
+  template <typename T> void calibrate(const BasicFlatMatrix<T> &batch);
+
+  // Logits of the last layer, valid until the next forward().
+  template <typename T>
+  const FlatMatrixF &forward(const BasicFlatMatrix<T> &inputs);
+
+  int size() const;
+  QuantizedLayerDense &layer(int i);
+  std::size_t memory_bytes() const;
+
+private:
+  std::vector<QuantizedLayerDense> m_layers;
+};
+
+// Accuracy of a quantized layer or model against the one it was built
+// from, on one batch. argmax_agreement is the share of rows whose largest
+// output lands on the same neuron. The accuracies against labels are only
+// filled in by the model version, whose quantization error compounds over
+// the layers; their difference is the accuracy cost of int8 inference.
+struct QuantizationReport {
+  double max_abs_error;
+  double mean_abs_error;
+  double max_reference;
+  double argmax_agreement;
+  double reference_accuracy;
+  double quantized_accuracy;
+};
+
+template <typename T>
+QuantizationReport quantization_report(BasicLayerDense<T> &reference,
+                                       QuantizedLayerDense &quantized,
+                                       const BasicFlatMatrix<T> &batch);
+
+template <typename T>
+QuantizationReport quantization_report(BasicSequential<T> &reference,
+                                       QuantizedSequential &quantized,
+                                       const BasicFlatMatrix<T> &batch,
+                                       const std::vector<int> &labels);
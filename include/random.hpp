@@ -0,0 +1,51 @@
+#pragma once
+
+#include "flat_matrix.hpp"
+#include <array>
+#include <cstdint>
+
+// Philox4x32-10 (Salmon et al., "Parallel Random Numbers: As Easy as 1, 2,
+// 3"): a counter-based generator that maps a 128-bit counter and a 64-bit
+// key to 128 random bits with no state in between. Any element of a stream
+// can be computed directly from its index, so fills split across threads
+// give the same numbers as a serial fill.
+using PhiloxCounter = std::array<std::uint32_t, 4>;
+using PhiloxKey = std::array<std::uint32_t, 2>;
+
+// One block of the generator behind the fills below, for checks against
+// the published known-answer vectors.
+PhiloxCounter philox4x32(PhiloxCounter ctr, PhiloxKey key);
+
+// Streams with this bit set are drawn by randn_matrix (utils.hpp), so they
+// never repeat the streams init_weights uses for layers under the same seed.
+constexpr std::uint64_t RANDN_STREAM_BIT = std::uint64_t(1) << 63;
+
+// Element (i, j) of the fills below depends only on `seed`, `stream` and
+// its index i * cols + j, so the result is the same for any thread count
+// and any stride. Different streams under one seed, e.g. one per layer,
+// are independent.
+template <typename T>
+void fill_normal(BasicFlatMatrix<T> &M, std::uint64_t seed,
+                 std::uint64_t stream, double mean = 0.0, double stddev = 1.0);
+
+// Uniform on [low, high).
+template <typename T>
+void fill_uniform(BasicFlatMatrix<T> &M, std::uint64_t seed,
+                  std::uint64_t stream, double low = 0.0, double high = 1.0);
+
+// Weight initializers, in terms of the fan-in and fan-out of a layer:
+//
+//   HeNormal       N(0, 2 / fan_in)
+//   HeUniform      U(-sqrt(6 / fan_in), sqrt(6 / fan_in))
+//   XavierNormal   N(0, 2 / (fan_in + fan_out))
+//   XavierUniform  U(-sqrt(6 / (fan_in + fan_out)), ...)
+//
+// He suits layers followed by a ReLU, Xavier layers followed by softmax or
+// nothing.
+enum class WeightInit { HeNormal, HeUniform, XavierNormal, XavierUniform };
+
+// (fan_in x fan_out) weights for layer `layer` of a model seeded with `seed`.
+// `layer` must not have RANDN_STREAM_BIT set.
+template <typename T = double>
+BasicFlatMatrix<T> init_weights(int fan_in, int fan_out, WeightInit init,
+                                std::uint64_t seed, std::uint64_t layer);
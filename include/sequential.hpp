@@ -0,0 +1,103 @@
+#pragma once
+
+#include "activation_softmax_loss_cce.hpp"
+#include "fit_loop.hpp"
+#include "flat_matrix.hpp"
+#include "layer.hpp"
+#include "layer_dense.hpp"
+#include "profiler.hpp"
+#include "sparse_matrix.hpp"
+#include <memory>
+#include <random>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Ordered stack of layers trained with the softmax + cross-entropy head, so
+// the last layer produces logits. fit() walks the data in (shuffled)
+// mini-batches that are gathered into buffers owned by the model; memory
+// stays proportional to the batch size, not the dataset size.
+template <typename T> class BasicSequential {
+public:
+  template <typename L, typename... Args> L &add(Args &&...args) {
+    static_assert(std::is_base_of<BasicLayer<T>, L>::value,
+                  "Sequential::add: L has to derive from BasicLayer<T>");
+    auto layer = std::make_unique<L>(std::forward<Args>(args)...);
+    L &ref = *layer;
+    if constexpr (std::is_base_of<BasicLayerDense<T>, L>::value)
+      m_trainable.push_back(&ref);
+    m_layers.push_back(std::move(layer));
+    name_last_layer();
+    return ref;
+  }
+
+  int size() const;
+  BasicLayer<T> &layer(int i);
+  const BasicLayer<T> &layer(int i) const;
+
+  // Keeps memory that layers point into (a mapped checkpoint) alive for as
+  // long as the model exists.
+  void keep_alive(std::shared_ptr<const void> storage);
+
+  void forward(const BasicFlatMatrix<T> &inputs);
+  // Sparse inputs; the first layer has to be a LayerDense.
+  void forward(const BasicCsrMatrix<T> &inputs);
+  void backward(const BasicFlatMatrix<T> &dvalues);
+
+  // Logits of the last forward().
+  const BasicFlatMatrix<T> &output() const;
+
+  // Inference forward under a NoGradGuard. Layers keep nothing for
+  // backward, elementwise layers run in place, and activations alternate
+  // between two buffers owned by the model. The returned logits stay valid
+  // until the next predict().
+  const BasicFlatMatrix<T> &predict(const BasicFlatMatrix<T> &inputs);
+
+  // Runs the optimizer over `epochs` passes of X and returns the mean loss
+  // and accuracy of each epoch, measured on the training batches.
+  template <typename Optimizer>
+  std::vector<EpochStats> fit(const BasicFlatMatrix<T> &X,
+                              const std::vector<int> &y, Optimizer &optimizer,
+                              const FitOptions &options = {}) {
+    int batches = begin_fit(X, y, options);
+    return fit_loop(X.rows(), batches, options, m_order, m_rng,
+                    [&](int b, int &correct) {
+                      double loss =
+                          train_batch(X, y, b, options.batch_size, correct);
+                      NN_PROFILE_SCOPE("Sequential::optimizer_step");
+                      optimizer_step(optimizer, m_trainable);
+                      return loss;
+                    });
+  }
+
+  // Mean loss and accuracy over X, evaluated batch by batch in order.
+  EpochStats evaluate(const BasicFlatMatrix<T> &X, const std::vector<int> &y,
+                      int batch_size = 256);
+
+private:
+  void name_last_layer();
+  int begin_fit(const BasicFlatMatrix<T> &X, const std::vector<int> &y,
+                const FitOptions &options);
+  void gather(const BasicFlatMatrix<T> &X, const std::vector<int> &y,
+              int first, int count, bool permuted);
+  int count_correct() const;
+  double train_batch(const BasicFlatMatrix<T> &X, const std::vector<int> &y,
+                     int b, int batch_size, int &correct);
+
+  std::shared_ptr<const void> m_storage; // outlives the layers
+  std::vector<std::unique_ptr<BasicLayer<T>>> m_layers;
+  std::vector<BasicLayerDense<T> *> m_trainable;
+  // Profiler scope names, "layer<i>.forward" and "layer<i>.backward".
+  std::vector<const char *> m_forward_names;
+  std::vector<const char *> m_backward_names;
+  BasicActivationSoftmaxLossCategoricalCrossEntropy<T> m_head;
+
+  std::vector<int> m_order;
+  std::mt19937 m_rng;
+  BasicFlatMatrix<T> m_batch_x;
+  std::vector<int> m_batch_y;
+  BasicFlatMatrix<T> m_ping, m_pong; // predict() activations
+};
+
+using Sequential = BasicSequential<double>;
+using SequentialF = BasicSequential<float>;
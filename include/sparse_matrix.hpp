@@ -0,0 +1,92 @@
+#pragma once
+
+#include "flat_matrix.hpp"
+#include "gemm.hpp"
+#include <cstddef>
+#include <vector>
+
+// Entries of a CSR matrix grouped by column, for products with its
+// transpose. Column cols[s] owns entries[starts[s]] up to entries[starts[s +
+// 1]], ordered by row; entry_rows holds the row of each of those entries.
+struct CsrColumnIndex {
+  std::vector<int> cols; // distinct columns, ascending
+  std::vector<int> starts;
+  std::vector<int> entries;
+  std::vector<int> entry_rows;
+};
+
+// Compressed sparse row matrix for inputs that are mostly zeros, such as
+// one-hot and bag-of-words features. Row i owns entries row_ptr()[i] up to
+// row_ptr()[i + 1] of col_idx() and values().
+template <typename T> class BasicCsrMatrix {
+public:
+  explicit BasicCsrMatrix(int cols = 0);
+
+  // Keeps the non-zero entries of M.
+  static BasicCsrMatrix from_dense(const BasicFlatMatrix<T> &M);
+
+  // Appends a row with n entries at the given columns. Columns have to be
+  // in range; within a row they are kept in the given order.
+  void add_row(const int *cols, const T *values, int n);
+
+  // Drops every row but keeps the buffers, so a batch can be refilled
+  // without touching the heap.
+  void clear(int cols);
+  void reserve(int rows, std::size_t nnz);
+
+  int rows() const;
+  int cols() const;
+  std::size_t nnz() const;
+
+  const int *row_ptr() const;
+  const int *col_idx() const;
+  const T *values() const;
+
+  BasicFlatMatrix<T> to_dense() const;
+
+  // Built on the first call and kept, also by copies, until the matrix
+  // changes, so a batch is sorted by column only once. The first call must
+  // not race with another one on the same matrix.
+  const CsrColumnIndex &column_index() const;
+
+private:
+  int m_cols;
+  std::vector<int> m_row_ptr; // rows() + 1 offsets
+  std::vector<int> m_col_idx;
+  std::vector<T> m_values;
+  mutable CsrColumnIndex m_index;
+  mutable bool m_index_valid = false;
+};
+
+using CsrMatrix = BasicCsrMatrix<double>;
+using CsrMatrixF = BasicCsrMatrix<float>;
+
+// Gradient of a weight matrix of which only some rows are non-zero: row
+// rows[i] of the full gradient is values.row(i), all other rows are zero.
+// rows is sorted ascending.
+template <typename T> struct BasicSparseRowGradient {
+  std::vector<int> rows;
+  BasicFlatMatrix<T> values;
+};
+
+using SparseRowGradient = BasicSparseRowGradient<double>;
+using SparseRowGradientF = BasicSparseRowGradient<float>;
+
+// Result (A.rows x B.cols) = A * B followed by the epilogue. Each output row
+// costs one pass over B's rows named by the row's non-zeros.
+template <typename T>
+void spmm_into(const BasicCsrMatrix<T> &A, const BasicFlatMatrix<T> &B,
+               BasicFlatMatrix<T> &Result,
+               const GemmEpilogue<T> &epilogue = GemmEpilogue<T>());
+
+// Result (A.cols x D.cols) = A^T * D. Only the rows of Result named by a
+// column of A receive data; the others are zeroed.
+template <typename T>
+void spmm_tn_into(const BasicCsrMatrix<T> &A, const BasicFlatMatrix<T> &D,
+                  BasicFlatMatrix<T> &Result);
+
+// A^T * D restricted to its non-zero rows, so time and memory depend on
+// the number of distinct columns of A instead of A.cols.
+template <typename T>
+void spmm_tn_into(const BasicCsrMatrix<T> &A, const BasicFlatMatrix<T> &D,
+                  BasicSparseRowGradient<T> &Result);
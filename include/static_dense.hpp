@@ -0,0 +1,74 @@
+#pragma once
+
+#include "flat_matrix.hpp"
+#include "layer_dense.hpp"
+#include "static_matrix.hpp"
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+// Inference-only dense layer with compile-time sizes and inline weights,
+// optionally followed by a ReLU. Layers chain with their shapes checked by
+// the compiler:
+//
+//   StaticDenseReLU<16, 32> hidden(trained_hidden);
+//   StaticDense<32, 4> head(trained_head);
+//   auto scores = head.forward(hidden.forward(x)); // x: StaticMatrix<1, 16>
+template <typename T, int In, int Out, bool ReLU = false>
+class BasicStaticDense {
+public:
+  BasicStaticDense() : weights(T(0)), biases(T(0)) {}
+
+  // Copies trained parameters; throws if the layer has another shape.
+  explicit BasicStaticDense(const BasicLayerDense<T> &layer) {
+    load(layer.weights, layer.biases);
+  }
+
+  BasicStaticDense(const BasicFlatMatrix<T> &w, const std::vector<T> &b) {
+    load(w, b);
+  }
+
+  void load(const BasicFlatMatrix<T> &w, const std::vector<T> &b) {
+    if (static_cast<int>(b.size()) != Out) {
+      throw std::invalid_argument(
+          "StaticDense load: the number of biases has to match Out!");
+    }
+    weights = BasicStaticMatrix<T, In, Out>(w);
+    std::copy(b.begin(), b.end(), biases.data());
+  }
+
+  // output = inputs * weights + biases (then max(0, .) for ReLU layers),
+  // for a compile-time batch of B rows.
+  template <int B>
+  void forward_into(const BasicStaticMatrix<T, B, In> &inputs,
+                    BasicStaticMatrix<T, B, Out> &output) const {
+    NN_STATIC_UNROLL
+    for (int i = 0; i < B; ++i) {
+      static_matrix_detail::row_times_matrix<T, In, Out, ReLU>(
+          inputs.row(i), weights.data(), biases.data(), output.row(i));
+    }
+  }
+
+  template <int B>
+  BasicStaticMatrix<T, B, Out>
+  forward(const BasicStaticMatrix<T, B, In> &inputs) const {
+    BasicStaticMatrix<T, B, Out> output;
+    forward_into(inputs, output);
+    return output;
+  }
+
+  static constexpr int n_inputs() { return In; }
+  static constexpr int n_neurons() { return Out; }
+
+  BasicStaticMatrix<T, In, Out> weights;
+  BasicStaticMatrix<T, 1, Out> biases;
+};
+
+template <int In, int Out>
+using StaticDense = BasicStaticDense<double, In, Out>;
+template <int In, int Out>
+using StaticDenseF = BasicStaticDense<float, In, Out>;
+template <int In, int Out>
+using StaticDenseReLU = BasicStaticDense<double, In, Out, true>;
+template <int In, int Out>
+using StaticDenseReLUF = BasicStaticDense<float, In, Out, true>;
@@ -0,0 +1,179 @@
+#pragma once
+
+#include "flat_matrix.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__GNUC__) && !defined(__clang__)
+#define NN_STATIC_UNROLL _Pragma("GCC unroll 32")
+#elif defined(__clang__)
+#define NN_STATIC_UNROLL _Pragma("unroll")
+#else
+#define NN_STATIC_UNROLL
+#endif
+
+// Row-major R x C matrix with inline storage, for networks small enough that
+// heap buffers and runtime shape checks would dominate. All sizes are known
+// to the compiler, so the kernels below unroll completely and mismatched
+// shapes fail to compile instead of throwing.
+template <typename T, int R, int C> class BasicStaticMatrix {
+  static_assert(R > 0 && C > 0, "StaticMatrix: dimensions have to be positive");
+
+public:
+  using value_type = T;
+
+  BasicStaticMatrix() = default;
+
+  explicit BasicStaticMatrix(T initVal) { fill(initVal); }
+
+  // Copies a FlatMatrix of the same shape.
+  explicit BasicStaticMatrix(const BasicFlatMatrix<T> &m) {
+    if (m.rows() != R || m.cols() != C) {
+      throw std::invalid_argument(
+          "StaticMatrix: the FlatMatrix shape does not match!");
+    }
+    for (int i = 0; i < R; ++i)
+      std::copy(m.row(i), m.row(i) + C, row(i));
+  }
+
+  static constexpr int rows() { return R; }
+  static constexpr int cols() { return C; }
+  static constexpr std::size_t size() { return std::size_t(R) * C; }
+
+  T &operator()(int i, int j) { return m_data[i * C + j]; }
+  T operator()(int i, int j) const { return m_data[i * C + j]; }
+
+  T *row(int i) { return m_data + i * C; }
+  const T *row(int i) const { return m_data + i * C; }
+
+  T *data() { return m_data; }
+  const T *data() const { return m_data; }
+
+  void fill(T value) { std::fill(m_data, m_data + size(), value); }
+
+  BasicFlatMatrix<T> to_flat() const {
+    BasicFlatMatrix<T> m(R, C);
+    for (int i = 0; i < R; ++i)
+      std::copy(row(i), row(i) + C, m.row(i));
+    return m;
+  }
+
+private:
+  alignas(32) T m_data[R * C];
+};
+
+template <int R, int C> using StaticMatrix = BasicStaticMatrix<double, R, C>;
+template <int R, int C> using StaticMatrixF = BasicStaticMatrix<float, R, C>;
+
+namespace static_matrix_detail {
+
+#ifdef __AVX__
+constexpr int VEC_BYTES = 32;
+#else
+constexpr int VEC_BYTES = 16;
+#endif
+
+#if defined(__GNUC__)
+// Vector extension types; the attribute cannot be applied to a template
+// parameter directly.
+template <typename T> struct simd;
+template <> struct simd<float> {
+  typedef float type __attribute__((vector_size(VEC_BYTES)));
+};
+template <> struct simd<double> {
+  typedef double type __attribute__((vector_size(VEC_BYTES)));
+};
+#endif
+
+// out[0, N) = bias + x[0, K) * W, with W a row-major K x N block and bias
+// optional, followed by max(0, .) when ReLU is set. The accumulators for a
+// whole output row live in vector registers for the entire k loop; with
+// the trip counts fixed the loops unroll into straight-line code.
+template <typename T, int K, int N, bool ReLU>
+inline void row_times_matrix(const T *x, const T *W, const T *bias, T *out) {
+  int j0 = 0;
+#if defined(__GNUC__)
+  using V = typename simd<T>::type;
+  constexpr int L = VEC_BYTES / sizeof(T);
+  constexpr int NV = N / L;
+  if constexpr (NV > 0) {
+    // Narrow rows would be one long chain of dependent adds, so k is
+    // spread over several independent accumulator sets that are summed at
+    // the end.
+    constexpr int CHAINS = NV >= 4 ? 1 : 4 / NV;
+    V acc[CHAINS][NV];
+    NN_STATIC_UNROLL
+    for (int v = 0; v < NV; ++v) {
+      NN_STATIC_UNROLL
+      for (int c = 0; c < CHAINS; ++c)
+        acc[c][v] = V{};
+      if (bias)
+        std::memcpy(&acc[0][v], bias + v * L, sizeof(V));
+    }
+    NN_STATIC_UNROLL
+    for (int k = 0; k < K; ++k) {
+      V xk = x[k] - V{}; // broadcast; x - 0 folds away, 0 + x does not
+      const T *w = W + k * N;
+      NN_STATIC_UNROLL
+      for (int v = 0; v < NV; ++v) {
+        V wv;
+        std::memcpy(&wv, w + v * L, sizeof(V));
+        acc[k % CHAINS][v] += xk * wv;
+      }
+    }
+    NN_STATIC_UNROLL
+    for (int v = 0; v < NV; ++v) {
+      NN_STATIC_UNROLL
+      for (int c = 1; c < CHAINS; ++c)
+        acc[0][v] += acc[c][v];
+      std::memcpy(out + v * L, &acc[0][v], sizeof(V));
+    }
+    j0 = NV * L;
+  }
+#endif
+  // Columns left over after the vector blocks (all of them without
+  // vector extensions).
+  for (int j = j0; j < N; ++j) {
+    T acc = bias ? bias[j] : T(0);
+    for (int k = 0; k < K; ++k)
+      acc += x[k] * W[k * N + j];
+    out[j] = acc;
+  }
+  if (ReLU) {
+    NN_STATIC_UNROLL
+    for (int j = 0; j < N; ++j)
+      out[j] = std::max(out[j], T(0));
+  }
+}
+
+} // namespace static_matrix_detail
+
+// Result = A * B for compile-time shapes; the inner dimension has to agree.
+template <typename T, int R, int K, int C>
+void matmul_into(const BasicStaticMatrix<T, R, K> &A,
+                 const BasicStaticMatrix<T, K, C> &B,
+                 BasicStaticMatrix<T, R, C> &Result) {
+  NN_STATIC_UNROLL
+  for (int i = 0; i < R; ++i) {
+    static_matrix_detail::row_times_matrix<T, K, C, false>(
+        A.row(i), B.data(), nullptr, Result.row(i));
+  }
+}
+
+template <typename T, int R, int K, int C>
+BasicStaticMatrix<T, R, C> matmul(const BasicStaticMatrix<T, R, K> &A,
+                                  const BasicStaticMatrix<T, K, C> &B) {
+  BasicStaticMatrix<T, R, C> Result;
+  matmul_into(A, B, Result);
+  return Result;
+}
+
+template <typename T, int R, int C>
+void relu_inplace(BasicStaticMatrix<T, R, C> &M) {
+  T *m = M.data();
+  NN_STATIC_UNROLL
+  for (std::size_t i = 0; i < M.size(); ++i)
+    m[i] = std::max(m[i], T(0));
+}
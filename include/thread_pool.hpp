@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Persistent pool of worker threads for data-parallel loops. A parallel_for
+// splits [begin, end) into chunks of `grain` iterations and hands every
+// participant (the workers plus the calling thread) a contiguous run of
+// chunks; whoever runs dry steals the back half of someone else's run.
+class ThreadPool {
+public:
+  explicit ThreadPool(int num_threads);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  // Number of participants including the calling thread.
+  int size() const;
+
+  // Calls fn(chunk_begin, chunk_end) over [begin, end). Nested calls from
+  // inside a running loop execute serially on the calling worker. If fn
+  // throws, the chunks not yet started are skipped, and the first exception
+  // is rethrown on the calling thread once every participant has stopped.
+  template <typename Fn>
+  void parallel_for(int begin, int end, int grain, Fn &&fn) {
+    run(begin, end, grain, &invoke<Fn>, &fn);
+  }
+
+  // Process-wide pool used by the matrix kernels and layers.
+  static ThreadPool &global();
+
+private:
+  using Trampoline = void (*)(void *, int, int);
+
+  template <typename Fn> static void invoke(void *fn, int begin, int end) {
+    (*static_cast<typename std::remove_reference<Fn>::type *>(fn))(begin, end);
+  }
+
+  struct alignas(64) Slot {
+    std::mutex mutex;
+    int next = 0;
+    int end = 0;
+  };
+
+  void run(int begin, int end, int grain, Trampoline call, void *fn);
+  void work(int self);
+  bool take(int self, int &chunk);
+  void worker_loop(int self);
+
+  int m_size;
+  std::vector<std::thread> m_workers;
+  std::unique_ptr<Slot[]> m_slots;
+
+  std::mutex m_submit;
+  std::mutex m_mutex;
+  std::condition_variable m_wake;
+  std::condition_variable m_done;
+  std::uint64_t m_generation = 0;
+  int m_pending = 0;
+  bool m_stop = false;
+  std::exception_ptr m_error; // first exception of the running loop
+  std::atomic<bool> m_failed{false};
+
+  Trampoline m_call = nullptr;
+  void *m_fn = nullptr;
+  int m_begin = 0;
+  int m_end = 0;
+  int m_grain = 1;
+};
+
+// Resizes the global pool. Must not be called while a loop is running.
+// The initial size comes from NN_NUM_THREADS or the hardware concurrency.
+void set_num_threads(int num_threads);
+int num_threads();
+
+// In deterministic mode reductions are split into a fixed number of chunks
+// that depends only on the problem size, and partial results are combined
+// in chunk order, so results are bit-identical for any thread count.
+void set_deterministic(bool enabled);
+bool deterministic();
+
+// Number of partial results a reduction over n items should use.
+int reduction_chunks(int n, int grain);
+
+template <typename Fn>
+void parallel_for(int begin, int end, int grain, Fn &&fn) {
+  ThreadPool::global().parallel_for(begin, end, grain, std::forward<Fn>(fn));
+}
@@ -1,26 +1,42 @@
 #pragma once
 
 #include "../include/flat_matrix.hpp"
+#include <cstdint>
 #include <functional>
 #include <vector>
 
+// Seeds randn and randn_matrix, which otherwise start from the clock. After
+// the same seed, the same sequence of calls gives the same numbers.
+void set_random_seed(std::uint64_t seed);
+
 double randn(double mean = 0.0, double stddev = 1.0);
 
-FlatMatrix randn_matrix(int rows, int cols, double mean, double stddev,
-                        double scale = 1.0);
+// Filled in parallel from a counter-based generator (see random.hpp).
+template <typename T = double>
+BasicFlatMatrix<T> randn_matrix(int rows, int cols, double mean, double stddev,
+                                double scale = 1.0);
 
-FlatMatrix create_matrix(int rows, int cols, double initVal = 0.0);
+template <typename T = double>
+BasicFlatMatrix<T> create_matrix(int rows, int cols, T initVal = T(0));
 
-FlatMatrix transpose(const FlatMatrix &M);
+template <typename T> BasicFlatMatrix<T> transpose(const BasicFlatMatrix<T> &M);
 
-std::vector<double> sum_rows(const FlatMatrix &M);
-std::vector<double> sum_cols(const FlatMatrix &M);
+template <typename T> std::vector<T> sum_rows(const BasicFlatMatrix<T> &M);
+template <typename T> std::vector<T> sum_cols(const BasicFlatMatrix<T> &M);
+template <typename T>
+void sum_cols_into(const BasicFlatMatrix<T> &M, std::vector<T> &sums);
 
-FlatMatrix elementwise_max(const FlatMatrix &M, double threshold);
+template <typename T>
+BasicFlatMatrix<T> elementwise_max(const BasicFlatMatrix<T> &M,
+                                   typename BasicFlatMatrix<T>::value_type
+                                       threshold);
 
-FlatMatrix elementwise_mul(const FlatMatrix &A, const FlatMatrix &B);
+template <typename T>
+BasicFlatMatrix<T> elementwise_mul(const BasicFlatMatrix<T> &A,
+                                   const BasicFlatMatrix<T> &B);
 
-FlatMatrix softmax_jacobian(const std::vector<double> &p);
+template <typename T>
+BasicFlatMatrix<T> softmax_jacobian(const std::vector<T> &p);
 
 double numerical_gradient(std::function<double(const FlatMatrix &)> f,
-                          const FlatMatrix &W, int i, int j, double eps = 1e-5);
\ No newline at end of file
+                          const FlatMatrix &W, int i, int j, double eps = 1e-5);
@@ -0,0 +1,31 @@
+#pragma once
+
+// Array versions of exp and log for the network head. On CPUs with AVX2 and
+// FMA they run as polynomial approximations over whole vectors; elsewhere
+// they call std::exp / std::log per element. Error against the correctly
+// rounded result, over the ranges below:
+//
+//   exp  float  <= 1 ulp on [-87.3, 88.7]
+//        double <= 1 ulp on [-708.3, 709.7]
+//   log  float  <= 3 ulp on the positive normals
+//        double <= 3 ulp on the positive normals
+//
+// Below the exp range the result is 0, above it +inf. log returns -inf
+// for 0, NaN for negative inputs and treats subnormal inputs as the
+// smallest normal number. NaN inputs give NaN.
+
+template <typename T> void vec_exp(const T *x, T *out, int n);
+template <typename T> void vec_log(const T *x, T *out, int n);
+
+// Largest of x[0, n); -inf for n == 0.
+template <typename T> T vec_max(const T *x, int n);
+
+// out[i] = exp(x[i] - shift), returning the sum of out.
+template <typename T> T vec_exp_sum(const T *x, T shift, T *out, int n);
+
+template <typename T> void vec_scale(T *x, T factor, int n);
+
+// Numerically stable softmax of one row. The input is read once: every
+// block of the row is exponentiated against its own maximum and the blocks
+// are brought to the common maximum while normalizing.
+template <typename T> void softmax_row(const T *in, T *out, int n);
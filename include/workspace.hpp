@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// Number of heap buffers handed out by FlatMatrix and Workspace since the
+// start of the program. Once a training loop has reached its steady state
+// this stops changing between steps.
+std::size_t heap_allocation_count();
+// Same, counting only the buffers allocated by the calling thread.
+std::size_t thread_heap_allocation_count();
+
+void record_heap_allocation();
+
+// Bump arena for scratch memory. Space is handed out in stack order and
+// given back by rewinding to a mark. While the arena is still learning how
+// much a step needs it chains extra blocks; the first time it is rewound to
+// empty those blocks are merged into one, so every later step of the same
+// shape is served without touching the heap.
+class Workspace {
+public:
+  struct Mark {
+    std::size_t block;
+    std::size_t used;
+  };
+
+  Workspace() = default;
+  ~Workspace();
+
+  Workspace(const Workspace &) = delete;
+  Workspace &operator=(const Workspace &) = delete;
+
+  // Returns room for n values of type T, 64-byte aligned.
+  template <typename T = double> T *allocate(std::size_t n) {
+    return static_cast<T *>(allocate_bytes(n * sizeof(T)));
+  }
+
+  void *allocate_bytes(std::size_t bytes);
+
+  Mark mark() const;
+  void release(const Mark &mark);
+
+  // Bytes available without growing.
+  std::size_t capacity() const;
+
+  // Scratch arena of the calling thread, used by the matrix kernels.
+  static Workspace &local();
+
+private:
+  struct Block {
+    unsigned char *data;
+    std::size_t size;
+    std::size_t used;
+  };
+
+  void add_block(std::size_t n);
+  void free_blocks();
+
+  std::vector<Block> m_blocks;
+  std::size_t m_current = 0;
+};
+
+// Gives back everything allocated from a workspace in the enclosing scope.
+class WorkspaceScope {
+public:
+  explicit WorkspaceScope(Workspace &ws = Workspace::local())
+      : m_ws(ws), m_mark(ws.mark()) {}
+  ~WorkspaceScope() { m_ws.release(m_mark); }
+
+  WorkspaceScope(const WorkspaceScope &) = delete;
+  WorkspaceScope &operator=(const WorkspaceScope &) = delete;
+
+  template <typename T = double> T *allocate(std::size_t n) {
+    return m_ws.allocate<T>(n);
+  }
+
+private:
+  Workspace &m_ws;
+  Workspace::Mark m_mark;
+};
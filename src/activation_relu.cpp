@@ -1,29 +1,65 @@
 #include "../include/activation_relu.hpp"
 #include "flat_matrix.hpp"
+#include "thread_pool.hpp"
+#include "profiler.hpp"
 #include <algorithm>
 #include <stdexcept>
 
-void ActivationReLU::forward(const FlatMatrix &inputs) {
-  this->inputs = inputs;
+namespace {
 
-  this->output = FlatMatrix(inputs.rows(), inputs.cols(), 0.0);
-  for (int i = 0; i < inputs.rows(); ++i) {
-    for (int j = 0; j < inputs.cols(); ++j) {
-      this->output.set(i, j, std::max(0.0, inputs.get(i, j)));
+// Elementwise, so `out` may be `inputs`.
+template <typename T>
+void relu_into(const BasicFlatMatrix<T> &inputs, BasicFlatMatrix<T> &out) {
+  int C = inputs.cols();
+  out.resize(inputs.rows(), C);
+  parallel_for(0, inputs.rows(), 16, [&](int first, int last) {
+    for (int i = first; i < last; ++i) {
+      const T *in = inputs.row(i);
+      T *o = out.row(i);
+      for (int j = 0; j < C; ++j) {
+        o[j] = std::max(T(0), in[j]);
+      }
     }
-  }
+  });
+}
+
+} // namespace
+
+template <typename T>
+void BasicActivationReLU<T>::forward(const BasicFlatMatrix<T> &inputs) {
+  NN_PROFILE_SCOPE_COUNTS("ActivationReLU::forward",
+                          double(inputs.rows()) * inputs.cols(),
+                          2.0 * sizeof(T) * inputs.rows() * inputs.cols());
+  relu_into(inputs, this->output);
 }
 
-void ActivationReLU::backward(const FlatMatrix &dvalues) {
-  if (dvalues.rows() != inputs.rows() || dvalues.cols() != inputs.cols())
+template <typename T>
+void BasicActivationReLU<T>::forward_into(const BasicFlatMatrix<T> &inputs,
+                                          BasicFlatMatrix<T> &out) {
+  relu_into(inputs, out);
+}
+
+template <typename T>
+void BasicActivationReLU<T>::backward(const BasicFlatMatrix<T> &dvalues) {
+  NN_PROFILE_SCOPE_COUNTS("ActivationReLU::backward",
+                          double(dvalues.rows()) * dvalues.cols(),
+                          3.0 * sizeof(T) * dvalues.rows() * dvalues.cols());
+  const BasicFlatMatrix<T> &out = this->output;
+  if (dvalues.rows() != out.rows() || dvalues.cols() != out.cols())
     throw std::invalid_argument("ReLU backward: shape mismatch");
 
   this->dinputs = dvalues;
 
-  for (int i = 0; i < inputs.rows(); ++i) {
-    for (int j = 0; j < inputs.cols(); ++j) {
-      if (inputs.get(i, j) <= 0.0)
-        dinputs.set(i, j, 0.0);
+  int C = out.cols();
+  for (int i = 0; i < out.rows(); ++i) {
+    const T *o = out.row(i);
+    T *d = this->dinputs.row(i);
+    for (int j = 0; j < C; ++j) {
+      if (o[j] <= T(0))
+        d[j] = T(0);
     }
   }
-}
\ No newline at end of file
+}
+
+template class BasicActivationReLU<float>;
+template class BasicActivationReLU<double>;
@@ -1,64 +1,78 @@
 #include "../include/activation_softmax.hpp"
 #include "flat_matrix.hpp"
-#include <cmath>
-#include <limits>
+#include "thread_pool.hpp"
+#include "profiler.hpp"
+#include "vec_math.hpp"
 #include <stdexcept>
 
-void ActivationSoftmax::forward(const FlatMatrix &inputs_) {
-  inputs = inputs_;
+namespace {
 
+// Row by row, so `out` may be `inputs`.
+template <typename T>
+void softmax_into(const BasicFlatMatrix<T> &inputs, BasicFlatMatrix<T> &out) {
   int R = inputs.rows();
   int C = inputs.cols();
 
-  output = FlatMatrix(R, C, 0.0);
+  out.resize(R, C);
 
-  for (int i = 0; i < R; ++i) {
-    double maxVal = -std::numeric_limits<double>::infinity();
-    for (int j = 0; j < C; ++j) {
-      double value = inputs.get(i, j);
-      if (value > maxVal) {
-        maxVal = value;
-      }
+  parallel_for(0, R, 8, [&](int first, int last) {
+    for (int i = first; i < last; ++i) {
+      softmax_row(inputs.row(i), out.row(i), C);
     }
+  });
+}
 
-    double sumExp = 0;
-    for (int j = 0; j < C; ++j) {
-      double exponent = std::exp(inputs.get(i, j) - maxVal);
-      output.set(i, j, exponent);
-      sumExp += exponent;
-    }
+} // namespace
 
-    for (int j = 0; j < C; ++j) {
-      double finExp = output.get(i, j) / sumExp;
-      output.set(i, j, finExp);
-    }
-  }
+template <typename T>
+void BasicActivationSoftmax<T>::forward(const BasicFlatMatrix<T> &inputs) {
+  NN_PROFILE_SCOPE_COUNTS("ActivationSoftmax::forward",
+                          4.0 * inputs.rows() * inputs.cols(),
+                          2.0 * sizeof(T) * inputs.rows() * inputs.cols());
+  softmax_into(inputs, this->output);
 }
 
-void ActivationSoftmax::backward(const FlatMatrix &dvalues) {
+template <typename T>
+void BasicActivationSoftmax<T>::forward_into(const BasicFlatMatrix<T> &inputs,
+                                             BasicFlatMatrix<T> &out) {
+  softmax_into(inputs, out);
+}
+
+template <typename T>
+void BasicActivationSoftmax<T>::backward(const BasicFlatMatrix<T> &dvalues) {
+  NN_PROFILE_SCOPE_COUNTS("ActivationSoftmax::backward",
+                          4.0 * dvalues.rows() * dvalues.cols(),
+                          3.0 * sizeof(T) * dvalues.rows() * dvalues.cols());
   
-  if (dvalues.rows() != output.rows() || dvalues.cols() != output.cols()) {
+  if (dvalues.rows() != this->output.rows() ||
+      dvalues.cols() != this->output.cols()) {
     throw std::invalid_argument{"ActivationSoftmax::backward: Invalid input! dvalues has to match output."};
   }
   
   int R = dvalues.rows();
   int C = dvalues.cols();
 
-  dinputs = FlatMatrix(R, C, 0.0);
+  this->dinputs.resize(R, C);
 
   for (int i = 0; i < R; ++i)
   {
-    double dot = 0.0;
+    const T *out = this->output.row(i);
+    const T *dval = dvalues.row(i);
+    T *dinp = this->dinputs.row(i);
+
+    T dot = 0;
 
     for (int j = 0; j < C; ++j)
     {
-      dot += output.get(i, j) * dvalues.get(i, j);
+      dot += out[j] * dval[j];
     }
 
     for (int j = 0; j < C; ++j)
     {
-      double new_val = output.get(i, j) * (dvalues.get(i, j) - dot);
-      dinputs.set(i, j, new_val);
+      dinp[j] = out[j] * (dval[j] - dot);
     }
   }
 }
+
+template class BasicActivationSoftmax<float>;
+template class BasicActivationSoftmax<double>;
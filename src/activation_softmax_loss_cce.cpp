@@ -0,0 +1,172 @@
+#include "../include/activation_softmax_loss_cce.hpp"
+#include "flat_matrix.hpp"
+#include "thread_pool.hpp"
+#include "workspace.hpp"
+#include "profiler.hpp"
+#include "vec_math.hpp"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+namespace {
+
+constexpr double CLIP = 1e-7;
+
+double clip(double p) { return std::max(CLIP, std::min(p, 1 - CLIP)); }
+
+void check_labels(const std::vector<int> &y_true_labels, int C) {
+  for (int label : y_true_labels) {
+    if (label < 0 || label >= C) {
+      throw std::invalid_argument{
+          "ActivationSoftmaxLossCCE: label index out of range!"};
+    }
+  }
+}
+
+// Adds the per-sample losses up in sample order so the mean is the same no
+// matter how the rows were scheduled.
+double mean(const double *losses, int R) {
+  double sum = 0.0;
+  for (int i = 0; i < R; ++i) {
+    sum += losses[i];
+  }
+  return sum / static_cast<double>(R);
+}
+
+} // namespace
+
+template <typename T>
+double BasicActivationSoftmaxLossCategoricalCrossEntropy<T>::forward(
+    const BasicFlatMatrix<T> &inputs, const std::vector<int> &y_true_labels) {
+  NN_PROFILE_SCOPE_COUNTS("SoftmaxCCE::forward",
+                          4.0 * inputs.rows() * inputs.cols(),
+                          2.0 * sizeof(T) * inputs.rows() * inputs.cols());
+  if (inputs.rows() != static_cast<int>(y_true_labels.size())) {
+    throw std::invalid_argument{
+        "ActivationSoftmaxLossCCE: the number of labels is not correct!"};
+  }
+
+  int R = inputs.rows();
+  int C = inputs.cols();
+  check_labels(y_true_labels, C);
+
+  output.resize(R, C);
+
+  WorkspaceScope scratch;
+  double *losses = scratch.allocate(R);
+
+  parallel_for(0, R, 8, [&](int first, int last) {
+    for (int i = first; i < last; ++i) {
+      T *out = output.row(i);
+      softmax_row(inputs.row(i), out, C);
+      losses[i] = -std::log(clip(out[y_true_labels[i]]));
+    }
+  });
+
+  return mean(losses, R);
+}
+
+template <typename T>
+double BasicActivationSoftmaxLossCategoricalCrossEntropy<T>::forward(
+    const BasicFlatMatrix<T> &inputs, const BasicFlatMatrix<T> &y_true_onehot) {
+  NN_PROFILE_SCOPE_COUNTS("SoftmaxCCE::forward",
+                          5.0 * inputs.rows() * inputs.cols(),
+                          3.0 * sizeof(T) * inputs.rows() * inputs.cols());
+  if (inputs.rows() != y_true_onehot.rows() ||
+      inputs.cols() != y_true_onehot.cols()) {
+    throw std::invalid_argument{
+        "ActivationSoftmaxLossCCE: the shape of the one-hot labels is not "
+        "correct!"};
+  }
+
+  int R = inputs.rows();
+  int C = inputs.cols();
+
+  output.resize(R, C);
+
+  WorkspaceScope scratch;
+  double *losses = scratch.allocate(R);
+
+  parallel_for(0, R, 8, [&](int first, int last) {
+    for (int i = first; i < last; ++i) {
+      T *out = output.row(i);
+      const T *target = y_true_onehot.row(i);
+      softmax_row(inputs.row(i), out, C);
+
+      double loss = 0.0;
+      for (int j = 0; j < C; ++j) {
+        if (target[j] != T(0)) {
+          loss -= target[j] * std::log(clip(out[j]));
+        }
+      }
+      losses[i] = loss;
+    }
+  });
+
+  return mean(losses, R);
+}
+
+template <typename T>
+void BasicActivationSoftmaxLossCategoricalCrossEntropy<T>::backward(
+    const std::vector<int> &y_true_labels) {
+  NN_PROFILE_SCOPE_COUNTS("SoftmaxCCE::backward",
+                          double(output.rows()) * output.cols(),
+                          2.0 * sizeof(T) * output.rows() * output.cols());
+  if (output.rows() != static_cast<int>(y_true_labels.size())) {
+    throw std::invalid_argument{
+        "ActivationSoftmaxLossCCE::backward: the number of labels is not "
+        "correct!"};
+  }
+
+  int R = output.rows();
+  int C = output.cols();
+  check_labels(y_true_labels, C);
+  T scale = T(1) / static_cast<T>(R);
+
+  dinputs.resize(R, C);
+
+  parallel_for(0, R, 16, [&](int first, int last) {
+    for (int i = first; i < last; ++i) {
+      const T *out = output.row(i);
+      T *dinp = dinputs.row(i);
+      for (int j = 0; j < C; ++j) {
+        dinp[j] = out[j] * scale;
+      }
+      dinp[y_true_labels[i]] -= scale;
+    }
+  });
+}
+
+template <typename T>
+void BasicActivationSoftmaxLossCategoricalCrossEntropy<T>::backward(
+    const BasicFlatMatrix<T> &y_true_onehot) {
+  NN_PROFILE_SCOPE_COUNTS("SoftmaxCCE::backward",
+                          2.0 * output.rows() * output.cols(),
+                          3.0 * sizeof(T) * output.rows() * output.cols());
+  if (output.rows() != y_true_onehot.rows() ||
+      output.cols() != y_true_onehot.cols()) {
+    throw std::invalid_argument{
+        "ActivationSoftmaxLossCCE::backward: the shape of the one-hot labels "
+        "is not correct!"};
+  }
+
+  int R = output.rows();
+  int C = output.cols();
+  T scale = T(1) / static_cast<T>(R);
+
+  dinputs.resize(R, C);
+
+  parallel_for(0, R, 16, [&](int first, int last) {
+    for (int i = first; i < last; ++i) {
+      const T *out = output.row(i);
+      const T *target = y_true_onehot.row(i);
+      T *dinp = dinputs.row(i);
+      for (int j = 0; j < C; ++j) {
+        dinp[j] = (out[j] - target[j]) * scale;
+      }
+    }
+  });
+}
+
+template class BasicActivationSoftmaxLossCategoricalCrossEntropy<float>;
+template class BasicActivationSoftmaxLossCategoricalCrossEntropy<double>;
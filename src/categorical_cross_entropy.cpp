@@ -1,8 +1,13 @@
 #include "../include/categorical_cross_entropy.hpp"
-#include <cmath>
+#include "profiler.hpp"
+#include "vec_math.hpp"
+#include "workspace.hpp"
+#include <algorithm>
 #include <stdexcept>
 
-double LossCategoricalCrossEntropy::forward(const FlatMatrix &y_pred, const std::vector<int> &y_true_labels) {
+template <typename T>
+double BasicLossCategoricalCrossEntropy<T>::forward(const BasicFlatMatrix<T> &y_pred, const std::vector<int> &y_true_labels) {
+    NN_PROFILE_SCOPE_COUNTS("LossCCE::forward", 2.0 * y_pred.rows(), (sizeof(T) + sizeof(int)) * double(y_pred.rows()));
     if (y_pred.rows() != y_true_labels.size())
     {
         throw std::invalid_argument{"LossCCO: the number of labels is not correct!"};
@@ -11,17 +16,37 @@ double LossCategoricalCrossEntropy::forward(const FlatMatrix &y_pred, const std:
     double loss_sum = 0.0;
     int num_samples = y_true_labels.size();
 
+    // The labels index y_pred unchecked below, so they are validated first.
+    for (int label : y_true_labels)
+    {
+        if (label < 0 || label >= y_pred.cols())
+        {
+            throw std::out_of_range{"LossCCO: label index out of range!"};
+        }
+    }
+
+    // Gather the clipped probabilities first so the logs run as one
+    // vectorized pass.
+    WorkspaceScope scratch;
+    double *log_p = scratch.allocate(num_samples);
+    for (int i = 0; i < num_samples; i++)
+    {
+        double p = y_pred(i, y_true_labels[i]);
+        log_p[i] = std::max(1e-7, std::min(p, 1 - 1e-7));
+    }
+    vec_log(log_p, log_p, num_samples);
+
     for (int i = 0; i < num_samples; i++)
     {
-        double p = y_pred.get(i, y_true_labels[i]);
-        p = std::max(1e-7, std::min(p, 1 - 1e-7));
-        loss_sum += - std::log(p);
+        loss_sum += - log_p[i];
     }
     
     return loss_sum / static_cast<double>(num_samples);
 }
 
-double LossCategoricalCrossEntropy::forward(const FlatMatrix &y_pred, const FlatMatrix &y_true_onehot) {
+template <typename T>
+double BasicLossCategoricalCrossEntropy<T>::forward(const BasicFlatMatrix<T> &y_pred, const BasicFlatMatrix<T> &y_true_onehot) {
+    NN_PROFILE_SCOPE_COUNTS("LossCCE::forward", 2.0 * y_pred.rows() * y_pred.cols(), 2.0 * sizeof(T) * y_pred.rows() * y_pred.cols());
     if (y_pred.rows() != y_true_onehot.rows() || y_pred.cols() != y_true_onehot.cols())
     {
         throw std::invalid_argument{"LossCCO: the shape of the one-hot labels is not correct!"};
@@ -31,21 +56,49 @@ double LossCategoricalCrossEntropy::forward(const FlatMatrix &y_pred, const Flat
     int C = y_true_onehot.cols();
 
     double sum_of_samples = 0.0;
+
+    // Zero targets contribute nothing, so only the non-zero ones are
+    // gathered (one per row for true one-hot labels, all of them for soft
+    // labels), over as many rows as fit the buffer, and their logs taken
+    // in one vectorized pass.
+    int capacity = std::max(C, 4096);
+    WorkspaceScope scratch;
+    double *weights = scratch.allocate(capacity);
+    double *log_p = scratch.allocate(capacity);
+    int pending = 0;
+
+    auto flush = [&]() {
+        vec_log(log_p, log_p, pending);
+        for (int k = 0; k < pending; k++)
+        {
+            sum_of_samples -= weights[k] * log_p[k];
+        }
+        pending = 0;
+    };
     
     for (int i = 0; i < R; i++)
     {
-        double negative_sample_sum = 0.0;
+        if (pending + C > capacity)
+        {
+            flush();
+        }
 
+        const T *pred = y_pred.row(i);
+        const T *target = y_true_onehot.row(i);
         for (int j = 0; j < C; j++)
         {
-            double p = y_pred.get(i, j);
-            double clipped_p = std::max(1e-7, std::min(p, 1 - 1e-7));
-
-            negative_sample_sum += y_true_onehot.get(i,j) * std::log(clipped_p);
+            if (target[j] != T(0))
+            {
+                weights[pending] = target[j];
+                log_p[pending] = std::max(1e-7, std::min(static_cast<double>(pred[j]), 1 - 1e-7));
+                pending++;
+            }
         }
-        
-        sum_of_samples += -negative_sample_sum;
     }
+    flush();
     
     return sum_of_samples / static_cast<double>(R);
-}
\ No newline at end of file
+}
+
+template class BasicLossCategoricalCrossEntropy<float>;
+template class BasicLossCategoricalCrossEntropy<double>;
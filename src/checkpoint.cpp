@@ -0,0 +1,416 @@
+#include "../include/checkpoint.hpp"
+#include "activation_relu.hpp"
+#include "activation_softmax.hpp"
+#include "layer_dense.hpp"
+#include "layer_dense_relu.hpp"
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The format is little-endian and blocks are used in place.
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__,
+              "checkpoints need a little-endian host");
+
+namespace {
+
+constexpr char MAGIC[8] = {'N', 'N', 'C', 'K', 'P', 'T', '\0', '\0'};
+constexpr std::uint32_t VERSION = 1;
+constexpr std::uint64_t ALIGNMENT = 64;
+constexpr std::uint32_t FLAG_OPTIMIZER = 1;
+
+enum Block {
+  WEIGHTS,
+  BIASES,
+  WEIGHT_MOMENTUMS,
+  BIAS_MOMENTUMS,
+  WEIGHT_CACHE,
+  BIAS_CACHE,
+  BLOCKS
+};
+
+std::uint64_t align_up(std::uint64_t n) {
+  return (n + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+}
+
+template <typename T> CheckpointDtype dtype_of();
+template <> CheckpointDtype dtype_of<float>() {
+  return CheckpointDtype::Float32;
+}
+template <> CheckpointDtype dtype_of<double>() {
+  return CheckpointDtype::Float64;
+}
+
+// rows * cols * value_size, or false if that overflows.
+bool block_bytes(std::uint64_t rows, std::uint64_t cols,
+                 std::uint64_t value_size, std::uint64_t &bytes) {
+  return !__builtin_mul_overflow(rows, cols, &bytes) &&
+         !__builtin_mul_overflow(bytes, value_size, &bytes);
+}
+
+std::uint64_t rotl(std::uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+// Four independent multiply-rotate lanes over 64-bit words, so hashing runs
+// at memory speed. n has to be a multiple of 32, which the 64-byte block
+// alignment guarantees.
+std::uint64_t checksum(const unsigned char *p, std::uint64_t n) {
+  constexpr std::uint64_t P1 = 0x9E3779B185EBCA87ULL;
+  constexpr std::uint64_t P2 = 0xC2B2AE3D27D4EB4FULL;
+  std::uint64_t h[4] = {P1, P2, P1 ^ P2, P1 + P2};
+  for (std::uint64_t i = 0; i < n; i += 32) {
+    for (int l = 0; l < 4; ++l) {
+      std::uint64_t w;
+      std::memcpy(&w, p + i + 8 * l, sizeof(w));
+      h[l] = rotl(h[l] + w * P2, 31) * P1;
+    }
+  }
+  std::uint64_t out = n;
+  for (int l = 0; l < 4; ++l)
+    out = rotl(out ^ h[l], 27) * P1 + P2;
+  return out;
+}
+
+// Private mapping of a whole file, released when the last owner goes.
+struct Mapping {
+  void *base = nullptr;
+  std::size_t size = 0;
+
+  ~Mapping() {
+    if (base)
+      ::munmap(base, size);
+  }
+
+  const unsigned char *bytes() const {
+    return static_cast<const unsigned char *>(base);
+  }
+};
+
+std::shared_ptr<Mapping> map_file(const std::string &path) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw std::runtime_error("load_checkpoint: cannot open " + path);
+
+  struct stat st;
+  if (::fstat(fd, &st) != 0 ||
+      static_cast<std::size_t>(st.st_size) < sizeof(CheckpointHeader)) {
+    ::close(fd);
+    throw std::runtime_error("load_checkpoint: " + path +
+                             " is too small to be a checkpoint");
+  }
+
+  auto mapping = std::make_shared<Mapping>();
+  mapping->size = static_cast<std::size_t>(st.st_size);
+  // Private and writable, like MappedDataset: mapped weights are ordinary
+  // matrices, and a write copies the page instead of reaching the file.
+  void *base = ::mmap(nullptr, mapping->size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (base == MAP_FAILED)
+    throw std::runtime_error("load_checkpoint: mmap failed for " + path);
+  mapping->base = base;
+  return mapping;
+}
+
+struct BlockSource {
+  const void *data = nullptr;
+  std::uint64_t bytes = 0;
+};
+
+template <typename T>
+CheckpointLayerKind kind_of(const BasicLayer<T> &layer) {
+  if (dynamic_cast<const BasicLayerDenseReLU<T> *>(&layer))
+    return CheckpointLayerKind::DenseReLU;
+  if (dynamic_cast<const BasicLayerDense<T> *>(&layer))
+    return CheckpointLayerKind::Dense;
+  if (dynamic_cast<const BasicActivationReLU<T> *>(&layer))
+    return CheckpointLayerKind::ReLU;
+  if (dynamic_cast<const BasicActivationSoftmax<T> *>(&layer))
+    return CheckpointLayerKind::Softmax;
+  throw std::invalid_argument(
+      "save_checkpoint: the model contains a layer type without a "
+      "checkpoint format");
+}
+
+bool is_dense(CheckpointLayerKind kind) {
+  return kind == CheckpointLayerKind::Dense ||
+         kind == CheckpointLayerKind::DenseReLU;
+}
+
+template <typename T>
+bool matches(const BasicFlatMatrix<T> &state, const BasicFlatMatrix<T> &like) {
+  return state.rows() == like.rows() && state.cols() == like.cols() &&
+         state.rows() > 0;
+}
+
+void write_block(std::ofstream &out, std::uint64_t offset, const void *data,
+                 std::uint64_t bytes) {
+  static const char zeros[ALIGNMENT] = {};
+  std::uint64_t pos = static_cast<std::uint64_t>(out.tellp());
+  while (pos < offset) {
+    std::uint64_t n = std::min<std::uint64_t>(ALIGNMENT, offset - pos);
+    out.write(zeros, static_cast<std::streamsize>(n));
+    pos += n;
+  }
+  out.write(static_cast<const char *>(data),
+            static_cast<std::streamsize>(bytes));
+  if (!out)
+    throw std::runtime_error("save_checkpoint: write failed");
+}
+
+// Writes the blocks laid out by save_checkpoint to `path`, then hashes
+// what actually reached the file and patches the checksum into the header.
+void write_checkpoint(const std::string &path, CheckpointHeader header,
+                      const std::vector<CheckpointLayerRecord> &records,
+                      const std::vector<BlockSource> &sources) {
+  {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out)
+      throw std::runtime_error("save_checkpoint: cannot create " + path);
+
+    write_block(out, 0, &header, sizeof(header));
+    write_block(out, sizeof(header), records.data(),
+                sizeof(CheckpointLayerRecord) * records.size());
+    for (std::size_t i = 0; i < records.size(); ++i) {
+      for (int b = 0; b < BLOCKS; ++b) {
+        const BlockSource &src = sources[i * BLOCKS + b];
+        if (src.data)
+          write_block(out, records[i].offsets[b], src.data, src.bytes);
+      }
+    }
+    write_block(out, header.file_size, nullptr, 0);
+  }
+
+  header.checksum =
+      checksum(map_file(path)->bytes() + sizeof(CheckpointHeader),
+               header.file_size - sizeof(CheckpointHeader));
+  std::fstream patch(path, std::ios::binary | std::ios::in | std::ios::out);
+  patch.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  if (!patch)
+    throw std::runtime_error("save_checkpoint: write failed");
+}
+
+} // namespace
+
+template <typename T>
+void save_checkpoint(const std::string &path, const BasicSequential<T> &model,
+                     const OptimizerState *optimizer) {
+  int n = model.size();
+
+  CheckpointHeader header{};
+  std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version = VERSION;
+  header.dtype = dtype_of<T>();
+  header.layer_count = static_cast<std::uint32_t>(n);
+  if (optimizer) {
+    header.flags |= FLAG_OPTIMIZER;
+    header.iterations = optimizer->iterations;
+    header.current_learning_rate = optimizer->current_learning_rate;
+  }
+
+  // Lay out every block first so the records can be written up front.
+  std::vector<CheckpointLayerRecord> records(n);
+  std::vector<BlockSource> sources(static_cast<size_t>(n) * BLOCKS);
+  std::uint64_t offset = align_up(sizeof(CheckpointHeader) +
+                                  sizeof(CheckpointLayerRecord) * n);
+
+  // Blocks are stored packed, so strided matrices are written from a
+  // compact copy that lives until the file is done.
+  std::deque<BasicFlatMatrix<T>> compacted;
+  auto packed_data = [&](const BasicFlatMatrix<T> &M) -> const T * {
+    if (M.is_contiguous())
+      return M.data();
+    compacted.push_back(M.compact());
+    return compacted.back().data();
+  };
+
+  for (int i = 0; i < n; ++i) {
+    CheckpointLayerRecord &record = records[i];
+    record.kind = kind_of(model.layer(i));
+    if (!is_dense(record.kind))
+      continue;
+
+    const auto &dense =
+        static_cast<const BasicLayerDense<T> &>(model.layer(i));
+    record.rows = dense.weights.rows();
+    record.cols = dense.weights.cols();
+
+    std::uint64_t matrix_bytes;
+    if (!block_bytes(record.rows, record.cols, sizeof(T), matrix_bytes))
+      throw std::invalid_argument("save_checkpoint: a layer is too large");
+    std::uint64_t vector_bytes = sizeof(T) * record.cols;
+    BlockSource *src = &sources[static_cast<size_t>(i) * BLOCKS];
+    src[WEIGHTS] = {packed_data(dense.weights), matrix_bytes};
+    src[BIASES] = {dense.biases.data(), vector_bytes};
+    if (matches(dense.weight_momentums, dense.weights) &&
+        dense.bias_momentums.size() == record.cols) {
+      src[WEIGHT_MOMENTUMS] = {packed_data(dense.weight_momentums),
+                               matrix_bytes};
+      src[BIAS_MOMENTUMS] = {dense.bias_momentums.data(), vector_bytes};
+    }
+    if (matches(dense.weight_cache, dense.weights) &&
+        dense.bias_cache.size() == record.cols) {
+      src[WEIGHT_CACHE] = {packed_data(dense.weight_cache), matrix_bytes};
+      src[BIAS_CACHE] = {dense.bias_cache.data(), vector_bytes};
+    }
+
+    for (int b = 0; b < BLOCKS; ++b) {
+      if (!src[b].data)
+        continue;
+      record.offsets[b] = offset;
+      offset = align_up(offset + src[b].bytes);
+    }
+  }
+  header.file_size = offset;
+
+  // Written next to `path` and renamed over it at the end, so a model that
+  // still maps the old file keeps its pages and a failed save leaves the
+  // old checkpoint in place.
+  std::string tmp_path = path + ".tmp" + std::to_string(::getpid());
+  try {
+    write_checkpoint(tmp_path, header, records, sources);
+  } catch (...) {
+    std::remove(tmp_path.c_str());
+    throw;
+  }
+  if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    std::remove(tmp_path.c_str());
+    throw std::runtime_error("save_checkpoint: cannot replace " + path);
+  }
+}
+
+template <typename T>
+BasicSequential<T> load_checkpoint(const std::string &path,
+                                   const CheckpointLoadOptions &options,
+                                   OptimizerState *optimizer) {
+  std::shared_ptr<Mapping> mapping = map_file(path);
+  const unsigned char *base = mapping->bytes();
+
+  CheckpointHeader header;
+  std::memcpy(&header, base, sizeof(header));
+  std::uint64_t table_end = sizeof(CheckpointHeader) +
+                            sizeof(CheckpointLayerRecord) *
+                                static_cast<std::uint64_t>(header.layer_count);
+  if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 ||
+      header.version != VERSION || header.file_size != mapping->size ||
+      header.file_size % ALIGNMENT != 0 || table_end > header.file_size) {
+    throw std::runtime_error("load_checkpoint: " + path +
+                             " is not a valid checkpoint");
+  } else if (header.dtype != dtype_of<T>()) {
+    throw std::invalid_argument(
+        "load_checkpoint: the checkpoint dtype does not match T");
+  } else if ((options.map ? options.verify_mapped : options.verify) &&
+             checksum(base + sizeof(CheckpointHeader),
+                      header.file_size - sizeof(CheckpointHeader)) !=
+                 header.checksum) {
+    throw std::runtime_error("load_checkpoint: checksum mismatch in " + path);
+  }
+
+  const auto *records = reinterpret_cast<const CheckpointLayerRecord *>(
+      base + sizeof(CheckpointHeader));
+
+  BasicSequential<T> model;
+  for (std::uint32_t i = 0; i < header.layer_count; ++i) {
+    const CheckpointLayerRecord &record = records[i];
+
+    if (record.kind == CheckpointLayerKind::ReLU) {
+      model.template add<BasicActivationReLU<T>>();
+      continue;
+    } else if (record.kind == CheckpointLayerKind::Softmax) {
+      model.template add<BasicActivationSoftmax<T>>();
+      continue;
+    } else if (!is_dense(record.kind) || record.rows == 0 ||
+               record.cols == 0 || record.rows > INT_MAX ||
+               record.cols > INT_MAX) {
+      throw std::runtime_error("load_checkpoint: bad layer record in " + path);
+    }
+
+    int rows = static_cast<int>(record.rows);
+    int cols = static_cast<int>(record.cols);
+    std::uint64_t matrix_bytes;
+    if (!block_bytes(record.rows, record.cols, sizeof(T), matrix_bytes))
+      throw std::runtime_error("load_checkpoint: bad layer record in " + path);
+    std::uint64_t vector_bytes = sizeof(T) * record.cols;
+    std::uint64_t bytes[BLOCKS] = {matrix_bytes, vector_bytes, matrix_bytes,
+                                   vector_bytes, matrix_bytes, vector_bytes};
+    const T *blocks[BLOCKS] = {};
+    for (int b = 0; b < BLOCKS; ++b) {
+      std::uint64_t off = record.offsets[b];
+      if (off == 0)
+        continue;
+      if (off % ALIGNMENT != 0 || off < table_end ||
+          off > header.file_size || bytes[b] > header.file_size - off) {
+        throw std::runtime_error("load_checkpoint: bad block offset in " +
+                                 path);
+      }
+      blocks[b] = reinterpret_cast<const T *>(base + off);
+    }
+    if (!blocks[WEIGHTS] || !blocks[BIASES])
+      throw std::runtime_error("load_checkpoint: missing weights in " + path);
+
+    BasicFlatMatrix<T> weights;
+    if (options.map) {
+      // The mapping is private and writable, so the view may be written.
+      weights = BasicFlatMatrix<T>::view(const_cast<T *>(blocks[WEIGHTS]),
+                                         rows, cols);
+    } else {
+      weights.resize(rows, cols);
+      std::memcpy(weights.data(), blocks[WEIGHTS], bytes[WEIGHTS]);
+    }
+    std::vector<T> biases(blocks[BIASES], blocks[BIASES] + cols);
+
+    BasicLayerDense<T> *dense;
+    if (record.kind == CheckpointLayerKind::DenseReLU) {
+      dense = &model.template add<BasicLayerDenseReLU<T>>(std::move(weights),
+                                                         std::move(biases));
+    } else {
+      dense = &model.template add<BasicLayerDense<T>>(std::move(weights),
+                                                     std::move(biases));
+    }
+
+    if (options.map)
+      continue;
+    if (blocks[WEIGHT_MOMENTUMS] && blocks[BIAS_MOMENTUMS]) {
+      dense->weight_momentums.resize(rows, cols);
+      std::memcpy(dense->weight_momentums.data(), blocks[WEIGHT_MOMENTUMS],
+                  bytes[WEIGHT_MOMENTUMS]);
+      dense->bias_momentums.assign(blocks[BIAS_MOMENTUMS],
+                                   blocks[BIAS_MOMENTUMS] + cols);
+    }
+    if (blocks[WEIGHT_CACHE] && blocks[BIAS_CACHE]) {
+      dense->weight_cache.resize(rows, cols);
+      std::memcpy(dense->weight_cache.data(), blocks[WEIGHT_CACHE],
+                  bytes[WEIGHT_CACHE]);
+      dense->bias_cache.assign(blocks[BIAS_CACHE], blocks[BIAS_CACHE] + cols);
+    }
+  }
+
+  if (optimizer) {
+    *optimizer = OptimizerState{};
+    if ((header.flags & FLAG_OPTIMIZER) && !options.map) {
+      optimizer->iterations = header.iterations;
+      optimizer->current_learning_rate = header.current_learning_rate;
+    }
+  }
+  if (options.map)
+    model.keep_alive(mapping);
+  return model;
+}
+
+#define INSTANTIATE_CHECKPOINT(T)                                              \
+  template void save_checkpoint(const std::string &,                           \
+                                const BasicSequential<T> &,                    \
+                                const OptimizerState *);                       \
+  template BasicSequential<T> load_checkpoint(                                 \
+      const std::string &, const CheckpointLoadOptions &, OptimizerState *);
+
+INSTANTIATE_CHECKPOINT(float)
+INSTANTIATE_CHECKPOINT(double)
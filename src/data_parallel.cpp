@@ -0,0 +1,244 @@
+#include "../include/data_parallel.hpp"
+#include "activation_relu.hpp"
+#include "activation_softmax.hpp"
+#include "layer_dense_relu.hpp"
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+#include <utility>
+
+namespace {
+
+constexpr int GRAIN = 4096;
+
+// Appends a layer of the same type to `replica` that shares the weights of
+// `layer` through a view.
+template <typename T>
+void add_replica_layer(BasicSequential<T> &replica, BasicLayer<T> &layer) {
+  if (auto *dense = dynamic_cast<BasicLayerDense<T> *>(&layer)) {
+    auto weights = BasicFlatMatrix<T>::view(
+        dense->weights.data(), dense->weights.rows(), dense->weights.cols(),
+        dense->weights.stride());
+    if (dynamic_cast<BasicLayerDenseReLU<T> *>(&layer))
+      replica.template add<BasicLayerDenseReLU<T>>(std::move(weights),
+                                                   dense->biases);
+    else
+      replica.template add<BasicLayerDense<T>>(std::move(weights),
+                                               dense->biases);
+  } else if (dynamic_cast<BasicActivationReLU<T> *>(&layer)) {
+    replica.template add<BasicActivationReLU<T>>();
+  } else if (dynamic_cast<BasicActivationSoftmax<T> *>(&layer)) {
+    replica.template add<BasicActivationSoftmax<T>>();
+  } else {
+    throw std::invalid_argument(
+        "DataParallelTrainer: the model contains a layer type that cannot "
+        "be replicated");
+  }
+}
+
+template <typename T>
+void scale(T *values, std::size_t n, T factor) {
+  for (std::size_t i = 0; i < n; ++i)
+    values[i] *= factor;
+}
+
+// Gradients may be strided, so they are walked row by row.
+template <typename T> void scale(BasicFlatMatrix<T> &M, T factor) {
+  for (int i = 0; i < M.rows(); ++i)
+    scale(M.row(i), static_cast<std::size_t>(M.cols()), factor);
+}
+
+} // namespace
+
+template <typename T>
+BasicDataParallelTrainer<T>::BasicDataParallelTrainer(
+    BasicSequential<T> &model, int replicas)
+    : m_model(model) {
+  if (replicas <= 0)
+    replicas = num_threads();
+  if (model.size() == 0) {
+    throw std::invalid_argument(
+        "DataParallelTrainer: the model has no layers");
+  }
+
+  m_replicas.push_back(&model);
+  for (int r = 1; r < replicas; ++r) {
+    m_copies.push_back(std::make_unique<BasicSequential<T>>());
+    for (int i = 0; i < model.size(); ++i)
+      add_replica_layer(*m_copies.back(), model.layer(i));
+    m_replicas.push_back(m_copies.back().get());
+  }
+
+  m_dense.resize(replicas);
+  for (int r = 0; r < replicas; ++r) {
+    for (int i = 0; i < model.size(); ++i) {
+      if (auto *dense =
+              dynamic_cast<BasicLayerDense<T> *>(&m_replicas[r]->layer(i)))
+        m_dense[r].push_back(dense);
+    }
+  }
+  m_shards.resize(replicas);
+}
+
+template <typename T> int BasicDataParallelTrainer<T>::replicas() const {
+  return static_cast<int>(m_replicas.size());
+}
+
+template <typename T>
+int BasicDataParallelTrainer<T>::begin_fit(const BasicFlatMatrix<T> &X,
+                                           const std::vector<int> &y,
+                                           const FitOptions &options) {
+  if (X.rows() != static_cast<int>(y.size())) {
+    throw std::invalid_argument(
+        "DataParallelTrainer fit: X.rows and the number of labels have to "
+        "match!");
+  } else if (X.rows() == 0) {
+    throw std::invalid_argument("DataParallelTrainer fit: X has no samples!");
+  } else if (options.batch_size <= 0 || options.epochs < 0) {
+    throw std::invalid_argument(
+        "DataParallelTrainer fit: batch_size has to be positive and epochs "
+        "not negative!");
+  }
+
+  // Checked here because a throw from inside a shard would leave the other
+  // replicas running on freed state.
+  int outputs =
+      m_dense[0].empty() ? X.cols() : m_dense[0].back()->weights.cols();
+  for (int label : y) {
+    if (label < 0 || label >= outputs) {
+      throw std::invalid_argument(
+          "DataParallelTrainer fit: label index out of range!");
+    }
+  }
+
+  m_order.resize(X.rows());
+  std::iota(m_order.begin(), m_order.end(), 0);
+  m_rng.seed(options.seed);
+  sync_replicas();
+
+  return (X.rows() + options.batch_size - 1) / options.batch_size;
+}
+
+template <typename T>
+void BasicDataParallelTrainer<T>::run_shard(int r, const BasicFlatMatrix<T> &X,
+                                            const std::vector<int> &y,
+                                            int first, int count, int total) {
+  Shard &shard = m_shards[r];
+  int C = X.cols();
+  shard.x.resize(count, C);
+  shard.y.resize(count);
+  for (int i = 0; i < count; ++i) {
+    int src = m_order[first + i];
+    std::memcpy(shard.x.row(i), X.row(src), sizeof(T) * C);
+    shard.y[i] = y[src];
+  }
+
+  BasicSequential<T> &replica = *m_replicas[r];
+  replica.forward(shard.x);
+  shard.loss = shard.head.forward(replica.output(), shard.y) * count;
+
+  const BasicFlatMatrix<T> &probs = shard.head.output;
+  shard.correct = 0;
+  for (int i = 0; i < count; ++i) {
+    const T *p = probs.row(i);
+    int best = static_cast<int>(std::max_element(p, p + probs.cols()) - p);
+    shard.correct += best == shard.y[i];
+  }
+
+  shard.head.backward(shard.y);
+  replica.backward(shard.head.dinputs);
+
+  // The head averages over the shard; weighting by its share of the batch
+  // turns the sum over replicas into the mean over the whole batch.
+  T weight = static_cast<T>(count) / static_cast<T>(total);
+  for (BasicLayerDense<T> *dense : m_dense[r]) {
+    scale(dense->dweights, weight);
+    scale(dense->dbiases.data(), dense->dbiases.size(), weight);
+  }
+}
+
+template <typename T>
+double BasicDataParallelTrainer<T>::train_batch(const BasicFlatMatrix<T> &X,
+                                                const std::vector<int> &y,
+                                                int b, int batch_size,
+                                                int &correct) {
+  int first = b * batch_size;
+  int count = std::min(batch_size, X.rows() - first);
+  int active = std::min(replicas(), count);
+
+  {
+    NN_PROFILE_SCOPE("DataParallel::replicas");
+    parallel_for(0, active, 1, [&](int r0, int r1) {
+      for (int r = r0; r < r1; ++r) {
+        int begin = static_cast<int>(1LL * count * r / active);
+        int end = static_cast<int>(1LL * count * (r + 1) / active);
+        run_shard(r, X, y, first + begin, end - begin, count);
+      }
+    });
+  }
+
+  all_reduce(active);
+
+  double loss = 0.0;
+  for (int r = 0; r < active; ++r) {
+    loss += m_shards[r].loss;
+    correct += m_shards[r].correct;
+  }
+  return loss;
+}
+
+// Sums the gradients of replicas [0, active) into replica 0. Every element
+// is reduced with the same pairwise tree (r += r + stride for stride = 1, 2,
+// 4, ...), so the result does not depend on how the chunks are scheduled.
+template <typename T>
+void BasicDataParallelTrainer<T>::all_reduce(int active) {
+  NN_PROFILE_SCOPE("DataParallel::all_reduce");
+  if (active <= 1)
+    return;
+
+  // Runs over rows x cols elements in chunks of GRAIN; row_of(r, i) is row i
+  // of replica r, so strided gradients are summed row by row.
+  auto reduce = [&](auto row_of, int rows, int cols) {
+    std::size_t total = static_cast<std::size_t>(rows) * cols;
+    int chunks = static_cast<int>((total + GRAIN - 1) / GRAIN);
+    parallel_for(0, chunks, 1, [&](int c0, int c1) {
+      std::size_t begin = static_cast<std::size_t>(c0) * GRAIN;
+      std::size_t end = std::min(total, static_cast<std::size_t>(c1) * GRAIN);
+      for (std::size_t k = begin; k < end;) {
+        int i = static_cast<int>(k / cols);
+        int j0 = static_cast<int>(k % cols);
+        int j1 = static_cast<int>(std::min<std::size_t>(cols, j0 + (end - k)));
+        for (int stride = 1; stride < active; stride *= 2) {
+          for (int r = 0; r + stride < active; r += 2 * stride) {
+            T *dst = row_of(r, i);
+            const T *src = row_of(r + stride, i);
+            for (int j = j0; j < j1; ++j)
+              dst[j] += src[j];
+          }
+        }
+        k += j1 - j0;
+      }
+    });
+  };
+
+  for (std::size_t l = 0; l < m_dense[0].size(); ++l) {
+    const BasicFlatMatrix<T> &dw = m_dense[0][l]->dweights;
+    reduce([&](int r, int i) { return m_dense[r][l]->dweights.row(i); },
+           dw.rows(), dw.cols());
+    reduce([&](int r, int) { return m_dense[r][l]->dbiases.data(); }, 1,
+           static_cast<int>(m_dense[0][l]->dbiases.size()));
+  }
+}
+
+// Weights are shared through views; only the biases need copying.
+template <typename T> void BasicDataParallelTrainer<T>::sync_replicas() {
+  for (std::size_t r = 1; r < m_dense.size(); ++r) {
+    for (std::size_t l = 0; l < m_dense[0].size(); ++l)
+      m_dense[r][l]->biases = m_dense[0][l]->biases;
+  }
+}
+
+template class BasicDataParallelTrainer<float>;
+template class BasicDataParallelTrainer<double>;
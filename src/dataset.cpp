@@ -0,0 +1,390 @@
+#include "../include/dataset.hpp"
+#include "flat_matrix.hpp"
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr char MAGIC[8] = {'N', 'N', 'D', 'A', 'T', 'A', '\0', '\0'};
+constexpr std::uint32_t VERSION = 1;
+constexpr std::uint64_t ALIGNMENT = 64;
+constexpr int CSV_CHUNK_ROWS = 4096;
+
+static_assert(sizeof(std::int32_t) == sizeof(int),
+              "labels are stored as int32 and exposed as int");
+
+std::uint64_t align_up(std::uint64_t n) {
+  return (n + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+}
+
+std::size_t dtype_size(DatasetDtype dtype) {
+  switch (dtype) {
+  case DatasetDtype::Float32:
+    return sizeof(float);
+  case DatasetDtype::Float64:
+    return sizeof(double);
+  }
+  throw std::invalid_argument("Dataset: unknown dtype");
+}
+
+// rows * cols * value_size, or false if that does not fit. The bound
+// leaves room for the offsets and labels around the features.
+bool feature_bytes(std::uint64_t rows, std::uint64_t cols,
+                   std::size_t value_size, std::uint64_t &bytes) {
+  return !__builtin_mul_overflow(rows, cols, &bytes) &&
+         !__builtin_mul_overflow(bytes, value_size, &bytes) &&
+         bytes <= std::numeric_limits<std::uint64_t>::max() / 2;
+}
+
+template <typename T> DatasetDtype dtype_of();
+template <> DatasetDtype dtype_of<float>() { return DatasetDtype::Float32; }
+template <> DatasetDtype dtype_of<double>() { return DatasetDtype::Float64; }
+
+DatasetHeader make_header(DatasetDtype dtype, std::uint64_t rows,
+                          std::uint64_t cols) {
+  DatasetHeader header{};
+  std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version = VERSION;
+  header.dtype = dtype;
+  header.rows = rows;
+  header.cols = cols;
+  std::uint64_t bytes;
+  if (rows > static_cast<std::uint64_t>(INT_MAX) ||
+      !feature_bytes(rows, cols, dtype_size(dtype), bytes))
+    throw std::invalid_argument("Dataset: too many rows or columns");
+  header.features_offset = align_up(sizeof(DatasetHeader));
+  header.labels_offset = align_up(header.features_offset + bytes);
+  return header;
+}
+
+std::uint64_t file_size(const DatasetHeader &header) {
+  return header.labels_offset + header.rows * sizeof(std::int32_t);
+}
+
+void write_at(std::fstream &out, std::uint64_t offset, const void *data,
+              std::size_t bytes) {
+  out.seekp(static_cast<std::streamoff>(offset));
+  out.write(static_cast<const char *>(data),
+            static_cast<std::streamsize>(bytes));
+  if (!out)
+    throw std::runtime_error("Dataset: write failed");
+}
+
+std::fstream create_file(const std::string &path, const DatasetHeader &header) {
+  std::fstream out(path, std::ios::out | std::ios::trunc | std::ios::binary);
+  if (!out)
+    throw std::runtime_error("Dataset: cannot create " + path);
+  out.close();
+  out.open(path, std::ios::in | std::ios::out | std::ios::binary);
+
+  write_at(out, 0, &header, sizeof(header));
+  // Extend to the full size up front so the padding gaps are zero bytes.
+  char zero = 0;
+  write_at(out, file_size(header) - 1, &zero, 1);
+  return out;
+}
+
+void split_line(const std::string &line, char delimiter,
+                std::vector<double> &fields) {
+  fields.clear();
+  const char *p = line.c_str();
+  for (;;) {
+    char *end;
+    double value = std::strtod(p, &end);
+    if (end == p)
+      throw std::invalid_argument("convert_csv_to_dataset: bad field in '" +
+                                  line + "'");
+    fields.push_back(value);
+    while (*end == ' ' || *end == '\r')
+      ++end;
+    if (*end == '\0')
+      return;
+    if (*end != delimiter)
+      throw std::invalid_argument("convert_csv_to_dataset: bad field in '" +
+                                  line + "'");
+    p = end + 1;
+  }
+}
+
+std::int32_t label_value(double value, const std::string &line) {
+  // Also rejects NaN, which fails every comparison.
+  if (!(value >= std::numeric_limits<std::int32_t>::min() &&
+        value <= std::numeric_limits<std::int32_t>::max() &&
+        value == std::trunc(value))) {
+    throw std::invalid_argument(
+        "convert_csv_to_dataset: label is not an int32 in '" + line + "'");
+  }
+  return static_cast<std::int32_t>(value);
+}
+
+// Second pass of convert_csv_to_dataset: converts the rows chunk by chunk
+// and writes each block at its offset.
+void convert_rows(std::ifstream &in, std::fstream &out,
+                  const DatasetHeader &header, int label,
+                  const CsvOptions &options) {
+  std::uint64_t rows = header.rows;
+  std::uint64_t cols = header.cols;
+  std::size_t columns = cols + 1;
+  std::size_t value_size = dtype_size(options.dtype);
+  std::string line;
+  std::vector<double> fields;
+
+  in.clear();
+  in.seekg(0);
+  if (options.header)
+    std::getline(in, line);
+
+  std::vector<char> feature_chunk(CSV_CHUNK_ROWS * cols * value_size);
+  std::vector<std::int32_t> label_chunk(CSV_CHUNK_ROWS);
+  std::uint64_t written = 0;
+  int filled = 0;
+
+  auto flush = [&] {
+    write_at(out, header.features_offset + written * cols * value_size,
+             feature_chunk.data(), filled * cols * value_size);
+    write_at(out, header.labels_offset + written * sizeof(std::int32_t),
+             label_chunk.data(), filled * sizeof(std::int32_t));
+    written += filled;
+    filled = 0;
+  };
+
+  while (written + filled < rows && std::getline(in, line)) {
+    if (line.empty() || line == "\r")
+      continue;
+    split_line(line, options.delimiter, fields);
+    if (fields.size() != columns) {
+      throw std::invalid_argument(
+          "convert_csv_to_dataset: rows have different numbers of columns");
+    }
+
+    char *dst = feature_chunk.data() + filled * cols * value_size;
+    std::size_t k = 0;
+    for (std::size_t c = 0; c < columns; ++c) {
+      if (static_cast<int>(c) == label)
+        continue;
+      if (options.dtype == DatasetDtype::Float32) {
+        float v = static_cast<float>(fields[c]);
+        std::memcpy(dst + k * value_size, &v, value_size);
+      } else {
+        std::memcpy(dst + k * value_size, &fields[c], value_size);
+      }
+      ++k;
+    }
+    label_chunk[filled] = label_value(fields[label], line);
+
+    if (++filled == CSV_CHUNK_ROWS)
+      flush();
+  }
+  if (filled > 0)
+    flush();
+
+  // The file shrank since the first pass counted its rows.
+  if (written != rows) {
+    throw std::runtime_error(
+        "convert_csv_to_dataset: the CSV changed during the conversion");
+  }
+}
+
+} // namespace
+
+MappedDataset::MappedDataset(const std::string &path) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw std::runtime_error("MappedDataset: cannot open " + path);
+
+  struct stat st;
+  if (::fstat(fd, &st) != 0 ||
+      static_cast<std::size_t>(st.st_size) < sizeof(DatasetHeader)) {
+    ::close(fd);
+    throw std::runtime_error("MappedDataset: " + path +
+                             " is too small to be a dataset");
+  }
+
+  m_size = static_cast<std::size_t>(st.st_size);
+  // Private and writable: views are mutable matrices, and a stray write
+  // only copies that page instead of touching the file.
+  m_base = ::mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (m_base == MAP_FAILED) {
+    m_base = nullptr;
+    throw std::runtime_error("MappedDataset: mmap failed for " + path);
+  }
+
+  std::memcpy(&m_header, m_base, sizeof(DatasetHeader));
+  const DatasetHeader &h = m_header;
+  std::uint64_t bytes = 0;
+  bool valid = std::memcmp(h.magic, MAGIC, sizeof(MAGIC)) == 0 &&
+               h.version == VERSION &&
+               (h.dtype == DatasetDtype::Float32 ||
+                h.dtype == DatasetDtype::Float64) &&
+               h.rows <= static_cast<std::uint64_t>(INT_MAX) && h.cols > 0 &&
+               h.cols <= static_cast<std::uint64_t>(INT_MAX) &&
+               feature_bytes(h.rows, h.cols, dtype_size(h.dtype), bytes) &&
+               h.features_offset % ALIGNMENT == 0 &&
+               h.labels_offset % ALIGNMENT == 0 &&
+               h.features_offset <= h.labels_offset &&
+               bytes <= h.labels_offset - h.features_offset &&
+               h.labels_offset <= m_size && file_size(h) <= m_size;
+  if (!valid) {
+    unmap();
+    throw std::runtime_error("MappedDataset: " + path +
+                             " is not a valid dataset file");
+  }
+}
+
+MappedDataset::~MappedDataset() { unmap(); }
+
+MappedDataset::MappedDataset(MappedDataset &&other) noexcept
+    : m_base(other.m_base), m_size(other.m_size), m_header(other.m_header) {
+  other.m_base = nullptr;
+  other.m_size = 0;
+}
+
+MappedDataset &MappedDataset::operator=(MappedDataset &&other) noexcept {
+  if (this == &other)
+    return *this;
+  unmap();
+  m_base = other.m_base;
+  m_size = other.m_size;
+  m_header = other.m_header;
+  other.m_base = nullptr;
+  other.m_size = 0;
+  return *this;
+}
+
+void MappedDataset::unmap() {
+  if (m_base)
+    ::munmap(m_base, m_size);
+  m_base = nullptr;
+  m_size = 0;
+}
+
+int MappedDataset::rows() const { return static_cast<int>(m_header.rows); }
+
+int MappedDataset::cols() const { return static_cast<int>(m_header.cols); }
+
+DatasetDtype MappedDataset::dtype() const { return m_header.dtype; }
+
+template <typename T>
+BasicFlatMatrix<T> MappedDataset::features(int first, int count) {
+  if (dtype_of<T>() != m_header.dtype) {
+    throw std::invalid_argument(
+        "MappedDataset::features: T does not match the stored dtype");
+  } else if (first < 0 || count < 0 || first > rows() - count) {
+    throw std::out_of_range("MappedDataset::features: row range out of range");
+  }
+
+  T *base = reinterpret_cast<T *>(static_cast<char *>(m_base) +
+                                  m_header.features_offset);
+  return BasicFlatMatrix<T>::view(base + static_cast<size_t>(first) * cols(),
+                                  count, cols());
+}
+
+template <typename T> BasicFlatMatrix<T> MappedDataset::features() {
+  return features<T>(0, rows());
+}
+
+const std::int32_t *MappedDataset::labels() const {
+  return reinterpret_cast<const std::int32_t *>(
+      static_cast<const char *>(m_base) + m_header.labels_offset);
+}
+
+std::vector<int> MappedDataset::labels(int first, int count) const {
+  if (first < 0 || count < 0 || first > rows() - count)
+    throw std::out_of_range("MappedDataset::labels: row range out of range");
+  const std::int32_t *begin = labels() + first;
+  return std::vector<int>(begin, begin + count);
+}
+
+template <typename T>
+void write_dataset(const std::string &path, const BasicFlatMatrix<T> &X,
+                   const std::vector<int> &y) {
+  if (X.rows() != static_cast<int>(y.size())) {
+    throw std::invalid_argument(
+        "write_dataset: X.rows and the number of labels have to match!");
+  }
+
+  DatasetHeader header = make_header(dtype_of<T>(), X.rows(), X.cols());
+  std::fstream out = create_file(path, header);
+  BasicFlatMatrix<T> packed;
+  const BasicFlatMatrix<T> &features =
+      X.is_contiguous() ? X : (packed = X.compact());
+  write_at(out, header.features_offset, features.data(),
+           sizeof(T) * static_cast<size_t>(X.rows()) * X.cols());
+  std::vector<std::int32_t> labels(y.begin(), y.end());
+  write_at(out, header.labels_offset, labels.data(),
+           sizeof(std::int32_t) * labels.size());
+}
+
+int convert_csv_to_dataset(const std::string &csv_path,
+                           const std::string &out_path,
+                           const CsvOptions &options) {
+  std::ifstream in(csv_path);
+  if (!in)
+    throw std::runtime_error("convert_csv_to_dataset: cannot open " +
+                             csv_path);
+
+  std::string line;
+  std::vector<double> fields;
+
+  // First pass: shape only.
+  std::uint64_t rows = 0;
+  std::size_t columns = 0;
+  if (options.header)
+    std::getline(in, line);
+  while (std::getline(in, line)) {
+    if (line.empty() || line == "\r")
+      continue;
+    if (columns == 0) {
+      split_line(line, options.delimiter, fields);
+      columns = fields.size();
+    }
+    ++rows;
+  }
+  if (rows > static_cast<std::uint64_t>(INT_MAX) || columns < 2) {
+    throw std::invalid_argument("convert_csv_to_dataset: " + csv_path +
+                                " needs at least one feature and one label "
+                                "column and at most INT_MAX rows");
+  }
+
+  int label = options.label_column < 0
+                  ? static_cast<int>(columns) - 1
+                  : options.label_column;
+  if (label >= static_cast<int>(columns))
+    throw std::invalid_argument("convert_csv_to_dataset: bad label_column");
+
+  std::uint64_t cols = columns - 1;
+  DatasetHeader header = make_header(options.dtype, rows, cols);
+  std::fstream out = create_file(out_path, header);
+  try {
+    convert_rows(in, out, header, label, options);
+  } catch (...) {
+    out.close();
+    std::remove(out_path.c_str());
+    throw;
+  }
+  return static_cast<int>(rows);
+}
+
+template BasicFlatMatrix<float> MappedDataset::features<float>(int, int);
+template BasicFlatMatrix<double> MappedDataset::features<double>(int, int);
+template BasicFlatMatrix<float> MappedDataset::features<float>();
+template BasicFlatMatrix<double> MappedDataset::features<double>();
+template void write_dataset(const std::string &, const BasicFlatMatrix<float> &,
+                            const std::vector<int> &);
+template void write_dataset(const std::string &,
+                            const BasicFlatMatrix<double> &,
+                            const std::vector<int> &);
@@ -0,0 +1,499 @@
+#include "../include/execution_plan.hpp"
+#include "activation_relu.hpp"
+#include "activation_softmax.hpp"
+#include "gemm.hpp"
+#include "layer_dense_relu.hpp"
+#include "thread_pool.hpp"
+#include "utils.hpp"
+#include "vec_math.hpp"
+#include <cmath>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+
+namespace {
+
+constexpr std::size_t ALIGNMENT = 64;
+constexpr double CLIP = 1e-7;
+
+std::size_t round_up(std::size_t n) {
+  return (n + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+}
+
+double clip(double p) { return std::max(CLIP, std::min(p, 1 - CLIP)); }
+
+// A buffer written at step `first` and last read at step `last`.
+struct Interval {
+  std::size_t bytes;
+  int first;
+  int last;
+  std::size_t offset;
+};
+
+// Greedy by size: the largest buffers are placed first, each at the lowest
+// offset that does not overlap a placed buffer whose lifetime overlaps its
+// own. Returns the slab size.
+std::size_t pack(std::vector<Interval> &buffers) {
+  std::vector<int> order(buffers.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(), [&](int a, int b) {
+    if (buffers[a].bytes != buffers[b].bytes)
+      return buffers[a].bytes > buffers[b].bytes;
+    return buffers[a].first != buffers[b].first
+               ? buffers[a].first < buffers[b].first
+               : a < b;
+  });
+
+  std::size_t total = 0;
+  std::vector<int> placed, live;
+  for (int b : order) {
+    Interval &x = buffers[b];
+    live.clear();
+    for (int p : placed) {
+      if (buffers[p].first <= x.last && x.first <= buffers[p].last)
+        live.push_back(p);
+    }
+    std::sort(live.begin(), live.end(), [&](int p, int q) {
+      return buffers[p].offset < buffers[q].offset;
+    });
+
+    std::size_t offset = 0;
+    for (int p : live) {
+      if (offset + x.bytes <= buffers[p].offset)
+        break;
+      offset = std::max(offset, buffers[p].offset + buffers[p].bytes);
+    }
+    x.offset = offset;
+    placed.push_back(b);
+    total = std::max(total, offset + x.bytes);
+  }
+  return total;
+}
+
+// Elementwise, so `out` may be `in`.
+template <typename T> void relu_rows(const T *in, T *out, int R, int C) {
+  parallel_for(0, R, 16, [&](int first, int last) {
+    for (int i = first; i < last; ++i) {
+      const T *x = in + static_cast<std::size_t>(i) * C;
+      T *y = out + static_cast<std::size_t>(i) * C;
+      for (int j = 0; j < C; ++j)
+        y[j] = std::max(T(0), x[j]);
+    }
+  });
+}
+
+template <typename T> void softmax_rows(const T *in, T *out, int R, int C) {
+  parallel_for(0, R, 8, [&](int first, int last) {
+    for (int i = first; i < last; ++i) {
+      std::size_t at = static_cast<std::size_t>(i) * C;
+      softmax_row(in + at, out + at, C);
+    }
+  });
+}
+
+// Zeroes the gradient wherever the (post-ReLU) output is not positive;
+// `dinputs` may be `dvalues`.
+template <typename T>
+void relu_mask_rows(const T *output, const T *dvalues, T *dinputs, int R,
+                    int C) {
+  parallel_for(0, R, 16, [&](int first, int last) {
+    for (std::size_t k = static_cast<std::size_t>(first) * C;
+         k < static_cast<std::size_t>(last) * C; ++k)
+      dinputs[k] = output[k] > T(0) ? dvalues[k] : T(0);
+  });
+}
+
+// Softmax Jacobian times dvalues, row by row; `dinputs` may be `dvalues`.
+template <typename T>
+void softmax_backward_rows(const T *output, const T *dvalues, T *dinputs,
+                           int R, int C) {
+  parallel_for(0, R, 16, [&](int first, int last) {
+    for (int i = first; i < last; ++i) {
+      std::size_t at = static_cast<std::size_t>(i) * C;
+      const T *out = output + at;
+      const T *dval = dvalues + at;
+      T *dinp = dinputs + at;
+      T dot = 0;
+      for (int j = 0; j < C; ++j)
+        dot += out[j] * dval[j];
+      for (int j = 0; j < C; ++j)
+        dinp[j] = out[j] * (dval[j] - dot);
+    }
+  });
+}
+
+} // namespace
+
+template <typename T>
+BasicExecutionPlan<T>::BasicExecutionPlan(BasicSequential<T> &model,
+                                          int max_batch)
+    : m_max_batch(max_batch) {
+  if (max_batch <= 0) {
+    throw std::invalid_argument(
+        "ExecutionPlan: max_batch has to be positive!");
+  } else if (model.size() == 0) {
+    throw std::invalid_argument("ExecutionPlan: the model has no layers");
+  }
+
+  int cols = -1;
+  for (int i = 0; i < model.size(); ++i) {
+    BasicLayer<T> &layer = model.layer(i);
+    Step step{};
+    if (auto *dense = dynamic_cast<BasicLayerDense<T> *>(&layer)) {
+      step.op = dynamic_cast<BasicLayerDenseReLU<T> *>(&layer) ? Op::DenseReLU
+                                                                : Op::Dense;
+      step.dense = dense;
+      step.in_cols = dense->weights.rows();
+      step.out_cols = dense->weights.cols();
+      if (cols >= 0 && cols != step.in_cols) {
+        throw std::invalid_argument(
+            "ExecutionPlan: weights.rows of a LayerDense has to match the "
+            "width of the layer before it!");
+      } else if (dense->sparse_gradients) {
+        // The plan writes dense dweights; the optimizer would read the
+        // stale sparse_dweights instead.
+        throw std::invalid_argument(
+            "ExecutionPlan: LayerDense with sparse_gradients is not "
+            "supported!");
+      }
+      m_trainable.push_back(dense);
+    } else {
+      if (dynamic_cast<BasicActivationReLU<T> *>(&layer)) {
+        step.op = Op::ReLU;
+      } else if (dynamic_cast<BasicActivationSoftmax<T> *>(&layer)) {
+        step.op = Op::Softmax;
+      } else {
+        throw std::invalid_argument(
+            "ExecutionPlan: the model contains a layer type the plan does "
+            "not support");
+      }
+      if (cols < 0) {
+        throw std::invalid_argument(
+            "ExecutionPlan: the first layer has to be a LayerDense!");
+      }
+      step.in_cols = step.out_cols = cols;
+    }
+    cols = step.out_cols;
+    m_steps.push_back(step);
+  }
+
+  std::size_t unused = 0;
+  std::size_t infer = layout(false, m_infer_offsets, unused);
+  std::size_t train = layout(true, m_train_offsets, m_unplanned_bytes);
+  m_slab_bytes = std::max(infer, train);
+  m_base = static_cast<unsigned char *>(m_slab.allocate_bytes(m_slab_bytes));
+}
+
+template <typename T>
+std::size_t BasicExecutionPlan<T>::layout(bool training,
+                                          std::vector<std::size_t> &offsets,
+                                          std::size_t &unplanned) const {
+  // Steps are numbered in execution order: forward step i runs at i, the
+  // head at n and the backward of step i at 2n - i.
+  int n = static_cast<int>(m_steps.size());
+  int ids = 2 * n + 2;
+  std::vector<int> first(ids, -1), last(ids, -1), root(ids);
+  std::vector<std::size_t> bytes(ids, 0);
+  std::iota(root.begin(), root.end(), 0);
+
+  auto define = [&](int id, int t, int cols) {
+    first[id] = t;
+    last[id] = std::max(last[id], t);
+    bytes[id] = round_up(sizeof(T) * static_cast<std::size_t>(m_max_batch) *
+                         static_cast<std::size_t>(cols));
+  };
+  auto use = [&](int id, int t) { last[id] = std::max(last[id], t); };
+  auto elementwise = [&](int i) {
+    return m_steps[i].op == Op::ReLU || m_steps[i].op == Op::Softmax;
+  };
+
+  for (int i = 0; i < n; ++i) {
+    define(act(i + 1), i, m_steps[i].out_cols);
+    if (i > 0)
+      use(act(i), i);
+  }
+  if (training) {
+    define(grad(n), n, m_steps[n - 1].out_cols);
+    use(act(n), n);
+    for (int i = n - 1; i >= 0; --i) {
+      int t = 2 * n - i;
+      const Step &step = m_steps[i];
+      use(grad(i + 1), t);
+      if (!elementwise(i) && i > 0)
+        use(act(i), t); // the inputs, for dweights
+      if (step.op != Op::Dense)
+        use(act(i + 1), t); // the outputs, for the mask or the Jacobian
+      if (i > 0)
+        define(grad(i), t, step.in_cols);
+    }
+  }
+
+  // Run in place wherever the input dies at the step that consumes it.
+  for (int i = 1; i < n; ++i) {
+    if (elementwise(i) && last[act(i)] == i)
+      root[act(i + 1)] = root[act(i)];
+  }
+  if (training) {
+    if (last[act(n)] == n)
+      root[grad(n)] = root[act(n)];
+    for (int i = n - 1; i > 0; --i) {
+      if (elementwise(i))
+        root[grad(i)] = root[grad(i + 1)];
+    }
+  }
+
+  std::vector<Interval> buffers;
+  std::vector<int> slot(ids, -1);
+  for (int id = 0; id < ids; ++id) {
+    if (first[id] < 0)
+      continue;
+    unplanned += bytes[id];
+    int &s = slot[root[id]];
+    if (s < 0) {
+      s = static_cast<int>(buffers.size());
+      buffers.push_back(Interval{bytes[id], first[id], last[id], 0});
+    } else {
+      Interval &b = buffers[s];
+      b.bytes = std::max(b.bytes, bytes[id]);
+      b.first = std::min(b.first, first[id]);
+      b.last = std::max(b.last, last[id]);
+    }
+  }
+
+  std::size_t total = pack(buffers);
+  offsets.assign(ids, 0);
+  for (int id = 0; id < ids; ++id) {
+    if (first[id] >= 0)
+      offsets[id] = buffers[slot[root[id]]].offset;
+  }
+  return total;
+}
+
+template <typename T> int BasicExecutionPlan<T>::max_batch() const {
+  return m_max_batch;
+}
+
+template <typename T> int BasicExecutionPlan<T>::n_inputs() const {
+  return m_steps.front().in_cols;
+}
+
+template <typename T> int BasicExecutionPlan<T>::n_outputs() const {
+  return m_steps.back().out_cols;
+}
+
+template <typename T> std::size_t BasicExecutionPlan<T>::slab_bytes() const {
+  return m_slab_bytes;
+}
+
+template <typename T>
+std::size_t BasicExecutionPlan<T>::unplanned_bytes() const {
+  return m_unplanned_bytes;
+}
+
+template <typename T>
+T *BasicExecutionPlan<T>::buffer(const std::vector<std::size_t> &offsets,
+                                 int id) const {
+  return reinterpret_cast<T *>(m_base + offsets[id]);
+}
+
+template <typename T>
+void BasicExecutionPlan<T>::check_batch(const BasicFlatMatrix<T> &X,
+                                        const char *what) const {
+  if (X.cols() != n_inputs()) {
+    throw std::invalid_argument(std::string("ExecutionPlan ") + what +
+                                ": X.cols and n_inputs have to match!");
+  } else if (X.rows() <= 0 || X.rows() > m_max_batch) {
+    throw std::invalid_argument(std::string("ExecutionPlan ") + what +
+                                ": X.rows has to be in [1, max_batch]!");
+  }
+}
+
+template <typename T>
+void BasicExecutionPlan<T>::run_forward(
+    const BasicFlatMatrix<T> &X, const std::vector<std::size_t> &offsets) {
+  NN_PROFILE_SCOPE("ExecutionPlan::forward");
+  int R = X.rows();
+  const T *in = X.data();
+  for (int i = 0; i < static_cast<int>(m_steps.size()); ++i) {
+    const Step &step = m_steps[i];
+    T *out = buffer(offsets, act(i + 1));
+    switch (step.op) {
+    case Op::Dense:
+    case Op::DenseReLU: {
+      GemmEpilogue<T> epilogue;
+      epilogue.bias = step.dense->biases.data();
+      epilogue.relu = step.op == Op::DenseReLU;
+      // Only the caller's batch can be strided; slab buffers are packed.
+      int ld_in = i == 0 ? X.stride() : step.in_cols;
+      gemm(false, false, R, step.out_cols, step.in_cols, in, ld_in,
+           step.dense->weights.data(), step.dense->weights.stride(), out,
+           step.out_cols, epilogue);
+      break;
+    }
+    case Op::ReLU:
+      relu_rows(in, out, R, step.out_cols);
+      break;
+    case Op::Softmax:
+      softmax_rows(in, out, R, step.out_cols);
+      break;
+    }
+    in = out;
+  }
+}
+
+template <typename T>
+double BasicExecutionPlan<T>::run_head(int R, const std::vector<int> &y,
+                                       int &correct) {
+  NN_PROFILE_SCOPE("ExecutionPlan::head");
+  int n = static_cast<int>(m_steps.size());
+  int C = n_outputs();
+  const T *logits = buffer(m_train_offsets, act(n));
+  T *dlogits = buffer(m_train_offsets, grad(n));
+  T scale = T(1) / static_cast<T>(R);
+
+  WorkspaceScope scratch;
+  double *losses = scratch.allocate(R);
+  int *hits = scratch.allocate<int>(R);
+
+  // Probabilities go straight into the gradient buffer and become
+  // (p - y) / R there, as in the softmax + cross-entropy head.
+  parallel_for(0, R, 8, [&](int first, int last) {
+    for (int i = first; i < last; ++i) {
+      std::size_t at = static_cast<std::size_t>(i) * C;
+      T *p = dlogits + at;
+      softmax_row(logits + at, p, C);
+      losses[i] = -std::log(clip(p[y[i]]));
+      hits[i] = std::max_element(p, p + C) - p == y[i];
+      for (int j = 0; j < C; ++j)
+        p[j] = p[j] * scale;
+      p[y[i]] -= scale;
+    }
+  });
+
+  double sum = 0.0;
+  for (int i = 0; i < R; ++i) {
+    sum += losses[i];
+    correct += hits[i];
+  }
+  return sum / static_cast<double>(R);
+}
+
+template <typename T>
+void BasicExecutionPlan<T>::run_backward(const BasicFlatMatrix<T> &X) {
+  NN_PROFILE_SCOPE("ExecutionPlan::backward");
+  int R = X.rows();
+  const std::vector<std::size_t> &offsets = m_train_offsets;
+  for (int i = static_cast<int>(m_steps.size()) - 1; i >= 0; --i) {
+    const Step &step = m_steps[i];
+    int K = step.in_cols;
+    int C = step.out_cols;
+    T *dvalues = buffer(offsets, grad(i + 1));
+    switch (step.op) {
+    case Op::ReLU:
+      relu_mask_rows(buffer(offsets, act(i + 1)), dvalues,
+                     buffer(offsets, grad(i)), R, C);
+      break;
+    case Op::Softmax:
+      softmax_backward_rows(buffer(offsets, act(i + 1)), dvalues,
+                            buffer(offsets, grad(i)), R, C);
+      break;
+    case Op::DenseReLU:
+      relu_mask_rows(buffer(offsets, act(i + 1)), dvalues, dvalues, R, C);
+      // fall through
+    case Op::Dense: {
+      BasicLayerDense<T> &layer = *step.dense;
+      const T *inputs = i == 0 ? X.data() : buffer(offsets, act(i));
+      int ld_in = i == 0 ? X.stride() : K;
+      layer.dweights.resize(K, C);
+      gemm(true, false, K, C, R, inputs, ld_in, dvalues, C,
+           layer.dweights.data(), layer.dweights.stride());
+      sum_cols_into(BasicFlatMatrix<T>::view(dvalues, R, C), layer.dbiases);
+      if (i > 0) {
+        gemm(false, true, R, K, C, dvalues, C, layer.weights.data(),
+             layer.weights.stride(), buffer(offsets, grad(i)), K);
+      }
+      break;
+    }
+    }
+  }
+}
+
+template <typename T>
+const BasicFlatMatrix<T> &
+BasicExecutionPlan<T>::forward(const BasicFlatMatrix<T> &X) {
+  check_batch(X, "forward");
+  run_forward(X, m_infer_offsets);
+  m_logits = BasicFlatMatrix<T>::view(
+      buffer(m_infer_offsets, act(static_cast<int>(m_steps.size()))),
+      X.rows(), n_outputs());
+  return m_logits;
+}
+
+template <typename T>
+double BasicExecutionPlan<T>::train_step(const BasicFlatMatrix<T> &X,
+                                         const std::vector<int> &y,
+                                         int &correct) {
+  check_batch(X, "train_step");
+  if (static_cast<int>(y.size()) != X.rows()) {
+    throw std::invalid_argument(
+        "ExecutionPlan train_step: X.rows and the number of labels have to "
+        "match!");
+  }
+  for (int label : y) {
+    if (label < 0 || label >= n_outputs())
+      throw std::invalid_argument(
+          "ExecutionPlan train_step: label index out of range!");
+  }
+
+  run_forward(X, m_train_offsets);
+  double loss = run_head(X.rows(), y, correct);
+  run_backward(X);
+  return loss;
+}
+
+template <typename T>
+int BasicExecutionPlan<T>::begin_fit(const BasicFlatMatrix<T> &X,
+                                     const std::vector<int> &y,
+                                     const FitOptions &options) {
+  if (X.rows() != static_cast<int>(y.size())) {
+    throw std::invalid_argument(
+        "ExecutionPlan fit: X.rows and the number of labels have to match!");
+  } else if (X.rows() == 0) {
+    throw std::invalid_argument("ExecutionPlan fit: X has no samples!");
+  } else if (options.batch_size <= 0 || options.epochs < 0) {
+    throw std::invalid_argument(
+        "ExecutionPlan fit: batch_size has to be positive and epochs not "
+        "negative!");
+  } else if (std::min(options.batch_size, X.rows()) > m_max_batch) {
+    throw std::invalid_argument(
+        "ExecutionPlan fit: batch_size is larger than max_batch!");
+  }
+
+  m_order.resize(X.rows());
+  std::iota(m_order.begin(), m_order.end(), 0);
+  m_rng.seed(options.seed);
+  m_batch_y.reserve(std::min(options.batch_size, X.rows()));
+
+  return (X.rows() + options.batch_size - 1) / options.batch_size;
+}
+
+template <typename T>
+void BasicExecutionPlan<T>::gather(const BasicFlatMatrix<T> &X,
+                                   const std::vector<int> &y, int first,
+                                   int count) {
+  int C = X.cols();
+  m_batch_x.resize(count, C);
+  m_batch_y.resize(count);
+
+  parallel_for(0, count, 32, [&](int b0, int b1) {
+    for (int b = b0; b < b1; ++b) {
+      int src = m_order[first + b];
+      std::memcpy(m_batch_x.row(b), X.row(src), sizeof(T) * C);
+      m_batch_y[b] = y[src];
+    }
+  });
+}
+
+template class BasicExecutionPlan<float>;
+template class BasicExecutionPlan<double>;
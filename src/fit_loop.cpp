@@ -0,0 +1,11 @@
+#include "../include/fit_loop.hpp"
+#include <cstdio>
+
+void report_epoch(const FitOptions &options, const EpochStats &stats) {
+  if (options.on_epoch)
+    options.on_epoch(stats);
+  if (options.verbose) {
+    std::printf("epoch: %d, acc: %.3f, loss: %.3f\n", stats.epoch,
+                stats.accuracy, stats.loss);
+  }
+}
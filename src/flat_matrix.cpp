@@ -1,67 +1,270 @@
 #include "../include/flat_matrix.hpp"
+#include "../include/gemm.hpp"
+#include "../include/matrix_expr.hpp"
+#include "../include/workspace.hpp"
 #include <algorithm>
 #include <cstddef>
+#include <new>
 #include <stdexcept>
 
-int FlatMatrix::index(int i, int j) const {
+namespace {
+
+// Padded strides avoid multiples of this many bytes.
+constexpr std::size_t SET_ALIASING_BYTES = 512;
+
+} // namespace
+
+template <typename T>
+size_t BasicFlatMatrix<T>::index(int i, int j) const {
   if (i < 0 || i >= m_rows || j < 0 || j >= m_cols) {
     throw std::out_of_range("FlatMatrix::index: Index out of range");
   }
-  return i * m_cols + j;
+  return static_cast<size_t>(i) * m_stride + j;
+}
+
+template <typename T> void BasicFlatMatrix<T>::release() {
+  if (m_owner && m_data)
+    ::operator delete(m_data, std::align_val_t(ALIGNMENT));
+  m_data = nullptr;
+  m_capacity = 0;
+  m_owner = true;
 }
 
-FlatMatrix::FlatMatrix(int rows, int cols, double initVal)
-    : m_rows(rows), m_cols(cols) {
+template <typename T> void BasicFlatMatrix<T>::reserve(size_t size) {
+  if (size <= m_capacity) {
+    return;
+  }
+  release();
+  m_data = static_cast<T *>(
+      ::operator new(size * sizeof(T), std::align_val_t(ALIGNMENT)));
+  m_capacity = size;
+  record_heap_allocation();
+}
+
+template <typename T> int BasicFlatMatrix<T>::stride_for(int cols) const {
+  if (!m_padded)
+    return cols;
+  int per_line = static_cast<int>(ALIGNMENT / sizeof(T));
+  int stride = (cols + per_line - 1) / per_line * per_line;
+  if (stride * sizeof(T) % SET_ALIASING_BYTES == 0)
+    stride += per_line;
+  return stride;
+}
+
+template <typename T>
+void BasicFlatMatrix<T>::copy_rows(const BasicFlatMatrix &other) {
+  if (is_contiguous() && other.is_contiguous()) {
+    std::copy(other.m_data,
+              other.m_data + static_cast<size_t>(m_rows) * m_cols, m_data);
+    return;
+  }
+  for (int i = 0; i < m_rows; ++i)
+    std::copy(other.row(i), other.row(i) + m_cols, row(i));
+}
+
+template <typename T>
+BasicFlatMatrix<T>::BasicFlatMatrix(int rows, int cols, T initVal)
+    : m_rows(rows), m_cols(cols), m_stride(cols), m_capacity(0),
+      m_data(nullptr), m_owner(true), m_padded(false) {
   if (rows < 0 || cols <= 0) {
     throw std::invalid_argument(
         "FlatMatrix: Rows and Columns have to be greater than 0");
   }
-  m_data = new double[static_cast<size_t>(rows) * cols];
-  for (int i = 0; i < rows * cols; ++i) {
-    m_data[i] = initVal;
+  reserve(static_cast<size_t>(rows) * cols);
+  std::fill(m_data, m_data + static_cast<size_t>(rows) * cols, initVal);
+}
+
+template <typename T>
+BasicFlatMatrix<T>::BasicFlatMatrix(const BasicFlatMatrix &other)
+    : m_rows(other.m_rows), m_cols(other.m_cols), m_stride(other.m_cols),
+      m_capacity(0), m_data(nullptr), m_owner(true),
+      m_padded(other.m_padded) {
+  m_stride = stride_for(m_cols);
+  reserve(static_cast<size_t>(m_rows) * m_stride);
+  copy_rows(other);
+}
+
+template <typename T>
+BasicFlatMatrix<T>::BasicFlatMatrix(BasicFlatMatrix &&other) noexcept
+    : m_rows(other.m_rows), m_cols(other.m_cols), m_stride(other.m_stride),
+      m_capacity(other.m_capacity), m_data(other.m_data),
+      m_owner(other.m_owner), m_padded(other.m_padded) {
+  other.m_rows = 0;
+  other.m_cols = 0;
+  other.m_stride = 0;
+  other.m_capacity = 0;
+  other.m_data = nullptr;
+  other.m_owner = true;
+  other.m_padded = false;
+}
+
+template <typename T>
+BasicFlatMatrix<T> BasicFlatMatrix<T>::view(T *data, int rows, int cols) {
+  return view(data, rows, cols, cols);
+}
+
+template <typename T>
+BasicFlatMatrix<T> BasicFlatMatrix<T>::view(T *data, int rows, int cols,
+                                            int stride) {
+  if (rows < 0 || cols <= 0) {
+    throw std::invalid_argument(
+        "FlatMatrix::view: Rows and Columns have to be greater than 0");
+  } else if (stride < cols) {
+    throw std::invalid_argument(
+        "FlatMatrix::view: the stride has to be at least cols");
+  }
+  BasicFlatMatrix m;
+  m.m_rows = rows;
+  m.m_cols = cols;
+  m.m_stride = stride;
+  // A strided view cannot take another shape in place.
+  m.m_capacity = stride == cols ? static_cast<size_t>(rows) * cols : 0;
+  m.m_data = data;
+  m.m_owner = false;
+  return m;
+}
+
+template <typename T>
+BasicFlatMatrix<T> BasicFlatMatrix<T>::padded(int rows, int cols, T initVal) {
+  if (rows < 0 || cols <= 0) {
+    throw std::invalid_argument(
+        "FlatMatrix::padded: Rows and Columns have to be greater than 0");
+  }
+  BasicFlatMatrix m;
+  m.m_padded = true;
+  m.m_rows = rows;
+  m.m_cols = cols;
+  m.m_stride = m.stride_for(cols);
+  size_t n = static_cast<size_t>(rows) * m.m_stride;
+  m.reserve(n);
+  std::fill(m.m_data, m.m_data + n, initVal);
+  return m;
+}
+
+template <typename T>
+BasicFlatMatrix<T> BasicFlatMatrix<T>::block(int row, int col, int rows,
+                                             int cols) {
+  if (row < 0 || col < 0 || rows < 0 || cols <= 0 || row + rows > m_rows ||
+      col + cols > m_cols) {
+    throw std::out_of_range("FlatMatrix::block: block out of range");
   }
+  return view(m_data + static_cast<size_t>(row) * m_stride + col, rows, cols,
+              m_stride);
 }
 
-FlatMatrix::FlatMatrix(const FlatMatrix &other)
-    : m_rows(other.m_rows), m_cols(other.m_cols) {
-  m_data = new double[static_cast<size_t>(m_rows) * m_cols];
+template <typename T> BasicFlatMatrix<T> BasicFlatMatrix<T>::compact() const {
+  BasicFlatMatrix m;
+  if (m_cols == 0)
+    return m;
+  m.resize(m_rows, m_cols);
+  m.copy_rows(*this);
+  return m;
+}
 
-  std::copy(other.m_data, other.m_data + static_cast<size_t>(m_rows) * m_cols,
-            m_data);
+template <typename T> bool BasicFlatMatrix<T>::is_view() const {
+  return !m_owner;
 }
 
-double FlatMatrix::get(int i, int j) const {
-  int idx = index(i, j);
-  return m_data[idx];
+template <typename T> T BasicFlatMatrix<T>::get(int i, int j) const {
+  return m_data[index(i, j)];
 }
 
-void FlatMatrix::set(int i, int j, double value) {
-  int idx = index(i, j);
-  m_data[idx] = value;
+template <typename T> void BasicFlatMatrix<T>::set(int i, int j, T value) {
+  m_data[index(i, j)] = value;
 }
 
-int FlatMatrix::rows() const { return m_rows; }
+template <typename T> int BasicFlatMatrix<T>::rows() const { return m_rows; }
+
+template <typename T> int BasicFlatMatrix<T>::cols() const { return m_cols; }
 
-int FlatMatrix::cols() const { return m_cols; }
+template <typename T> T *BasicFlatMatrix<T>::data() { return m_data; }
 
-FlatMatrix &FlatMatrix::operator=(const FlatMatrix &other) {
+template <typename T> const T *BasicFlatMatrix<T>::data() const {
+  return m_data;
+}
+
+template <typename T> void BasicFlatMatrix<T>::resize(int rows, int cols) {
+  if (rows < 0 || cols <= 0) {
+    throw std::invalid_argument(
+        "FlatMatrix::resize: Rows and Columns have to be greater than 0");
+  }
+  if (rows == m_rows && cols == m_cols)
+    return;
+  int stride = stride_for(cols);
+  reserve(static_cast<size_t>(rows) * stride);
+  m_rows = rows;
+  m_cols = cols;
+  m_stride = stride;
+}
+
+template <typename T>
+BasicFlatMatrix<T> &
+BasicFlatMatrix<T>::operator=(const BasicFlatMatrix &other) {
   if (this == &other) {
     return *this;
   }
 
-  if (m_rows != other.m_rows || m_cols != other.m_cols) {
-    delete[] m_data;
-    m_rows = other.m_rows;
-    m_cols = other.m_cols;
-    m_data = new double[static_cast<size_t>(m_rows) * m_cols];
+  check_assign(other.m_rows, other.m_cols);
+  resize(other.m_rows, other.m_cols);
+  copy_rows(other);
+  return *this;
+}
+
+template <typename T>
+BasicFlatMatrix<T> &
+BasicFlatMatrix<T>::operator=(BasicFlatMatrix &&other) noexcept {
+  if (this == &other) {
+    return *this;
   }
 
-  std::copy(other.m_data, other.m_data + static_cast<size_t>(m_rows) * m_cols,
-            m_data);
+  release();
+  m_rows = other.m_rows;
+  m_cols = other.m_cols;
+  m_stride = other.m_stride;
+  m_capacity = other.m_capacity;
+  m_data = other.m_data;
+  m_owner = other.m_owner;
+  m_padded = other.m_padded;
+
+  other.m_rows = 0;
+  other.m_cols = 0;
+  other.m_stride = 0;
+  other.m_capacity = 0;
+  other.m_data = nullptr;
+  other.m_owner = true;
+  other.m_padded = false;
   return *this;
 }
 
-FlatMatrix matmul(const FlatMatrix &A, const FlatMatrix &B) {
+template <typename T> BasicFlatMatrix<T>::~BasicFlatMatrix() { release(); }
+
+template <typename T>
+BasicFlatMatrix<T> matmul(const BasicFlatMatrix<T> &A,
+                          const BasicFlatMatrix<T> &B) {
+  BasicFlatMatrix<T> Result;
+  matmul_into(A, B, Result);
+  return Result;
+}
+
+template <typename T>
+BasicFlatMatrix<T> matmul_tn(const BasicFlatMatrix<T> &A,
+                             const BasicFlatMatrix<T> &B) {
+  BasicFlatMatrix<T> Result;
+  matmul_tn_into(A, B, Result);
+  return Result;
+}
+
+template <typename T>
+BasicFlatMatrix<T> matmul_nt(const BasicFlatMatrix<T> &A,
+                             const BasicFlatMatrix<T> &B) {
+  BasicFlatMatrix<T> Result;
+  matmul_nt_into(A, B, Result);
+  return Result;
+}
+
+template <typename T>
+void matmul_into(const BasicFlatMatrix<T> &A, const BasicFlatMatrix<T> &B,
+                 BasicFlatMatrix<T> &Result) {
   if (A.cols() != B.rows()) {
     throw std::invalid_argument("matmul: cols A and rows B do not match");
   }
@@ -70,21 +273,46 @@ FlatMatrix matmul(const FlatMatrix &A, const FlatMatrix &B) {
   int C = B.cols(); // Columns in the result
   int K = A.cols(); // shared dimensions of matrixes
 
-  FlatMatrix Result(R, C, 0.0);
+  Result.resize(R, C);
+  gemm(false, false, R, C, K, A.data(), A.stride(), B.data(), B.stride(),
+       Result.data(), Result.stride());
+}
 
-  for (int i = 0; i < R; ++i) {
-    for (int j = 0; j < C; ++j) {
-      double sum = 0.0;
-      for (int k = 0; k < K; ++k) {
-        sum += A.get(i, k) * B.get(k, j);
-      }
-      Result.set(i, j, sum);
-    }
+template <typename T>
+void matmul_tn_into(const BasicFlatMatrix<T> &A, const BasicFlatMatrix<T> &B,
+                    BasicFlatMatrix<T> &Result) {
+  if (A.rows() != B.rows()) {
+    throw std::invalid_argument("matmul_tn: rows A and rows B do not match");
   }
-  return Result;
+
+  int R = A.cols();
+  int C = B.cols();
+  int K = A.rows();
+
+  Result.resize(R, C);
+  gemm(true, false, R, C, K, A.data(), A.stride(), B.data(), B.stride(),
+       Result.data(), Result.stride());
+}
+
+template <typename T>
+void matmul_nt_into(const BasicFlatMatrix<T> &A, const BasicFlatMatrix<T> &B,
+                    BasicFlatMatrix<T> &Result) {
+  if (A.cols() != B.cols()) {
+    throw std::invalid_argument("matmul_nt: cols A and cols B do not match");
+  }
+
+  int R = A.rows();
+  int C = B.rows();
+  int K = A.cols();
+
+  Result.resize(R, C);
+  gemm(false, true, R, C, K, A.data(), A.stride(), B.data(), B.stride(),
+       Result.data(), Result.stride());
 }
 
-FlatMatrix subtract(const FlatMatrix &A, const FlatMatrix &B) {
+template <typename T>
+BasicFlatMatrix<T> subtract(const BasicFlatMatrix<T> &A,
+                            const BasicFlatMatrix<T> &B) {
   int rA = A.rows(), cA = A.cols();
   int rB = B.rows(), cB = B.cols();
 
@@ -92,16 +320,28 @@ FlatMatrix subtract(const FlatMatrix &A, const FlatMatrix &B) {
     throw std::invalid_argument("subtract: dimensions do not match!");
   }
 
-  FlatMatrix R(rA, cA, 0.0);
-  for (int i = 0; i < rA; ++i) {
-    for (int j = 0; j < cA; ++j) {
-      R.set(i, j, A.get(i, j) - B.get(i, j));
-    }
-  }
-  return R;
+  using nn::expr::operator-;
+  return BasicFlatMatrix<T>(A - B);
 }
 
-FlatMatrix::~FlatMatrix() {
-  if (m_data)
-    delete[] m_data;
-}
\ No newline at end of file
+#define INSTANTIATE_FLAT_MATRIX(T)                                             \
+  template class BasicFlatMatrix<T>;                                           \
+  template BasicFlatMatrix<T> matmul(const BasicFlatMatrix<T> &,               \
+                                     const BasicFlatMatrix<T> &);              \
+  template BasicFlatMatrix<T> matmul_tn(const BasicFlatMatrix<T> &,            \
+                                        const BasicFlatMatrix<T> &);           \
+  template BasicFlatMatrix<T> matmul_nt(const BasicFlatMatrix<T> &,            \
+                                        const BasicFlatMatrix<T> &);           \
+  template void matmul_into(const BasicFlatMatrix<T> &,                        \
+                            const BasicFlatMatrix<T> &, BasicFlatMatrix<T> &); \
+  template void matmul_tn_into(const BasicFlatMatrix<T> &,                     \
+                               const BasicFlatMatrix<T> &,                     \
+                               BasicFlatMatrix<T> &);                          \
+  template void matmul_nt_into(const BasicFlatMatrix<T> &,                     \
+                               const BasicFlatMatrix<T> &,                     \
+                               BasicFlatMatrix<T> &);                          \
+  template BasicFlatMatrix<T> subtract(const BasicFlatMatrix<T> &,             \
+                                       const BasicFlatMatrix<T> &);
+
+INSTANTIATE_FLAT_MATRIX(float)
+INSTANTIATE_FLAT_MATRIX(double)
@@ -0,0 +1,451 @@
+#include "../include/gemm.hpp"
+#include "../include/thread_pool.hpp"
+#include "../include/workspace.hpp"
+#include "profiler.hpp"
+#include <algorithm>
+#include <cstddef>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define NN_GEMM_X86 1
+#include <immintrin.h>
+#endif
+
+// Blocking follows the usual Goto/BLIS layout: a KC x NC panel of B is packed
+// once and reused for every MC x KC block of A, which in turn is swept by an
+// MR x NR register tile. KC * NR values of B stay in L1, MC * KC of A in L2.
+// The tile is two AVX2 vectors wide, so float gets twice the columns.
+namespace {
+
+template <typename T> struct Blocking;
+
+template <> struct Blocking<double> {
+  static constexpr int MR = 6;
+  static constexpr int NR = 8;
+  static constexpr int MC = 120;
+  static constexpr int KC = 256;
+  static constexpr int NC = 2048;
+};
+
+template <> struct Blocking<float> {
+  static constexpr int MR = 6;
+  static constexpr int NR = 16;
+  static constexpr int MC = 120;
+  static constexpr int KC = 256;
+  static constexpr int NC = 4096;
+};
+
+// A strided view of a source operand so packing does not care whether the
+// element (i, k) lives at i * lda + k or somewhere else.
+template <typename T> struct Operand {
+  const T *data;
+  int rs; // row stride
+  int cs; // column stride
+
+  T at(int i, int j) const {
+    return data[static_cast<size_t>(i) * rs + static_cast<size_t>(j) * cs];
+  }
+};
+
+// Packs an mc x kc block of A into MR-row micro-panels laid out k-major, so
+// the micro-kernel reads MR consecutive values per k. Short panels are padded
+// with zeros.
+template <typename T>
+void pack_a(const Operand<T> &A, int i0, int k0, int mc, int kc, T *dst) {
+  constexpr int MR = Blocking<T>::MR;
+  for (int ip = 0; ip < mc; ip += MR) {
+    int mr = std::min(MR, mc - ip);
+    for (int k = 0; k < kc; ++k) {
+      for (int i = 0; i < mr; ++i)
+        dst[i] = A.at(i0 + ip + i, k0 + k);
+      for (int i = mr; i < MR; ++i)
+        dst[i] = T(0);
+      dst += MR;
+    }
+  }
+}
+
+// Packs a kc x nc block of B into NR-column micro-panels laid out k-major.
+// A transposed B (unit row stride) is read column by column instead so the
+// source is still walked contiguously.
+template <typename T>
+void pack_b(const Operand<T> &B, int k0, int j0, int kc, int nc, T *dst) {
+  constexpr int NR = Blocking<T>::NR;
+  for (int jp = 0; jp < nc; jp += NR) {
+    int nr = std::min(NR, nc - jp);
+
+    if (B.rs == 1) {
+      for (int j = 0; j < nr; ++j) {
+        const T *src =
+            B.data + static_cast<size_t>(j0 + jp + j) * B.cs + k0;
+        for (int k = 0; k < kc; ++k)
+          dst[k * NR + j] = src[k];
+      }
+      for (int j = nr; j < NR; ++j)
+        for (int k = 0; k < kc; ++k)
+          dst[k * NR + j] = T(0);
+      dst += static_cast<size_t>(kc) * NR;
+      continue;
+    }
+
+    for (int k = 0; k < kc; ++k) {
+      if (nr == NR) {
+        const T *src = B.data + static_cast<size_t>(k0 + k) * B.rs + (j0 + jp);
+        std::copy(src, src + NR, dst);
+      } else {
+        for (int j = 0; j < nr; ++j)
+          dst[j] = B.at(k0 + k, j0 + jp + j);
+        for (int j = nr; j < NR; ++j)
+          dst[j] = T(0);
+      }
+      dst += NR;
+    }
+  }
+}
+
+// Computes the MR x NR tile a * b over kc and stores it to C, either
+// overwriting it or adding to what is already there. On the last kc block
+// the epilogue is applied before the store; `bias` then points at the
+// tile's first column.
+template <typename T>
+using MicroKernel = void (*)(int kc, const T *a, const T *b, T *C, int ldc,
+                             bool accumulate, const T *bias, bool relu);
+
+template <typename T>
+void micro_kernel_scalar(int kc, const T *a, const T *b, T *C, int ldc,
+                         bool accumulate, const T *bias, bool relu) {
+  constexpr int MR = Blocking<T>::MR;
+  constexpr int NR = Blocking<T>::NR;
+
+  T acc[MR][NR] = {};
+  for (int k = 0; k < kc; ++k) {
+    for (int i = 0; i < MR; ++i) {
+      T ai = a[i];
+      for (int j = 0; j < NR; ++j)
+        acc[i][j] += ai * b[j];
+    }
+    a += MR;
+    b += NR;
+  }
+
+  for (int i = 0; i < MR; ++i) {
+    T *c = C + static_cast<size_t>(i) * ldc;
+    for (int j = 0; j < NR; ++j) {
+      T v = accumulate ? c[j] + acc[i][j] : acc[i][j];
+      if (bias)
+        v += bias[j];
+      c[j] = relu ? std::max(v, T(0)) : v;
+    }
+  }
+}
+
+#ifdef NN_GEMM_X86
+__attribute__((target("avx2,fma"))) void
+micro_kernel_avx2(int kc, const double *a, const double *b, double *C, int ldc,
+                  bool accumulate, const double *bias, bool relu) {
+  __m256d c00 = _mm256_setzero_pd(), c01 = _mm256_setzero_pd();
+  __m256d c10 = _mm256_setzero_pd(), c11 = _mm256_setzero_pd();
+  __m256d c20 = _mm256_setzero_pd(), c21 = _mm256_setzero_pd();
+  __m256d c30 = _mm256_setzero_pd(), c31 = _mm256_setzero_pd();
+  __m256d c40 = _mm256_setzero_pd(), c41 = _mm256_setzero_pd();
+  __m256d c50 = _mm256_setzero_pd(), c51 = _mm256_setzero_pd();
+
+  for (int k = 0; k < kc; ++k) {
+    __m256d b0 = _mm256_loadu_pd(b);
+    __m256d b1 = _mm256_loadu_pd(b + 4);
+    __m256d ai;
+
+    ai = _mm256_broadcast_sd(a + 0);
+    c00 = _mm256_fmadd_pd(ai, b0, c00);
+    c01 = _mm256_fmadd_pd(ai, b1, c01);
+    ai = _mm256_broadcast_sd(a + 1);
+    c10 = _mm256_fmadd_pd(ai, b0, c10);
+    c11 = _mm256_fmadd_pd(ai, b1, c11);
+    ai = _mm256_broadcast_sd(a + 2);
+    c20 = _mm256_fmadd_pd(ai, b0, c20);
+    c21 = _mm256_fmadd_pd(ai, b1, c21);
+    ai = _mm256_broadcast_sd(a + 3);
+    c30 = _mm256_fmadd_pd(ai, b0, c30);
+    c31 = _mm256_fmadd_pd(ai, b1, c31);
+    ai = _mm256_broadcast_sd(a + 4);
+    c40 = _mm256_fmadd_pd(ai, b0, c40);
+    c41 = _mm256_fmadd_pd(ai, b1, c41);
+    ai = _mm256_broadcast_sd(a + 5);
+    c50 = _mm256_fmadd_pd(ai, b0, c50);
+    c51 = _mm256_fmadd_pd(ai, b1, c51);
+
+    a += 6;
+    b += 8;
+  }
+
+  __m256d rows[6][2] = {{c00, c01}, {c10, c11}, {c20, c21},
+                        {c30, c31}, {c40, c41}, {c50, c51}};
+  __m256d bias0 = bias ? _mm256_loadu_pd(bias) : _mm256_setzero_pd();
+  __m256d bias1 = bias ? _mm256_loadu_pd(bias + 4) : _mm256_setzero_pd();
+  __m256d zero = _mm256_setzero_pd();
+
+  for (int i = 0; i < 6; ++i) {
+    double *c = C + static_cast<size_t>(i) * ldc;
+    if (accumulate) {
+      rows[i][0] = _mm256_add_pd(rows[i][0], _mm256_loadu_pd(c));
+      rows[i][1] = _mm256_add_pd(rows[i][1], _mm256_loadu_pd(c + 4));
+    }
+    if (bias) {
+      rows[i][0] = _mm256_add_pd(rows[i][0], bias0);
+      rows[i][1] = _mm256_add_pd(rows[i][1], bias1);
+    }
+    if (relu) {
+      rows[i][0] = _mm256_max_pd(rows[i][0], zero);
+      rows[i][1] = _mm256_max_pd(rows[i][1], zero);
+    }
+    _mm256_storeu_pd(c, rows[i][0]);
+    _mm256_storeu_pd(c + 4, rows[i][1]);
+  }
+}
+
+__attribute__((target("avx2,fma"))) void
+micro_kernel_avx2(int kc, const float *a, const float *b, float *C, int ldc,
+                  bool accumulate, const float *bias, bool relu) {
+  __m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps();
+  __m256 c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps();
+  __m256 c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps();
+  __m256 c30 = _mm256_setzero_ps(), c31 = _mm256_setzero_ps();
+  __m256 c40 = _mm256_setzero_ps(), c41 = _mm256_setzero_ps();
+  __m256 c50 = _mm256_setzero_ps(), c51 = _mm256_setzero_ps();
+
+  for (int k = 0; k < kc; ++k) {
+    __m256 b0 = _mm256_loadu_ps(b);
+    __m256 b1 = _mm256_loadu_ps(b + 8);
+    __m256 ai;
+
+    ai = _mm256_broadcast_ss(a + 0);
+    c00 = _mm256_fmadd_ps(ai, b0, c00);
+    c01 = _mm256_fmadd_ps(ai, b1, c01);
+    ai = _mm256_broadcast_ss(a + 1);
+    c10 = _mm256_fmadd_ps(ai, b0, c10);
+    c11 = _mm256_fmadd_ps(ai, b1, c11);
+    ai = _mm256_broadcast_ss(a + 2);
+    c20 = _mm256_fmadd_ps(ai, b0, c20);
+    c21 = _mm256_fmadd_ps(ai, b1, c21);
+    ai = _mm256_broadcast_ss(a + 3);
+    c30 = _mm256_fmadd_ps(ai, b0, c30);
+    c31 = _mm256_fmadd_ps(ai, b1, c31);
+    ai = _mm256_broadcast_ss(a + 4);
+    c40 = _mm256_fmadd_ps(ai, b0, c40);
+    c41 = _mm256_fmadd_ps(ai, b1, c41);
+    ai = _mm256_broadcast_ss(a + 5);
+    c50 = _mm256_fmadd_ps(ai, b0, c50);
+    c51 = _mm256_fmadd_ps(ai, b1, c51);
+
+    a += 6;
+    b += 16;
+  }
+
+  __m256 rows[6][2] = {{c00, c01}, {c10, c11}, {c20, c21},
+                       {c30, c31}, {c40, c41}, {c50, c51}};
+  __m256 bias0 = bias ? _mm256_loadu_ps(bias) : _mm256_setzero_ps();
+  __m256 bias1 = bias ? _mm256_loadu_ps(bias + 8) : _mm256_setzero_ps();
+  __m256 zero = _mm256_setzero_ps();
+
+  for (int i = 0; i < 6; ++i) {
+    float *c = C + static_cast<size_t>(i) * ldc;
+    if (accumulate) {
+      rows[i][0] = _mm256_add_ps(rows[i][0], _mm256_loadu_ps(c));
+      rows[i][1] = _mm256_add_ps(rows[i][1], _mm256_loadu_ps(c + 8));
+    }
+    if (bias) {
+      rows[i][0] = _mm256_add_ps(rows[i][0], bias0);
+      rows[i][1] = _mm256_add_ps(rows[i][1], bias1);
+    }
+    if (relu) {
+      rows[i][0] = _mm256_max_ps(rows[i][0], zero);
+      rows[i][1] = _mm256_max_ps(rows[i][1], zero);
+    }
+    _mm256_storeu_ps(c, rows[i][0]);
+    _mm256_storeu_ps(c + 8, rows[i][1]);
+  }
+}
+#endif
+
+template <typename T> MicroKernel<T> select_micro_kernel() {
+#ifdef NN_GEMM_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    return static_cast<MicroKernel<T>>(micro_kernel_avx2);
+#endif
+  return micro_kernel_scalar<T>;
+}
+
+template <typename T> MicroKernel<T> micro_kernel() {
+  static const MicroKernel<T> kernel = select_micro_kernel<T>();
+  return kernel;
+}
+
+// Runs the micro-kernel over one packed mc x kc block of A against one packed
+// kc x nc panel of B. Edge tiles go through a scratch tile so the kernel can
+// always work on full MR x NR registers. `epilogue` is null except on the
+// last kc block, and its bias is already offset to C's first column.
+template <typename T>
+void macro_kernel(int mc, int nc, int kc, const T *packedA, const T *packedB,
+                  T *C, int ldc, bool accumulate,
+                  const GemmEpilogue<T> *epilogue) {
+  constexpr int MR = Blocking<T>::MR;
+  constexpr int NR = Blocking<T>::NR;
+
+  MicroKernel<T> kernel = micro_kernel<T>();
+  T edge[MR * NR];
+  const T *bias = epilogue ? epilogue->bias : nullptr;
+  bool relu = epilogue && epilogue->relu;
+
+  for (int jr = 0; jr < nc; jr += NR) {
+    int nr = std::min(NR, nc - jr);
+    const T *b = packedB + static_cast<size_t>(jr) * kc;
+
+    for (int ir = 0; ir < mc; ir += MR) {
+      int mr = std::min(MR, mc - ir);
+      const T *a = packedA + static_cast<size_t>(ir) * kc;
+      T *c = C + static_cast<size_t>(ir) * ldc + jr;
+
+      if (mr == MR && nr == NR) {
+        kernel(kc, a, b, c, ldc, accumulate, bias ? bias + jr : nullptr, relu);
+        continue;
+      }
+
+      kernel(kc, a, b, edge, NR, false, nullptr, false);
+      for (int i = 0; i < mr; ++i) {
+        T *crow = c + static_cast<size_t>(i) * ldc;
+        for (int j = 0; j < nr; ++j) {
+          T v = edge[i * NR + j];
+          if (accumulate)
+            v += crow[j];
+          if (bias)
+            v += bias[jr + j];
+          crow[j] = relu ? std::max(v, T(0)) : v;
+        }
+      }
+    }
+  }
+}
+
+// Work is split across the thread pool in one of two ways: when there are
+// enough MC row blocks every participant packs its own A block against the
+// shared B panel, otherwise (small batches) one A block is packed and the
+// panel's NR columns are divided instead. Either way each C element is
+// produced by the same sequence of FMAs, so the split never changes results.
+template <typename T>
+void gemm_blocked(int M, int N, int K, const Operand<T> &A,
+                  const Operand<T> &B, T *C, int ldc,
+                  const GemmEpilogue<T> &epilogue) {
+  constexpr int MR = Blocking<T>::MR;
+  constexpr int NR = Blocking<T>::NR;
+  constexpr int MC = Blocking<T>::MC;
+  constexpr int KC = Blocking<T>::KC;
+  constexpr int NC = Blocking<T>::NC;
+
+  const size_t panel_size = static_cast<size_t>(NC + NR) * KC;
+  const size_t block_size = static_cast<size_t>(MC + MR) * KC;
+
+  WorkspaceScope scratch;
+  T *panelB = scratch.allocate<T>(std::min(
+      panel_size, static_cast<size_t>(N + NR) * std::min(K, KC)));
+  T *sharedA = nullptr;
+
+  int threads = num_threads();
+  int row_blocks = (M + MC - 1) / MC;
+
+  for (int jc = 0; jc < N; jc += NC) {
+    int nc = std::min(NC, N - jc);
+    int col_panels = (nc + NR - 1) / NR;
+
+    for (int pc = 0; pc < K; pc += KC) {
+      int kc = std::min(KC, K - pc);
+      bool accumulate = pc > 0;
+
+      GemmEpilogue<T> tail = epilogue;
+      if (tail.bias)
+        tail.bias += jc;
+      const GemmEpilogue<T> *last_block = pc + kc == K ? &tail : nullptr;
+
+      parallel_for(0, col_panels, 16, [&](int first, int last) {
+        int j0 = first * NR;
+        int j1 = std::min(nc, last * NR);
+        pack_b(B, pc, jc + j0, kc, j1 - j0,
+               panelB + static_cast<size_t>(j0) * kc);
+      });
+
+      if (row_blocks >= threads) {
+        parallel_for(0, row_blocks, 1, [&](int first, int last) {
+          WorkspaceScope local;
+          T *blockA = local.allocate<T>(block_size);
+          for (int block = first; block < last; ++block) {
+            int ic = block * MC;
+            int mc = std::min(MC, M - ic);
+            pack_a(A, ic, pc, mc, kc, blockA);
+            macro_kernel(mc, nc, kc, blockA, panelB,
+                         C + static_cast<size_t>(ic) * ldc + jc, ldc,
+                         accumulate, last_block);
+          }
+        });
+        continue;
+      }
+
+      if (!sharedA)
+        sharedA = scratch.allocate<T>(block_size);
+      for (int ic = 0; ic < M; ic += MC) {
+        int mc = std::min(MC, M - ic);
+        pack_a(A, ic, pc, mc, kc, sharedA);
+        int grain = std::max(1, col_panels / (4 * threads));
+        parallel_for(0, col_panels, grain, [&](int first, int last) {
+          int j0 = first * NR;
+          int j1 = std::min(nc, last * NR);
+          GemmEpilogue<T> part = tail;
+          if (part.bias)
+            part.bias += j0;
+          macro_kernel(mc, j1 - j0, kc, sharedA,
+                       panelB + static_cast<size_t>(j0) * kc,
+                       C + static_cast<size_t>(ic) * ldc + jc + j0, ldc,
+                       accumulate, last_block ? &part : nullptr);
+        });
+      }
+    }
+  }
+}
+
+template <typename T>
+void gemm_impl(bool transA, bool transB, int M, int N, int K, const T *A,
+               int lda, const T *B, int ldb, T *C, int ldc,
+               const GemmEpilogue<T> &epilogue) {
+  if (M <= 0 || N <= 0)
+    return;
+  NN_PROFILE_SCOPE_COUNTS("gemm", 2.0 * M * N * K,
+                          sizeof(T) * (double(M) * K + double(K) * N +
+                                       double(M) * N));
+
+  if (K <= 0) {
+    for (int i = 0; i < M; ++i) {
+      T *c = C + static_cast<size_t>(i) * ldc;
+      for (int j = 0; j < N; ++j) {
+        T v = epilogue.bias ? epilogue.bias[j] : T(0);
+        c[j] = epilogue.relu ? std::max(v, T(0)) : v;
+      }
+    }
+    return;
+  }
+
+  Operand<T> a = transA ? Operand<T>{A, 1, lda} : Operand<T>{A, lda, 1};
+  Operand<T> b = transB ? Operand<T>{B, 1, ldb} : Operand<T>{B, ldb, 1};
+  gemm_blocked(M, N, K, a, b, C, ldc, epilogue);
+}
+
+} // namespace
+
+void gemm(bool transA, bool transB, int M, int N, int K, const double *A,
+          int lda, const double *B, int ldb, double *C, int ldc,
+          const GemmEpilogue<double> &epilogue) {
+  gemm_impl(transA, transB, M, N, K, A, lda, B, ldb, C, ldc, epilogue);
+}
+
+void gemm(bool transA, bool transB, int M, int N, int K, const float *A,
+          int lda, const float *B, int ldb, float *C, int ldc,
+          const GemmEpilogue<float> &epilogue) {
+  gemm_impl(transA, transB, M, N, K, A, lda, B, ldb, C, ldc, epilogue);
+}
@@ -0,0 +1,378 @@
+#include "../include/inference_server.hpp"
+#include "flat_matrix.hpp"
+#include "profiler.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <stdexcept>
+#include <utility>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+bool read_all(int fd, void *data, std::size_t bytes) {
+    char *p = static_cast<char *>(data);
+    while (bytes > 0) {
+        ssize_t n = ::read(fd, p, bytes);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        bytes -= static_cast<std::size_t>(n);
+    }
+    return true;
+}
+
+bool write_all(int fd, const void *data, std::size_t bytes) {
+    const char *p = static_cast<const char *>(data);
+    while (bytes > 0) {
+        ssize_t n = ::send(fd, p, bytes, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        bytes -= static_cast<std::size_t>(n);
+    }
+    return true;
+}
+
+sockaddr_un socket_address(const std::string &path) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+        throw std::invalid_argument("InferenceServer: socket path is too long");
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return addr;
+}
+
+} // namespace
+
+template <typename T>
+BasicInferenceServer<T>::BasicInferenceServer(BasicSequential<T> &model,
+                                              int n_inputs,
+                                              const ServerOptions &options)
+    : m_model(model), m_inputs(n_inputs), m_options(options) {
+    if (n_inputs <= 0 || options.max_batch <= 0 || options.max_wait_us < 0 ||
+        options.latency_window <= 0) {
+        throw std::invalid_argument(
+            "InferenceServer: n_inputs, max_batch and latency_window have to "
+            "be positive and max_wait_us not negative");
+    }
+
+    m_batch.resize(options.max_batch, n_inputs);
+    m_latencies.reserve(options.latency_window);
+    m_stats_start = Clock::now();
+    m_batcher = std::thread(&BasicInferenceServer::batch_loop, this);
+}
+
+template <typename T> BasicInferenceServer<T>::~BasicInferenceServer() {
+    stop();
+}
+
+template <typename T>
+std::future<std::vector<T>>
+BasicInferenceServer<T>::submit(std::vector<T> features) {
+    if (static_cast<int>(features.size()) != m_inputs) {
+        throw std::invalid_argument(
+            "InferenceServer submit: features.size and n_inputs have to "
+            "match!");
+    }
+
+    Request request;
+    request.features = std::move(features);
+    request.enqueued = Clock::now();
+    std::future<std::vector<T>> result = request.result.get_future();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_stop)
+            throw std::runtime_error(
+                "InferenceServer submit: server is stopped");
+        m_queue.push_back(std::move(request));
+    }
+    m_ready.notify_one();
+    return result;
+}
+
+template <typename T>
+std::vector<T> BasicInferenceServer<T>::predict(std::vector<T> features) {
+    return submit(std::move(features)).get();
+}
+
+template <typename T> void BasicInferenceServer<T>::batch_loop() {
+    std::vector<Request> batch;
+    batch.reserve(m_options.max_batch);
+    const auto max_wait = std::chrono::microseconds(m_options.max_wait_us);
+    const std::size_t max_batch = m_options.max_batch;
+
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_ready.wait(lock, [&] { return m_stop || !m_queue.empty(); });
+            if (m_queue.empty())
+                return; // stopped and drained
+
+            // The oldest request sets the deadline; later ones only shorten
+            // the wait by filling the batch.
+            Clock::time_point deadline = m_queue.front().enqueued + max_wait;
+            m_ready.wait_until(lock, deadline, [&] {
+                return m_stop || m_queue.size() >= max_batch;
+            });
+
+            std::size_t take = std::min(max_batch, m_queue.size());
+            for (std::size_t i = 0; i < take; ++i) {
+                batch.push_back(std::move(m_queue.front()));
+                m_queue.pop_front();
+            }
+        }
+
+        run_batch(batch);
+        batch.clear();
+    }
+}
+
+template <typename T>
+void BasicInferenceServer<T>::run_batch(std::vector<Request> &batch) {
+    NN_PROFILE_SCOPE("InferenceServer::batch");
+    int rows = static_cast<int>(batch.size());
+
+    std::exception_ptr error;
+    const BasicFlatMatrix<T> *logits = nullptr;
+    try {
+        m_batch.resize(rows, m_inputs);
+        for (int i = 0; i < rows; ++i)
+            std::copy(batch[i].features.begin(), batch[i].features.end(),
+                      m_batch.row(i));
+        logits = &m_model.predict(m_batch);
+    } catch (...) {
+        error = std::current_exception();
+    }
+
+    // Statistics are recorded before any caller is released, so stats() read
+    // after the last predict() returned always includes it.
+    Clock::time_point done = Clock::now();
+    {
+        std::lock_guard<std::mutex> lock(m_stats_mutex);
+        for (const Request &request : batch) {
+            double us = std::chrono::duration<double, std::micro>(
+                            done - request.enqueued)
+                            .count();
+            if (m_latencies.size() <
+                static_cast<std::size_t>(m_options.latency_window))
+                m_latencies.push_back(us);
+            else
+                m_latencies[m_latency_next] = us;
+            m_latency_next = (m_latency_next + 1) % m_options.latency_window;
+        }
+        m_requests += batch.size();
+        ++m_batches;
+    }
+
+    if (error) {
+        for (Request &request : batch)
+            request.result.set_exception(error);
+        return;
+    }
+
+    const BasicFlatMatrix<T> &out = *logits;
+    for (int i = 0; i < rows; ++i)
+        batch[i].result.set_value(
+            std::vector<T>(out.row(i), out.row(i) + out.cols()));
+}
+
+template <typename T>
+void BasicInferenceServer<T>::serve_unix(const std::string &path) {
+    if (m_listen_fd >= 0)
+        throw std::runtime_error("InferenceServer: already serving a socket");
+
+    sockaddr_un addr = socket_address(path);
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        throw std::runtime_error("InferenceServer: socket() failed");
+
+    ::unlink(path.c_str());
+    if (::bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+        ::listen(fd, 128) != 0) {
+        ::close(fd);
+        throw std::runtime_error("InferenceServer: cannot listen on " + path);
+    }
+
+    m_socket_path = path;
+    m_listen_fd = fd;
+    m_acceptor = std::thread(&BasicInferenceServer::accept_loop, this);
+}
+
+template <typename T> void BasicInferenceServer<T>::accept_loop() {
+    for (;;) {
+        int fd = ::accept(m_listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            return; // listening socket shut down by stop()
+        }
+
+        std::lock_guard<std::mutex> lock(m_connections_mutex);
+        for (auto it = m_connections.begin(); it != m_connections.end();) {
+            if (it->done) {
+                it->thread.join();
+                it = m_connections.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        Connection &connection = m_connections.emplace_back(fd);
+        connection.thread =
+            std::thread(&BasicInferenceServer::serve_connection, this,
+                        std::ref(connection));
+    }
+}
+
+template <typename T>
+void BasicInferenceServer<T>::serve_connection(Connection &connection) {
+    const int fd = connection.fd;
+    std::vector<T> features;
+    for (;;) {
+        std::uint32_t count;
+        if (!read_all(fd, &count, sizeof(count)))
+            break;
+
+        std::uint32_t reply_count = 0;
+        std::vector<T> result;
+        if (count == static_cast<std::uint32_t>(m_inputs)) {
+            features.resize(count);
+            if (!read_all(fd, features.data(), sizeof(T) * count))
+                break;
+            try {
+                result = predict(features);
+                reply_count = static_cast<std::uint32_t>(result.size());
+            } catch (const std::exception &) {
+                reply_count = 0;
+            }
+        } else {
+            // The stream cannot be resynchronised after a bad count.
+            write_all(fd, &reply_count, sizeof(reply_count));
+            break;
+        }
+
+        if (!write_all(fd, &reply_count, sizeof(reply_count)) ||
+            !write_all(fd, result.data(), sizeof(T) * reply_count))
+            break;
+    }
+
+    // Under the lock, so stop() never shuts down an fd number that has been
+    // closed and reused.
+    std::lock_guard<std::mutex> lock(m_connections_mutex);
+    ::close(fd);
+    connection.fd = -1;
+    connection.done = true;
+}
+
+template <typename T> void BasicInferenceServer<T>::stop() {
+    if (m_listen_fd >= 0) {
+        ::shutdown(m_listen_fd, SHUT_RDWR);
+        m_acceptor.join();
+        ::close(m_listen_fd);
+        ::unlink(m_socket_path.c_str());
+        m_listen_fd = -1;
+
+        // Wake connections blocked in read(); their threads then close their
+        // fds and finish. The acceptor is gone, so the list no longer grows.
+        {
+            std::lock_guard<std::mutex> lock(m_connections_mutex);
+            for (const Connection &connection : m_connections) {
+                if (connection.fd >= 0)
+                    ::shutdown(connection.fd, SHUT_RDWR);
+            }
+        }
+        for (Connection &connection : m_connections)
+            connection.thread.join();
+        m_connections.clear();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_ready.notify_all();
+    if (m_batcher.joinable())
+        m_batcher.join();
+}
+
+template <typename T> ServerStats BasicInferenceServer<T>::stats() const {
+    std::lock_guard<std::mutex> lock(m_stats_mutex);
+
+    ServerStats s{};
+    s.requests = m_requests;
+    s.batches = m_batches;
+    s.mean_batch =
+        m_batches ? static_cast<double>(m_requests) / m_batches : 0;
+    double seconds =
+        std::chrono::duration<double>(Clock::now() - m_stats_start).count();
+    s.throughput = seconds > 0 ? m_requests / seconds : 0.0;
+
+    if (!m_latencies.empty()) {
+        std::vector<double> sorted = m_latencies;
+        std::sort(sorted.begin(), sorted.end());
+        auto at = [&](double q) {
+            return sorted[static_cast<std::size_t>(q * (sorted.size() - 1))];
+        };
+        s.p50_us = at(0.50);
+        s.p99_us = at(0.99);
+        s.max_us = sorted.back();
+    }
+    return s;
+}
+
+template <typename T> void BasicInferenceServer<T>::reset_stats() {
+    std::lock_guard<std::mutex> lock(m_stats_mutex);
+    m_latencies.clear();
+    m_latency_next = 0;
+    m_requests = 0;
+    m_batches = 0;
+    m_stats_start = Clock::now();
+}
+
+template <typename T>
+BasicInferenceClient<T>::BasicInferenceClient(const std::string &path) {
+    sockaddr_un addr = socket_address(path);
+    m_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (m_fd < 0 || ::connect(m_fd, reinterpret_cast<sockaddr *>(&addr),
+                              sizeof(addr)) != 0) {
+        if (m_fd >= 0)
+            ::close(m_fd);
+        throw std::runtime_error("InferenceClient: cannot connect to " + path);
+    }
+}
+
+template <typename T> BasicInferenceClient<T>::~BasicInferenceClient() {
+    ::close(m_fd);
+}
+
+template <typename T>
+std::vector<T>
+BasicInferenceClient<T>::predict(const std::vector<T> &features) {
+    std::uint32_t count = static_cast<std::uint32_t>(features.size());
+    if (!write_all(m_fd, &count, sizeof(count)) ||
+        !write_all(m_fd, features.data(), sizeof(T) * count) ||
+        !read_all(m_fd, &count, sizeof(count))) {
+        throw std::runtime_error("InferenceClient predict: connection lost");
+    }
+    if (count == 0)
+        throw std::runtime_error("InferenceClient predict: request rejected");
+
+    std::vector<T> result(count);
+    if (!read_all(m_fd, result.data(), sizeof(T) * count))
+        throw std::runtime_error("InferenceClient predict: connection lost");
+    return result;
+}
+
+template class BasicInferenceServer<float>;
+template class BasicInferenceServer<double>;
+template class BasicInferenceClient<float>;
+template class BasicInferenceClient<double>;
@@ -1,48 +1,176 @@
 
 #include "layer_dense.hpp"
 #include "flat_matrix.hpp"
+#include "gemm.hpp"
 #include "utils.hpp"
+#include "profiler.hpp"
 #include <stdexcept>
+#include <utility>
 #include <vector>
 
-LayerDense::LayerDense(int n_inputs, int n_neurons)
-    : weights(randn_matrix(n_inputs, n_neurons, 0.0, 0.01)),
-      biases(std::vector<double>(n_neurons, 0.0)), inputs(0, n_inputs),
-      output(0, n_neurons), dinputs(0, n_inputs), dweights(0, n_neurons),
-      dbiases(n_neurons, 0.0) {}
+template <typename T>
+BasicLayerDense<T>::BasicLayerDense(int n_inputs, int n_neurons)
+    : weights(randn_matrix<T>(n_inputs, n_neurons, 0.0, 0.01)),
+      biases(std::vector<T>(n_neurons, T(0))), dweights(0, n_neurons),
+      dbiases(n_neurons, T(0)), inputs(0, n_inputs) {}
 
-void LayerDense::forward(const FlatMatrix &Inputs) {
+template <typename T>
+BasicLayerDense<T>::BasicLayerDense(int n_inputs, int n_neurons,
+                                    WeightInit init, std::uint64_t seed,
+                                    std::uint64_t layer)
+    : BasicLayerDense(init_weights<T>(n_inputs, n_neurons, init, seed, layer),
+                      std::vector<T>(n_neurons, T(0))) {}
+
+template <typename T>
+BasicLayerDense<T>::BasicLayerDense(BasicFlatMatrix<T> w, std::vector<T> b)
+    : weights(std::move(w)), biases(std::move(b)),
+      dweights(0, this->weights.cols()), dbiases(this->weights.cols(), T(0)),
+      inputs(0, this->weights.rows()) {
+  if (static_cast<int>(biases.size()) != weights.cols()) {
+    throw std::invalid_argument(
+        "LayerDense: biases.size and weights.cols have to match!");
+  }
+}
+
+template <typename T>
+void BasicLayerDense<T>::forward(const BasicFlatMatrix<T> &Inputs) {
+  NN_PROFILE_SCOPE_COUNTS(
+      "LayerDense::forward",
+      2.0 * Inputs.rows() * weights.rows() * weights.cols(),
+      sizeof(T) * (2.0 * Inputs.rows() * Inputs.cols() +
+                   double(weights.rows()) * weights.cols() +
+                   double(Inputs.rows()) * weights.cols()));
+  if (Inputs.cols() != weights.rows()) {
+    throw std::invalid_argument(
+        "LayerDense forward: input.cols and weights.rows have to match!");
+  }
+
+  keep_inputs(Inputs);
+  affine_into(Inputs, this->output, false);
+}
+
+template <typename T>
+void BasicLayerDense<T>::forward_into(const BasicFlatMatrix<T> &Inputs,
+                                      BasicFlatMatrix<T> &out) {
   if (Inputs.cols() != weights.rows()) {
     throw std::invalid_argument(
         "LayerDense forward: input.cols and weights.rows have to match!");
+  } else if (&Inputs == &out) {
+    throw std::invalid_argument(
+        "LayerDense forward_into: out has to differ from the inputs!");
   }
+  affine_into(Inputs, out, false);
+}
 
-  this->inputs = Inputs;
+template <typename T>
+void BasicLayerDense<T>::affine_into(const BasicFlatMatrix<T> &Inputs,
+                                     BasicFlatMatrix<T> &out,
+                                     bool relu) const {
+  int R = Inputs.rows();
+  int C = weights.cols();
+  int K = weights.rows();
 
-  output = matmul(inputs, weights);
+  GemmEpilogue<T> epilogue;
+  epilogue.bias = biases.data();
+  epilogue.relu = relu;
+
+  out.resize(R, C);
+  gemm(false, false, R, C, K, Inputs.data(), Inputs.stride(), weights.data(),
+       weights.stride(), out.data(), out.stride(), epilogue);
+}
+
+template <typename T>
+void BasicLayerDense<T>::keep_inputs(const BasicFlatMatrix<T> &Inputs) {
+  if (grad_enabled())
+    inputs = Inputs;
+  else
+    inputs.resize(0, Inputs.cols());
+  inputs_kept = grad_enabled();
+  sparse_forward = false;
+}
 
-  for (int i = 0; i < output.rows(); ++i) {
-    for (int j = 0; j < output.cols(); ++j) {
-      double currentValue = output.get(i, j);
-      output.set(i, j, currentValue + biases[j]);
-    }
+template <typename T>
+void BasicLayerDense<T>::keep_inputs(const BasicCsrMatrix<T> &Inputs) {
+  if (grad_enabled()) {
+    // Indexed on the caller's batch, so a batch fed again is not re-sorted.
+    Inputs.column_index();
+    sparse_inputs = Inputs;
+  } else {
+    sparse_inputs.clear(Inputs.cols());
   }
+  inputs_kept = grad_enabled();
+  sparse_forward = true;
 }
 
-void LayerDense::backward(const FlatMatrix &dvalues) {
-  if (dvalues.cols() != weights.cols()) {
+template <typename T>
+void BasicLayerDense<T>::forward(const BasicCsrMatrix<T> &Inputs) {
+  NN_PROFILE_SCOPE_COUNTS(
+      "LayerDense::forward_sparse", 2.0 * Inputs.nnz() * weights.cols(),
+      sizeof(T) * (double(Inputs.nnz()) * weights.cols() +
+                   double(Inputs.rows()) * weights.cols()));
+  if (Inputs.cols() != weights.rows()) {
+    throw std::invalid_argument(
+        "LayerDense forward: input.cols and weights.rows have to match!");
+  }
+
+  keep_inputs(Inputs);
+
+  GemmEpilogue<T> epilogue;
+  epilogue.bias = biases.data();
+  spmm_into(Inputs, weights, this->output, epilogue);
+}
+
+template <typename T> bool BasicLayerDense<T>::has_sparse_dweights() const {
+  return sparse_forward && sparse_gradients;
+}
+
+template <typename T> int BasicLayerDense<T>::input_rows() const {
+  return sparse_forward ? sparse_inputs.rows() : inputs.rows();
+}
+
+template <typename T>
+void BasicLayerDense<T>::weight_gradients(const BasicFlatMatrix<T> &dvalues) {
+  if (!sparse_forward)
+    matmul_tn_into(inputs, dvalues, dweights);
+  else if (sparse_gradients)
+    spmm_tn_into(sparse_inputs, dvalues, sparse_dweights);
+  else
+    spmm_tn_into(sparse_inputs, dvalues, dweights);
+}
+
+template <typename T>
+void BasicLayerDense<T>::input_gradients(const BasicFlatMatrix<T> &dvalues) {
+  if (sparse_forward)
+    this->dinputs.resize(0, weights.rows());
+  else
+    matmul_nt_into(dvalues, weights, this->dinputs);
+}
+
+template <typename T>
+void BasicLayerDense<T>::backward(const BasicFlatMatrix<T> &dvalues) {
+  NN_PROFILE_SCOPE_COUNTS(
+      "LayerDense::backward",
+      4.0 * dvalues.rows() * weights.rows() * weights.cols(),
+      2.0 * sizeof(T) *
+          (double(inputs.rows()) * inputs.cols() +
+           double(weights.rows()) * weights.cols() +
+           double(dvalues.rows()) * dvalues.cols()));
+  if (!inputs_kept) {
+    throw std::logic_error(
+        "LayerDense backward: forward ran under NoGradGuard");
+  } else if (dvalues.cols() != weights.cols()) {
     throw std::invalid_argument(
         "LayerDense backward: dvalues.cols and weights.cols have to match!");
-  } else if (dvalues.rows() != inputs.rows()) {
+  } else if (dvalues.rows() != input_rows()) {
     throw std::invalid_argument(
         "LayerDense backward: dvalues.rows and inputs.rows have to match!");
   }
 
-  FlatMatrix Tinputs = transpose(inputs);
+  weight_gradients(dvalues);
+  sum_cols_into(dvalues, dbiases);
 
-  dweights = matmul(Tinputs, dvalues);
-  dbiases = sum_cols(dvalues);
+  input_gradients(dvalues);
+}
 
-  FlatMatrix Tweights = transpose(weights);
-  dinputs = matmul(dvalues, Tweights);
-}
\ No newline at end of file
+template class BasicLayerDense<float>;
+template class BasicLayerDense<double>;
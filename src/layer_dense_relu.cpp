@@ -0,0 +1,142 @@
+#include "layer_dense_relu.hpp"
+#include "flat_matrix.hpp"
+#include "gemm.hpp"
+#include "thread_pool.hpp"
+#include "workspace.hpp"
+#include "profiler.hpp"
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+
+template <typename T>
+BasicLayerDenseReLU<T>::BasicLayerDenseReLU(int n_inputs, int n_neurons)
+    : BasicLayerDense<T>(n_inputs, n_neurons), dmasked(0, n_neurons) {}
+
+template <typename T>
+BasicLayerDenseReLU<T>::BasicLayerDenseReLU(int n_inputs, int n_neurons,
+                                            WeightInit init, std::uint64_t seed,
+                                            std::uint64_t layer)
+    : BasicLayerDense<T>(n_inputs, n_neurons, init, seed, layer),
+      dmasked(0, n_neurons) {}
+
+template <typename T>
+BasicLayerDenseReLU<T>::BasicLayerDenseReLU(BasicFlatMatrix<T> weights,
+                                            std::vector<T> biases)
+    : BasicLayerDense<T>(std::move(weights), std::move(biases)),
+      dmasked(0, this->weights.cols()) {}
+
+template <typename T>
+void BasicLayerDenseReLU<T>::forward(const BasicFlatMatrix<T> &Inputs) {
+  NN_PROFILE_SCOPE_COUNTS(
+      "LayerDenseReLU::forward",
+      2.0 * Inputs.rows() * this->weights.rows() * this->weights.cols(),
+      sizeof(T) * (2.0 * Inputs.rows() * Inputs.cols() +
+                   double(this->weights.rows()) * this->weights.cols() +
+                   double(Inputs.rows()) * this->weights.cols()));
+  if (Inputs.cols() != this->weights.rows()) {
+    throw std::invalid_argument(
+        "LayerDenseReLU forward: input.cols and weights.rows have to match!");
+  }
+
+  this->keep_inputs(Inputs);
+  this->affine_into(Inputs, this->output, true);
+}
+
+template <typename T>
+void BasicLayerDenseReLU<T>::forward_into(const BasicFlatMatrix<T> &Inputs,
+                                          BasicFlatMatrix<T> &out) {
+  if (Inputs.cols() != this->weights.rows()) {
+    throw std::invalid_argument(
+        "LayerDenseReLU forward: input.cols and weights.rows have to match!");
+  } else if (&Inputs == &out) {
+    throw std::invalid_argument(
+        "LayerDenseReLU forward_into: out has to differ from the inputs!");
+  }
+  this->affine_into(Inputs, out, true);
+}
+
+template <typename T>
+void BasicLayerDenseReLU<T>::forward(const BasicCsrMatrix<T> &Inputs) {
+  NN_PROFILE_SCOPE_COUNTS(
+      "LayerDenseReLU::forward_sparse",
+      2.0 * Inputs.nnz() * this->weights.cols(),
+      sizeof(T) * (double(Inputs.nnz()) * this->weights.cols() +
+                   double(Inputs.rows()) * this->weights.cols()));
+  if (Inputs.cols() != this->weights.rows()) {
+    throw std::invalid_argument(
+        "LayerDenseReLU forward: input.cols and weights.rows have to match!");
+  }
+
+  this->keep_inputs(Inputs);
+
+  GemmEpilogue<T> epilogue;
+  epilogue.bias = this->biases.data();
+  epilogue.relu = true;
+  spmm_into(Inputs, this->weights, this->output, epilogue);
+}
+
+template <typename T>
+void BasicLayerDenseReLU<T>::backward(const BasicFlatMatrix<T> &dvalues) {
+  NN_PROFILE_SCOPE_COUNTS(
+      "LayerDenseReLU::backward",
+      4.0 * dvalues.rows() * this->weights.rows() * this->weights.cols(),
+      2.0 * sizeof(T) *
+          (double(this->inputs.rows()) * this->inputs.cols() +
+           double(this->weights.rows()) * this->weights.cols() +
+           double(dvalues.rows()) * dvalues.cols()));
+  if (!this->inputs_kept) {
+    throw std::logic_error(
+        "LayerDenseReLU backward: forward ran under NoGradGuard");
+  } else if (dvalues.cols() != this->weights.cols()) {
+    throw std::invalid_argument(
+        "LayerDenseReLU backward: dvalues.cols and weights.cols have to "
+        "match!");
+  } else if (dvalues.rows() != this->output.rows()) {
+    throw std::invalid_argument(
+        "LayerDenseReLU backward: dvalues.rows and output.rows have to "
+        "match!");
+  }
+
+  int R = dvalues.rows();
+  int C = dvalues.cols();
+
+  // One sweep applies the ReLU mask and accumulates the bias gradient, in
+  // per-chunk partials combined in chunk order like sum_cols.
+  dmasked.resize(R, C);
+
+  int chunks = reduction_chunks(R, 64);
+  int rows_per_chunk = (R + chunks - 1) / chunks;
+  WorkspaceScope scratch;
+  T *partial = scratch.allocate<T>(static_cast<size_t>(chunks) * C);
+  std::fill(partial, partial + static_cast<size_t>(chunks) * C, T(0));
+
+  parallel_for(0, chunks, 1, [&](int first, int last) {
+    for (int c = first; c < last; ++c) {
+      T *bias_sums = partial + static_cast<size_t>(c) * C;
+      int i_end = std::min(R, (c + 1) * rows_per_chunk);
+      for (int i = c * rows_per_chunk; i < i_end; ++i) {
+        const T *out = this->output.row(i);
+        const T *dval = dvalues.row(i);
+        T *masked = dmasked.row(i);
+        for (int j = 0; j < C; ++j) {
+          T d = out[j] > T(0) ? dval[j] : T(0);
+          masked[j] = d;
+          bias_sums[j] += d;
+        }
+      }
+    }
+  });
+
+  this->dbiases.assign(C, T(0));
+  for (int c = 0; c < chunks; ++c) {
+    for (int j = 0; j < C; ++j) {
+      this->dbiases[j] += partial[static_cast<size_t>(c) * C + j];
+    }
+  }
+
+  this->weight_gradients(dmasked);
+  this->input_gradients(dmasked);
+}
+
+template class BasicLayerDenseReLU<float>;
+template class BasicLayerDenseReLU<double>;
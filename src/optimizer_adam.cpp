@@ -0,0 +1,136 @@
+#include "../include/optimizer_adam.hpp"
+#include "optimizer_detail.hpp"
+#include "thread_pool.hpp"
+#include "profiler.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cmath>
+#include <stdexcept>
+
+namespace {
+
+constexpr int GRAIN = 4096;
+
+} // namespace
+
+template <typename T>
+BasicOptimizerAdam<T>::BasicOptimizerAdam(double learning_rate, double decay,
+                                          double epsilon, double beta_1,
+                                          double beta_2, double weight_decay)
+    : learning_rate(learning_rate), current_learning_rate(learning_rate),
+      decay(decay), epsilon(epsilon), beta_1(beta_1), beta_2(beta_2),
+      weight_decay(weight_decay), iterations(0) {}
+
+template <typename T> void BasicOptimizerAdam<T>::pre_update_params() {
+  if (decay != 0.0)
+    current_learning_rate = learning_rate / (1.0 + decay * iterations);
+}
+
+template <typename T>
+void BasicOptimizerAdam<T>::update_params(BasicLayerDense<T> &layer) {
+  NN_PROFILE_SCOPE_COUNTS(
+      "OptimizerAdam::update_params",
+      14.0 * (double(layer.weights.rows()) * layer.weights.cols() +
+              layer.biases.size()),
+      7.0 * sizeof(T) *
+          (double(layer.weights.rows()) * layer.weights.cols() +
+           layer.biases.size()));
+  if (!optimizer_detail::gradients_match(layer)) {
+    throw std::invalid_argument(
+        "OptimizerAdam update_params: gradients and parameters have to "
+        "match, call backward first!");
+  }
+
+  optimizer_detail::zeroed_like(layer.weight_momentums, layer.weights);
+  optimizer_detail::zeroed_like(layer.bias_momentums, layer.biases);
+  optimizer_detail::zeroed_like(layer.weight_cache, layer.weights);
+  optimizer_detail::zeroed_like(layer.bias_cache, layer.biases);
+
+  // The bias corrections only depend on the step count, so they are folded
+  // into two scalars instead of dividing every moment.
+  int t = iterations + 1;
+  const T b1 = static_cast<T>(beta_1);
+  const T b2 = static_cast<T>(beta_2);
+  const T m_scale = static_cast<T>(1.0 / (1.0 - std::pow(beta_1, t)));
+  const T v_scale = static_cast<T>(1.0 / (1.0 - std::pow(beta_2, t)));
+  const T lr = static_cast<T>(current_learning_rate);
+  const T eps = static_cast<T>(epsilon);
+  const T shrink = static_cast<T>(1.0 - current_learning_rate * weight_decay);
+
+  auto step = [&](T *param, const T *grad, T *m, T *v, std::size_t first,
+                  std::size_t last, bool decoupled) {
+    for (std::size_t i = first; i < last; ++i) {
+      T g = grad[i];
+      T mi = b1 * m[i] + (T(1) - b1) * g;
+      T vi = b2 * v[i] + (T(1) - b2) * g * g;
+      m[i] = mi;
+      v[i] = vi;
+      T p = decoupled ? param[i] * shrink : param[i];
+      param[i] = p - lr * (mi * m_scale) / (std::sqrt(vi * v_scale) + eps);
+    }
+  };
+
+  std::size_t n_weights =
+      static_cast<std::size_t>(layer.weights.rows()) * layer.weights.cols();
+  std::size_t n_biases = layer.biases.size();
+  bool decoupled = weight_decay != 0.0;
+
+  if (layer.has_sparse_dweights()) {
+    // Lazy Adam: only the rows with a gradient move, and only their
+    // moments decay. The bias correction still follows the global step.
+    const BasicSparseRowGradient<T> &g = layer.sparse_dweights;
+    int C = layer.weights.cols();
+    int rows = static_cast<int>(g.rows.size());
+    parallel_for(0, rows, std::max(1, GRAIN / C), [&](int first, int last) {
+      for (int s = first; s < last; ++s) {
+        int r = g.rows[s];
+        step(layer.weights.row(r), g.values.row(s),
+             layer.weight_momentums.row(r), layer.weight_cache.row(r), 0, C,
+             decoupled);
+      }
+    });
+    step(layer.biases.data(), layer.dbiases.data(), layer.bias_momentums.data(),
+         layer.bias_cache.data(), 0, n_biases, false);
+    return;
+  }
+
+  if (!optimizer_detail::packed(layer)) {
+    int C = layer.weights.cols();
+    parallel_for(0, layer.weights.rows(), std::max(1, GRAIN / C),
+                 [&](int first, int last) {
+                   for (int r = first; r < last; ++r) {
+                     step(layer.weights.row(r), layer.dweights.row(r),
+                          layer.weight_momentums.row(r),
+                          layer.weight_cache.row(r), 0, C, decoupled);
+                   }
+                 });
+    step(layer.biases.data(), layer.dbiases.data(), layer.bias_momentums.data(),
+         layer.bias_cache.data(), 0, n_biases, false);
+    return;
+  }
+
+  // parallel_for counts in int, so it splits chunks of GRAIN parameters and
+  // the parameter indices stay size_t.
+  std::size_t n = n_weights + n_biases;
+  int chunks = static_cast<int>((n + GRAIN - 1) / GRAIN);
+  parallel_for(0, chunks, 1, [&](int first_chunk, int last_chunk) {
+    std::size_t first = static_cast<std::size_t>(first_chunk) * GRAIN;
+    std::size_t last =
+        std::min(n, static_cast<std::size_t>(last_chunk) * GRAIN);
+    if (first < n_weights)
+      step(layer.weights.data(), layer.dweights.data(),
+           layer.weight_momentums.data(), layer.weight_cache.data(), first,
+           std::min(last, n_weights), decoupled);
+    if (last > n_weights)
+      step(layer.biases.data(), layer.dbiases.data(),
+           layer.bias_momentums.data(), layer.bias_cache.data(),
+           std::max(first, n_weights) - n_weights, last - n_weights, false);
+  });
+}
+
+template <typename T> void BasicOptimizerAdam<T>::post_update_params() {
+  ++iterations;
+}
+
+template class BasicOptimizerAdam<float>;
+template class BasicOptimizerAdam<double>;
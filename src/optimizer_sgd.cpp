@@ -0,0 +1,133 @@
+#include "../include/optimizer_sgd.hpp"
+#include "optimizer_detail.hpp"
+#include "thread_pool.hpp"
+#include "profiler.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <stdexcept>
+
+namespace {
+
+constexpr int GRAIN = 4096;
+
+} // namespace
+
+template <typename T>
+BasicOptimizerSGD<T>::BasicOptimizerSGD(double learning_rate, double decay,
+                                        double momentum, bool nesterov)
+    : learning_rate(learning_rate), current_learning_rate(learning_rate),
+      decay(decay), momentum(momentum), nesterov(nesterov), iterations(0) {}
+
+template <typename T> void BasicOptimizerSGD<T>::pre_update_params() {
+  if (decay != 0.0)
+    current_learning_rate = learning_rate / (1.0 + decay * iterations);
+}
+
+template <typename T>
+void BasicOptimizerSGD<T>::update_params(BasicLayerDense<T> &layer) {
+  NN_PROFILE_SCOPE_COUNTS(
+      "OptimizerSGD::update_params",
+      3.0 * (double(layer.weights.rows()) * layer.weights.cols() +
+             layer.biases.size()),
+      5.0 * sizeof(T) *
+          (double(layer.weights.rows()) * layer.weights.cols() +
+           layer.biases.size()));
+  if (!optimizer_detail::gradients_match(layer)) {
+    throw std::invalid_argument(
+        "OptimizerSGD update_params: gradients and parameters have to match, "
+        "call backward first!");
+  }
+
+  const T lr = static_cast<T>(current_learning_rate);
+  const T mu = static_cast<T>(momentum);
+
+  std::size_t n_weights =
+      static_cast<std::size_t>(layer.weights.rows()) * layer.weights.cols();
+  std::size_t n_biases = layer.biases.size();
+
+  if (momentum != 0.0) {
+    optimizer_detail::zeroed_like(layer.weight_momentums, layer.weights);
+    optimizer_detail::zeroed_like(layer.bias_momentums, layer.biases);
+  }
+
+  // Weights and biases form one index range so a single parallel pass
+  // covers every parameter; each chunk splits at the weights/biases seam.
+  auto step = [&](T *param, const T *grad, T *velocity, std::size_t first,
+                  std::size_t last) {
+    if (momentum == 0.0) {
+      for (std::size_t i = first; i < last; ++i)
+        param[i] -= lr * grad[i];
+    } else if (nesterov) {
+      for (std::size_t i = first; i < last; ++i) {
+        T v = mu * velocity[i] - lr * grad[i];
+        velocity[i] = v;
+        param[i] += mu * v - lr * grad[i];
+      }
+    } else {
+      for (std::size_t i = first; i < last; ++i) {
+        T v = mu * velocity[i] - lr * grad[i];
+        velocity[i] = v;
+        param[i] += v;
+      }
+    }
+  };
+
+  if (layer.has_sparse_dweights()) {
+    // Rows without a gradient are left alone, including their velocity.
+    const BasicSparseRowGradient<T> &g = layer.sparse_dweights;
+    int C = layer.weights.cols();
+    int rows = static_cast<int>(g.rows.size());
+    parallel_for(0, rows, std::max(1, GRAIN / C), [&](int first, int last) {
+      for (int s = first; s < last; ++s) {
+        int r = g.rows[s];
+        T *velocity =
+            momentum != 0.0 ? layer.weight_momentums.row(r) : nullptr;
+        step(layer.weights.row(r), g.values.row(s), velocity, 0, C);
+      }
+    });
+    step(layer.biases.data(), layer.dbiases.data(),
+         layer.bias_momentums.data(), 0, n_biases);
+    return;
+  }
+
+  if (!optimizer_detail::packed(layer)) {
+    int C = layer.weights.cols();
+    parallel_for(0, layer.weights.rows(), std::max(1, GRAIN / C),
+                 [&](int first, int last) {
+                   for (int r = first; r < last; ++r) {
+                     T *velocity = momentum != 0.0
+                                       ? layer.weight_momentums.row(r)
+                                       : nullptr;
+                     step(layer.weights.row(r), layer.dweights.row(r),
+                          velocity, 0, C);
+                   }
+                 });
+    step(layer.biases.data(), layer.dbiases.data(),
+         layer.bias_momentums.data(), 0, n_biases);
+    return;
+  }
+
+  // parallel_for counts in int, so it splits chunks of GRAIN parameters and
+  // the parameter indices stay size_t.
+  std::size_t n = n_weights + n_biases;
+  int chunks = static_cast<int>((n + GRAIN - 1) / GRAIN);
+  parallel_for(0, chunks, 1, [&](int first_chunk, int last_chunk) {
+    std::size_t first = static_cast<std::size_t>(first_chunk) * GRAIN;
+    std::size_t last =
+        std::min(n, static_cast<std::size_t>(last_chunk) * GRAIN);
+    if (first < n_weights)
+      step(layer.weights.data(), layer.dweights.data(),
+           layer.weight_momentums.data(), first, std::min(last, n_weights));
+    if (last > n_weights)
+      step(layer.biases.data(), layer.dbiases.data(),
+           layer.bias_momentums.data(), std::max(first, n_weights) - n_weights,
+           last - n_weights);
+  });
+}
+
+template <typename T> void BasicOptimizerSGD<T>::post_update_params() {
+  ++iterations;
+}
+
+template class BasicOptimizerSGD<float>;
+template class BasicOptimizerSGD<double>;
@@ -0,0 +1,206 @@
+#include "../include/profiler.hpp"
+#include "workspace.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace {
+
+struct Event {
+  const char *name;
+  std::uint64_t start;
+  std::uint64_t duration;
+  double flops;
+  double bytes;
+};
+
+struct ThreadLog {
+  int tid;
+  std::vector<Event> events;
+  std::unordered_map<const char *, ProfileStat> stats;
+};
+
+struct Registry {
+  std::mutex mutex;
+  std::vector<std::unique_ptr<ThreadLog>> logs;
+  std::set<std::string> names;
+  std::size_t capacity = std::size_t(1) << 20;
+  std::chrono::steady_clock::time_point epoch =
+      std::chrono::steady_clock::now();
+};
+
+Registry &registry() {
+  static Registry *r = new Registry; // never destroyed, threads may outlive
+  return *r;
+}
+
+// Logs are owned by the registry so they survive their thread and can still
+// be exported after a pool resize.
+ThreadLog &local_log() {
+  thread_local ThreadLog *log = nullptr;
+  if (!log) {
+    Registry &r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.logs.push_back(std::make_unique<ThreadLog>());
+    log = r.logs.back().get();
+    log->tid = static_cast<int>(r.logs.size());
+  }
+  return *log;
+}
+
+std::uint64_t now_ns() {
+  return static_cast<std::uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - registry().epoch)
+          .count());
+}
+
+// Chrome trace names are JSON strings.
+std::string escape(const char *s) {
+  std::string out;
+  for (; *s; ++s) {
+    if (*s == '"' || *s == '\\')
+      out += '\\';
+    out += *s;
+  }
+  return out;
+}
+
+} // namespace
+
+bool profiling_enabled() {
+#if defined(NN_PROFILING) && NN_PROFILING
+  return true;
+#else
+  return false;
+#endif
+}
+
+ProfileScope::ProfileScope(const char *name, double flops, double bytes)
+    : m_name(name), m_flops(flops), m_bytes(bytes),
+      m_allocations(thread_heap_allocation_count()) {
+  m_start = now_ns();
+}
+
+ProfileScope::~ProfileScope() {
+  std::uint64_t duration = now_ns() - m_start;
+  ThreadLog &log = local_log();
+
+  ProfileStat &stat = log.stats[m_name];
+  if (stat.calls == 0)
+    stat.name = m_name;
+  ++stat.calls;
+  stat.total_ns += duration;
+  stat.max_ns = std::max(stat.max_ns, duration);
+  stat.flops += m_flops;
+  stat.bytes += m_bytes;
+  stat.allocations += thread_heap_allocation_count() - m_allocations;
+
+  if (log.events.size() < registry().capacity)
+    log.events.push_back({m_name, m_start, duration, m_flops, m_bytes});
+}
+
+std::vector<ProfileStat> profiler_stats() {
+  Registry &r = registry();
+  std::lock_guard<std::mutex> lock(r.mutex);
+
+  std::unordered_map<std::string, ProfileStat> merged;
+  for (const auto &log : r.logs) {
+    for (const auto &entry : log->stats) {
+      const ProfileStat &s = entry.second;
+      auto it = merged.find(s.name);
+      if (it == merged.end()) {
+        merged.emplace(s.name, s);
+        continue;
+      }
+      ProfileStat &m = it->second;
+      m.calls += s.calls;
+      m.total_ns += s.total_ns;
+      m.max_ns = std::max(m.max_ns, s.max_ns);
+      m.flops += s.flops;
+      m.bytes += s.bytes;
+      m.allocations += s.allocations;
+    }
+  }
+
+  std::vector<ProfileStat> stats;
+  stats.reserve(merged.size());
+  for (auto &entry : merged)
+    stats.push_back(std::move(entry.second));
+  std::sort(stats.begin(), stats.end(),
+            [](const ProfileStat &a, const ProfileStat &b) {
+              return a.total_ns > b.total_ns;
+            });
+  return stats;
+}
+
+std::string profile_report() {
+  std::string out;
+  char line[256];
+  std::snprintf(line, sizeof(line), "%-32s %8s %12s %10s %9s %9s %7s\n",
+                "scope", "calls", "total ms", "avg us", "GFLOP/s", "GB/s",
+                "allocs");
+  out += line;
+  for (const ProfileStat &s : profiler_stats()) {
+    std::snprintf(line, sizeof(line),
+                  "%-32s %8llu %12.3f %10.2f %9.2f %9.2f %7llu\n",
+                  s.name.c_str(), static_cast<unsigned long long>(s.calls),
+                  s.total_ns / 1e6, s.total_ns / 1e3 / s.calls, s.gflops(),
+                  s.gbps(), static_cast<unsigned long long>(s.allocations));
+    out += line;
+  }
+  return out;
+}
+
+void profiler_reset() {
+  Registry &r = registry();
+  std::lock_guard<std::mutex> lock(r.mutex);
+  for (auto &log : r.logs) {
+    log->events.clear();
+    log->stats.clear();
+  }
+}
+
+void set_trace_capacity(std::size_t events_per_thread) {
+  Registry &r = registry();
+  std::lock_guard<std::mutex> lock(r.mutex);
+  r.capacity = events_per_thread;
+}
+
+void write_chrome_trace(const std::string &path) {
+  std::ofstream out(path);
+  if (!out)
+    throw std::runtime_error("write_chrome_trace: cannot create " + path);
+
+  Registry &r = registry();
+  std::lock_guard<std::mutex> lock(r.mutex);
+
+  out << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n";
+  bool first = true;
+  char line[512];
+  for (const auto &log : r.logs) {
+    for (const Event &e : log->events) {
+      std::snprintf(line, sizeof(line),
+                    "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, "
+                    "\"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, \"args\": "
+                    "{\"flops\": %.0f, \"bytes\": %.0f}}",
+                    first ? "" : ",\n", escape(e.name).c_str(), log->tid,
+                    e.start / 1e3, e.duration / 1e3, e.flops, e.bytes);
+      out << line;
+      first = false;
+    }
+  }
+  out << "\n]}\n";
+}
+
+const char *profile_name(const std::string &name) {
+  Registry &r = registry();
+  std::lock_guard<std::mutex> lock(r.mutex);
+  return r.names.insert(name).first->c_str();
+}
@@ -0,0 +1,380 @@
+#include "../include/quantized_dense.hpp"
+#include "activation_relu.hpp"
+#include "flat_matrix.hpp"
+#include "thread_pool.hpp"
+#include "profiler.hpp"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define NN_QDENSE_X86 1
+#include <immintrin.h>
+#endif
+
+namespace {
+
+constexpr int KWIDTH = 16; // int8 values per 128-bit load
+constexpr int NBLOCK = 4;  // output channels computed together
+
+int round_up(int n) { return (n + KWIDTH - 1) / KWIDTH * KWIDTH; }
+
+std::int8_t quantize(float x, float inv_scale) {
+  float q = std::nearbyint(x * inv_scale);
+  return static_cast<std::int8_t>(std::max(-127.0f, std::min(127.0f, q)));
+}
+
+// acc[n] = dot(x, w + n * stride) over k values for NBLOCK channels; k is a
+// multiple of KWIDTH and both operands are zero-padded to it.
+using DotKernel = void (*)(const std::int8_t *x, const std::int8_t *w,
+                           int stride, int k, std::int32_t *acc);
+
+void dot_scalar(const std::int8_t *x, const std::int8_t *w, int stride, int k,
+                std::int32_t *acc) {
+  for (int n = 0; n < NBLOCK; ++n) {
+    const std::int8_t *wn = w + static_cast<size_t>(n) * stride;
+    std::int32_t sum = 0;
+    for (int i = 0; i < k; ++i)
+      sum += static_cast<std::int32_t>(x[i]) * wn[i];
+    acc[n] = sum;
+  }
+}
+
+#ifdef NN_QDENSE_X86
+__attribute__((target("avx2"))) std::int32_t hsum(__m256i v) {
+  __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v),
+                            _mm256_extracti128_si256(v, 1));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtsi128_si32(s);
+}
+
+// Sign-extends 16 int8 values to int16 and multiplies pairs with madd, so
+// each step adds 8 int32 partial sums per channel without overflow.
+__attribute__((target("avx2"))) void dot_avx2(const std::int8_t *x,
+                                              const std::int8_t *w, int stride,
+                                              int k, std::int32_t *acc) {
+  const std::int8_t *w0 = w;
+  const std::int8_t *w1 = w + stride;
+  const std::int8_t *w2 = w + 2 * static_cast<size_t>(stride);
+  const std::int8_t *w3 = w + 3 * static_cast<size_t>(stride);
+
+  __m256i s0 = _mm256_setzero_si256(), s1 = _mm256_setzero_si256();
+  __m256i s2 = _mm256_setzero_si256(), s3 = _mm256_setzero_si256();
+
+  for (int i = 0; i < k; i += KWIDTH) {
+    __m256i xv = _mm256_cvtepi8_epi16(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(x + i)));
+    s0 = _mm256_add_epi32(
+        s0, _mm256_madd_epi16(xv, _mm256_cvtepi8_epi16(_mm_loadu_si128(
+                                      reinterpret_cast<const __m128i *>(
+                                          w0 + i)))));
+    s1 = _mm256_add_epi32(
+        s1, _mm256_madd_epi16(xv, _mm256_cvtepi8_epi16(_mm_loadu_si128(
+                                      reinterpret_cast<const __m128i *>(
+                                          w1 + i)))));
+    s2 = _mm256_add_epi32(
+        s2, _mm256_madd_epi16(xv, _mm256_cvtepi8_epi16(_mm_loadu_si128(
+                                      reinterpret_cast<const __m128i *>(
+                                          w2 + i)))));
+    s3 = _mm256_add_epi32(
+        s3, _mm256_madd_epi16(xv, _mm256_cvtepi8_epi16(_mm_loadu_si128(
+                                      reinterpret_cast<const __m128i *>(
+                                          w3 + i)))));
+  }
+
+  acc[0] = hsum(s0);
+  acc[1] = hsum(s1);
+  acc[2] = hsum(s2);
+  acc[3] = hsum(s3);
+}
+#endif
+
+DotKernel select_dot_kernel() {
+#ifdef NN_QDENSE_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return dot_avx2;
+#endif
+  return dot_scalar;
+}
+
+const DotKernel dot_kernel = select_dot_kernel();
+
+} // namespace
+
+template <typename T>
+QuantizedLayerDense::QuantizedLayerDense(const BasicLayerDense<T> &layer,
+                                         bool relu)
+    : m_inputs(layer.weights.rows()), m_neurons(layer.weights.cols()),
+      m_stride(round_up(layer.weights.rows())), m_relu(relu) {
+  int padded = (m_neurons + NBLOCK - 1) / NBLOCK * NBLOCK;
+  m_weights.assign(static_cast<size_t>(padded) * m_stride, 0);
+  m_weight_scales.assign(padded, 0.0f);
+  m_biases.assign(padded, 0.0f);
+
+  // Per-channel symmetric scales: column j of the weights maps its largest
+  // magnitude to 127 and is stored as row j so the kernel reads it linearly.
+  for (int j = 0; j < m_neurons; ++j) {
+    float max_abs = 0.0f;
+    for (int i = 0; i < m_inputs; ++i)
+      max_abs = std::max(max_abs, std::fabs(static_cast<float>(
+                                      layer.weights(i, j))));
+
+    float scale = max_abs > 0.0f ? max_abs / 127.0f : 1.0f;
+    m_weight_scales[j] = scale;
+    m_biases[j] = static_cast<float>(layer.biases[j]);
+
+    std::int8_t *row = m_weights.data() + static_cast<size_t>(j) * m_stride;
+    for (int i = 0; i < m_inputs; ++i)
+      row[i] = quantize(static_cast<float>(layer.weights(i, j)), 1.0f / scale);
+  }
+}
+
+template <typename T>
+QuantizedLayerDense::QuantizedLayerDense(const BasicLayerDenseReLU<T> &layer)
+    : QuantizedLayerDense(static_cast<const BasicLayerDense<T> &>(layer),
+                          true) {}
+
+template <typename T>
+void QuantizedLayerDense::calibrate(const BasicFlatMatrix<T> &batch) {
+  if (batch.cols() != m_inputs) {
+    throw std::invalid_argument(
+        "QuantizedLayerDense calibrate: batch.cols and n_inputs have to "
+        "match!");
+  }
+
+  for (int i = 0; i < batch.rows(); ++i) {
+    const T *in = batch.row(i);
+    for (int k = 0; k < m_inputs; ++k)
+      m_calibrated_max =
+          std::max(m_calibrated_max, std::fabs(static_cast<float>(in[k])));
+  }
+  m_calibrated = true;
+}
+
+void QuantizedLayerDense::reset_calibration() {
+  m_calibrated_max = 0.0f;
+  m_calibrated = false;
+}
+
+bool QuantizedLayerDense::calibrated() const { return m_calibrated; }
+
+template <typename T>
+void QuantizedLayerDense::forward(const BasicFlatMatrix<T> &inputs) {
+  NN_PROFILE_SCOPE_COUNTS(
+      "QuantizedLayerDense::forward",
+      2.0 * inputs.rows() * m_inputs * m_neurons,
+      sizeof(T) * double(inputs.rows()) * m_inputs +
+          double(m_neurons) * m_stride +
+          sizeof(float) * double(inputs.rows()) * m_neurons);
+  if (inputs.cols() != m_inputs) {
+    throw std::invalid_argument(
+        "QuantizedLayerDense forward: input.cols and n_inputs have to match!");
+  }
+
+  int R = inputs.rows();
+  int N = m_neurons;
+
+  m_qinputs.resize(static_cast<size_t>(R) * m_stride);
+  m_input_scales.resize(R);
+  output.resize(R, N);
+
+  parallel_for(0, R, 16, [&](int first, int last) {
+    for (int i = first; i < last; ++i) {
+      const T *in = inputs.row(i);
+      float max_abs = m_calibrated_max;
+      if (!m_calibrated) {
+        for (int k = 0; k < m_inputs; ++k)
+          max_abs = std::max(max_abs, std::fabs(static_cast<float>(in[k])));
+      }
+
+      float scale = max_abs > 0.0f ? max_abs / 127.0f : 1.0f;
+      m_input_scales[i] = scale;
+
+      std::int8_t *q = m_qinputs.data() + static_cast<size_t>(i) * m_stride;
+      for (int k = 0; k < m_inputs; ++k)
+        q[k] = quantize(static_cast<float>(in[k]), 1.0f / scale);
+      std::fill(q + m_inputs, q + m_stride, 0);
+    }
+  });
+
+  // Rows are split across threads, about 64 blocks of output channels per
+  // chunk; the int32 sums are requantized to float with the bias and ReLU
+  // folded into the store.
+  int blocks = (N + NBLOCK - 1) / NBLOCK;
+  parallel_for(0, R, std::max(1, 64 / blocks), [&](int first, int last) {
+    for (int i = first; i < last; ++i) {
+      const std::int8_t *q =
+          m_qinputs.data() + static_cast<size_t>(i) * m_stride;
+      float *out = output.row(i);
+      float sx = m_input_scales[i];
+      for (int j0 = 0; j0 < N; j0 += NBLOCK) {
+        std::int32_t acc[NBLOCK];
+        dot_kernel(q, m_weights.data() + static_cast<size_t>(j0) * m_stride,
+                   m_stride, m_stride, acc);
+
+        int j_end = std::min(N, j0 + NBLOCK);
+        for (int j = j0; j < j_end; ++j) {
+          float v = static_cast<float>(acc[j - j0]) * sx * m_weight_scales[j] +
+                    m_biases[j];
+          out[j] = m_relu ? std::max(v, 0.0f) : v;
+        }
+      }
+    }
+  });
+}
+
+int QuantizedLayerDense::n_inputs() const { return m_inputs; }
+
+int QuantizedLayerDense::n_neurons() const { return m_neurons; }
+
+std::size_t QuantizedLayerDense::memory_bytes() const {
+  return m_weights.size() * sizeof(std::int8_t) +
+         m_weight_scales.size() * sizeof(float) +
+         m_biases.size() * sizeof(float);
+}
+
+namespace {
+
+template <typename T> int arg_max(const T *x, int n) {
+  return static_cast<int>(std::max_element(x, x + n) - x);
+}
+
+// Compares the outputs row by row; with labels also the accuracies.
+template <typename T>
+QuantizationReport compare(const BasicFlatMatrix<T> &expected,
+                           const FlatMatrixF &actual,
+                           const std::vector<int> *labels) {
+  QuantizationReport report{0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
+  int R = expected.rows();
+  int C = expected.cols();
+  if (R == 0)
+    return report;
+
+  double abs_sum = 0.0;
+  int agree = 0, expected_hits = 0, actual_hits = 0;
+  for (int i = 0; i < R; ++i) {
+    const T *e = expected.row(i);
+    const float *a = actual.row(i);
+    for (int j = 0; j < C; ++j) {
+      double err = std::fabs(static_cast<double>(e[j]) - a[j]);
+      report.max_abs_error = std::max(report.max_abs_error, err);
+      report.max_reference =
+          std::max(report.max_reference, std::fabs(static_cast<double>(e[j])));
+      abs_sum += err;
+    }
+    int e_arg = arg_max(e, C);
+    int a_arg = arg_max(a, C);
+    agree += e_arg == a_arg;
+    if (labels) {
+      expected_hits += e_arg == (*labels)[i];
+      actual_hits += a_arg == (*labels)[i];
+    }
+  }
+
+  report.mean_abs_error = abs_sum / (static_cast<double>(R) * C);
+  report.argmax_agreement = static_cast<double>(agree) / R;
+  report.reference_accuracy = static_cast<double>(expected_hits) / R;
+  report.quantized_accuracy = static_cast<double>(actual_hits) / R;
+  return report;
+}
+
+} // namespace
+
+template <typename T>
+QuantizationReport quantization_report(BasicLayerDense<T> &reference,
+                                       QuantizedLayerDense &quantized,
+                                       const BasicFlatMatrix<T> &batch) {
+  reference.forward(batch);
+  quantized.forward(batch);
+  return compare(reference.output, quantized.output, nullptr);
+}
+
+template <typename T>
+QuantizedSequential::QuantizedSequential(const BasicSequential<T> &model) {
+  for (int i = 0; i < model.size(); ++i) {
+    const BasicLayer<T> &layer = model.layer(i);
+    if (auto *fused = dynamic_cast<const BasicLayerDenseReLU<T> *>(&layer)) {
+      m_layers.emplace_back(*fused);
+    } else if (auto *dense = dynamic_cast<const BasicLayerDense<T> *>(&layer)) {
+      bool relu = i + 1 < model.size() &&
+                  dynamic_cast<const BasicActivationReLU<T> *>(
+                      &model.layer(i + 1)) != nullptr;
+      m_layers.emplace_back(*dense, relu);
+      i += relu;
+    } else {
+      throw std::invalid_argument(
+          "QuantizedSequential: only LayerDense, LayerDenseReLU and an "
+          "ActivationReLU after a LayerDense can be quantized!");
+    }
+  }
+  if (m_layers.empty())
+    throw std::invalid_argument("QuantizedSequential: the model has no layers");
+}
+
+template <typename T>
+void QuantizedSequential::calibrate(const BasicFlatMatrix<T> &batch) {
+  m_layers[0].calibrate(batch);
+  m_layers[0].forward(batch);
+  for (std::size_t l = 1; l < m_layers.size(); ++l) {
+    m_layers[l].calibrate(m_layers[l - 1].output);
+    m_layers[l].forward(m_layers[l - 1].output);
+  }
+}
+
+template <typename T>
+const FlatMatrixF &QuantizedSequential::forward(const BasicFlatMatrix<T> &inputs) {
+  m_layers[0].forward(inputs);
+  for (std::size_t l = 1; l < m_layers.size(); ++l)
+    m_layers[l].forward(m_layers[l - 1].output);
+  return m_layers.back().output;
+}
+
+int QuantizedSequential::size() const {
+  return static_cast<int>(m_layers.size());
+}
+
+QuantizedLayerDense &QuantizedSequential::layer(int i) { return m_layers[i]; }
+
+std::size_t QuantizedSequential::memory_bytes() const {
+  std::size_t bytes = 0;
+  for (const QuantizedLayerDense &layer : m_layers)
+    bytes += layer.memory_bytes();
+  return bytes;
+}
+
+template <typename T>
+QuantizationReport quantization_report(BasicSequential<T> &reference,
+                                       QuantizedSequential &quantized,
+                                       const BasicFlatMatrix<T> &batch,
+                                       const std::vector<int> &labels) {
+  if (static_cast<int>(labels.size()) != batch.rows()) {
+    throw std::invalid_argument(
+        "quantization_report: batch.rows and the number of labels have to "
+        "match!");
+  }
+  const BasicFlatMatrix<T> &expected = reference.predict(batch);
+  return compare(expected, quantized.forward(batch), &labels);
+}
+
+#define INSTANTIATE_QUANTIZED_DENSE(T)                                         \
+  template QuantizedLayerDense::QuantizedLayerDense(                           \
+      const BasicLayerDense<T> &, bool);                                       \
+  template QuantizedLayerDense::QuantizedLayerDense(                           \
+      const BasicLayerDenseReLU<T> &);                                         \
+  template void QuantizedLayerDense::calibrate(const BasicFlatMatrix<T> &);    \
+  template void QuantizedLayerDense::forward(const BasicFlatMatrix<T> &);      \
+  template QuantizationReport quantization_report(                             \
+      BasicLayerDense<T> &, QuantizedLayerDense &, const BasicFlatMatrix<T> &); \
+  template QuantizedSequential::QuantizedSequential(                           \
+      const BasicSequential<T> &);                                             \
+  template void QuantizedSequential::calibrate(const BasicFlatMatrix<T> &);    \
+  template const FlatMatrixF &QuantizedSequential::forward(                    \
+      const BasicFlatMatrix<T> &);                                             \
+  template QuantizationReport quantization_report(                             \
+      BasicSequential<T> &, QuantizedSequential &, const BasicFlatMatrix<T> &, \
+      const std::vector<int> &);
+
+INSTANTIATE_QUANTIZED_DENSE(float)
+INSTANTIATE_QUANTIZED_DENSE(double)
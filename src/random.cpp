@@ -0,0 +1,247 @@
+#include "../include/random.hpp"
+#include "thread_pool.hpp"
+#include "vec_math.hpp"
+#include "profiler.hpp"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <type_traits>
+
+namespace {
+
+// Values generated per batch; a multiple of 4 so that batches start on a
+// Philox block.
+constexpr int CHUNK = 256;
+constexpr int BLOCKS = CHUNK / 4;
+constexpr int GRAIN = 16; // batches per parallel_for chunk
+
+PhiloxKey key_of(std::uint64_t seed) {
+  return {static_cast<std::uint32_t>(seed),
+          static_cast<std::uint32_t>(seed >> 32)};
+}
+
+// Philox4x32-10 of blocks [first_block, first_block + n) of `stream`, whose
+// counter is (block, stream), so every (stream, block) pair is drawn once.
+// Each round runs across all blocks before the next, which lets the
+// compiler vectorize it; lane l of block b ends up in x[l][b].
+void philox_blocks(const PhiloxKey &key, std::uint64_t stream,
+                   std::uint64_t first_block, int n,
+                   std::uint32_t (&x)[4][BLOCKS]) {
+  for (int b = 0; b < n; ++b) {
+    std::uint64_t block = first_block + b;
+    x[0][b] = static_cast<std::uint32_t>(block);
+    x[1][b] = static_cast<std::uint32_t>(block >> 32);
+    x[2][b] = static_cast<std::uint32_t>(stream);
+    x[3][b] = static_cast<std::uint32_t>(stream >> 32);
+  }
+  std::uint32_t k0 = key[0], k1 = key[1];
+  for (int round = 0; round < 10; ++round) {
+    for (int b = 0; b < n; ++b) {
+      std::uint64_t p0 = std::uint64_t(0xD2511F53u) * x[0][b];
+      std::uint64_t p1 = std::uint64_t(0xCD9E8D57u) * x[2][b];
+      std::uint32_t c1 = x[1][b], c3 = x[3][b];
+      x[0][b] = static_cast<std::uint32_t>(p1 >> 32) ^ c1 ^ k0;
+      x[1][b] = static_cast<std::uint32_t>(p1);
+      x[2][b] = static_cast<std::uint32_t>(p0 >> 32) ^ c3 ^ k1;
+      x[3][b] = static_cast<std::uint32_t>(p0);
+    }
+    k0 += 0x9E3779B9u;
+    k1 += 0xBB67AE85u;
+  }
+}
+
+// Uniform on (0, 1): an odd multiple of 2^-bits with as many bits as T
+// holds exactly, so log() never sees 0.
+template <typename T> T open_unit(std::uint32_t x) {
+  if constexpr (std::is_same<T, float>::value)
+    return static_cast<float>((x >> 9) * 2 + 1) * 0x1p-24f;
+  else
+    return static_cast<double>(std::uint64_t(x) * 2 + 1) * 0x1p-33;
+}
+
+// Uniform on [0, 1).
+template <typename T> T unit(std::uint32_t x) {
+  if constexpr (std::is_same<T, float>::value)
+    return static_cast<float>(x >> 8) * 0x1p-24f;
+  else
+    return static_cast<double>(x) * 0x1p-32;
+}
+
+// sin and cos of 2 pi u for u in [0, 1]. u is moved by the nearest quarter
+// turn onto [-1/8, 1/8], exactly, where Taylor series to degree 15 and 16
+// are accurate to double precision; the quarter turn then swaps and negates
+// the pair. Branch-free, so loops over it vectorize.
+template <typename T> void sincos_turns(T u, T &s, T &c) {
+  int q = static_cast<int>(T(4) * u + T(0.5));
+  T x = static_cast<T>(6.283185307179586) * (u - T(0.25) * T(q));
+  T x2 = x * x;
+  T sn = T(-1) / T(1307674368000);
+  sn = sn * x2 + T(1) / T(6227020800);
+  sn = sn * x2 - T(1) / T(39916800);
+  sn = sn * x2 + T(1) / T(362880);
+  sn = sn * x2 - T(1) / T(5040);
+  sn = sn * x2 + T(1) / T(120);
+  sn = sn * x2 - T(1) / T(6);
+  sn = (sn * x2) * x + x;
+  T cs = T(1) / T(20922789888000);
+  cs = cs * x2 - T(1) / T(87178291200);
+  cs = cs * x2 + T(1) / T(479001600);
+  cs = cs * x2 - T(1) / T(3628800);
+  cs = cs * x2 + T(1) / T(40320);
+  cs = cs * x2 - T(1) / T(720);
+  cs = cs * x2 + T(1) / T(24);
+  cs = cs * x2 - T(1) / T(2);
+  cs = cs * x2 + T(1);
+  q &= 3;
+  T sin_q = (q & 1) ? cs : sn;
+  T cos_q = (q & 1) ? sn : cs;
+  s = (q & 2) ? -sin_q : sin_q;
+  c = ((q + 1) & 2) ? -cos_q : cos_q;
+}
+
+// 4 * blocks standard normals from consecutive blocks, by Box-Muller on
+// lanes (0, 1) and (2, 3) of each block.
+template <typename T>
+void normals(const PhiloxKey &key, std::uint64_t stream,
+             std::uint64_t first_block, int blocks, T *z) {
+  std::uint32_t x[4][BLOCKS];
+  philox_blocks(key, stream, first_block, blocks, x);
+  T radius[CHUNK / 2], angle[CHUNK / 2];
+  for (int b = 0; b < blocks; ++b) {
+    radius[2 * b] = open_unit<T>(x[0][b]);
+    angle[2 * b] = open_unit<T>(x[1][b]);
+    radius[2 * b + 1] = open_unit<T>(x[2][b]);
+    angle[2 * b + 1] = open_unit<T>(x[3][b]);
+  }
+  int pairs = 2 * blocks;
+  vec_log(radius, radius, pairs);
+  // sqrt may set errno, which keeps a loop from vectorizing, so the
+  // rotation gets a loop of its own.
+  T cosine[CHUNK / 2], sine[CHUNK / 2];
+  for (int p = 0; p < pairs; ++p)
+    sincos_turns(angle[p], sine[p], cosine[p]);
+  for (int p = 0; p < pairs; ++p) {
+    T r = std::sqrt(T(-2) * radius[p]);
+    z[2 * p] = r * cosine[p];
+    z[2 * p + 1] = r * sine[p];
+  }
+}
+
+// Splits the flat index range of M into batches of CHUNK values, has
+// `generate(first_block, blocks, values)` produce each batch and stores
+// value k at (k / cols, k % cols).
+template <typename T, typename Generate>
+void fill_blocks(BasicFlatMatrix<T> &M, Generate generate) {
+  std::uint64_t C = M.cols();
+  std::uint64_t total = static_cast<std::uint64_t>(M.rows()) * C;
+  int batches = static_cast<int>((total + CHUNK - 1) / CHUNK);
+
+  parallel_for(0, batches, GRAIN, [&](int first, int last) {
+    T values[CHUNK];
+    for (int c = first; c < last; ++c) {
+      std::uint64_t begin = static_cast<std::uint64_t>(c) * CHUNK;
+      std::uint64_t end = std::min<std::uint64_t>(total, begin + CHUNK);
+      generate(begin / 4, static_cast<int>((end - begin + 3) / 4), values);
+
+      const T *v = values;
+      for (std::uint64_t k = begin; k < end;) {
+        int i = static_cast<int>(k / C);
+        std::uint64_t j = k % C;
+        std::uint64_t n = std::min(end - k, C - j);
+        std::copy(v, v + n, M.row(i) + j);
+        v += n;
+        k += n;
+      }
+    }
+  });
+}
+
+} // namespace
+
+PhiloxCounter philox4x32(PhiloxCounter ctr, PhiloxKey key) {
+  std::uint32_t x[4][BLOCKS];
+  philox_blocks(key, ctr[2] | std::uint64_t(ctr[3]) << 32,
+                ctr[0] | std::uint64_t(ctr[1]) << 32, 1, x);
+  return {x[0][0], x[1][0], x[2][0], x[3][0]};
+}
+
+template <typename T>
+void fill_normal(BasicFlatMatrix<T> &M, std::uint64_t seed,
+                 std::uint64_t stream, double mean, double stddev) {
+  NN_PROFILE_SCOPE_COUNTS("fill_normal", 0,
+                          sizeof(T) * double(M.rows()) * M.cols());
+  PhiloxKey key = key_of(seed);
+  const T mu = static_cast<T>(mean);
+  const T sigma = static_cast<T>(stddev);
+  fill_blocks(M, [&](std::uint64_t first_block, int blocks, T *values) {
+    normals(key, stream, first_block, blocks, values);
+    for (int k = 0; k < 4 * blocks; ++k)
+      values[k] = mu + sigma * values[k];
+  });
+}
+
+template <typename T>
+void fill_uniform(BasicFlatMatrix<T> &M, std::uint64_t seed,
+                  std::uint64_t stream, double low, double high) {
+  NN_PROFILE_SCOPE_COUNTS("fill_uniform", 0,
+                          sizeof(T) * double(M.rows()) * M.cols());
+  if (!(low < high))
+    throw std::invalid_argument("fill_uniform: low has to be below high!");
+
+  PhiloxKey key = key_of(seed);
+  const T lo = static_cast<T>(low);
+  const T width = static_cast<T>(high - low);
+  fill_blocks(M, [&](std::uint64_t first_block, int blocks, T *values) {
+    std::uint32_t x[4][BLOCKS];
+    philox_blocks(key, stream, first_block, blocks, x);
+    for (int b = 0; b < blocks; ++b) {
+      for (int lane = 0; lane < 4; ++lane)
+        values[4 * b + lane] = lo + width * unit<T>(x[lane][b]);
+    }
+  });
+}
+
+template <typename T>
+BasicFlatMatrix<T> init_weights(int fan_in, int fan_out, WeightInit init,
+                                std::uint64_t seed, std::uint64_t layer) {
+  if (fan_in <= 0 || fan_out <= 0) {
+    throw std::invalid_argument(
+        "init_weights: fan_in and fan_out have to be positive!");
+  } else if (layer & RANDN_STREAM_BIT) {
+    throw std::invalid_argument(
+        "init_weights: layer numbers with RANDN_STREAM_BIT are reserved!");
+  }
+
+  BasicFlatMatrix<T> W(fan_in, fan_out);
+  double fan_avg = 0.5 * (double(fan_in) + fan_out);
+  switch (init) {
+  case WeightInit::HeNormal:
+    fill_normal(W, seed, layer, 0.0, std::sqrt(2.0 / fan_in));
+    break;
+  case WeightInit::HeUniform: {
+    double limit = std::sqrt(6.0 / fan_in);
+    fill_uniform(W, seed, layer, -limit, limit);
+    break;
+  }
+  case WeightInit::XavierNormal:
+    fill_normal(W, seed, layer, 0.0, std::sqrt(1.0 / fan_avg));
+    break;
+  case WeightInit::XavierUniform: {
+    double limit = std::sqrt(3.0 / fan_avg);
+    fill_uniform(W, seed, layer, -limit, limit);
+    break;
+  }
+  }
+  return W;
+}
+
+#define INSTANTIATE_RANDOM(T)                                                  \
+  template void fill_normal(BasicFlatMatrix<T> &, std::uint64_t,               \
+                            std::uint64_t, double, double);                    \
+  template void fill_uniform(BasicFlatMatrix<T> &, std::uint64_t,              \
+                             std::uint64_t, double, double);                   \
+  template BasicFlatMatrix<T> init_weights(int, int, WeightInit,               \
+                                           std::uint64_t, std::uint64_t);
+
+INSTANTIATE_RANDOM(float)
+INSTANTIATE_RANDOM(double)
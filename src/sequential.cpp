@@ -0,0 +1,212 @@
+#include "../include/sequential.hpp"
+#include "flat_matrix.hpp"
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+template <typename T> int BasicSequential<T>::size() const {
+  return static_cast<int>(m_layers.size());
+}
+
+template <typename T> BasicLayer<T> &BasicSequential<T>::layer(int i) {
+  if (i < 0 || i >= size())
+    throw std::out_of_range("Sequential::layer: index out of range");
+  return *m_layers[i];
+}
+
+template <typename T>
+const BasicLayer<T> &BasicSequential<T>::layer(int i) const {
+  if (i < 0 || i >= size())
+    throw std::out_of_range("Sequential::layer: index out of range");
+  return *m_layers[i];
+}
+
+template <typename T>
+void BasicSequential<T>::keep_alive(std::shared_ptr<const void> storage) {
+  m_storage = std::move(storage);
+}
+
+template <typename T> void BasicSequential<T>::name_last_layer() {
+  std::string prefix = "layer" + std::to_string(size() - 1);
+  m_forward_names.push_back(profile_name(prefix + ".forward"));
+  m_backward_names.push_back(profile_name(prefix + ".backward"));
+}
+
+template <typename T>
+void BasicSequential<T>::forward(const BasicFlatMatrix<T> &inputs) {
+  if (m_layers.empty())
+    throw std::invalid_argument("Sequential forward: the model has no layers");
+
+  const BasicFlatMatrix<T> *x = &inputs;
+  for (int i = 0; i < size(); ++i) {
+    NN_PROFILE_SCOPE(m_forward_names[i]);
+    m_layers[i]->forward(*x);
+    x = &m_layers[i]->output;
+  }
+}
+
+template <typename T>
+void BasicSequential<T>::forward(const BasicCsrMatrix<T> &inputs) {
+  auto *first = m_layers.empty()
+                    ? nullptr
+                    : dynamic_cast<BasicLayerDense<T> *>(m_layers[0].get());
+  if (!first) {
+    throw std::invalid_argument(
+        "Sequential forward: sparse inputs need a LayerDense first!");
+  }
+
+  {
+    NN_PROFILE_SCOPE(m_forward_names[0]);
+    first->forward(inputs);
+  }
+  const BasicFlatMatrix<T> *x = &first->output;
+  for (int i = 1; i < size(); ++i) {
+    NN_PROFILE_SCOPE(m_forward_names[i]);
+    m_layers[i]->forward(*x);
+    x = &m_layers[i]->output;
+  }
+}
+
+template <typename T>
+void BasicSequential<T>::backward(const BasicFlatMatrix<T> &dvalues) {
+  const BasicFlatMatrix<T> *d = &dvalues;
+  for (int i = size() - 1; i >= 0; --i) {
+    NN_PROFILE_SCOPE(m_backward_names[i]);
+    m_layers[i]->backward(*d);
+    d = &m_layers[i]->dinputs;
+  }
+}
+
+template <typename T>
+const BasicFlatMatrix<T> &BasicSequential<T>::output() const {
+  if (m_layers.empty())
+    throw std::invalid_argument("Sequential output: the model has no layers");
+  return m_layers.back()->output;
+}
+
+template <typename T>
+const BasicFlatMatrix<T> &
+BasicSequential<T>::predict(const BasicFlatMatrix<T> &inputs) {
+  if (m_layers.empty())
+    throw std::invalid_argument("Sequential predict: the model has no layers");
+
+  NoGradGuard no_grad;
+  BasicFlatMatrix<T> *x = nullptr; // the caller's inputs until layer 0 ran
+  for (int i = 0; i < size(); ++i) {
+    NN_PROFILE_SCOPE(m_forward_names[i]);
+    BasicLayer<T> &layer = *m_layers[i];
+    BasicFlatMatrix<T> *out =
+        x && layer.in_place() ? x : (x == &m_ping ? &m_pong : &m_ping);
+    layer.forward_into(x ? *x : inputs, *out);
+    x = out;
+  }
+  return *x;
+}
+
+template <typename T>
+int BasicSequential<T>::begin_fit(const BasicFlatMatrix<T> &X,
+                                  const std::vector<int> &y,
+                                  const FitOptions &options) {
+  if (X.rows() != static_cast<int>(y.size())) {
+    throw std::invalid_argument(
+        "Sequential fit: X.rows and the number of labels have to match!");
+  } else if (X.rows() == 0) {
+    throw std::invalid_argument("Sequential fit: X has no samples!");
+  } else if (options.batch_size <= 0 || options.epochs < 0) {
+    throw std::invalid_argument(
+        "Sequential fit: batch_size has to be positive and epochs not "
+        "negative!");
+  } else if (m_layers.empty()) {
+    throw std::invalid_argument("Sequential fit: the model has no layers");
+  }
+
+  m_order.resize(X.rows());
+  std::iota(m_order.begin(), m_order.end(), 0);
+  m_rng.seed(options.seed);
+  m_batch_y.reserve(std::min(options.batch_size, X.rows()));
+
+  return (X.rows() + options.batch_size - 1) / options.batch_size;
+}
+
+// Copies rows [first, first + count) of X (through m_order when permuted)
+// into the batch buffers, which keep their capacity between batches.
+template <typename T>
+void BasicSequential<T>::gather(const BasicFlatMatrix<T> &X,
+                                const std::vector<int> &y, int first,
+                                int count, bool permuted) {
+  NN_PROFILE_SCOPE_COUNTS("Sequential::gather", 0,
+                          2.0 * sizeof(T) * count * X.cols());
+  int C = X.cols();
+  m_batch_x.resize(count, C);
+  m_batch_y.resize(count);
+
+  parallel_for(0, count, 32, [&](int b0, int b1) {
+    for (int b = b0; b < b1; ++b) {
+      int src = permuted ? m_order[first + b] : first + b;
+      std::memcpy(m_batch_x.row(b), X.row(src), sizeof(T) * C);
+      m_batch_y[b] = y[src];
+    }
+  });
+}
+
+template <typename T> int BasicSequential<T>::count_correct() const {
+  const BasicFlatMatrix<T> &probs = m_head.output;
+  int C = probs.cols();
+  int correct = 0;
+  for (int i = 0; i < probs.rows(); ++i) {
+    const T *p = probs.row(i);
+    int best = static_cast<int>(std::max_element(p, p + C) - p);
+    correct += best == m_batch_y[i];
+  }
+  return correct;
+}
+
+template <typename T>
+double BasicSequential<T>::train_batch(const BasicFlatMatrix<T> &X,
+                                       const std::vector<int> &y, int b,
+                                       int batch_size, int &correct) {
+  int first = b * batch_size;
+  int count = std::min(batch_size, X.rows() - first);
+  gather(X, y, first, count, true);
+
+  forward(m_batch_x);
+  double loss = m_head.forward(output(), m_batch_y);
+  correct += count_correct();
+
+  m_head.backward(m_batch_y);
+  backward(m_head.dinputs);
+
+  return loss * count;
+}
+
+template <typename T>
+EpochStats BasicSequential<T>::evaluate(const BasicFlatMatrix<T> &X,
+                                        const std::vector<int> &y,
+                                        int batch_size) {
+  if (X.rows() != static_cast<int>(y.size())) {
+    throw std::invalid_argument(
+        "Sequential evaluate: X.rows and the number of labels have to match!");
+  } else if (batch_size <= 0) {
+    throw std::invalid_argument(
+        "Sequential evaluate: batch_size has to be positive!");
+  }
+
+  double loss_sum = 0.0;
+  int correct = 0;
+  for (int first = 0; first < X.rows(); first += batch_size) {
+    int count = std::min(batch_size, X.rows() - first);
+    gather(X, y, first, count, false);
+    loss_sum += m_head.forward(predict(m_batch_x), m_batch_y) * count;
+    correct += count_correct();
+  }
+
+  int n = std::max(1, X.rows());
+  return EpochStats{0, loss_sum / n, static_cast<double>(correct) / n};
+}
+
+template class BasicSequential<float>;
+template class BasicSequential<double>;
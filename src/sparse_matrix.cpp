@@ -0,0 +1,264 @@
+#include "../include/sparse_matrix.hpp"
+#include "thread_pool.hpp"
+#include "workspace.hpp"
+#include "profiler.hpp"
+#include <algorithm>
+#include <stdexcept>
+
+template <typename T>
+BasicCsrMatrix<T>::BasicCsrMatrix(int cols) : m_cols(cols), m_row_ptr(1, 0) {
+  if (cols < 0)
+    throw std::invalid_argument("CsrMatrix: cols has to be non-negative!");
+}
+
+template <typename T>
+BasicCsrMatrix<T> BasicCsrMatrix<T>::from_dense(const BasicFlatMatrix<T> &M) {
+  BasicCsrMatrix<T> A(M.cols());
+  A.m_row_ptr.reserve(static_cast<std::size_t>(M.rows()) + 1);
+  for (int i = 0; i < M.rows(); ++i) {
+    const T *m = M.row(i);
+    for (int j = 0; j < M.cols(); ++j) {
+      if (m[j] != T(0)) {
+        A.m_col_idx.push_back(j);
+        A.m_values.push_back(m[j]);
+      }
+    }
+    A.m_row_ptr.push_back(static_cast<int>(A.m_col_idx.size()));
+  }
+  return A;
+}
+
+template <typename T>
+void BasicCsrMatrix<T>::add_row(const int *cols, const T *values, int n) {
+  for (int k = 0; k < n; ++k) {
+    if (cols[k] < 0 || cols[k] >= m_cols)
+      throw std::out_of_range("CsrMatrix add_row: column index out of range");
+  }
+  m_col_idx.insert(m_col_idx.end(), cols, cols + n);
+  m_values.insert(m_values.end(), values, values + n);
+  m_row_ptr.push_back(static_cast<int>(m_col_idx.size()));
+  m_index_valid = false;
+}
+
+template <typename T> void BasicCsrMatrix<T>::clear(int cols) {
+  if (cols < 0)
+    throw std::invalid_argument("CsrMatrix: cols has to be non-negative!");
+  m_cols = cols;
+  m_row_ptr.resize(1);
+  m_col_idx.clear();
+  m_values.clear();
+  m_index_valid = false;
+}
+
+template <typename T>
+void BasicCsrMatrix<T>::reserve(int rows, std::size_t nnz) {
+  m_row_ptr.reserve(static_cast<std::size_t>(rows) + 1);
+  m_col_idx.reserve(nnz);
+  m_values.reserve(nnz);
+}
+
+template <typename T> int BasicCsrMatrix<T>::rows() const {
+  return static_cast<int>(m_row_ptr.size()) - 1;
+}
+
+template <typename T> int BasicCsrMatrix<T>::cols() const { return m_cols; }
+
+template <typename T> std::size_t BasicCsrMatrix<T>::nnz() const {
+  return m_col_idx.size();
+}
+
+template <typename T> const int *BasicCsrMatrix<T>::row_ptr() const {
+  return m_row_ptr.data();
+}
+
+template <typename T> const int *BasicCsrMatrix<T>::col_idx() const {
+  return m_col_idx.data();
+}
+
+template <typename T> const T *BasicCsrMatrix<T>::values() const {
+  return m_values.data();
+}
+
+template <typename T> BasicFlatMatrix<T> BasicCsrMatrix<T>::to_dense() const {
+  BasicFlatMatrix<T> M(rows(), m_cols, T(0));
+  for (int i = 0; i < rows(); ++i) {
+    for (int k = m_row_ptr[i]; k < m_row_ptr[i + 1]; ++k)
+      M(i, m_col_idx[k]) += m_values[k];
+  }
+  return M;
+}
+
+// Entries ordered by (column, row), so every row of A^T * D is summed over
+// the rows of D in a fixed order.
+template <typename T>
+const CsrColumnIndex &BasicCsrMatrix<T>::column_index() const {
+  if (m_index_valid)
+    return m_index;
+
+  int nnz = static_cast<int>(m_col_idx.size());
+  std::vector<int> &entries = m_index.entries;
+  entries.resize(nnz);
+  for (int k = 0; k < nnz; ++k)
+    entries[k] = k;
+  std::sort(entries.begin(), entries.end(), [&](int a, int b) {
+    return m_col_idx[a] != m_col_idx[b] ? m_col_idx[a] < m_col_idx[b] : a < b;
+  });
+
+  // Entry k belongs to the row whose range contains it.
+  m_index.entry_rows.resize(nnz);
+  for (int k = 0; k < nnz; ++k) {
+    int e = entries[k];
+    m_index.entry_rows[k] = static_cast<int>(
+        std::upper_bound(m_row_ptr.begin(), m_row_ptr.end(), e) -
+        m_row_ptr.begin() - 1);
+  }
+
+  m_index.cols.clear();
+  m_index.starts.clear();
+  for (int k = 0; k < nnz; ++k) {
+    int col = m_col_idx[entries[k]];
+    if (k == 0 || col != m_index.cols.back()) {
+      m_index.cols.push_back(col);
+      m_index.starts.push_back(k);
+    }
+  }
+  m_index.starts.push_back(nnz);
+  m_index_valid = true;
+  return m_index;
+}
+
+template <typename T>
+void spmm_into(const BasicCsrMatrix<T> &A, const BasicFlatMatrix<T> &B,
+               BasicFlatMatrix<T> &Result, const GemmEpilogue<T> &epilogue) {
+  NN_PROFILE_SCOPE_COUNTS("spmm", 2.0 * A.nnz() * B.cols(),
+                          sizeof(T) * (double(A.nnz()) * B.cols() +
+                                       double(A.rows()) * B.cols()));
+  if (A.cols() != B.rows()) {
+    throw std::invalid_argument(
+        "spmm_into: A.cols and B.rows have to match!");
+  }
+
+  int R = A.rows();
+  int C = B.cols();
+  const int *row_ptr = A.row_ptr();
+  const int *col_idx = A.col_idx();
+  const T *values = A.values();
+
+  Result.resize(R, C);
+  parallel_for(0, R, 16, [&](int first, int last) {
+    for (int i = first; i < last; ++i) {
+      T *out = Result.row(i);
+      if (epilogue.bias)
+        std::copy(epilogue.bias, epilogue.bias + C, out);
+      else
+        std::fill(out, out + C, T(0));
+
+      for (int k = row_ptr[i]; k < row_ptr[i + 1]; ++k) {
+        T a = values[k];
+        const T *b = B.row(col_idx[k]);
+        for (int j = 0; j < C; ++j)
+          out[j] += a * b[j];
+      }
+
+      if (epilogue.relu) {
+        for (int j = 0; j < C; ++j)
+          out[j] = std::max(out[j], T(0));
+      }
+    }
+  });
+}
+
+namespace {
+
+// Writes row s of the compact product A^T * D, i.e. the row of its s-th
+// distinct column, to target(s, col). Distinct columns run in parallel.
+template <typename T, typename Target>
+void scatter_rows(const BasicCsrMatrix<T> &A, const CsrColumnIndex &index,
+                  const BasicFlatMatrix<T> &D, Target target) {
+  int C = D.cols();
+  const T *values = A.values();
+  const int *starts = index.starts.data();
+  const int *entries = index.entries.data();
+  const int *entry_rows = index.entry_rows.data();
+
+  int n = static_cast<int>(index.cols.size());
+
+  parallel_for(0, n, 4, [&](int first, int last) {
+    for (int s = first; s < last; ++s) {
+      T *out = target(s, index.cols[s]);
+      std::fill(out, out + C, T(0));
+      for (int k = starts[s]; k < starts[s + 1]; ++k) {
+        T a = values[entries[k]];
+        const T *d = D.row(entry_rows[k]);
+        for (int j = 0; j < C; ++j)
+          out[j] += a * d[j];
+      }
+    }
+  });
+}
+
+template <typename T>
+void check_tn(const BasicCsrMatrix<T> &A, const BasicFlatMatrix<T> &D) {
+  if (A.rows() != D.rows()) {
+    throw std::invalid_argument(
+        "spmm_tn_into: A.rows and D.rows have to match!");
+  }
+}
+
+} // namespace
+
+template <typename T>
+void spmm_tn_into(const BasicCsrMatrix<T> &A, const BasicFlatMatrix<T> &D,
+                  BasicFlatMatrix<T> &Result) {
+  NN_PROFILE_SCOPE_COUNTS("spmm_tn", 2.0 * A.nnz() * D.cols(),
+                          sizeof(T) * (double(A.nnz()) * D.cols() +
+                                       double(A.cols()) * D.cols()));
+  check_tn(A, D);
+
+  int C = D.cols();
+  const CsrColumnIndex &index = A.column_index();
+  Result.resize(A.cols(), C);
+
+  // scatter_rows writes the rows of the columns in the index; only the
+  // rows between them are zeroed here.
+  int next = 0;
+  for (int col : index.cols) {
+    for (; next < col; ++next)
+      std::fill(Result.row(next), Result.row(next) + C, T(0));
+    next = col + 1;
+  }
+  for (; next < A.cols(); ++next)
+    std::fill(Result.row(next), Result.row(next) + C, T(0));
+
+  scatter_rows(A, index, D, [&](int, int col) { return Result.row(col); });
+}
+
+template <typename T>
+void spmm_tn_into(const BasicCsrMatrix<T> &A, const BasicFlatMatrix<T> &D,
+                  BasicSparseRowGradient<T> &Result) {
+  NN_PROFILE_SCOPE_COUNTS("spmm_tn_sparse", 2.0 * A.nnz() * D.cols(),
+                          2.0 * sizeof(T) * A.nnz() * D.cols());
+  check_tn(A, D);
+
+  // The index gives the distinct columns up front, so Result is sized once
+  // and every one of its rows is written by scatter_rows.
+  const CsrColumnIndex &index = A.column_index();
+  Result.rows.assign(index.cols.begin(), index.cols.end());
+  Result.values.resize(static_cast<int>(index.cols.size()), D.cols());
+  scatter_rows(A, index, D, [&](int s, int) { return Result.values.row(s); });
+}
+
+#define INSTANTIATE_SPARSE_MATRIX(T)                                           \
+  template class BasicCsrMatrix<T>;                                            \
+  template void spmm_into(const BasicCsrMatrix<T> &,                           \
+                          const BasicFlatMatrix<T> &, BasicFlatMatrix<T> &,    \
+                          const GemmEpilogue<T> &);                            \
+  template void spmm_tn_into(const BasicCsrMatrix<T> &,                        \
+                             const BasicFlatMatrix<T> &,                       \
+                             BasicFlatMatrix<T> &);                            \
+  template void spmm_tn_into(const BasicCsrMatrix<T> &,                        \
+                             const BasicFlatMatrix<T> &,                       \
+                             BasicSparseRowGradient<T> &);
+
+INSTANTIATE_SPARSE_MATRIX(float)
+INSTANTIATE_SPARSE_MATRIX(double)
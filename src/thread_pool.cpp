@@ -0,0 +1,216 @@
+#include "../include/thread_pool.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <stdexcept>
+
+namespace {
+
+thread_local bool inside_parallel_region = false;
+
+// Marks the current thread as running chunks of a loop, until the scope
+// ends, also by an exception.
+class RegionGuard {
+public:
+  RegionGuard() : m_previous(inside_parallel_region) {
+    inside_parallel_region = true;
+  }
+  ~RegionGuard() { inside_parallel_region = m_previous; }
+
+  RegionGuard(const RegionGuard &) = delete;
+  RegionGuard &operator=(const RegionGuard &) = delete;
+
+private:
+  bool m_previous;
+};
+
+std::atomic<bool> deterministic_mode{false};
+
+int default_thread_count() {
+  if (const char *env = std::getenv("NN_NUM_THREADS")) {
+    int n = std::atoi(env);
+    if (n > 0)
+      return n;
+  }
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+std::unique_ptr<ThreadPool> &global_pool() {
+  static std::unique_ptr<ThreadPool> pool =
+      std::make_unique<ThreadPool>(default_thread_count());
+  return pool;
+}
+
+} // namespace
+
+ThreadPool::ThreadPool(int num_threads) : m_size(num_threads) {
+  if (num_threads <= 0) {
+    throw std::invalid_argument(
+        "ThreadPool: the number of threads has to be greater than 0");
+  }
+
+  m_slots = std::make_unique<Slot[]>(m_size);
+  m_workers.reserve(m_size - 1);
+  for (int i = 1; i < m_size; ++i)
+    m_workers.emplace_back(&ThreadPool::worker_loop, this, i);
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = true;
+  }
+  m_wake.notify_all();
+  for (std::thread &worker : m_workers)
+    worker.join();
+}
+
+int ThreadPool::size() const { return m_size; }
+
+ThreadPool &ThreadPool::global() { return *global_pool(); }
+
+void ThreadPool::run(int begin, int end, int grain, Trampoline call,
+                     void *fn) {
+  if (end <= begin)
+    return;
+
+  grain = std::max(1, grain);
+  int chunks = (end - begin + grain - 1) / grain;
+
+  if (m_size == 1 || chunks == 1 || inside_parallel_region) {
+    call(fn, begin, end);
+    return;
+  }
+
+  std::lock_guard<std::mutex> submit(m_submit);
+
+  for (int p = 0; p < m_size; ++p) {
+    std::lock_guard<std::mutex> lock(m_slots[p].mutex);
+    m_slots[p].next = static_cast<int>(static_cast<long long>(chunks) * p /
+                                       m_size);
+    m_slots[p].end = static_cast<int>(static_cast<long long>(chunks) *
+                                      (p + 1) / m_size);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_call = call;
+    m_fn = fn;
+    m_begin = begin;
+    m_end = end;
+    m_grain = grain;
+    m_pending = m_size - 1;
+    m_error = nullptr;
+    m_failed = false;
+    ++m_generation;
+  }
+  m_wake.notify_all();
+
+  work(0);
+
+  // Workers may still be inside fn, so even after a failure the loop only
+  // ends here.
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_done.wait(lock, [this] { return m_pending == 0; });
+  if (m_error) {
+    std::exception_ptr error = std::move(m_error);
+    m_error = nullptr;
+    lock.unlock();
+    std::rethrow_exception(error);
+  }
+}
+
+bool ThreadPool::take(int self, int &chunk) {
+  {
+    Slot &own = m_slots[self];
+    std::lock_guard<std::mutex> lock(own.mutex);
+    if (own.next < own.end) {
+      chunk = own.next++;
+      return true;
+    }
+  }
+
+  for (int offset = 1; offset < m_size; ++offset) {
+    Slot &victim = m_slots[(self + offset) % m_size];
+    int first, last;
+    {
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      int remaining = victim.end - victim.next;
+      if (remaining <= 0)
+        continue;
+      int stolen = (remaining + 1) / 2;
+      last = victim.end;
+      first = last - stolen;
+      victim.end = first;
+    }
+
+    chunk = first;
+    Slot &own = m_slots[self];
+    std::lock_guard<std::mutex> lock(own.mutex);
+    own.next = first + 1;
+    own.end = last;
+    return true;
+  }
+  return false;
+}
+
+void ThreadPool::work(int self) {
+  RegionGuard region;
+  try {
+    int chunk;
+    while (!m_failed.load(std::memory_order_relaxed) && take(self, chunk)) {
+      int chunk_begin = m_begin + chunk * m_grain;
+      int chunk_end = std::min(m_end, chunk_begin + m_grain);
+      m_call(m_fn, chunk_begin, chunk_end);
+    }
+  } catch (...) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_error)
+      m_error = std::current_exception();
+    m_failed = true;
+  }
+}
+
+void ThreadPool::worker_loop(int self) {
+  std::uint64_t seen = 0;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_wake.wait(lock, [&] { return m_stop || m_generation != seen; });
+      if (m_stop)
+        return;
+      seen = m_generation;
+    }
+
+    work(self);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (--m_pending == 0)
+      m_done.notify_one();
+  }
+}
+
+void set_num_threads(int num_threads) {
+  if (num_threads <= 0) {
+    throw std::invalid_argument(
+        "set_num_threads: the number of threads has to be greater than 0");
+  }
+  if (global_pool()->size() == num_threads)
+    return;
+  global_pool().reset();
+  global_pool() = std::make_unique<ThreadPool>(num_threads);
+}
+
+int num_threads() { return ThreadPool::global().size(); }
+
+void set_deterministic(bool enabled) { deterministic_mode = enabled; }
+
+bool deterministic() { return deterministic_mode; }
+
+int reduction_chunks(int n, int grain) {
+  grain = std::max(1, grain);
+  int chunks = std::max(1, (n + grain - 1) / grain);
+  if (deterministic())
+    return chunks;
+  return std::min(chunks, num_threads());
+}
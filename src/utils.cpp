@@ -1,126 +1,174 @@
 #include "../include/utils.hpp"
 #include "flat_matrix.hpp"
+#include "matrix_expr.hpp"
+#include "random.hpp"
+#include "thread_pool.hpp"
+#include "workspace.hpp"
+#include "profiler.hpp"
 #include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <random>
 #include <stdexcept>
 #include <vector>
 
-static std::mt19937 global_rng{static_cast<unsigned>(
-    std::chrono::high_resolution_clock::now().time_since_epoch().count())};
+static std::uint64_t clock_seed() {
+  return static_cast<std::uint64_t>(
+      std::chrono::high_resolution_clock::now().time_since_epoch().count());
+}
+
+static std::mt19937 global_rng{static_cast<unsigned>(clock_seed())};
+
+// randn_matrix draws stream RANDN_STREAM_BIT | n of the global seed for its
+// n-th call.
+static std::uint64_t global_seed = clock_seed();
+static std::atomic<std::uint64_t> next_stream{0};
+
+void set_random_seed(std::uint64_t seed) {
+  global_rng.seed(static_cast<unsigned>(seed));
+  global_seed = seed;
+  next_stream = 0;
+}
 
 double randn(double mean, double stddev) {
   std::normal_distribution<double> dist(mean, stddev);
   return dist(global_rng);
 }
 
-FlatMatrix randn_matrix(int rows, int cols, double mean, double stddev,
-                        double scale) {
-  FlatMatrix M(rows, cols, 0.0);
-
-  for (int i = 0; i < rows; ++i) {
-    for (int j = 0; j < cols; ++j) {
-      double val = randn(mean, stddev) * scale;
-      M.set(i, j, val);
-    }
-  }
+template <typename T>
+BasicFlatMatrix<T> randn_matrix(int rows, int cols, double mean, double stddev,
+                                double scale) {
+  BasicFlatMatrix<T> M(rows, cols);
+  fill_normal(M, global_seed, RANDN_STREAM_BIT | next_stream++, mean * scale,
+              stddev * scale);
   return M;
 }
 
-FlatMatrix create_matrix(int rows, int cols, double initVal) {
-  return FlatMatrix(rows, cols, initVal);
+template <typename T>
+BasicFlatMatrix<T> create_matrix(int rows, int cols, T initVal) {
+  return BasicFlatMatrix<T>(rows, cols, initVal);
 }
 
-FlatMatrix transpose(const FlatMatrix &M) {
+template <typename T>
+BasicFlatMatrix<T> transpose(const BasicFlatMatrix<T> &M) {
+  NN_PROFILE_SCOPE_COUNTS("transpose", 0,
+                          2.0 * sizeof(T) * M.rows() * M.cols());
   int R = M.rows();
   int C = M.cols();
 
-  FlatMatrix T(C, R, 0.0);
-  for (int i = 0; i < R; ++i) {
-    for (int j = 0; j < C; ++j) {
-      T.set(j, i, M.get(i, j));
+  BasicFlatMatrix<T> Mt(C, R, T(0));
+
+  // 32 x 32 tiles keep both the rows read and the rows written in cache.
+  const int TILE = 32;
+  parallel_for(0, R, TILE, [&](int i0, int i1) {
+    for (int j0 = 0; j0 < C; j0 += TILE) {
+      int j1 = std::min(C, j0 + TILE);
+      for (int i = i0; i < i1; ++i) {
+        const T *m = M.row(i);
+        for (int j = j0; j < j1; ++j) {
+          Mt(j, i) = m[j];
+        }
+      }
     }
-  }
-  return T;
+  });
+  return Mt;
 }
 
-std::vector<double> sum_rows(const FlatMatrix &M) {
+template <typename T> std::vector<T> sum_rows(const BasicFlatMatrix<T> &M) {
   int R = M.rows();
   int C = M.cols();
 
-  std::vector<double> sums(R, 0.0);
+  std::vector<T> sums(R, T(0));
   for (int i = 0; i < R; ++i) {
+    const T *m = M.row(i);
     for (int j = 0; j < C; ++j) {
-      sums[i] += M.get(i, j);
+      sums[i] += m[j];
     }
   }
   return sums;
 }
 
-std::vector<double> sum_cols(const FlatMatrix &M) {
-  int R = M.rows();
-  int C = M.cols();
-
-  std::vector<double> sums(C, 0.0);
-  for (int i = 0; i < R; ++i) {
-    for (int j = 0; j < C; ++j) {
-      sums[j] += M.get(i, j);
-    }
-  }
+template <typename T> std::vector<T> sum_cols(const BasicFlatMatrix<T> &M) {
+  std::vector<T> sums;
+  sum_cols_into(M, sums);
   return sums;
 }
 
-FlatMatrix elementwise_max(const FlatMatrix &M, double threshold) {
+template <typename T>
+void sum_cols_into(const BasicFlatMatrix<T> &M, std::vector<T> &sums) {
+  NN_PROFILE_SCOPE_COUNTS("sum_cols", double(M.rows()) * M.cols(),
+                          sizeof(T) * (double(M.rows()) * M.cols() + M.cols()));
   int R = M.rows();
   int C = M.cols();
 
-  FlatMatrix T(R, C, 0.0);
-  for (int i = 0; i < R; ++i) {
+  // Every chunk of rows sums into its own partial row; the partials are then
+  // added up in chunk order so the result does not depend on scheduling.
+  int chunks = reduction_chunks(R, 64);
+  int rows_per_chunk = (R + chunks - 1) / chunks;
+  WorkspaceScope scratch;
+  T *partial = scratch.allocate<T>(static_cast<size_t>(chunks) * C);
+  std::fill(partial, partial + static_cast<size_t>(chunks) * C, T(0));
+
+  parallel_for(0, chunks, 1, [&](int first, int last) {
+    for (int c = first; c < last; ++c) {
+      T *row_sums = partial + static_cast<size_t>(c) * C;
+      int i_end = std::min(R, (c + 1) * rows_per_chunk);
+      for (int i = c * rows_per_chunk; i < i_end; ++i) {
+        const T *m = M.row(i);
+        for (int j = 0; j < C; ++j) {
+          row_sums[j] += m[j];
+        }
+      }
+    }
+  });
+
+  sums.assign(C, T(0));
+  for (int c = 0; c < chunks; ++c) {
     for (int j = 0; j < C; ++j) {
-      double element_max = std::max(M.get(i, j), threshold);
-      T.set(i, j, element_max);
+      sums[j] += partial[static_cast<size_t>(c) * C + j];
     }
   }
-  return T;
 }
 
-FlatMatrix elementwise_mul(const FlatMatrix &A, const FlatMatrix &B) {
+template <typename T>
+BasicFlatMatrix<T> elementwise_max(const BasicFlatMatrix<T> &M,
+                                   typename BasicFlatMatrix<T>::value_type
+                                       threshold) {
+  return BasicFlatMatrix<T>(nn::expr::max(M, threshold));
+}
+
+template <typename T>
+BasicFlatMatrix<T> elementwise_mul(const BasicFlatMatrix<T> &A,
+                                   const BasicFlatMatrix<T> &B) {
+  NN_PROFILE_SCOPE_COUNTS("elementwise_mul", double(A.rows()) * A.cols(),
+                          3.0 * sizeof(T) * A.rows() * A.cols());
   if (A.cols() != B.cols() || A.rows() != B.rows()) {
     throw std::invalid_argument("elementwise_mul: cols A and cols B AND rows A "
                                 "and Rows B have to match!");
   }
 
-  int R = A.rows();
-  int C = A.cols();
-
-  FlatMatrix M(R, C, 0.0);
-  for (int i = 0; i < R; ++i) {
-    for (int j = 0; j < C; ++j) {
-      double element_mul = A.get(i, j) * B.get(i, j);
-      M.set(i, j, element_mul);
-    }
-  }
-  return M;
+  return BasicFlatMatrix<T>(nn::expr::hadamard(A, B));
 }
 
-FlatMatrix softmax_jacobian(const std::vector<double> &p) {
-  FlatMatrix D(p.size(), p.size(), 0.0);
+template <typename T>
+BasicFlatMatrix<T> softmax_jacobian(const std::vector<T> &p) {
+  BasicFlatMatrix<T> D(p.size(), p.size(), T(0));
 
   int R = D.rows();
-  int C = D.cols();
   for (int i = 0; i < R; ++i) {
-    D.set(i, i, p[i]);
+    D(i, i) = p[i];
   }
 
   int n = static_cast<int>(p.size());
-  FlatMatrix P(n, n, 0.0);
+  BasicFlatMatrix<T> P(n, n, T(0));
   for (int i = 0; i < n; ++i) {
+    T *row = P.row(i);
     for (int j = 0; j < n; ++j) {
-      P.set(i, j, p[i] * p[j]);
+      row[j] = p[i] * p[j];
     }
   }
 
-  FlatMatrix J = subtract(D, P);
+  BasicFlatMatrix<T> J = subtract(D, P);
 
   return J;
 }
@@ -143,4 +191,20 @@ double numerical_gradient(std::function<double(const FlatMatrix &)> f,
 
   double gradient_approx = (f_plus - f_minus) / (2.0 * eps);
   return gradient_approx;
-}
\ No newline at end of file
+}
+
+#define INSTANTIATE_UTILS(T)                                                   \
+  template BasicFlatMatrix<T> randn_matrix<T>(int, int, double, double,        \
+                                              double);                         \
+  template BasicFlatMatrix<T> create_matrix<T>(int, int, T);                   \
+  template BasicFlatMatrix<T> transpose(const BasicFlatMatrix<T> &);           \
+  template std::vector<T> sum_rows(const BasicFlatMatrix<T> &);                \
+  template std::vector<T> sum_cols(const BasicFlatMatrix<T> &);                \
+  template void sum_cols_into(const BasicFlatMatrix<T> &, std::vector<T> &);   \
+  template BasicFlatMatrix<T> elementwise_max(const BasicFlatMatrix<T> &, T);  \
+  template BasicFlatMatrix<T> elementwise_mul(const BasicFlatMatrix<T> &,      \
+                                              const BasicFlatMatrix<T> &);     \
+  template BasicFlatMatrix<T> softmax_jacobian(const std::vector<T> &);
+
+INSTANTIATE_UTILS(float)
+INSTANTIATE_UTILS(double)
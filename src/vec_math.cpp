@@ -0,0 +1,484 @@
+#include "../include/vec_math.hpp"
+#include "workspace.hpp"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define NN_VEC_MATH_X86 1
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// Range reduction and polynomial constants. exp(x) = 2^n * exp(r) with
+// |r| <= ln2 / 2 and exp(r) from its Taylor series; log(x) = e * ln2 +
+// 2 atanh(s) with s = (m - 1) / (m + 1), m in [sqrt(1/2), sqrt(2)], so
+// |s| <= 0.172 and the odd atanh series converges fast. ln2 is split into
+// a short high part and a correction so n * LN2_HI is exact.
+template <typename T> struct MathConstants;
+
+template <> struct MathConstants<float> {
+  static constexpr float EXP_LO = -87.3365447f;  // ln(FLT_MIN)
+  static constexpr float EXP_HI = 88.7228391f;   // ln(FLT_MAX)
+  static constexpr float LN2_HI = 0.693359375f;
+  static constexpr float LN2_LO = -2.12194440e-4f;
+  static constexpr int EXP_DEGREE = 7;
+  static constexpr int LOG_TERMS = 5;
+};
+
+template <> struct MathConstants<double> {
+  static constexpr double EXP_LO = -708.39641853226408; // ln(DBL_MIN)
+  static constexpr double EXP_HI = 709.78271289338397;  // ln(DBL_MAX)
+  static constexpr double LN2_HI = 6.93145751953125e-1;
+  static constexpr double LN2_LO = 1.42860682030941723212e-6;
+  static constexpr int EXP_DEGREE = 13;
+  static constexpr int LOG_TERMS = 11;
+};
+
+// 1 / k! for the exp polynomial and 1 / (2k + 1) for the atanh series.
+template <typename T> struct Coefficients {
+  static constexpr int D = MathConstants<T>::EXP_DEGREE;
+  static constexpr int L = MathConstants<T>::LOG_TERMS;
+  T inv_factorial[D + 1];
+  T inv_odd[L];
+
+  constexpr Coefficients() : inv_factorial(), inv_odd() {
+    double factorial = 1.0;
+    for (int k = 0; k <= D; ++k) {
+      factorial *= k > 0 ? k : 1;
+      inv_factorial[k] = static_cast<T>(1.0 / factorial);
+    }
+    for (int k = 0; k < L; ++k)
+      inv_odd[k] = static_cast<T>(1.0 / (2 * k + 1));
+  }
+};
+
+template <typename T> constexpr Coefficients<T> COEFFS{};
+
+template <typename T> struct Kernels {
+  void (*exp_sum)(const T *x, T shift, T *out, int n, T *sum);
+  void (*log)(const T *x, T *out, int n);
+  T (*max)(const T *x, int n);
+  void (*scale)(T *x, T factor, int n);
+};
+
+template <typename T>
+void exp_sum_scalar(const T *x, T shift, T *out, int n, T *sum) {
+  T s = 0;
+  for (int i = 0; i < n; ++i) {
+    out[i] = std::exp(x[i] - shift);
+    s += out[i];
+  }
+  if (sum)
+    *sum = s;
+}
+
+template <typename T> void log_scalar(const T *x, T *out, int n) {
+  for (int i = 0; i < n; ++i)
+    out[i] = std::log(x[i]);
+}
+
+template <typename T> T max_scalar(const T *x, int n) {
+  T m = -std::numeric_limits<T>::infinity();
+  for (int i = 0; i < n; ++i)
+    m = std::max(m, x[i]);
+  return m;
+}
+
+template <typename T> void scale_scalar(T *x, T factor, int n) {
+  for (int i = 0; i < n; ++i)
+    x[i] *= factor;
+}
+
+#ifdef NN_VEC_MATH_X86
+#define NN_AVX2 __attribute__((target("avx2,fma"), always_inline)) inline
+
+// Thin wrappers so the kernels below are written once for both types.
+struct Avx2Float {
+  using T = float;
+  using V = __m256;
+  static constexpr int LANES = 8;
+
+  NN_AVX2 static V load(const T *p) { return _mm256_loadu_ps(p); }
+  NN_AVX2 static void store(T *p, V v) { _mm256_storeu_ps(p, v); }
+  NN_AVX2 static V set1(T v) { return _mm256_set1_ps(v); }
+  NN_AVX2 static V add(V a, V b) { return _mm256_add_ps(a, b); }
+  NN_AVX2 static V sub(V a, V b) { return _mm256_sub_ps(a, b); }
+  NN_AVX2 static V mul(V a, V b) { return _mm256_mul_ps(a, b); }
+  NN_AVX2 static V div(V a, V b) { return _mm256_div_ps(a, b); }
+  NN_AVX2 static V fma(V a, V b, V c) { return _mm256_fmadd_ps(a, b, c); }
+  NN_AVX2 static V max(V a, V b) { return _mm256_max_ps(a, b); }
+  NN_AVX2 static V min(V a, V b) { return _mm256_min_ps(a, b); }
+  NN_AVX2 static V round(V a) {
+    return _mm256_round_ps(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  }
+  NN_AVX2 static V lt(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+  NN_AVX2 static V gt(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+  NN_AVX2 static V eq(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); }
+  NN_AVX2 static V is_nan(V a) { return _mm256_cmp_ps(a, a, _CMP_UNORD_Q); }
+  NN_AVX2 static V either(V a, V b) { return _mm256_or_ps(a, b); }
+  // mask ? a : b
+  NN_AVX2 static V select(V mask, V a, V b) {
+    return _mm256_blendv_ps(b, a, mask);
+  }
+
+  // 2^n for integral n in [-126, 127].
+  NN_AVX2 static V pow2(V n) {
+    __m256i bits = _mm256_add_epi32(_mm256_cvtps_epi32(n),
+                                    _mm256_set1_epi32(127));
+    return _mm256_castsi256_ps(_mm256_slli_epi32(bits, 23));
+  }
+
+  // x = m * 2^e with m in [1, 2), for positive normal x.
+  NN_AVX2 static V split(V x, V *e) {
+    __m256i bits = _mm256_castps_si256(x);
+    __m256i exponent = _mm256_sub_epi32(_mm256_srli_epi32(bits, 23),
+                                        _mm256_set1_epi32(127));
+    *e = _mm256_cvtepi32_ps(exponent);
+    __m256i mantissa = _mm256_or_si256(
+        _mm256_and_si256(bits, _mm256_set1_epi32(0x007fffff)),
+        _mm256_set1_epi32(0x3f800000));
+    return _mm256_castsi256_ps(mantissa);
+  }
+
+  NN_AVX2 static T hsum(V v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v),
+                          _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+  }
+
+  NN_AVX2 static T hmax(V v) {
+    __m128 s = _mm_max_ps(_mm256_castps256_ps128(v),
+                          _mm256_extractf128_ps(v, 1));
+    s = _mm_max_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_max_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+  }
+};
+
+struct Avx2Double {
+  using T = double;
+  using V = __m256d;
+  static constexpr int LANES = 4;
+
+  NN_AVX2 static V load(const T *p) { return _mm256_loadu_pd(p); }
+  NN_AVX2 static void store(T *p, V v) { _mm256_storeu_pd(p, v); }
+  NN_AVX2 static V set1(T v) { return _mm256_set1_pd(v); }
+  NN_AVX2 static V add(V a, V b) { return _mm256_add_pd(a, b); }
+  NN_AVX2 static V sub(V a, V b) { return _mm256_sub_pd(a, b); }
+  NN_AVX2 static V mul(V a, V b) { return _mm256_mul_pd(a, b); }
+  NN_AVX2 static V div(V a, V b) { return _mm256_div_pd(a, b); }
+  NN_AVX2 static V fma(V a, V b, V c) { return _mm256_fmadd_pd(a, b, c); }
+  NN_AVX2 static V max(V a, V b) { return _mm256_max_pd(a, b); }
+  NN_AVX2 static V min(V a, V b) { return _mm256_min_pd(a, b); }
+  NN_AVX2 static V round(V a) {
+    return _mm256_round_pd(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  }
+  NN_AVX2 static V lt(V a, V b) { return _mm256_cmp_pd(a, b, _CMP_LT_OQ); }
+  NN_AVX2 static V gt(V a, V b) { return _mm256_cmp_pd(a, b, _CMP_GT_OQ); }
+  NN_AVX2 static V eq(V a, V b) { return _mm256_cmp_pd(a, b, _CMP_EQ_OQ); }
+  NN_AVX2 static V is_nan(V a) { return _mm256_cmp_pd(a, a, _CMP_UNORD_Q); }
+  NN_AVX2 static V either(V a, V b) { return _mm256_or_pd(a, b); }
+  NN_AVX2 static V select(V mask, V a, V b) {
+    return _mm256_blendv_pd(b, a, mask);
+  }
+
+  // 2^n for integral n in [-1022, 1023]. AVX2 has no double -> int64
+  // conversion, so n is added to 1.5 * 2^52, which leaves it in the low
+  // mantissa bits; only the low 11 bits survive the shift into the
+  // exponent field.
+  NN_AVX2 static V pow2(V n) {
+    const V magic = set1(6755399441055744.0);
+    __m256i bits = _mm256_castpd_si256(add(n, magic));
+    bits = _mm256_add_epi64(bits, _mm256_set1_epi64x(1023));
+    return _mm256_castsi256_pd(_mm256_slli_epi64(bits, 52));
+  }
+
+  // x = m * 2^e with m in [1, 2), for positive normal x. The biased
+  // exponent is turned into a double by placing it in the mantissa of 2^52.
+  NN_AVX2 static V split(V x, V *e) {
+    __m256i bits = _mm256_castpd_si256(x);
+    __m256i biased = _mm256_srli_epi64(bits, 52);
+    const V two52 = set1(4503599627370496.0);
+    V exponent = _mm256_castsi256_pd(
+        _mm256_or_si256(biased, _mm256_castpd_si256(two52)));
+    *e = sub(exponent, set1(4503599627370496.0 + 1023.0));
+    __m256i mantissa = _mm256_or_si256(
+        _mm256_and_si256(bits, _mm256_set1_epi64x(0x000fffffffffffffLL)),
+        _mm256_set1_epi64x(0x3ff0000000000000LL));
+    return _mm256_castsi256_pd(mantissa);
+  }
+
+  NN_AVX2 static T hsum(V v) {
+    __m128d s = _mm_add_pd(_mm256_castpd256_pd128(v),
+                           _mm256_extractf128_pd(v, 1));
+    s = _mm_add_sd(s, _mm_unpackhi_pd(s, s));
+    return _mm_cvtsd_f64(s);
+  }
+
+  NN_AVX2 static T hmax(V v) {
+    __m128d s = _mm_max_pd(_mm256_castpd256_pd128(v),
+                           _mm256_extractf128_pd(v, 1));
+    s = _mm_max_sd(s, _mm_unpackhi_pd(s, s));
+    return _mm_cvtsd_f64(s);
+  }
+};
+
+template <typename S> NN_AVX2 typename S::V exp_v(typename S::V x) {
+  using T = typename S::T;
+  using C = MathConstants<T>;
+  using V = typename S::V;
+
+  V under = S::lt(x, S::set1(C::EXP_LO));
+  V over = S::gt(x, S::set1(C::EXP_HI));
+  V nan = S::is_nan(x);
+  V xc = S::min(S::max(x, S::set1(C::EXP_LO)), S::set1(C::EXP_HI));
+
+  V n = S::round(S::mul(xc, S::set1(static_cast<T>(1.4426950408889634))));
+  V r = S::fma(n, S::set1(-C::LN2_HI), xc);
+  r = S::fma(n, S::set1(-C::LN2_LO), r);
+
+  V p = S::set1(COEFFS<T>.inv_factorial[C::EXP_DEGREE]);
+  for (int k = C::EXP_DEGREE - 1; k >= 0; --k)
+    p = S::fma(p, r, S::set1(COEFFS<T>.inv_factorial[k]));
+
+  // 2^n is applied in two halves: near EXP_HI, n is one past the largest
+  // finite exponent and only exp(r) < 1 keeps the product finite.
+  V n_half = S::round(S::mul(n, S::set1(T(0.5))));
+  V result = S::mul(S::mul(p, S::pow2(n_half)), S::pow2(S::sub(n, n_half)));
+  result = S::select(under, S::set1(T(0)), result);
+  result = S::select(over, S::set1(std::numeric_limits<T>::infinity()),
+                     result);
+  return S::select(nan, x, result);
+}
+
+template <typename S> NN_AVX2 typename S::V log_v(typename S::V x) {
+  using T = typename S::T;
+  using C = MathConstants<T>;
+  using V = typename S::V;
+
+  V zero = S::set1(T(0));
+  V negative = S::lt(x, zero);
+  V is_zero = S::eq(x, zero);
+  V is_inf = S::eq(x, S::set1(std::numeric_limits<T>::infinity()));
+  V nan = S::is_nan(x);
+  V xc = S::max(x, S::set1(std::numeric_limits<T>::min()));
+
+  V e;
+  V m = S::split(xc, &e);
+  V high = S::gt(m, S::set1(static_cast<T>(1.4142135623730951)));
+  m = S::select(high, S::mul(m, S::set1(T(0.5))), m);
+  e = S::select(high, S::add(e, S::set1(T(1))), e);
+
+  V one = S::set1(T(1));
+  V s = S::div(S::sub(m, one), S::add(m, one));
+  V s2 = S::mul(s, s);
+  V q = S::set1(COEFFS<T>.inv_odd[C::LOG_TERMS - 1]);
+  for (int k = C::LOG_TERMS - 2; k >= 0; --k)
+    q = S::fma(q, s2, S::set1(COEFFS<T>.inv_odd[k]));
+
+  V two_s = S::add(s, s);
+  V result = S::fma(e, S::set1(C::LN2_LO), S::mul(two_s, q));
+  result = S::fma(e, S::set1(C::LN2_HI), result);
+
+  result = S::select(is_zero, S::set1(-std::numeric_limits<T>::infinity()),
+                     result);
+  result = S::select(is_inf, x, result);
+  return S::select(S::either(negative, nan),
+                   S::set1(std::numeric_limits<T>::quiet_NaN()), result);
+}
+
+// The tail of each array goes through a full-width buffer; padded lanes
+// are never stored or summed.
+template <typename S>
+__attribute__((target("avx2,fma"))) void
+exp_sum_avx2(const typename S::T *x, typename S::T shift, typename S::T *out,
+             int n, typename S::T *sum) {
+  using T = typename S::T;
+  using V = typename S::V;
+  constexpr int L = S::LANES;
+
+  V vshift = S::set1(shift);
+  V acc = S::set1(T(0));
+  int i = 0;
+  for (; i + L <= n; i += L) {
+    V y = exp_v<S>(S::sub(S::load(x + i), vshift));
+    S::store(out + i, y);
+    acc = S::add(acc, y);
+  }
+  T s = S::hsum(acc);
+  if (i < n) {
+    T buffer[L] = {};
+    std::copy(x + i, x + n, buffer);
+    S::store(buffer, exp_v<S>(S::sub(S::load(buffer), vshift)));
+    for (int j = 0; j < n - i; ++j) {
+      out[i + j] = buffer[j];
+      s += buffer[j];
+    }
+  }
+  if (sum)
+    *sum = s;
+}
+
+template <typename S>
+__attribute__((target("avx2,fma"))) void
+log_avx2(const typename S::T *x, typename S::T *out, int n) {
+  using T = typename S::T;
+  constexpr int L = S::LANES;
+
+  int i = 0;
+  for (; i + L <= n; i += L)
+    S::store(out + i, log_v<S>(S::load(x + i)));
+  if (i < n) {
+    T buffer[L];
+    std::fill(buffer, buffer + L, T(1));
+    std::copy(x + i, x + n, buffer);
+    S::store(buffer, log_v<S>(S::load(buffer)));
+    std::copy(buffer, buffer + (n - i), out + i);
+  }
+}
+
+template <typename S>
+__attribute__((target("avx2,fma"))) typename S::T
+max_avx2(const typename S::T *x, int n) {
+  using T = typename S::T;
+  constexpr int L = S::LANES;
+
+  T m = -std::numeric_limits<T>::infinity();
+  int i = 0;
+  if (n >= L) {
+    typename S::V acc = S::load(x);
+    for (i = L; i + L <= n; i += L)
+      acc = S::max(acc, S::load(x + i));
+    m = S::hmax(acc);
+  }
+  for (; i < n; ++i)
+    m = std::max(m, x[i]);
+  return m;
+}
+
+template <typename S>
+__attribute__((target("avx2,fma"))) void
+scale_avx2(typename S::T *x, typename S::T factor, int n) {
+  constexpr int L = S::LANES;
+  typename S::V f = S::set1(factor);
+  int i = 0;
+  for (; i + L <= n; i += L)
+    S::store(x + i, S::mul(S::load(x + i), f));
+  for (; i < n; ++i)
+    x[i] *= factor;
+}
+
+template <typename T> struct Avx2Traits;
+template <> struct Avx2Traits<float> {
+  using type = Avx2Float;
+};
+template <> struct Avx2Traits<double> {
+  using type = Avx2Double;
+};
+#endif
+
+template <typename T> Kernels<T> select_kernels() {
+#ifdef NN_VEC_MATH_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    using S = typename Avx2Traits<T>::type;
+    return {exp_sum_avx2<S>, log_avx2<S>, max_avx2<S>, scale_avx2<S>};
+  }
+#endif
+  return {exp_sum_scalar<T>, log_scalar<T>, max_scalar<T>, scale_scalar<T>};
+}
+
+template <typename T> const Kernels<T> &kernels() {
+  static const Kernels<T> k = select_kernels<T>();
+  return k;
+}
+
+// Row length handled per block by softmax_row; small enough to stay in L1
+// between its max and exp passes.
+constexpr int SOFTMAX_BLOCK = 1024;
+
+} // namespace
+
+template <typename T> void vec_exp(const T *x, T *out, int n) {
+  kernels<T>().exp_sum(x, T(0), out, n, nullptr);
+}
+
+template <typename T> void vec_log(const T *x, T *out, int n) {
+  kernels<T>().log(x, out, n);
+}
+
+template <typename T> T vec_max(const T *x, int n) {
+  return kernels<T>().max(x, n);
+}
+
+template <typename T> T vec_exp_sum(const T *x, T shift, T *out, int n) {
+  T sum;
+  kernels<T>().exp_sum(x, shift, out, n, &sum);
+  return sum;
+}
+
+template <typename T> void vec_scale(T *x, T factor, int n) {
+  kernels<T>().scale(x, factor, n);
+}
+
+template <typename T> void softmax_row(const T *in, T *out, int n) {
+  const Kernels<T> &k = kernels<T>();
+  if (n <= SOFTMAX_BLOCK) {
+    T sum;
+    k.exp_sum(in, k.max(in, n), out, n, &sum);
+    k.scale(out, T(1) / sum, n);
+    return;
+  }
+
+  // Online softmax over blocks: keep the running maximum and the sum
+  // relative to it, and remember each block's own maximum for the final
+  // rescale.
+  int blocks = (n + SOFTMAX_BLOCK - 1) / SOFTMAX_BLOCK;
+  WorkspaceScope scratch;
+  T *block_max = scratch.allocate<T>(blocks);
+
+  T running_max = -std::numeric_limits<T>::infinity();
+  T running_sum = 0;
+  for (int b = 0; b < blocks; ++b) {
+    int first = b * SOFTMAX_BLOCK;
+    int count = std::min(SOFTMAX_BLOCK, n - first);
+    T m = k.max(in + first, count);
+    block_max[b] = m;
+    if (m == -std::numeric_limits<T>::infinity()) {
+      // Contributes nothing; exp(-inf - -inf) would be NaN.
+      std::fill(out + first, out + first + count, T(0));
+      continue;
+    }
+    T s;
+    k.exp_sum(in + first, m, out + first, count, &s);
+    if (m > running_max) {
+      running_sum = running_sum * std::exp(running_max - m) + s;
+      running_max = m;
+    } else {
+      running_sum += s * std::exp(m - running_max);
+    }
+  }
+
+  T inv_sum = T(1) / running_sum;
+  for (int b = 0; b < blocks; ++b) {
+    int first = b * SOFTMAX_BLOCK;
+    int count = std::min(SOFTMAX_BLOCK, n - first);
+    k.scale(out + first, std::exp(block_max[b] - running_max) * inv_sum,
+            count);
+  }
+}
+
+#define INSTANTIATE_VEC_MATH(T)                                                \
+  template void vec_exp(const T *, T *, int);                                  \
+  template void vec_log(const T *, T *, int);                                  \
+  template T vec_max(const T *, int);                                          \
+  template T vec_exp_sum(const T *, T, T *, int);                              \
+  template void vec_scale(T *, T, int);                                        \
+  template void softmax_row(const T *, T *, int);
+
+INSTANTIATE_VEC_MATH(float)
+INSTANTIATE_VEC_MATH(double)
@@ -0,0 +1,98 @@
+#include "../include/workspace.hpp"
+#include <algorithm>
+#include <atomic>
+#include <new>
+
+namespace {
+
+std::atomic<std::size_t> heap_allocations{0};
+thread_local std::size_t thread_heap_allocations = 0;
+
+constexpr std::size_t ALIGNMENT = 64;
+constexpr std::size_t MIN_BLOCK = 1 << 17;
+
+std::size_t round_up(std::size_t n) {
+  return (n + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+}
+
+} // namespace
+
+std::size_t heap_allocation_count() { return heap_allocations; }
+
+std::size_t thread_heap_allocation_count() { return thread_heap_allocations; }
+
+void record_heap_allocation() {
+  heap_allocations.fetch_add(1, std::memory_order_relaxed);
+  ++thread_heap_allocations;
+}
+
+Workspace::~Workspace() { free_blocks(); }
+
+void Workspace::add_block(std::size_t n) {
+  unsigned char *data = static_cast<unsigned char *>(
+      ::operator new(n, std::align_val_t(ALIGNMENT)));
+  record_heap_allocation();
+  m_blocks.push_back(Block{data, n, 0});
+}
+
+void Workspace::free_blocks() {
+  for (Block &block : m_blocks)
+    ::operator delete(block.data, std::align_val_t(ALIGNMENT));
+  m_blocks.clear();
+  m_current = 0;
+}
+
+void *Workspace::allocate_bytes(std::size_t n) {
+  n = round_up(std::max<std::size_t>(n, 1));
+
+  while (m_current < m_blocks.size()) {
+    Block &block = m_blocks[m_current];
+    if (block.size - block.used >= n) {
+      unsigned char *ptr = block.data + block.used;
+      block.used += n;
+      return ptr;
+    }
+    if (m_current + 1 == m_blocks.size())
+      break;
+    ++m_current;
+  }
+
+  add_block(std::max(n, std::max(MIN_BLOCK, capacity())));
+  m_current = m_blocks.size() - 1;
+  m_blocks.back().used = n;
+  return m_blocks.back().data;
+}
+
+Workspace::Mark Workspace::mark() const {
+  if (m_blocks.empty())
+    return Mark{0, 0};
+  return Mark{m_current, m_blocks[m_current].used};
+}
+
+void Workspace::release(const Mark &mark) {
+  if (m_blocks.empty())
+    return;
+
+  for (std::size_t b = mark.block + 1; b < m_blocks.size(); ++b)
+    m_blocks[b].used = 0;
+  m_blocks[mark.block].used = mark.used;
+  m_current = mark.block;
+
+  if (mark.block == 0 && mark.used == 0 && m_blocks.size() > 1) {
+    std::size_t total = capacity();
+    free_blocks();
+    add_block(total);
+  }
+}
+
+std::size_t Workspace::capacity() const {
+  std::size_t total = 0;
+  for (const Block &block : m_blocks)
+    total += block.size;
+  return total;
+}
+
+Workspace &Workspace::local() {
+  thread_local Workspace workspace;
+  return workspace;
+}
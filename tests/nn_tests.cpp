@@ -0,0 +1,1436 @@
+// Behaviour checks for the library, one function per feature. Runs every
+// test, or only those whose name contains one of the command-line
+// arguments, and exits non-zero if any check failed.
+
+#include "activation_relu.hpp"
+#include "activation_softmax.hpp"
+#include "activation_softmax_loss_cce.hpp"
+#include "categorical_cross_entropy.hpp"
+#include "checkpoint.hpp"
+#include "data_parallel.hpp"
+#include "dataset.hpp"
+#include "execution_plan.hpp"
+#include "flat_matrix.hpp"
+#include "gemm.hpp"
+#include "inference_server.hpp"
+#include "layer.hpp"
+#include "layer_dense.hpp"
+#include "layer_dense_relu.hpp"
+#include "matrix_expr.hpp"
+#include "optimizer_adam.hpp"
+#include "optimizer_sgd.hpp"
+#include "profiler.hpp"
+#include "quantized_dense.hpp"
+#include "random.hpp"
+#include "sequential.hpp"
+#include "sparse_matrix.hpp"
+#include "static_dense.hpp"
+#include "static_matrix.hpp"
+#include "thread_pool.hpp"
+#include "utils.hpp"
+#include "vec_math.hpp"
+#include "workspace.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <stdexcept>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+namespace {
+
+// Atomic because checks also run inside parallel_for bodies.
+std::atomic<int> g_failures{0};
+
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      std::fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__,    \
+                   #cond);                                                     \
+      ++g_failures;                                                            \
+    }                                                                          \
+  } while (0)
+
+#define CHECK_NEAR(a, b, tol)                                                  \
+  do {                                                                         \
+    double a_ = (a), b_ = (b);                                                 \
+    if (!(std::fabs(a_ - b_) <= (tol))) {                                      \
+      std::fprintf(stderr, "%s:%d: CHECK_NEAR failed: %s = %.17g, %s = %.17g\n",\
+                   __FILE__, __LINE__, #a, a_, #b, b_);                        \
+      ++g_failures;                                                            \
+    }                                                                          \
+  } while (0)
+
+// True if fn() throws an E.
+template <typename E, typename Fn> bool throws(Fn fn) {
+  try {
+    fn();
+  } catch (const E &) {
+    return true;
+  } catch (...) {
+  }
+  return false;
+}
+
+struct Test {
+  const char *name;
+  void (*fn)();
+};
+
+std::vector<Test> &registry() {
+  static std::vector<Test> tests;
+  return tests;
+}
+
+struct Register {
+  Register(const char *name, void (*fn)()) { registry().push_back({name, fn}); }
+};
+
+#define TEST(name)                                                             \
+  void name();                                                                 \
+  Register register_##name(#name, name);                                       \
+  void name()
+
+template <typename T>
+BasicFlatMatrix<T> random_matrix(int rows, int cols, std::uint64_t stream) {
+  BasicFlatMatrix<T> M(rows, cols);
+  fill_normal(M, 12345, stream);
+  return M;
+}
+
+template <typename T, typename U>
+double max_diff(const BasicFlatMatrix<T> &A, const BasicFlatMatrix<U> &B) {
+  if (A.rows() != B.rows() || A.cols() != B.cols())
+    return INFINITY;
+  double d = 0.0;
+  for (int i = 0; i < A.rows(); ++i) {
+    for (int j = 0; j < A.cols(); ++j)
+      d = std::max(d, std::fabs(double(A(i, j)) - double(B(i, j))));
+  }
+  return d;
+}
+
+// op(A) * op(B) + bias, then ReLU, in double with the plain triple loop.
+template <typename T>
+BasicFlatMatrix<double>
+naive_gemm(bool transA, bool transB, const BasicFlatMatrix<T> &A,
+           const BasicFlatMatrix<T> &B, const GemmEpilogue<T> &epilogue) {
+  int M = transA ? A.cols() : A.rows();
+  int K = transA ? A.rows() : A.cols();
+  int N = transB ? B.rows() : B.cols();
+  BasicFlatMatrix<double> C(M, N);
+  for (int i = 0; i < M; ++i) {
+    for (int j = 0; j < N; ++j) {
+      double sum = epilogue.bias ? double(epilogue.bias[j]) : 0.0;
+      for (int k = 0; k < K; ++k) {
+        double a = transA ? A(k, i) : A(i, k);
+        double b = transB ? B(j, k) : B(k, j);
+        sum += a * b;
+      }
+      C(i, j) = epilogue.relu ? std::max(sum, 0.0) : sum;
+    }
+  }
+  return C;
+}
+
+// ---- packed GEMM ----------------------------------------------------------
+
+template <typename T> void check_gemm_shapes(double tol) {
+  // Shapes straddle the register and cache tile edges; K == 0 leaves only
+  // the epilogue.
+  const int sizes[] = {0, 1, 3, 7, 8, 13, 65, 130};
+  std::uint64_t stream = 0;
+  for (int M : {1, 5, 13, 65}) {
+    for (int N : {1, 3, 17, 66}) {
+      for (int K : sizes) {
+        // Matrices cannot have zero columns; for K == 0 the reference gets a
+        // zero column instead, which leaves only the epilogue as well.
+        BasicFlatMatrix<T> A = random_matrix<T>(M, std::max(K, 1), stream++);
+        BasicFlatMatrix<T> B = random_matrix<T>(std::max(K, 1), N, stream++);
+        if (K == 0) {
+          for (int i = 0; i < M; ++i)
+            A(i, 0) = T(0);
+        }
+        std::vector<T> bias(N);
+        for (int j = 0; j < N; ++j)
+          bias[j] = T(0.25) * T(j % 5) - T(0.5);
+
+        for (int variant = 0; variant < 3; ++variant) {
+          GemmEpilogue<T> epilogue;
+          epilogue.bias = variant > 0 ? bias.data() : nullptr;
+          epilogue.relu = variant == 2;
+          BasicFlatMatrix<T> C(M, N, T(42));
+          gemm(false, false, M, N, K, A.data(), A.stride(), B.data(),
+               B.stride(), C.data(), C.stride(), epilogue);
+          double scale = std::max(1.0, std::sqrt(double(K)));
+          CHECK(max_diff(C, naive_gemm(false, false, A, B, epilogue)) <=
+                tol * scale);
+        }
+      }
+    }
+  }
+}
+
+TEST(gemm_matches_naive) {
+  check_gemm_shapes<double>(1e-12);
+  check_gemm_shapes<float>(1e-4);
+}
+
+TEST(matmul_matches_naive) {
+  FlatMatrix A = random_matrix<double>(37, 129, 1);
+  FlatMatrix B = random_matrix<double>(129, 71, 2);
+  CHECK(max_diff(matmul(A, B), naive_gemm(false, false, A, B, {})) <= 1e-11);
+  CHECK(throws<std::invalid_argument>([&] { matmul(A, A); }));
+}
+
+// ---- transpose-free GEMM variants -----------------------------------------
+
+TEST(gemm_transposed_variants) {
+  std::uint64_t stream = 100;
+  for (int M : {1, 7, 33}) {
+    for (int N : {1, 9, 70}) {
+      for (int K : {1, 5, 130}) {
+        FlatMatrix At = random_matrix<double>(K, M, stream++);
+        FlatMatrix B = random_matrix<double>(K, N, stream++);
+        FlatMatrix A = random_matrix<double>(M, K, stream++);
+        FlatMatrix Bt = random_matrix<double>(N, K, stream++);
+        CHECK(max_diff(matmul_tn(At, B), naive_gemm(true, false, At, B, {})) <=
+              1e-12);
+        CHECK(max_diff(matmul_nt(A, Bt), naive_gemm(false, true, A, Bt, {})) <=
+              1e-12);
+
+        FlatMatrix C(M, N);
+        gemm(true, true, M, N, K, At.data(), At.stride(), Bt.data(),
+             Bt.stride(), C.data(), C.stride());
+        CHECK(max_diff(C, naive_gemm(true, true, At, Bt, {})) <= 1e-12);
+      }
+    }
+  }
+  FlatMatrix A = random_matrix<double>(4, 3, 1);
+  FlatMatrix AtA = matmul_tn(A, A);
+  CHECK(AtA.rows() == 3 && AtA.cols() == 3);
+  CHECK(throws<std::invalid_argument>(
+      [&] { matmul_nt(A, random_matrix<double>(4, 5, 2)); }));
+}
+
+// Gaussian blobs: class c is centred on +3 in feature c % cols.
+template <typename T>
+void make_blobs(int rows, int cols, int classes, BasicFlatMatrix<T> &X,
+                std::vector<int> &y) {
+  X = random_matrix<T>(rows, cols, 7);
+  y.resize(rows);
+  for (int i = 0; i < rows; ++i) {
+    y[i] = i % classes;
+    X(i, y[i] % cols) += T(3);
+  }
+}
+
+// Dense + ReLU into a linear output layer, with seeded weights.
+template <typename T>
+void build_mlp(BasicSequential<T> &model, int inputs, int hidden, int outputs,
+               std::uint64_t seed) {
+  model.template add<BasicLayerDenseReLU<T>>(inputs, hidden,
+                                             WeightInit::HeNormal, seed, 0);
+  model.template add<BasicLayerDense<T>>(hidden, outputs,
+                                         WeightInit::XavierNormal, seed, 1);
+}
+
+template <typename T>
+BasicLayerDense<T> &dense_layer(BasicSequential<T> &model, int i) {
+  return static_cast<BasicLayerDense<T> &>(model.layer(i));
+}
+
+// Restores the pool size and deterministic mode on scope exit.
+struct ThreadSettings {
+  int threads = num_threads();
+  bool was_deterministic = deterministic();
+  ~ThreadSettings() {
+    set_num_threads(threads);
+    set_deterministic(was_deterministic);
+  }
+};
+
+// ---- thread pool ----------------------------------------------------------
+
+TEST(parallel_for_covers_range_once) {
+  ThreadSettings restore;
+  for (int threads : {1, 2, 5}) {
+    set_num_threads(threads);
+    for (int grain : {1, 7, 1000}) {
+      std::vector<int> hits(1003, 0);
+      parallel_for(0, 1003, grain, [&](int first, int last) {
+        CHECK(first < last);
+        for (int i = first; i < last; ++i)
+          ++hits[i];
+        // Nested loops run serially on the calling worker.
+        parallel_for(0, 3, 1, [](int, int) {});
+      });
+      CHECK(std::count(hits.begin(), hits.end(), 1) == 1003);
+    }
+  }
+}
+
+TEST(parallel_for_rethrows_and_stays_parallel) {
+  ThreadSettings restore;
+  set_num_threads(4);
+  // Chunk 0 belongs to the calling thread, the last one to a worker.
+  for (int failing : {0, 63}) {
+    CHECK(throws<std::runtime_error>([&] {
+      parallel_for(0, 64, 1, [&](int first, int) {
+        if (first == failing)
+          throw std::runtime_error("chunk failed");
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+      });
+    }));
+
+    // The pool is still usable, and the caller is not stuck in serial mode.
+    std::vector<int> hits(64, 0);
+    std::mutex mutex;
+    std::vector<std::thread::id> threads;
+    parallel_for(0, 64, 1, [&](int first, int last) {
+      for (int i = first; i < last; ++i)
+        ++hits[i];
+      std::this_thread::sleep_for(std::chrono::microseconds(200));
+      std::lock_guard<std::mutex> lock(mutex);
+      threads.push_back(std::this_thread::get_id());
+    });
+    CHECK(std::count(hits.begin(), hits.end(), 1) == 64);
+    std::sort(threads.begin(), threads.end());
+    CHECK(std::unique(threads.begin(), threads.end()) - threads.begin() > 1);
+  }
+}
+
+TEST(deterministic_training_across_thread_counts) {
+  ThreadSettings restore;
+  set_deterministic(true);
+  FlatMatrix X;
+  std::vector<int> y;
+  make_blobs(300, 20, 4, X, y);
+  FitOptions options;
+  options.epochs = 2;
+  options.batch_size = 64;
+  options.verbose = false;
+
+  FlatMatrix reference;
+  for (int threads : {1, 2, 3}) {
+    set_num_threads(threads);
+    Sequential model;
+    build_mlp(model, 20, 48, 4, 1);
+    OptimizerAdam optimizer(0.01);
+    model.fit(X, y, optimizer, options);
+    if (threads == 1)
+      reference = dense_layer(model, 0).weights;
+    else
+      CHECK(max_diff(dense_layer(model, 0).weights, reference) == 0.0);
+  }
+}
+
+// ---- FlatMatrix moves and accessors ---------------------------------------
+
+TEST(flat_matrix_moves_and_accessors) {
+  FlatMatrix A = random_matrix<double>(5, 7, 3);
+  FlatMatrix copy = A;
+  const double *buffer = A.data();
+
+  FlatMatrix moved(std::move(A));
+  CHECK(moved.data() == buffer);
+  CHECK(max_diff(moved, copy) == 0.0);
+  CHECK(A.rows() == 0 && A.data() == nullptr);
+
+  FlatMatrix assigned(2, 2);
+  assigned = std::move(moved);
+  CHECK(assigned.data() == buffer);
+  CHECK(assigned.rows() == 5 && assigned.cols() == 7);
+
+  CHECK(assigned.row(3) == assigned.data() + 3 * assigned.stride());
+  CHECK(assigned(3, 4) == assigned.row(3)[4]);
+  assigned.set(1, 2, 9.5);
+  CHECK(assigned.get(1, 2) == 9.5);
+  CHECK(throws<std::out_of_range>([&] { assigned.get(5, 0); }));
+  CHECK(throws<std::out_of_range>([&] { assigned.set(0, -1, 1.0); }));
+}
+
+TEST(cce_rejects_out_of_range_labels) {
+  // Labels index the predictions through the unchecked accessor.
+  FlatMatrix probs(3, 4, 0.25);
+  LossCategoricalCrossEntropy cce;
+  CHECK_NEAR(cce.forward(probs, std::vector<int>{0, 3, 1}), std::log(4.0),
+             1e-12);
+  CHECK(throws<std::out_of_range>(
+      [&] { cce.forward(probs, std::vector<int>{0, 4, 1}); }));
+  CHECK(throws<std::out_of_range>(
+      [&] { cce.forward(probs, std::vector<int>{-1, 0, 1}); }));
+}
+
+// ---- allocation-free steady state -----------------------------------------
+
+TEST(training_step_does_not_allocate) {
+  FlatMatrix X;
+  std::vector<int> y;
+  make_blobs(64, 20, 4, X, y);
+  Sequential model;
+  model.add<LayerDense>(20, 32, WeightInit::HeNormal, 2, 0);
+  model.add<ActivationReLU>();
+  model.add<LayerDense>(32, 4, WeightInit::XavierNormal, 2, 1);
+  ActivationSoftmaxLossCategoricalCrossEntropy head;
+  OptimizerAdam optimizer(0.01);
+
+  auto step = [&] {
+    model.forward(X);
+    head.forward(model.output(), y);
+    head.backward(y);
+    model.backward(head.dinputs);
+    optimizer.pre_update_params();
+    optimizer.update_params(dense_layer(model, 0));
+    optimizer.update_params(dense_layer(model, 2));
+    optimizer.post_update_params();
+  };
+  step();
+  step();
+  std::size_t before = heap_allocation_count();
+  for (int i = 0; i < 3; ++i)
+    step();
+  CHECK(heap_allocation_count() == before);
+}
+
+// ---- fused dense + ReLU ---------------------------------------------------
+
+TEST(dense_relu_matches_dense_then_relu) {
+  FlatMatrix W = random_matrix<double>(13, 9, 20);
+  std::vector<double> b(9);
+  for (int j = 0; j < 9; ++j)
+    b[j] = 0.1 * (j - 4);
+  FlatMatrix X = random_matrix<double>(21, 13, 21);
+  FlatMatrix D = random_matrix<double>(21, 9, 22);
+
+  LayerDenseReLU fused(W, b);
+  LayerDense dense(W, b);
+  ActivationReLU relu;
+  fused.forward(X);
+  dense.forward(X);
+  relu.forward(dense.output);
+  CHECK(max_diff(fused.output, relu.output) <= 1e-14);
+
+  fused.backward(D);
+  relu.backward(D);
+  dense.backward(relu.dinputs);
+  CHECK(max_diff(fused.dweights, dense.dweights) <= 1e-13);
+  CHECK(max_diff(fused.dinputs, dense.dinputs) <= 1e-13);
+  for (int j = 0; j < 9; ++j)
+    CHECK_NEAR(fused.dbiases[j], dense.dbiases[j], 1e-13);
+}
+
+// ---- softmax + cross-entropy head -----------------------------------------
+
+TEST(softmax_cce_head_matches_separate_layers) {
+  const int R = 17, C = 6;
+  FlatMatrix logits = random_matrix<double>(R, C, 30);
+  std::vector<int> y(R);
+  for (int i = 0; i < R; ++i)
+    y[i] = (i * 5) % C;
+
+  ActivationSoftmaxLossCategoricalCrossEntropy head;
+  double loss = head.forward(logits, y);
+  head.backward(y);
+
+  ActivationSoftmax softmax;
+  LossCategoricalCrossEntropy cce;
+  softmax.forward(logits);
+  CHECK(max_diff(head.output, softmax.output) <= 1e-15);
+  CHECK_NEAR(loss, cce.forward(softmax.output, y), 1e-12);
+
+  // Gradient of the mean loss through the full softmax Jacobian.
+  FlatMatrix dprobs(R, C, 0.0);
+  for (int i = 0; i < R; ++i)
+    dprobs(i, y[i]) = -1.0 / (softmax.output(i, y[i]) * R);
+  softmax.backward(dprobs);
+  CHECK(max_diff(head.dinputs, softmax.dinputs) <= 1e-12);
+}
+
+// ---- float path -----------------------------------------------------------
+
+TEST(float_model_tracks_double_model) {
+  FlatMatrix X;
+  std::vector<int> y;
+  make_blobs(256, 16, 4, X, y);
+  FlatMatrixF XF(X.rows(), X.cols());
+  for (int i = 0; i < X.rows(); ++i) {
+    for (int j = 0; j < X.cols(); ++j)
+      XF(i, j) = static_cast<float>(X(i, j));
+  }
+
+  Sequential model;
+  SequentialF modelF;
+  build_mlp(model, 16, 32, 4, 3);
+  build_mlp(modelF, 16, 32, 4, 3);
+  CHECK(max_diff(dense_layer(modelF, 0).weights,
+                 dense_layer(model, 0).weights) <= 1e-6);
+
+  model.forward(X);
+  modelF.forward(XF);
+  CHECK(max_diff(modelF.output(), model.output()) <= 1e-4);
+
+  FitOptions options;
+  options.epochs = 5;
+  options.verbose = false;
+  OptimizerSGD optimizer(0.1);
+  OptimizerSGDF optimizerF(0.1);
+  std::vector<EpochStats> history = model.fit(X, y, optimizer, options);
+  std::vector<EpochStats> historyF = modelF.fit(XF, y, optimizerF, options);
+  CHECK(historyF.back().accuracy > 0.9);
+  CHECK_NEAR(historyF.back().loss, history.back().loss, 1e-3);
+}
+
+// ---- int8 inference -------------------------------------------------------
+
+TEST(int8_quantization_report_within_bounds) {
+  FlatMatrix X;
+  std::vector<int> y;
+  make_blobs(512, 24, 4, X, y);
+
+  // LayerDense + ActivationReLU checks the folding into a relu layer.
+  Sequential model;
+  model.add<LayerDense>(24, 64, WeightInit::HeNormal, 7, 0);
+  model.add<ActivationReLU>();
+  model.add<LayerDense>(64, 4, WeightInit::XavierNormal, 7, 1);
+  FitOptions options;
+  options.epochs = 5;
+  options.verbose = false;
+  OptimizerAdam optimizer(0.01);
+  model.fit(X, y, optimizer, options);
+
+  QuantizedSequential quantized(model);
+  CHECK(quantized.size() == 2);
+  quantized.calibrate(X);
+  QuantizationReport report = quantization_report(model, quantized, X, y);
+  CHECK(report.max_abs_error <= 0.05 * report.max_reference);
+  CHECK(report.argmax_agreement >= 0.97);
+  CHECK(report.reference_accuracy > 0.9);
+  CHECK(std::fabs(report.quantized_accuracy - report.reference_accuracy) <=
+        0.02);
+
+  QuantizedLayerDense last(dense_layer(model, 2), false);
+  last.calibrate(quantized.layer(0).output);
+  FlatMatrix hidden(X.rows(), 64);
+  for (int i = 0; i < X.rows(); ++i) {
+    for (int j = 0; j < 64; ++j)
+      hidden(i, j) = quantized.layer(0).output(i, j);
+  }
+  QuantizationReport layer_report =
+      quantization_report(dense_layer(model, 2), last, hidden);
+  CHECK(layer_report.max_abs_error <= 0.05 * layer_report.max_reference);
+  CHECK(layer_report.argmax_agreement >= 0.97);
+
+  Sequential softmax_model;
+  softmax_model.add<ActivationSoftmax>();
+  CHECK(throws<std::invalid_argument>(
+      [&] { QuantizedSequential unsupported(softmax_model); }));
+}
+
+// ---- optimizers -----------------------------------------------------------
+
+// A 6x9 layer with random gradients; `padded_storage` makes the weights
+// and their gradient strided so the optimizers take the row-by-row path.
+LayerDense layer_with_gradients(bool padded_storage) {
+  FlatMatrix weights = random_matrix<double>(6, 9, 20);
+  if (padded_storage) {
+    FlatMatrix padded = FlatMatrix::padded(6, 9);
+    padded = weights;
+    weights = std::move(padded);
+  }
+  LayerDense layer(std::move(weights), std::vector<double>(9, 0.5));
+  layer.dweights = padded_storage ? FlatMatrix::padded(6, 9) : FlatMatrix(6, 9);
+  FlatMatrix grad = random_matrix<double>(6, 9, 21);
+  for (int i = 0; i < 6; ++i) {
+    for (int j = 0; j < 9; ++j)
+      layer.dweights(i, j) = grad(i, j);
+  }
+  layer.dbiases.assign(9, 0.25);
+  return layer;
+}
+
+TEST(optimizers_match_reference_updates) {
+  for (bool padded_storage : {false, true}) {
+    // Nesterov SGD: v = mu v - lr g, p += mu v - lr g.
+    LayerDense sgd_layer = layer_with_gradients(padded_storage);
+    CHECK(sgd_layer.weights.is_contiguous() != padded_storage);
+    FlatMatrix p = sgd_layer.weights;
+    FlatMatrix v(6, 9);
+    OptimizerSGD sgd(0.1, 0.0, 0.9, true);
+    for (int step = 0; step < 3; ++step) {
+      sgd.pre_update_params();
+      sgd.update_params(sgd_layer);
+      sgd.post_update_params();
+      for (int i = 0; i < 6; ++i) {
+        for (int j = 0; j < 9; ++j) {
+          double g = sgd_layer.dweights(i, j);
+          v(i, j) = 0.9 * v(i, j) - 0.1 * g;
+          p(i, j) += 0.9 * v(i, j) - 0.1 * g;
+        }
+      }
+    }
+    CHECK(max_diff(sgd_layer.weights, p) <= 1e-12);
+
+    // AdamW with bias correction and decoupled weight decay.
+    LayerDense adam_layer = layer_with_gradients(padded_storage);
+    FlatMatrix q = adam_layer.weights;
+    FlatMatrix m(6, 9), s(6, 9);
+    const double lr = 0.01, b1 = 0.9, b2 = 0.999, eps = 1e-7, wd = 0.1;
+    OptimizerAdam adam(lr, 0.0, eps, b1, b2, wd);
+    for (int t = 1; t <= 3; ++t) {
+      adam.pre_update_params();
+      adam.update_params(adam_layer);
+      adam.post_update_params();
+      for (int i = 0; i < 6; ++i) {
+        for (int j = 0; j < 9; ++j) {
+          double g = adam_layer.dweights(i, j);
+          m(i, j) = b1 * m(i, j) + (1 - b1) * g;
+          s(i, j) = b2 * s(i, j) + (1 - b2) * g * g;
+          double m_hat = m(i, j) / (1 - std::pow(b1, t));
+          double s_hat = s(i, j) / (1 - std::pow(b2, t));
+          q(i, j) = q(i, j) * (1 - lr * wd) -
+                    lr * m_hat / (std::sqrt(s_hat) + eps);
+        }
+      }
+    }
+    CHECK(max_diff(adam_layer.weights, q) <= 1e-12);
+    double bias = 0.5;
+    double mb = 0.0, sb = 0.0;
+    for (int t = 1; t <= 3; ++t) {
+      mb = b1 * mb + (1 - b1) * 0.25;
+      sb = b2 * sb + (1 - b2) * 0.0625;
+      bias -= lr * (mb / (1 - std::pow(b1, t))) /
+              (std::sqrt(sb / (1 - std::pow(b2, t))) + eps);
+    }
+    CHECK_NEAR(adam_layer.biases[0], bias, 1e-12);
+  }
+}
+
+// ---- Sequential::fit ------------------------------------------------------
+
+TEST(sequential_fit_reports_epochs_and_learns) {
+  FlatMatrix X;
+  std::vector<int> y;
+  make_blobs(203, 12, 3, X, y); // 203 rows: the last batch is partial
+
+  std::vector<std::vector<EpochStats>> runs;
+  for (int run = 0; run < 2; ++run) {
+    Sequential model;
+    build_mlp(model, 12, 24, 3, 5);
+    OptimizerSGD optimizer(0.1, 0.0, 0.9);
+    std::vector<EpochStats> reported;
+    FitOptions options;
+    options.epochs = 6;
+    options.batch_size = 16;
+    options.seed = 11;
+    options.verbose = false;
+    options.on_epoch = [&](const EpochStats &stats) {
+      reported.push_back(stats);
+    };
+    std::vector<EpochStats> history = model.fit(X, y, optimizer, options);
+
+    CHECK(history.size() == 6 && reported.size() == 6);
+    for (std::size_t e = 0; e < history.size() && e < reported.size(); ++e) {
+      CHECK(history[e].epoch == static_cast<int>(e) + 1);
+      CHECK(reported[e].loss == history[e].loss);
+      CHECK(reported[e].accuracy == history[e].accuracy);
+    }
+    CHECK(history.back().loss < history.front().loss);
+    CHECK(history.back().accuracy > 0.95);
+    EpochStats eval = model.evaluate(X, y, 50);
+    CHECK(eval.accuracy > 0.95);
+    runs.push_back(history);
+  }
+  // Same seed, same shuffles and weights: the same run.
+  CHECK(runs[0].back().loss == runs[1].back().loss);
+
+  Sequential model;
+  build_mlp(model, 12, 24, 3, 5);
+  OptimizerSGD optimizer(0.1);
+  FitOptions bad;
+  bad.batch_size = 0;
+  CHECK(throws<std::invalid_argument>(
+      [&] { model.fit(X, y, optimizer, bad); }));
+  std::vector<int> short_y(y.begin(), y.end() - 1);
+  CHECK(throws<std::invalid_argument>(
+      [&] { model.fit(X, short_y, optimizer); }));
+}
+
+// ---- binary datasets ------------------------------------------------------
+
+std::string temp_path(const std::string &name) {
+  return (std::filesystem::temp_directory_path() /
+          ("nn_tests_" + std::to_string(::getpid()) + "_" + name))
+      .string();
+}
+
+void write_text(const std::string &path, const std::string &text) {
+  std::ofstream out(path, std::ios::binary);
+  out << text;
+}
+
+TEST(dataset_csv_round_trip) {
+  std::string csv = temp_path("data.csv");
+  std::string bin = temp_path("data.bin");
+  write_text(csv, "a,b,label\n"
+                  "1.5,-2,3\n"
+                  "\n"
+                  "0.25,4e3,0\r\n"
+                  "-7,0.125,2147483647\n");
+  CsvOptions options;
+  options.header = true;
+  options.label_column = -1;
+  for (DatasetDtype dtype : {DatasetDtype::Float32, DatasetDtype::Float64}) {
+    options.dtype = dtype;
+    CHECK(convert_csv_to_dataset(csv, bin, options) == 3);
+    MappedDataset data(bin);
+    CHECK(data.rows() == 3 && data.cols() == 2 && data.dtype() == dtype);
+    CHECK(data.labels(0, 3) == std::vector<int>({3, 0, 2147483647}));
+    const double expected[3][2] = {{1.5, -2}, {0.25, 4e3}, {-7, 0.125}};
+    for (int i = 0; i < 3; ++i) {
+      for (int j = 0; j < 2; ++j) {
+        double v = dtype == DatasetDtype::Float32
+                       ? data.features<float>()(i, j)
+                       : data.features<double>()(i, j);
+        CHECK(v == expected[i][j]);
+      }
+    }
+  }
+
+  // write_dataset of a padded matrix round-trips its values, not its stride.
+  FlatMatrixF X = FlatMatrixF::padded(5, 3);
+  for (int i = 0; i < 5; ++i) {
+    for (int j = 0; j < 3; ++j)
+      X(i, j) = static_cast<float>(10 * i + j);
+  }
+  write_dataset(bin, X, {0, 1, 2, 3, 4});
+  MappedDataset data(bin);
+  CHECK(max_diff(data.features<float>(1, 4), X.block(1, 0, 4, 3)) == 0.0);
+  CHECK(throws<std::invalid_argument>([&] { data.features<double>(); }));
+  CHECK(throws<std::out_of_range>([&] { data.features<float>(3, 3); }));
+
+  // Labels have to be int32 values; a failed conversion leaves no file.
+  for (const char *label : {"1.5", "nan", "3e9", "-2147483649"}) {
+    std::remove(bin.c_str());
+    write_text(csv, std::string("0,1,2\n") + label + ",3,4\n");
+    CHECK(throws<std::invalid_argument>(
+        [&] { convert_csv_to_dataset(csv, bin); }));
+    CHECK(!std::filesystem::exists(bin));
+  }
+  std::remove(csv.c_str());
+}
+
+// ---- checkpoints ----------------------------------------------------------
+
+TEST(checkpoint_save_load_map_round_trip) {
+  FlatMatrix X;
+  std::vector<int> y;
+  make_blobs(64, 10, 3, X, y);
+  Sequential model;
+  build_mlp(model, 10, 16, 3, 8);
+  OptimizerAdam optimizer(0.01);
+  FitOptions options;
+  options.epochs = 2;
+  options.verbose = false;
+  model.fit(X, y, optimizer, options);
+  FlatMatrix expected = model.predict(X);
+
+  std::string path = temp_path("model.ckpt");
+  OptimizerState saved = optimizer_state(optimizer);
+  save_checkpoint(path, model, &saved);
+
+  OptimizerState state;
+  Sequential copy = load_checkpoint<double>(path, {}, &state);
+  CHECK(copy.size() == model.size());
+  CHECK(state.iterations == saved.iterations);
+  CHECK(state.current_learning_rate == saved.current_learning_rate);
+  CHECK(max_diff(copy.predict(X), expected) == 0.0);
+  CHECK(max_diff(dense_layer(copy, 1).weight_cache,
+                 dense_layer(model, 1).weight_cache) == 0.0);
+
+  CheckpointLoadOptions map_options;
+  map_options.map = true;
+  Sequential mapped = load_checkpoint<double>(path, map_options, &state);
+  CHECK(max_diff(mapped.predict(X), expected) == 0.0);
+  CHECK(state.iterations == 0 && state.current_learning_rate == 0.0);
+  // Mapped weights are private: writing them neither faults nor reaches
+  // the file.
+  dense_layer(mapped, 0).weights(0, 0) += 1.0;
+  CHECK(max_diff(load_checkpoint<double>(path).predict(X), expected) == 0.0);
+  dense_layer(mapped, 0).weights(0, 0) -= 1.0;
+
+  // Saving over the mapped file leaves the mapped model intact.
+  Sequential other;
+  build_mlp(other, 10, 16, 3, 9);
+  save_checkpoint(path, other);
+  CHECK(max_diff(mapped.predict(X), expected) == 0.0);
+  CHECK(max_diff(load_checkpoint<double>(path).predict(X),
+                 other.predict(X)) == 0.0);
+
+  CHECK(throws<std::invalid_argument>(
+      [&] { load_checkpoint<float>(path); }));
+
+  // A flipped byte fails the checksum; a record whose rows * cols * 8
+  // overflows is rejected even unverified.
+  std::vector<char> bytes;
+  {
+    std::ifstream in(path, std::ios::binary);
+    bytes.assign(std::istreambuf_iterator<char>(in), {});
+  }
+  auto write_bytes = [&](const std::vector<char> &b) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(b.data(), static_cast<std::streamsize>(b.size()));
+  };
+  std::vector<char> flipped = bytes;
+  flipped.back() ^= 1;
+  write_bytes(flipped);
+  CHECK(throws<std::runtime_error>([&] { load_checkpoint<double>(path); }));
+  // Mapped loads skip the hash unless asked for it.
+  CHECK(load_checkpoint<double>(path, map_options).size() == model.size());
+  map_options.verify_mapped = true;
+  CHECK(throws<std::runtime_error>(
+      [&] { load_checkpoint<double>(path, map_options); }));
+
+  std::vector<char> huge = bytes;
+  const std::uint64_t big = 0x7FFFFFFF;
+  std::size_t record = sizeof(CheckpointHeader);
+  std::memcpy(&huge[record + offsetof(CheckpointLayerRecord, rows)], &big, 8);
+  std::memcpy(&huge[record + offsetof(CheckpointLayerRecord, cols)], &big, 8);
+  write_bytes(huge);
+  CheckpointLoadOptions unverified;
+  unverified.verify = false;
+  CHECK(throws<std::runtime_error>(
+      [&] { load_checkpoint<double>(path, unverified); }));
+  std::remove(path.c_str());
+}
+
+// ---- profiler -------------------------------------------------------------
+
+const ProfileStat *find_stat(const std::vector<ProfileStat> &stats,
+                             const std::string &name) {
+  for (const ProfileStat &s : stats) {
+    if (s.name == name)
+      return &s;
+  }
+  return nullptr;
+}
+
+TEST(profiler_aggregates_scopes_and_writes_traces) {
+  profiler_reset();
+  const char *outer = profile_name("test.\"outer\"");
+  const char *inner = profile_name(std::string("test.inner"));
+  CHECK(inner == profile_name("test.inner"));
+
+  for (int i = 0; i < 3; ++i) {
+    ProfileScope scope(outer, 100.0, 50.0);
+    for (int j = 0; j < 2; ++j) {
+      ProfileScope nested(inner);
+      FlatMatrix allocates(4, 4, 1.0);
+      CHECK(allocates(3, 3) == 1.0);
+    }
+  }
+  parallel_for(0, 4, 1, [&](int first, int last) {
+    for (int i = first; i < last; ++i)
+      ProfileScope scope(inner);
+  });
+
+  std::vector<ProfileStat> stats = profiler_stats();
+  const ProfileStat *o = find_stat(stats, outer);
+  const ProfileStat *n = find_stat(stats, inner);
+  CHECK(o && n);
+  if (o && n) {
+    CHECK(o->calls == 3 && n->calls == 10);
+    CHECK(o->flops == 300.0 && o->bytes == 150.0);
+    CHECK(o->intensity() == 2.0);
+    CHECK(o->total_ns >= o->max_ns && o->total_ns >= n->total_ns / 2);
+    // Nested scopes count the allocations of their children too.
+    CHECK(n->allocations == 6 && o->allocations == 6);
+  }
+  CHECK(profile_report().find("test.inner") != std::string::npos);
+
+  // Another thread's allocations are not charged to this thread's scopes.
+  const char *idle = profile_name("test.idle");
+  {
+    ProfileScope scope(idle);
+    std::thread other([] {
+      for (int i = 0; i < 100; ++i)
+        FlatMatrix(2, 2);
+    });
+    other.join();
+  }
+  const ProfileStat *quiet = find_stat(profiler_stats(), idle);
+  CHECK(quiet && quiet->calls == 1 && quiet->allocations == 0);
+
+  // Capacity bounds the trace, not the statistics; names are escaped.
+  set_trace_capacity(2);
+  profiler_reset();
+  for (int i = 0; i < 5; ++i)
+    ProfileScope scope(outer);
+  std::string path = temp_path("trace.json");
+  write_chrome_trace(path);
+  set_trace_capacity(std::size_t(1) << 20);
+  std::ifstream in(path);
+  std::string trace((std::istreambuf_iterator<char>(in)), {});
+  std::size_t events = 0;
+  for (std::size_t pos = trace.find("\"ph\": \"X\""); pos != std::string::npos;
+       pos = trace.find("\"ph\": \"X\"", pos + 1))
+    ++events;
+  CHECK(events == 2);
+  CHECK(trace.find("test.\\\"outer\\\"") != std::string::npos);
+  CHECK(find_stat(profiler_stats(), outer)->calls == 5);
+  std::remove(path.c_str());
+
+  profiler_reset();
+  CHECK(find_stat(profiler_stats(), outer) == nullptr);
+}
+
+// ---- inference server -----------------------------------------------------
+
+int open_fds() {
+  int n = 0;
+  for (const auto &entry :
+       std::filesystem::directory_iterator("/proc/self/fd")) {
+    (void)entry;
+    ++n;
+  }
+  return n;
+}
+
+TEST(inference_server_round_trips_without_leaks) {
+  Sequential model;
+  build_mlp(model, 6, 8, 3, 4);
+  FlatMatrix X = random_matrix<double>(5, 6, 30);
+  FlatMatrix expected = model.predict(X);
+
+  ServerOptions options;
+  options.max_wait_us = 100;
+  InferenceServer server(model, 6, options);
+  std::string path = temp_path("server.sock");
+  server.serve_unix(path);
+
+  int fds_before = open_fds();
+  for (int c = 0; c < 200; ++c) {
+    InferenceClient client(path);
+    int i = c % X.rows();
+    std::vector<double> out =
+        client.predict(std::vector<double>(X.row(i), X.row(i) + X.cols()));
+    CHECK(out.size() == 3);
+    for (int j = 0; j < 3 && j < static_cast<int>(out.size()); ++j)
+      CHECK(out[j] == expected(i, j));
+  }
+  // Connections close their fds as their clients go; one may still be
+  // finishing.
+  int fds_after = open_fds();
+  for (int wait = 0; wait < 100 && fds_after > fds_before; ++wait) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    fds_after = open_fds();
+  }
+  CHECK(fds_after <= fds_before);
+
+  {
+    InferenceClient client(path);
+    CHECK(throws<std::runtime_error>(
+        [&] { client.predict(std::vector<double>(5, 0.0)); }));
+  }
+  CHECK(server.stats().requests == 200);
+
+  InferenceClient idle(path); // stop() has to wake its connection
+  server.stop();
+  CHECK(!std::filesystem::exists(path));
+}
+
+// ---- data-parallel training -----------------------------------------------
+
+TEST(data_parallel_matches_sequential_training) {
+  ThreadSettings restore;
+  set_num_threads(3);
+  FlatMatrix X;
+  std::vector<int> y;
+  make_blobs(150, 10, 3, X, y);
+  FitOptions options;
+  options.epochs = 3;
+  options.batch_size = 32; // the last batch has 22 rows
+  options.seed = 2;
+  options.verbose = false;
+
+  Sequential reference;
+  build_mlp(reference, 10, 20, 3, 6);
+  OptimizerSGD reference_optimizer(0.2, 0.0, 0.9);
+  std::vector<EpochStats> expected =
+      reference.fit(X, y, reference_optimizer, options);
+
+  std::vector<FlatMatrix> weights;
+  for (int replicas : {1, 3, 3}) {
+    Sequential model;
+    build_mlp(model, 10, 20, 3, 6);
+    DataParallelTrainer trainer(model, replicas);
+    CHECK(trainer.replicas() == replicas);
+    OptimizerSGD optimizer(0.2, 0.0, 0.9);
+    std::vector<EpochStats> history = trainer.fit(X, y, optimizer, options);
+
+    // Shard gradients weighted by shard size add up to the batch gradient.
+    double tolerance = replicas == 1 ? 0.0 : 1e-9;
+    CHECK(history.size() == expected.size());
+    CHECK_NEAR(history.back().loss, expected.back().loss, tolerance);
+    CHECK(history.back().accuracy == expected.back().accuracy);
+    CHECK(max_diff(dense_layer(model, 1).weights,
+                   dense_layer(reference, 1).weights) <= tolerance);
+    weights.push_back(dense_layer(model, 0).weights);
+  }
+  // A fixed replica count gives the same bits run to run.
+  CHECK(max_diff(weights[1], weights[2]) == 0.0);
+
+  // Padded gradients on the reduced replica are summed row by row.
+  Sequential padded;
+  build_mlp(padded, 10, 20, 3, 6);
+  for (int i = 0; i < padded.size(); ++i)
+    dense_layer(padded, i).dweights = FlatMatrix::padded(1, 1);
+  DataParallelTrainer padded_trainer(padded, 3);
+  OptimizerSGD padded_optimizer(0.2, 0.0, 0.9);
+  padded_trainer.fit(X, y, padded_optimizer, options);
+  CHECK(!dense_layer(padded, 0).dweights.is_contiguous());
+  CHECK(max_diff(dense_layer(padded, 0).weights, weights[1]) <= 1e-9);
+
+  // A bad label in any shard is rejected before the replicas start.
+  std::vector<int> bad = y;
+  bad[140] = 99;
+  Sequential model;
+  build_mlp(model, 10, 20, 3, 6);
+  DataParallelTrainer trainer(model, 3);
+  OptimizerSGD optimizer(0.2);
+  CHECK(throws<std::invalid_argument>(
+      [&] { trainer.fit(X, bad, optimizer, options); }));
+  bad[140] = -1;
+  CHECK(throws<std::invalid_argument>(
+      [&] { trainer.fit(X, bad, optimizer, options); }));
+  CHECK(trainer.fit(X, y, optimizer, options).size() == 3);
+}
+
+// ---- expression templates -------------------------------------------------
+
+template <typename A, typename B, typename = void>
+struct has_multiply : std::false_type {};
+template <typename A, typename B>
+struct has_multiply<A, B,
+                    decltype(void(std::declval<A>() * std::declval<B>()))>
+    : std::true_type {};
+
+template <typename A, typename B, typename = void>
+struct has_add : std::false_type {};
+template <typename A, typename B>
+struct has_add<A, B, decltype(void(std::declval<A>() + std::declval<B>()))>
+    : std::true_type {};
+
+// Outside nn::expr matrices have no arithmetic operators.
+static_assert(!has_add<const FlatMatrix &, const FlatMatrix &>::value,
+              "operator+ leaked out of nn::expr");
+
+TEST(matrix_expressions_match_elementwise_loops) {
+  using namespace nn::expr;
+  static_assert(!has_multiply<const FlatMatrix &, const FlatMatrix &>::value,
+                "matrices multiply elementwise through hadamard() only");
+
+  // 300 x 70 spans several parallel chunks with a partial last one; the
+  // padded and block operands take the row-by-row path.
+  FlatMatrix A = random_matrix<double>(300, 70, 40);
+  FlatMatrix B = random_matrix<double>(300, 70, 41);
+  FlatMatrix big = random_matrix<double>(310, 80, 42);
+  FlatMatrix C = big.block(5, 3, 300, 70);
+  FlatMatrix P = FlatMatrix::padded(300, 70);
+  P = A;
+
+  FlatMatrix Z = max(hadamard(A, B) - C, 0.0);
+  FlatMatrix W = clip(2.0 * P + 1.0 - A / 4.0, -0.5, 0.5);
+  FlatMatrix V = min(-A, B) + max(A, 0.1);
+  FlatMatrix U = A;
+  U = hadamard(U, B) + U; // the destination may be an operand
+  for (int i = 0; i < 300; ++i) {
+    for (int j = 0; j < 70; ++j) {
+      double a = A(i, j), b = B(i, j), c = C(i, j);
+      CHECK(Z(i, j) == std::max(a * b - c, 0.0));
+      CHECK(W(i, j) ==
+            std::min(std::max(2.0 * a + 1.0 - a / 4.0, -0.5), 0.5));
+      CHECK(V(i, j) == std::min(-a, b) + std::max(a, 0.1));
+      CHECK(U(i, j) == a * b + a);
+    }
+  }
+
+  FlatMatrixF F(3, 4, 1.0f);
+  FlatMatrixF G = hadamard(F, F) * 3.0f;
+  CHECK(G(2, 3) == 3.0f);
+  CHECK(throws<std::invalid_argument>([&] { FlatMatrix bad = A + big; }));
+  CHECK(throws<std::invalid_argument>(
+      [&] { FlatMatrix bad = clip(A, 1.0, 0.0); }));
+}
+
+// ---- fixed-shape layers ---------------------------------------------------
+
+TEST(static_dense_matches_layer_dense) {
+  BasicLayerDenseReLU<float> hidden(6, 5, WeightInit::HeNormal, 19, 0);
+  BasicLayerDense<float> head(5, 3, WeightInit::XavierNormal, 19, 1);
+  for (float &b : hidden.biases)
+    b = 0.25f;
+
+  BasicStaticDense<float, 6, 5, true> static_hidden(hidden);
+  BasicStaticDense<float, 5, 3> static_head(head);
+
+  BasicFlatMatrix<float> X = random_matrix<float>(4, 6, 190);
+  hidden.forward(X);
+  head.forward(hidden.output);
+
+  BasicStaticMatrix<float, 4, 6> x(X);
+  BasicStaticMatrix<float, 4, 5> h = static_hidden.forward(x);
+  BasicStaticMatrix<float, 4, 3> y = static_head.forward(h);
+  CHECK(max_diff(h.to_flat(), hidden.output) <= 1e-5);
+  CHECK(max_diff(y.to_flat(), head.output) <= 1e-5);
+
+  CHECK(throws<std::invalid_argument>(
+      [&] { BasicStaticDense<float, 5, 5> wrong(hidden); }));
+}
+
+// ---- vectorized exp and log -----------------------------------------------
+
+// Distance in representable values between two finite floats or doubles.
+template <typename T> std::int64_t ulp_distance(T a, T b) {
+  using Bits = typename std::conditional<sizeof(T) == 4, std::int32_t,
+                                         std::int64_t>::type;
+  auto ordered = [](T x) {
+    Bits bits;
+    std::memcpy(&bits, &x, sizeof(x));
+    return bits < 0 ? std::int64_t(std::numeric_limits<Bits>::min()) -
+                          std::int64_t(bits)
+                    : std::int64_t(bits);
+  };
+  std::int64_t d = ordered(a) - ordered(b);
+  return d < 0 ? -d : d;
+}
+
+// Worst ulp error of vec_exp on [lo, hi] and of vec_log on the positive
+// normals, against std::exp / std::log in long double.
+template <typename T> void check_vec_math_ulps(T lo, T hi) {
+  const int n = 100003;
+  std::vector<T> x(n), out(n);
+  for (int i = 0; i < n; ++i)
+    x[i] = lo + (hi - lo) * (T(i) / T(n - 1));
+  x.back() = hi;
+  vec_exp(x.data(), out.data(), n);
+  std::int64_t worst = 0;
+  for (int i = 0; i < n; ++i) {
+    T ref = static_cast<T>(std::exp(static_cast<long double>(x[i])));
+    worst = std::max(worst, ulp_distance(out[i], ref));
+  }
+  CHECK(worst <= 1);
+
+  const int min_exp = std::numeric_limits<T>::min_exponent - 1;
+  const int max_exp = std::numeric_limits<T>::max_exponent - 1;
+  for (int i = 0; i < n; ++i) {
+    T mantissa = T(1) + T(i % 997) / T(997);
+    x[i] = std::ldexp(mantissa, min_exp + i % (max_exp - min_exp + 1));
+  }
+  vec_log(x.data(), out.data(), n);
+  worst = 0;
+  for (int i = 0; i < n; ++i) {
+    T ref = static_cast<T>(std::log(static_cast<long double>(x[i])));
+    worst = std::max(worst, ulp_distance(out[i], ref));
+  }
+  CHECK(worst <= 3);
+
+  const T inf = std::numeric_limits<T>::infinity();
+  T special[] = {hi * T(1.01), lo * T(1.1), T(0), T(-1), inf};
+  T exp_out[5], log_out[5];
+  vec_exp(special, exp_out, 5);
+  vec_log(special, log_out, 5);
+  CHECK(exp_out[0] == inf && exp_out[1] == T(0) && exp_out[2] == T(1));
+  CHECK(log_out[2] == -inf && std::isnan(log_out[3]) && log_out[4] == inf);
+}
+
+TEST(vec_exp_log_within_ulp_bounds) {
+  check_vec_math_ulps<float>(-87.3f, 88.72f);
+  check_vec_math_ulps<double>(-708.3, 709.78);
+}
+
+TEST(softmax_row_skips_blocks_of_minus_inf) {
+  // Longer than one softmax block, with the whole first block masked out.
+  const int n = 3000;
+  const double inf = std::numeric_limits<double>::infinity();
+  std::vector<double> in(n), out(n);
+  for (int i = 0; i < n; ++i)
+    in[i] = i < 1500 ? -inf : 0.001 * (i % 200);
+  softmax_row(in.data(), out.data(), n);
+
+  double max_in = 0.001 * 199, sum = 0;
+  for (int i = 1500; i < n; ++i)
+    sum += std::exp(in[i] - max_in);
+  double err = 0, total = 0;
+  for (int i = 0; i < n; ++i) {
+    double ref = i < 1500 ? 0.0 : std::exp(in[i] - max_in) / sum;
+    err = std::max(err, std::fabs(out[i] - ref));
+    total += out[i];
+  }
+  CHECK(err <= 1e-12);
+  CHECK_NEAR(total, 1.0, 1e-12);
+}
+
+// ---- sparse inputs --------------------------------------------------------
+
+TEST(csr_spmm_matches_dense) {
+  // Mostly zeros, with empty rows and columns shared between rows.
+  BasicFlatMatrix<double> dense(9, 40, 0.0);
+  for (int i = 0; i < 9; ++i) {
+    if (i % 4 == 3)
+      continue;
+    dense(i, (7 * i) % 40) = 0.5 + i;
+    dense(i, (3 * i + 5) % 40) = -1.25;
+    dense(i, 11) = 0.1 * i;
+  }
+  CsrMatrix A = CsrMatrix::from_dense(dense);
+  FlatMatrix B = random_matrix<double>(40, 6, 210);
+  FlatMatrix D = random_matrix<double>(9, 6, 211);
+  std::vector<double> bias = {0.5, -0.5, 0.25, 0.0, -1.0, 1.0};
+  GemmEpilogue<double> epilogue;
+  epilogue.bias = bias.data();
+  epilogue.relu = true;
+
+  FlatMatrix out;
+  spmm_into(A, B, out, epilogue);
+  CHECK(max_diff(out, naive_gemm(false, false, dense, B, epilogue)) <= 1e-12);
+
+  // Stale data in the outputs must not leak into the results.
+  FlatMatrix tn(40, 6, 7.0);
+  spmm_tn_into(A, D, tn);
+  BasicFlatMatrix<double> ref = naive_gemm(true, false, dense, D, {});
+  CHECK(max_diff(tn, ref) <= 1e-12);
+
+  SparseRowGradient grad;
+  grad.rows.assign(50, 3);
+  grad.values = FlatMatrix(50, 6, 7.0);
+  spmm_tn_into(A, D, grad);
+  CHECK(grad.values.rows() == static_cast<int>(grad.rows.size()));
+  CHECK(std::is_sorted(grad.rows.begin(), grad.rows.end()));
+  FlatMatrix expanded(40, 6, 0.0);
+  for (std::size_t s = 0; s < grad.rows.size(); ++s)
+    std::copy(grad.values.row(int(s)), grad.values.row(int(s)) + 6,
+              expanded.row(grad.rows[s]));
+  CHECK(max_diff(expanded, ref) <= 1e-12);
+  for (int col = 0; col < 40; ++col) {
+    bool used = false;
+    for (int i = 0; i < 9; ++i)
+      used = used || dense(i, col) != 0.0;
+    CHECK(used == std::binary_search(grad.rows.begin(), grad.rows.end(), col));
+  }
+
+  // The column index follows rows added after it was built.
+  int col = 39;
+  double value = 2.0;
+  A.add_row(&col, &value, 1);
+  FlatMatrix D2 = random_matrix<double>(10, 6, 212);
+  spmm_tn_into(A, D2, tn);
+  CHECK(max_diff(tn, naive_gemm(true, false, A.to_dense(), D2, {})) <= 1e-12);
+}
+
+// ---- no-grad inference ----------------------------------------------------
+
+TEST(backward_after_no_grad_forward_throws) {
+  LayerDense dense(4, 3, WeightInit::XavierNormal, 22, 0);
+  LayerDenseReLU relu(4, 3, WeightInit::HeNormal, 22, 1);
+  FlatMatrix X = random_matrix<double>(5, 4, 220);
+  FlatMatrix dvalues(5, 3, 1.0);
+  CsrMatrix sparse = CsrMatrix::from_dense(X);
+  // A shape error (std::invalid_argument is a logic_error too) is not it.
+  auto no_grad_error = [&](LayerDense *layer) {
+    try {
+      layer->backward(dvalues);
+    } catch (const std::invalid_argument &) {
+      return false;
+    } catch (const std::logic_error &e) {
+      return std::strstr(e.what(), "NoGradGuard") != nullptr;
+    }
+    return false;
+  };
+
+  for (LayerDense *layer : {&dense, static_cast<LayerDense *>(&relu)}) {
+    {
+      NoGradGuard no_grad;
+      layer->forward(X);
+    }
+    CHECK(no_grad_error(layer));
+    {
+      NoGradGuard no_grad;
+      layer->forward(sparse);
+    }
+    CHECK(no_grad_error(layer));
+
+    // A forward with gradients enabled makes backward usable again.
+    layer->forward(X);
+    layer->backward(dvalues);
+    CHECK(layer->dinputs.rows() == 5 && layer->dinputs.cols() == 4);
+  }
+}
+
+// ---- execution plans ------------------------------------------------------
+
+TEST(execution_plan_fit_matches_sequential_fit) {
+  FlatMatrix X;
+  std::vector<int> y;
+  make_blobs(150, 10, 3, X, y); // the last batch of 32 is partial
+
+  // Every op the plan compiles: Dense, ReLU, DenseReLU.
+  auto build = [](Sequential &model) {
+    model.add<LayerDense>(10, 16, WeightInit::HeNormal, 23, 0);
+    model.add<ActivationReLU>();
+    model.add<LayerDenseReLU>(16, 16, WeightInit::HeNormal, 23, 1);
+    model.add<LayerDense>(16, 3, WeightInit::XavierNormal, 23, 2);
+  };
+  Sequential reference, planned;
+  build(reference);
+  build(planned);
+
+  FitOptions options;
+  options.epochs = 4;
+  options.batch_size = 32;
+  options.seed = 3;
+  options.verbose = false;
+  OptimizerAdam adam_a(0.01), adam_b(0.01);
+  std::vector<EpochStats> expected = reference.fit(X, y, adam_a, options);
+  ExecutionPlan plan(planned, 32);
+  std::vector<EpochStats> history = plan.fit(X, y, adam_b, options);
+
+  CHECK(history.size() == expected.size());
+  for (std::size_t e = 0; e < history.size() && e < expected.size(); ++e) {
+    CHECK(history[e].loss == expected[e].loss);
+    CHECK(history[e].accuracy == expected[e].accuracy);
+  }
+  for (int i : {0, 2, 3}) {
+    CHECK(max_diff(dense_layer(planned, i).weights,
+                   dense_layer(reference, i).weights) == 0.0);
+    CHECK(dense_layer(planned, i).biases == dense_layer(reference, i).biases);
+  }
+}
+
+TEST(execution_plan_rejects_sparse_gradients) {
+  Sequential model;
+  model.add<LayerDense>(4, 8, WeightInit::HeNormal, 23, 0);
+  model.add<ActivationReLU>();
+  model.add<LayerDense>(8, 3, WeightInit::XavierNormal, 23, 1);
+
+  // The plan writes dense dweights, which a sparse layer's optimizer step
+  // would ignore in favour of stale sparse_dweights.
+  dense_layer(model, 0).sparse_gradients = true;
+  CHECK(throws<std::invalid_argument>([&] { ExecutionPlan plan(model, 8); }));
+  dense_layer(model, 0).sparse_gradients = false;
+  ExecutionPlan plan(model, 8);
+  CHECK(plan.max_batch() == 8);
+}
+
+// ---- strided storage ------------------------------------------------------
+
+TEST(view_assignment_writes_through_same_shape) {
+  using namespace nn::expr;
+  FlatMatrix big = FlatMatrix::padded(6, 5, 1.0);
+  FlatMatrix inner = big.block(1, 1, 3, 2);
+  FlatMatrix src = random_matrix<double>(3, 2, 240);
+
+  inner = src;
+  CHECK(inner.is_view() && inner.data() == &big(1, 1));
+  for (int i = 0; i < 6; ++i) {
+    for (int j = 0; j < 5; ++j) {
+      bool in_block = i >= 1 && i < 4 && j >= 1 && j < 3;
+      CHECK(big(i, j) == (in_block ? src(i - 1, j - 1) : 1.0));
+    }
+  }
+
+  inner = src * 2.0;
+  CHECK(big(3, 2) == 2.0 * src(2, 1) && big(3, 3) == 1.0);
+
+  // Another shape would have to detach or overrun the viewed memory.
+  FlatMatrix wrong(2, 3, 5.0);
+  CHECK(throws<std::invalid_argument>([&] { inner = wrong; }));
+  CHECK(throws<std::invalid_argument>([&] { inner = wrong * 2.0; }));
+  CHECK(inner.rows() == 3 && inner.cols() == 2 && big(1, 1) == 2.0 * src(0, 0));
+
+  double raw[6] = {0, 0, 0, 0, 0, 0};
+  FlatMatrix flat = FlatMatrix::view(raw, 2, 3);
+  CHECK(throws<std::invalid_argument>([&] { flat = src; }));
+  flat = wrong;
+  CHECK(raw[0] == 5.0 && raw[5] == 5.0);
+
+  // Moving into a view rebinds it and leaves the old memory alone.
+  flat = FlatMatrix(1, 2, 9.0);
+  CHECK(!flat.is_view() && flat.rows() == 1 && raw[0] == 5.0);
+}
+
+// ---- counter-based RNG ----------------------------------------------------
+
+TEST(philox_matches_known_answers_and_streams_split) {
+  // Known-answer vectors of the Random123 distribution (kat_vectors).
+  struct Kat {
+    PhiloxCounter ctr;
+    PhiloxKey key;
+    PhiloxCounter expected;
+  } kats[] = {
+      {{0, 0, 0, 0}, {0, 0}, {0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8}},
+      {{0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff},
+       {0xffffffff, 0xffffffff},
+       {0x408f276d, 0x41c83b0e, 0xa20bc7c6, 0x6d5451fd}},
+      {{0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344},
+       {0xa4093822, 0x299f31d0},
+       {0xd16cfe09, 0x94fdcceb, 0x5001e420, 0x24126ea1}},
+  };
+  for (const Kat &kat : kats)
+    CHECK(philox4x32(kat.ctr, kat.key) == kat.expected);
+
+  // The fills draw the same blocks: counter (block, stream), key = seed.
+  BasicFlatMatrix<double> U(1, 8);
+  fill_uniform(U, 0x0000000500000003ull, 9);
+  PhiloxCounter block1 = philox4x32({1, 0, 9, 0}, {3, 5});
+  for (int lane = 0; lane < 4; ++lane)
+    CHECK(U(0, 4 + lane) == block1[lane] * 0x1p-32);
+
+  // randn_matrix streams stay clear of the layer streams under one seed.
+  set_random_seed(7);
+  FlatMatrix first = randn_matrix<double>(4, 4, 0.0, 1.0);
+  FlatMatrix layer0(4, 4), reserved0(4, 4);
+  fill_normal(layer0, 7, 0);
+  fill_normal(reserved0, 7, RANDN_STREAM_BIT | 0);
+  CHECK(max_diff(first, reserved0) == 0.0);
+  CHECK(max_diff(first, layer0) > 0.0);
+  CHECK(throws<std::invalid_argument>([] {
+    init_weights<double>(4, 4, WeightInit::HeNormal, 7, RANDN_STREAM_BIT);
+  }));
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  int run = 0;
+  for (const Test &test : registry()) {
+    bool selected = argc < 2;
+    for (int a = 1; a < argc; ++a)
+      selected = selected || std::strstr(test.name, argv[a]) != nullptr;
+    if (!selected)
+      continue;
+
+    int before = g_failures;
+    test.fn();
+    std::printf("%-48s %s\n", test.name,
+                g_failures == before ? "ok" : "FAILED");
+    ++run;
+  }
+  std::printf("%d tests, %d failed checks\n", run, g_failures.load());
+  return g_failures == 0 && run > 0 ? 0 : 1;
+}